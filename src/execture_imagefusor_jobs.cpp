@@ -2,7 +2,7 @@
 #include "starfm.h"
 #include "estarfm.h"
 #include "fitfc.h"
-//#include "spstfm.h"
+#include "spstfm.h"
 #include "utils_common.h"
 #include "multiresimages.h"
 #include "geoinfo.h"
@@ -45,7 +45,8 @@ void execute_estarfm_job_cpp(CharacterVector input_filenames,
                              const std::string& hightag,  
                              const std::string& lowtag,   
                              const std::string& MASKIMG_options,
-                             const std::string& MASKRANGE_options
+                             const std::string& MASKRANGE_options,
+                             CharacterVector output_options
 )
 {
 
@@ -62,6 +63,8 @@ void execute_estarfm_job_cpp(CharacterVector input_filenames,
   //Step 1: Prepare the Input
   //create a prediction area rectangle
   Rectangle pred_rectangle = Rectangle{pred_area[0],pred_area[1],pred_area[2],pred_area[3]};
+  //parse the GDAL creation options for the output images, like COMPRESS=DEFLATE
+  std::vector<std::pair<std::string,std::string>> writeOptions = helpers::parseWriteOptions(as<std::vector<std::string>>(output_options));
   
   // find the gi the first pair high image 
   Rcpp::LogicalVector is_high(input_filenames.size());
@@ -70,7 +73,7 @@ void execute_estarfm_job_cpp(CharacterVector input_filenames,
   Rcpp::CharacterVector filenames_high = input_filenames[is_high];
   std::string high_template_filename = Rcpp::as<std::vector<std::string> >(filenames_high)[0];
  //GeoInfo const& giHighPair1 {high_template_filename};
-  GeoInfo giHighPair1{high_template_filename};
+  GeoInfo giHighPair1;
   if(verbose){Rcout <<"Getting High Resolution Geoinformation from File: "<<high_template_filename<<std::endl;}
   
   // find the gi the first pair low image 
@@ -80,7 +83,7 @@ void execute_estarfm_job_cpp(CharacterVector input_filenames,
   Rcpp::CharacterVector filenames_low = input_filenames[is_low];
   std::string low_template_filename = Rcpp::as<std::vector<std::string> >(filenames_low)[0];
   if(verbose){Rcout <<"Getting Low Resolution Geoinformation from File: "<<low_template_filename<<std::endl;}
-  GeoInfo  giLowPair1{low_template_filename};
+  GeoInfo giLowPair1;
   
 
   
@@ -89,12 +92,31 @@ void execute_estarfm_job_cpp(CharacterVector input_filenames,
   //Step 2: Load the images and set the options
   
   //Load the images into a mri
+  //Deferred whole-image loading: only the pair images are loaded up front. The other images are just registered
+  //with their filename and loaded completely when a prediction needs them (see Step 5), so the memory does not grow
+  //with the number of dates. It is still bounded by the full pair images plus one full prediction date, there is
+  //no tiled reading. The pair images stay resident, since the tolerances use statistics over the whole pair images.
   auto mri = std::make_shared<MultiResImages>();
+  MultiResCollection<std::string> lazyFilenames;
   int n_inputs = input_filenames.size();
   for(int i=0; i< n_inputs;++i){
-    mri->set(as<std::string>(input_resolutions[i]),
-             input_dates[i],
-                        Image(as<std::string>(input_filenames[i])));
+    std::string filename = as<std::string>(input_filenames[i]);
+    std::string res = as<std::string>(input_resolutions[i]);
+    int date = input_dates[i];
+    if(!(date == date1 || date == date3)){
+      lazyFilenames.set(res, date, filename);
+      if(filename == high_template_filename){giHighPair1 = GeoInfo{filename};}
+      if(filename == low_template_filename){giLowPair1 = GeoInfo{filename};}
+      continue;
+    }
+    
+    // the geoinformation of the template images is taken from the same read, so each file is opened only once
+    GeoInfo gi;
+    Image img;
+    img.read(filename, gi);
+    if(filename == high_template_filename){giHighPair1 = gi;}
+    if(filename == low_template_filename){giLowPair1 = gi;}
+    mri->set(res, date, std::move(img));
   }
   
   //Pass the desired Options
@@ -120,6 +142,8 @@ void execute_estarfm_job_cpp(CharacterVector input_filenames,
 #ifdef _OPENMP
     ParallelizerOptions<EstarfmOptions> po;
     po.setNumberOfThreads(n_cores);
+    //predict and write in bands of a multiple of 256 rows, large enough for about four stripes per thread
+    po.setBandHeight(256 * std::max(1, n_cores / 4));
     po.setAlgOptions(o);
     Parallelizer<EstarfmFusor> esf;
     esf.srcImages(mri);
@@ -195,14 +219,16 @@ void execute_estarfm_job_cpp(CharacterVector input_filenames,
   }
   
   imagefusion::Image pairMask = baseMask;
-  if (pairValidSets.hasHigh) //If there are any ranges given for the highrez :
+  if (pairValidSets.hasHigh) { //If there are any ranges given for the highrez :
     //apply the ranges and update the mask accordingly
     pairMask = helpers::processSetMask(std::move(pairMask), mri->get(hightag, date1), pairValidSets.high);
-  pairMask = helpers::processSetMask(std::move(pairMask), mri->get(hightag, date3), pairValidSets.high);
-  if (pairValidSets.hasLow) //If there are any ranges given for the lowrez :
+    pairMask = helpers::processSetMask(std::move(pairMask), mri->get(hightag, date3), pairValidSets.high);
+  }
+  if (pairValidSets.hasLow) { //If there are any ranges given for the lowrez :
     //apply the ranges and update the mask accordingly
     pairMask = helpers::processSetMask(std::move(pairMask), mri->get(lowtag,  date1), pairValidSets.low);
-  pairMask = helpers::processSetMask(std::move(pairMask), mri->get(lowtag,  date3), pairValidSets.low);
+    pairMask = helpers::processSetMask(std::move(pairMask), mri->get(lowtag,  date3), pairValidSets.low);
+  }
   
   
   //Step 5: Predictions
@@ -212,6 +238,11 @@ void execute_estarfm_job_cpp(CharacterVector input_filenames,
     //Get the destination filename
     std::string pred_filename=as<std::string>(pred_filenames[i]);
     
+    //Load the low resolution image of the prediction date, unless it is a pair image
+    bool isLazyLoaded = !mri->has(lowtag, pred_dates[i]);
+    if (isLazyLoaded)
+      mri->set(lowtag, pred_dates[i], Image(lazyFilenames.get(lowtag, pred_dates[i])));
+    
     //Make the Mask
     //We use the basic ranges
     auto predValidSets = baseValidSets;
@@ -234,27 +265,22 @@ void execute_estarfm_job_cpp(CharacterVector input_filenames,
       //Adjust the mask by also applying those ranges.
       predMask = helpers::processSetMask(std::move(predMask), mri->get(lowtag, pred_dates[i]), predValidSets.low);
     
+    //The Geoinformation of the template is written together with the prediction
+    // adjust it, if we have used a pred area
+    GeoInfo giTemplate = helpers::predictionGeoInfo(giHighPair1, pred_rectangle);
+    
     //Predict using the new mask we have made
       if(verbose){Rcout  <<"Predicting for date"<< pred_dates[i]<< " using both pairs from dates " << date1 << " and " << date3 << "." << std::endl;}
-      esf.predict(pred_dates[i],predMask);  
-      esf.outputImage().write(pred_filename);
+      helpers::predictAndWrite(esf, pred_dates[i], predMask, pairMask, pred_filename, giTemplate, writeOptions);
     
     //Write the masks if desired
     if (output_masks){
       imagefusion::FileFormat outformat = imagefusion::FileFormat::fromFile(pred_filename);
-      std::string outmaskfilename = helpers::outputImageFile(predMask, giHighPair1, "MaskImage", pred_filename, "MaskImage", outformat, date1, pred_dates[i], date3);}
+      std::string outmaskfilename = helpers::outputImageFile(predMask, giHighPair1, "MaskImage", pred_filename, "MaskImage", outformat, date1, pred_dates[i], date3, writeOptions);}
     
-    //Add the Geoinformation of the template to the written file
-    // and adjust it, if we have used a pred area
-    GeoInfo giTemplate {giHighPair1};
-    if (giTemplate.hasGeotransform()) {
-      giTemplate.geotrans.translateImage(pred_rectangle.x, pred_rectangle.y);
-      if (pred_rectangle.width != 0)
-        giTemplate.size.width = pred_rectangle.width;
-      if (pred_rectangle.height != 0)
-        giTemplate.size.height = pred_rectangle.height;
-      giTemplate.addTo(pred_filename);
-    }
+    //Release the image of the prediction date again
+    if (isLazyLoaded)
+      mri->remove(lowtag, pred_dates[i]);
   }
 }
 
@@ -289,7 +315,8 @@ void execute_starfm_job_cpp(CharacterVector input_filenames,
                             const std::string& hightag,  
                             const std::string& lowtag,   
                             const std::string& MASKIMG_options,
-                            const std::string& MASKRANGE_options
+                            const std::string& MASKRANGE_options,
+                            CharacterVector output_options
 ){
    
 #ifdef _OPENMP
@@ -308,6 +335,8 @@ void execute_starfm_job_cpp(CharacterVector input_filenames,
   //Step 1: Prepare the Input
   //create a prediction area rectangle
   Rectangle pred_rectangle = Rectangle{pred_area[0],pred_area[1],pred_area[2],pred_area[3]};
+  //parse the GDAL creation options for the output images, like COMPRESS=DEFLATE
+  std::vector<std::pair<std::string,std::string>> writeOptions = helpers::parseWriteOptions(as<std::vector<std::string>>(output_options));
   
   // find the gi the first pair high image 
   Rcpp::LogicalVector is_high(input_filenames.size());
@@ -315,7 +344,7 @@ void execute_starfm_job_cpp(CharacterVector input_filenames,
     is_high[i] = (input_resolutions[i] == hightag);}
   Rcpp::CharacterVector filenames_high = input_filenames[is_high];
   std::string high_template_filename = Rcpp::as<std::vector<std::string> >(filenames_high)[0];
-  GeoInfo giHighPair1 {high_template_filename};
+  GeoInfo giHighPair1;
   if(verbose){Rcout <<"Getting High Resolution Geoinformation from File: "<<high_template_filename<<std::endl;}
   
   // find the gi the first pair low image 
@@ -325,21 +354,38 @@ void execute_starfm_job_cpp(CharacterVector input_filenames,
   Rcpp::CharacterVector filenames_low = input_filenames[is_low];
   std::string low_template_filename = Rcpp::as<std::vector<std::string> >(filenames_low)[0];
   if(verbose){Rcout <<"Getting Low Resolution Geoinformation from File: "<<low_template_filename<<std::endl;}
-  GeoInfo giLowPair1 {low_template_filename};
+  GeoInfo giLowPair1;
   
-  // a copy of the high image gi, which we later use for the output (and might modify a bit)
-  GeoInfo giTemplate {giHighPair1};
   
   
   
   //Step 2: Load the images and set the options
   //Load the images into a mri
+  //Deferred whole-image loading: only the pair images are loaded up front. The other images are just registered
+  //with their filename and loaded completely when a prediction needs them (see Step 5), so the memory does not grow
+  //with the number of dates. It is still bounded by the full pair images plus one full prediction date, there is
+  //no tiled reading. The pair images stay resident, since the tolerances use statistics over the whole pair images.
   auto mri = std::make_shared<MultiResImages>();
+  MultiResCollection<std::string> lazyFilenames;
   int n_inputs = input_filenames.size();
   for(int i=0; i< n_inputs;++i){
-    mri->set(as<std::string>(input_resolutions[i]),
-             input_dates[i],
-                        Image(as<std::string>(input_filenames[i])));
+    std::string filename = as<std::string>(input_filenames[i]);
+    std::string res = as<std::string>(input_resolutions[i]);
+    int date = input_dates[i];
+    if(!(date == date1 || (double_pair_mode && date == date3))){
+      lazyFilenames.set(res, date, filename);
+      if(filename == high_template_filename){giHighPair1 = GeoInfo{filename};}
+      if(filename == low_template_filename){giLowPair1 = GeoInfo{filename};}
+      continue;
+    }
+    
+    // the geoinformation of the template images is taken from the same read, so each file is opened only once
+    GeoInfo gi;
+    Image img;
+    img.read(filename, gi);
+    if(filename == high_template_filename){giHighPair1 = gi;}
+    if(filename == low_template_filename){giLowPair1 = gi;}
+    mri->set(res, date, std::move(img));
   }
   
   //Pass the desired Options
@@ -379,6 +425,8 @@ void execute_starfm_job_cpp(CharacterVector input_filenames,
 #ifdef _OPENMP
     ParallelizerOptions<StarfmOptions> po;
     po.setNumberOfThreads(n_cores);
+    //predict and write in bands of a multiple of 256 rows, large enough for about four stripes per thread
+    po.setBandHeight(256 * std::max(1, n_cores / 4));
     po.setAlgOptions(o);
     Parallelizer<StarfmFusor> sf;
     sf.srcImages(mri);
@@ -456,14 +504,16 @@ void execute_starfm_job_cpp(CharacterVector input_filenames,
   }
   
   imagefusion::Image pairMask = baseMask;
-  if (pairValidSets.hasHigh) //If there are any ranges given for the highrez :
+  if (pairValidSets.hasHigh) { //If there are any ranges given for the highrez :
     //apply the ranges and update the mask accordingly
     pairMask = helpers::processSetMask(std::move(pairMask), mri->get(hightag, date1), pairValidSets.high);
-  if(double_pair_mode){pairMask = helpers::processSetMask(std::move(pairMask), mri->get(hightag, date3), pairValidSets.high);}
-  if (pairValidSets.hasLow) //If there are any ranges given for the lowrez :
+    if(double_pair_mode){pairMask = helpers::processSetMask(std::move(pairMask), mri->get(hightag, date3), pairValidSets.high);}
+  }
+  if (pairValidSets.hasLow) { //If there are any ranges given for the lowrez :
     //apply the ranges and update the mask accordingly
     pairMask = helpers::processSetMask(std::move(pairMask), mri->get(lowtag,  date1), pairValidSets.low);
-  if(double_pair_mode){pairMask = helpers::processSetMask(std::move(pairMask), mri->get(lowtag,  date3), pairValidSets.low);}
+    if(double_pair_mode){pairMask = helpers::processSetMask(std::move(pairMask), mri->get(lowtag,  date3), pairValidSets.low);}
+  }
   
   
   
@@ -475,6 +525,11 @@ void execute_starfm_job_cpp(CharacterVector input_filenames,
     //Get the destination filename
     std::string pred_filename=as<std::string>(pred_filenames[i]);
     
+    //Load the low resolution image of the prediction date, unless it is a pair image
+    bool isLazyLoaded = !mri->has(lowtag, pred_dates[i]);
+    if (isLazyLoaded)
+      mri->set(lowtag, pred_dates[i], Image(lazyFilenames.get(lowtag, pred_dates[i])));
+    
     //Make the Mask
     //We use the basic ranges
     auto predValidSets = baseValidSets;
@@ -497,41 +552,38 @@ void execute_starfm_job_cpp(CharacterVector input_filenames,
       //Adjust the mask by also applying those ranges.
       predMask = helpers::processSetMask(std::move(predMask), mri->get(lowtag, pred_dates[i]), predValidSets.low);
     
+    //The Geoinformation of the template is written together with the prediction
+    // adjust it, if we have used a pred area
+    GeoInfo giTemplate = helpers::predictionGeoInfo(giHighPair1, pred_rectangle);
+    
     //Predict using the new mask we have made
     //If we have a parallelised fusor object, use that
 
       //OPTIONAL START
       if(verbose){Rcout  << "Predicting for date " << pred_dates[i];}
-      if (o.isDoublePairModeConfigured())
+      if (o.isDoublePairModeConfigured()) {
         if(verbose){Rcout  << " using both pairs from dates " << date1 << " and " << date3 << "." << std::endl;}
+      }
       else {
         if(verbose){Rcout  << " using a single pair from date " << date1 << "." << std::endl;}
       }
       
       //OPTIONAL END
-      sf.predict(pred_dates[i],predMask);  
-      sf.outputImage().write(pred_filename);
+      helpers::predictAndWrite(sf, pred_dates[i], predMask, pairMask, pred_filename, giTemplate, writeOptions);
     
     //Write the masks if desired
     if (output_masks){
       imagefusion::FileFormat outformat = imagefusion::FileFormat::fromFile(pred_filename);
       if(double_pair_mode){
-        std::string outmaskfilename = helpers::outputImageFile(predMask, giHighPair1, "MaskImage", pred_filename, "MaskImage", outformat, date1, pred_dates[i], date3);
+        std::string outmaskfilename = helpers::outputImageFile(predMask, giHighPair1, "MaskImage", pred_filename, "MaskImage", outformat, date1, pred_dates[i], date3, writeOptions);
     }else{
-      std::string outmaskfilename = helpers::outputImageFile(predMask, giHighPair1, "MaskImage", pred_filename, "MaskImage", outformat, date1, pred_dates[i], date1);
+      std::string outmaskfilename = helpers::outputImageFile(predMask, giHighPair1, "MaskImage", pred_filename, "MaskImage", outformat, date1, pred_dates[i], date1, writeOptions);
       }
     }
-    //Add the Geoinformation of the template to the written file
-    // and adjust it, if we have used a pred area
-    GeoInfo giTemplate {giHighPair1};
-    if (giTemplate.hasGeotransform()) {
-      giTemplate.geotrans.translateImage(pred_rectangle.x, pred_rectangle.y);
-      if (pred_rectangle.width != 0)
-        giTemplate.size.width = pred_rectangle.width;
-      if (pred_rectangle.height != 0)
-        giTemplate.size.height = pred_rectangle.height;
-      giTemplate.addTo(pred_filename);
-    }
+    
+    //Release the image of the prediction date again
+    if (isLazyLoaded)
+      mri->remove(lowtag, pred_dates[i]);
   }
 }
 
@@ -556,7 +608,8 @@ void execute_fitfc_job_cpp(CharacterVector input_filenames,
                             const std::string& hightag,  
                             const std::string& lowtag,   
                             const std::string& MASKIMG_options,
-                            const std::string& MASKRANGE_options
+                            const std::string& MASKRANGE_options,
+                            CharacterVector output_options
 ){
    
    
@@ -564,6 +617,8 @@ void execute_fitfc_job_cpp(CharacterVector input_filenames,
   //Step 1: Prepare the Input
   //create a prediction area rectangle
   Rectangle pred_rectangle = Rectangle{pred_area[0],pred_area[1],pred_area[2],pred_area[3]};
+  //parse the GDAL creation options for the output images, like COMPRESS=DEFLATE
+  std::vector<std::pair<std::string,std::string>> writeOptions = helpers::parseWriteOptions(as<std::vector<std::string>>(output_options));
   
   
   
@@ -573,7 +628,7 @@ void execute_fitfc_job_cpp(CharacterVector input_filenames,
     is_high[i] = (input_resolutions[i] == hightag);}
   Rcpp::CharacterVector filenames_high = input_filenames[is_high];
   std::string high_template_filename = Rcpp::as<std::vector<std::string> >(filenames_high)[0];
-  GeoInfo giHighPair1 {high_template_filename};
+  GeoInfo giHighPair1;
   if(verbose){Rcout <<"Getting High Resolution Geoinformation from File: "<<high_template_filename<<std::endl;}
   
   // find the gi the first pair low image 
@@ -583,21 +638,38 @@ void execute_fitfc_job_cpp(CharacterVector input_filenames,
   Rcpp::CharacterVector filenames_low = input_filenames[is_low];
   std::string low_template_filename = Rcpp::as<std::vector<std::string> >(filenames_low)[0];
   if(verbose){Rcout <<"Getting Low Resolution Geoinformation from File: "<<low_template_filename<<std::endl;}
-  GeoInfo  giLowPair1 {low_template_filename};
+  GeoInfo giLowPair1;
   
-  // a copy of the high image gi, which we later use for the output (and might modify a bit)
-  GeoInfo giTemplate {giHighPair1};
   
   
   
   //Step 2: Load the images and set the options
   //Load the images into a mri
+  //Deferred whole-image loading: only the pair images are loaded up front. The other images are just registered
+  //with their filename and loaded completely when a prediction needs them (see Step 5), so the memory does not grow
+  //with the number of dates. It is still bounded by the full pair images plus one full prediction date, there is
+  //no tiled reading.
   auto mri = std::make_shared<MultiResImages>();
+  MultiResCollection<std::string> lazyFilenames;
   int n_inputs = input_filenames.size();
   for(int i=0; i< n_inputs;++i){
-    mri->set(as<std::string>(input_resolutions[i]),
-             input_dates[i],
-                        Image(as<std::string>(input_filenames[i])));
+    std::string filename = as<std::string>(input_filenames[i]);
+    std::string res = as<std::string>(input_resolutions[i]);
+    int date = input_dates[i];
+    if(date != date1){
+      lazyFilenames.set(res, date, filename);
+      if(filename == high_template_filename){giHighPair1 = GeoInfo{filename};}
+      if(filename == low_template_filename){giLowPair1 = GeoInfo{filename};}
+      continue;
+    }
+    
+    // the geoinformation of the template images is taken from the same read, so each file is opened only once
+    GeoInfo gi;
+    Image img;
+    img.read(filename, gi);
+    if(filename == high_template_filename){giHighPair1 = gi;}
+    if(filename == low_template_filename){giLowPair1 = gi;}
+    mri->set(res, date, std::move(img));
   }
   
   //Pass the desired Options
@@ -713,6 +785,11 @@ void execute_fitfc_job_cpp(CharacterVector input_filenames,
     //Get the destination filename
     std::string pred_filename=as<std::string>(pred_filenames[i]);
     
+    //Load the low resolution image of the prediction date, unless it is a pair image
+    bool isLazyLoaded = !mri->has(lowtag, pred_dates[i]);
+    if (isLazyLoaded)
+      mri->set(lowtag, pred_dates[i], Image(lazyFilenames.get(lowtag, pred_dates[i])));
+    
     //Make the Mask
     //We use the basic ranges
     auto predValidSets = baseValidSets;
@@ -735,717 +812,465 @@ void execute_fitfc_job_cpp(CharacterVector input_filenames,
       //Adjust the mask by also applying those ranges.
       predMask = helpers::processSetMask(std::move(predMask), mri->get(lowtag, pred_dates[i]), predValidSets.low);
     
+    //The Geoinformation of the template is written together with the prediction
+    // adjust it, if we have used a pred area
+    GeoInfo giTemplate = helpers::predictionGeoInfo(giHighPair1, pred_rectangle);
+    
     //Predict using the new mask we have made
     //If we have a parallelised fusor object, use that
       if(verbose){Rcout  << "Predicting for date " << pred_dates[i];}
       if(verbose){Rcout  << " using pair from date " << date1<< std::endl;}
-      ffc.predict(pred_dates[i],predMask);  
-      ffc.outputImage().write(pred_filename);
+      helpers::predictAndWrite(ffc, pred_dates[i], predMask, pred_filename, giTemplate, writeOptions);
     
     //Write the masks if desired
     if (output_masks){
       imagefusion::FileFormat outformat = imagefusion::FileFormat::fromFile(pred_filename);
-      std::string outmaskfilename = helpers::outputImageFile(predMask, giHighPair1, "MaskImage", pred_filename, "MaskImage", outformat, date1, pred_dates[i]);}
+      std::string outmaskfilename = helpers::outputImageFile(predMask, giHighPair1, "MaskImage", pred_filename, "MaskImage", outformat, date1, pred_dates[i], 0, writeOptions);}
     
-    //Add the Geoinformation of the template to the written file
-    // and adjust it, if we have used a pred area
-    GeoInfo giTemplate {giHighPair1};
-    if (giTemplate.hasGeotransform()) {
-      giTemplate.geotrans.translateImage(pred_rectangle.x, pred_rectangle.y);
-      if (pred_rectangle.width != 0)
-        giTemplate.size.width = pred_rectangle.width;
-      if (pred_rectangle.height != 0)
-        giTemplate.size.height = pred_rectangle.height;
-      giTemplate.addTo(pred_filename);
-    }
+    //Release the image of the prediction date again
+    if (isLazyLoaded)
+      mri->remove(lowtag, pred_dates[i]);
   }
 }
 
 
+//===========================================spstfm=================================
+// Dictionaries are stored with cv::FileStorage (YAML, XML or JSON depending on the file extension)
+static bool loadSpstfmDictionary(std::string const& path, cv::Mat& dict) {
+  try {
+    cv::FileStorage fs(path, cv::FileStorage::READ);
+    if (!fs.isOpened())
+      return false;
+    fs["dictionary"] >> dict;
+  }
+  catch (cv::Exception const&) {
+    return false;
+  }
+  if (dict.empty())
+    return false;
+  if (dict.type() != CV_64FC1)
+    dict.convertTo(dict, CV_64FC1);
+  return true;
+}
 
-// //===========================================spstfm=================================
-// // [[Rcpp::export]]
-// void execute_spstfm_job_cpp(CharacterVector input_filenames, 
-//                             CharacterVector input_resolutions, 
-//                             IntegerVector input_dates, 
-//                             IntegerVector pred_dates, 
-//                             CharacterVector pred_filenames,   
-//                             IntegerVector pred_area, 
-//                             int date1,
-//                             int date3,
-//                             int n_cores,
-//                             int dict_size,
-//                             int n_training_samples,
-//                             int patch_size,
-//                             int patch_overlap,
-//                             int min_train_iter,
-//                             int max_train_iter,
-//                             bool output_masks,
-//                             bool use_nodata_value,
-//                             bool random_sampling,
-//                             bool verbose,
-//                             const std::string& hightag,  
-//                             const std::string& lowtag,   
-//                             const std::string& MASKIMG_options,
-//                             const std::string& MASKRANGE_options,
-//                             const std::string& LOADDICT_options,
-//                             const std::string& SAVEDICT_options,
-//                             const std::string& REUSE_options
-//                               
-// )
-// {
-//   
-//   
-//   
-// #ifndef _OPENMP
-//   if(n_cores>1){
-//     Rcout <<"Sorry, if you want to use Parallelizer, you need to install OpenMP first."<<std::endl;
-//   }
-// #endif 
-//   
-//   
-//   using namespace imagefusion;
-//   //Step 1: Prepare the Input
-//   //create a prediction area rectangle
-//   Rectangle pred_rectangle = Rectangle{pred_area[0],pred_area[1],pred_area[2],pred_area[3]};
-//   
-//   // check spelling of reuse dictionary option
-//   std::string reuseOpt = REUSE_options;
-//   if (reuseOpt != "improve" && reuseOpt != "clear" && reuseOpt != "use") {
-//     Rcpp::Rcerr << "For --dict-reuse you must either give 'improve', 'clear' or 'use'. You gave " << reuseOpt << "." << std::endl;
-//   }
-//   
-//   // find the gi the first pair high image 
-//   Rcpp::LogicalVector is_high(input_filenames.size());
-//   for( int i=0; i<input_filenames.size(); i++){
-//     is_high[i] = (input_resolutions[i] == hightag);}
-//   Rcpp::CharacterVector filenames_high = input_filenames[is_high];
-//   std::string high_template_filename = Rcpp::as<std::vector<std::string> >(filenames_high)[0];
-//   GeoInfo  giHighPair1 {high_template_filename};
-//   if(verbose){Rcout <<"Getting High Resolution Geoinformation from File: "<<high_template_filename<<std::endl;}
-//   
-//   // find the gi the first pair low image 
-//   Rcpp::LogicalVector is_low(input_filenames.size());
-//   for( int i=0; i<input_filenames.size(); i++){
-//     is_low[i] = (input_resolutions[i] == lowtag);}
-//   Rcpp::CharacterVector filenames_low = input_filenames[is_low];
-//   std::string low_template_filename = Rcpp::as<std::vector<std::string> >(filenames_low)[0];
-//   if(verbose){Rcout <<"Getting Low Resolution Geoinformation from File: "<<low_template_filename<<std::endl;}
-//   GeoInfo giLowPair1 {low_template_filename};
-//   
-//   
-//   
-//   
-//   
-//   //Step 2: Load the images and set the options
-//   
-//   //Load the images into a mri
-//   auto mri = std::make_shared<MultiResImages>();
-//   int n_inputs = input_filenames.size();
-//   for(int i=0; i< n_inputs;++i){
-//     mri->set(as<std::string>(input_resolutions[i]),
-//              input_dates[i],
-//                         Image(as<std::string>(input_filenames[i])));
-//   }
-//   
-//   //Pass the desired Options
-//   //required arguments
-//   imagefusion::SpstfmOptions o;
-//   o.setHighResTag(hightag);
-//   o.setLowResTag(lowtag);
-//   o.setDate1(date1);
-//   o.setDate3(date3);
-//   //optional arguments
-//   o.setPredictionArea(pred_rectangle);
-//   o.setDictSize(dict_size);
-//   o.setNumberTrainingSamples(n_training_samples);
-//   o.setPatchSize(patch_size);
-//   o.setPatchOverlap(patch_overlap);
-//   o.setMinTrainIter(min_train_iter);
-//   o.setMaxTrainIter(max_train_iter);
-//   if(random_sampling){
-//     o.setSamplingStrategy(imagefusion::SpstfmOptions::SamplingStrategy::random);
-//   }else{
-//     o.setSamplingStrategy(imagefusion::SpstfmOptions::SamplingStrategy::variance);
-//   }
-//   
-//   
-//   
-//   //Step 3: Create the Fusor
-//   //Create the Fusor
-//   SpstfmFusor spsf;
-//   spsf.srcImages(mri); 
-//   
-//   
-//   
-//   //Step 4: Handle the Masking for the Input Pairs
-//   //We create a single base mask "pairMask" derived from applying the ranges(if any are given) to the
-//   //Images for Date1 and Date3
-//   //This is implemented effectively in the c++ code, which is why we simply wrap around its option parser system
-//   //and pass it strings which contain the options we would like, as if on command line
-//   using Descriptor = imagefusion::option::Descriptor;
-//   using ArgChecker = imagefusion::option::ArgChecker;
-//   using Parse      = imagefusion::option::Parse;
-//   std::vector<Descriptor> usage{
-//     Descriptor::text(""),
-//     {"MASKIMG",       "",            "m", "mask-img",                     ArgChecker::Mask,        helpers::usageMaskFile},
-//     {"MASKRANGE",     "HIGHINVALID", "",  "mask-high-res-invalid-ranges", ArgChecker::IntervalSet, "  --mask-high-res-invalid-ranges=<range-list> \tThis is the same as --mask-invalid-ranges, but is applied only for the high resolution images.\n"},
-//     {"MASKRANGE",     "HIGHVALID",   "",  "mask-high-res-valid-ranges",   ArgChecker::IntervalSet, "  --mask-high-res-valid-ranges=<range-list> \tThis is the same as --mask-valid-ranges, but is applied only for the high resolution images.\n"},
-//     {"MASKRANGE",     "INVALID",     "",  "mask-invalid-ranges",          ArgChecker::IntervalSet, helpers::usageInvalidRanges},
-//     {"MASKRANGE",     "LOWINVALID",  "",  "mask-low-res-invalid-ranges",  ArgChecker::IntervalSet, "  --mask-low-res-invalid-ranges=<range-list> \tThis is the same as --mask-invalid-ranges, but is applied only for the low resolution images.\n"},
-//     {"MASKRANGE",     "LOWVALID",    "",  "mask-low-res-valid-ranges",    ArgChecker::IntervalSet, "  --mask-low-res-valid-ranges=<range-list> \tThis is the same as --mask-valid-ranges, but is applied only for the low resolution images.\n"},
-//     {"MASKRANGE",     "VALID",       "",  "mask-valid-ranges",            ArgChecker::IntervalSet, helpers::usageValidRanges},
-//     {"SAVEDICT",      "",            "s", "save-dict",                    ArgChecker::NonEmpty,    "  -s <outfile>, --save-dict=<outfile> \tSave the dictionary after the last training to a file. This can be used later on with --load-dict=outfile and, if you do not want to improve it, --dict-reuse=use.\n"},
-//     {"LOADDICT",      "",            "l", "load-dict",                    ArgChecker::NonEmpty,    "  -l <file>, --load-dict=<file> \tLoad dictionary from a file, which has been written with --save-dict before. You can give the filename you specified with --save-dict, even if there have been generated numbers in the filename (which happens in case of multi-channel images). Do not specify multiple dictionaries. Only the last will be used otherwise.\n"},
-//     
-//     Descriptor::optfile() // 
-//   };
-//   
-//   //LOAD DICT
-//   // load dictionary from file
-//   if (!LOADDICT_options.empty()) {
-//     std::string dictPath = LOADDICT_options;
-//     unsigned int chans = mri->getAny().channels();
-//     if (chans == 1) {
-//       if (!std::filesystem::exists(dictPath)) {
-//         Rcpp::Rcerr << "Could not find the dictionary file " << dictPath << " to load a single-channel dictionary." << std::endl;
-//       }
-//       
-//       arma::mat dict;
-//       bool loadOK = dict.load(dictPath);
-//       if (loadOK) {
-//         if(verbose){Rcout  << "Using dictionary from " << dictPath << "." << std::endl;}
-//         spsf.setDictionary(dict);
-//       }
-//       else
-//         Rcpp::Rcerr << "Could not load dictionary from " << dictPath << " although the file exists. Defect file? Ignoring option --load-dict." << std::endl;
-//     }
-//     else {
-//       std::filesystem::path p = dictPath;
-//       std::string extension = p.extension().string();
-//       std::string basename  = p.stem().string();
-//       if (std::filesystem::exists(dictPath))
-//         basename.pop_back(); // drop channel number
-//       
-//       for (unsigned int c = 0; c < chans; ++c) {
-//         p = basename + std::to_string(c) + extension;
-//         auto outpath = p;
-//         
-//         std::string infilename = outpath.string();
-//         if (!std::filesystem::exists(infilename)) {
-//           Rcpp::Rcerr << "Could not find the dictionary file " << infilename << " to load a part of a multi-channel dictionary. "
-//           "Give either the same filename as specified with --save-dict or one of the actual files with channel number." << std::endl;
-//         }
-//         
-//         arma::mat dict;
-//         bool loadOK = dict.load(infilename);
-//         if (loadOK) {
-//           if(verbose){Rcout  << "Using dictionary from " << infilename << " for channel " << c << "." << std::endl;}
-//           spsf.setDictionary(dict, c);
-//         }
-//         else {
-//           Rcpp::Rcerr << "Could not load dictionary from " << infilename << " although the file exists. Defect file? Ignoring option --load-dict completely." << std::endl;
-//           // remove eventual dictionaries set to previous channels
-//           for (unsigned int i = 0; i < chans; ++i)
-//             spsf.setDictionary(dict, i);
-//           break;
-//         }
-//       }
-//     }
-//   }
-//   
-//   
-//   //MASK
-//   //First, parse the MASKIMG options, if given
-//   auto maskoptions = imagefusion::option::OptionParser::parse(usage,MASKIMG_options);
-//   std::vector<std::string> maskImgArgs;
-//   for (auto const& opt : maskoptions["MASKIMG"])
-//     maskImgArgs.push_back(opt.arg);
-//   //Gets the Mask if one was given in the options, otherwise create a base mask
-//   // from scratch. Uses first pair high image  as template.
-//   imagefusion::Image baseMask = helpers::parseAndCombineMaskImages<Parse>(maskImgArgs, giHighPair1.channels, !maskoptions["MASKRANGE"].empty());
-//   
-//   //get ranges
-//   auto rangeoptions = imagefusion::option::OptionParser::parse(usage,MASKRANGE_options);
-//   auto baseValidSets = helpers::parseAndCombineRanges<Parse>(rangeoptions["MASKRANGE"]);
-//   auto pairValidSets = baseValidSets;
-//   
-//   //adjust ranges by including the nodata value, if desired
-//   if (use_nodata_value) { //Only in case we want to include the nodatavalue
-//     if (!pairValidSets.hasHigh)//If there are NO ranges given for the highrez
-//       //set high limits to entire datarange
-//       pairValidSets.high += imagefusion::Interval::closed(-std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity());
-//     if (!pairValidSets.hasLow)//If there are NO ranges given for the lowrez
-//       //set low limits to entire datarange
-//       pairValidSets.low  += imagefusion::Interval::closed(-std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity());
-//     //Now ranges are given.
-//     pairValidSets.hasHigh = pairValidSets.hasLow = true;
-//     
-//     //Then we get the NoDataValue from the GeoInfo (if there is one),
-//     //make an interval of it, and subtract it from the high rez ranges
-//     if (giHighPair1.hasNodataValue()) {
-//       imagefusion::Interval nodataInt = imagefusion::Interval::closed(giHighPair1.getNodataValue(), giHighPair1.getNodataValue());
-//       pairValidSets.high -= nodataInt;
-//     }
-//     //Then we get the NoDataValue from the GeoInfo (if there is one),
-//     // make an interval of it, and subtract it from the low rez ranges
-//     if (giLowPair1.hasNodataValue()) {
-//       imagefusion::Interval nodataInt = imagefusion::Interval::closed(giLowPair1.getNodataValue(), giLowPair1.getNodataValue());
-//       pairValidSets.low -= nodataInt;
-//     }
-//   }
-//   
-//   imagefusion::Image pairMask = baseMask;
-//   if (pairValidSets.hasHigh) //If there are any ranges given for the highrez :
-//     //apply the ranges and update the mask accordingly
-//     pairMask = helpers::processSetMask(std::move(pairMask), mri->get(hightag, date1), pairValidSets.high);
-//   pairMask = helpers::processSetMask(std::move(pairMask), mri->get(hightag, date3), pairValidSets.high);
-//   if (pairValidSets.hasLow) //If there are any ranges given for the lowrez :
-//     //apply the ranges and update the mask accordingly
-//     pairMask = helpers::processSetMask(std::move(pairMask), mri->get(lowtag,  date1), pairValidSets.low);
-//   pairMask = helpers::processSetMask(std::move(pairMask), mri->get(lowtag,  date3), pairValidSets.low);
-//   
-//   
-//   //Step 6: Training
-//   // train dictionary (if there is one from a previous time series, improve it)
-//   if(verbose){Rcout  << "Training with dates " << date1 << " and " << date3 << std::endl;}
-//   if (reuseOpt == "improve")
-//     o.setDictionaryReuse(imagefusion::SpstfmOptions::ExistingDictionaryHandling::improve);
-//   else if (reuseOpt == "clear")
-//     o.setDictionaryReuse(imagefusion::SpstfmOptions::ExistingDictionaryHandling::clear);
-//   else // (reuseOpt == "use")
-//     o.setDictionaryReuse(imagefusion::SpstfmOptions::ExistingDictionaryHandling::use);
-//   
-//   spsf.processOptions(o);
-//   spsf.train(pairMask);
-//   
-//   
-//   //Step 6: Predictions
-//   //Predict for desired Dates
-//   int n_outputs = pred_dates.size();
-//   for(int i=0; i< n_outputs;++i){
-//     //Get the destination filename
-//     std::string pred_filename=as<std::string>(pred_filenames[i]);
-//     
-//     //Make the Mask
-//     //We use the basic ranges
-//     auto predValidSets = baseValidSets;
-//     
-//     if (use_nodata_value) {
-//       if (!predValidSets.hasLow)
-//         predValidSets.low  += imagefusion::Interval::closed(-std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity());
-//       predValidSets.hasLow = true;
-//       if (giHighPair1.hasNodataValue()) { 
-//         imagefusion::Interval nodataInt = imagefusion::Interval::closed(giHighPair1.getNodataValue(), giHighPair1.getNodataValue());
-//         predValidSets.low -= nodataInt;
-//       }
-//     }
-//     //For every prediction, we start out with the pairMask, which we obtained earlier through a combination of Date1 and Date3 masks 
-//     imagefusion::Image predMask = pairMask;
-//     
-//     //Apply the low res ranges, if there are any 
-//     //(pred will always be a high res image, so we only need the low ranges)
-//     if (predValidSets.hasLow)
-//       //Adjust the mask by also applying those ranges.
-//       predMask = helpers::processSetMask(std::move(predMask), mri->get(lowtag, pred_dates[i]), predValidSets.low);
-//     if(verbose){Rcout  <<"Predicting for date"<< pred_dates[i]<< " using both pairs from dates " << date1 << " and " << date3 << "." << std::endl;}
-//     
-//     spsf.predict(pred_dates[i],predMask);  
-//     spsf.outputImage().write(pred_filename);
-//     
-//     //Write the masks if desired
-//     if (output_masks){
-//       imagefusion::FileFormat outformat = imagefusion::FileFormat::fromFile(pred_filename);
-//       std::string outmaskfilename = helpers::outputImageFile(predMask, giHighPair1, "MaskImage", pred_filename, "MaskImage", outformat, date1, pred_dates[i], date3);}
-//     
-//     //Add the Geoinformation of the template to the written file
-//     // and adjust it, if we have used a pred area
-//     GeoInfo giTemplate {giHighPair1};
-//     if (giTemplate.hasGeotransform()) {
-//       giTemplate.geotrans.translateImage(pred_rectangle.x, pred_rectangle.y);
-//       if (pred_rectangle.width != 0)
-//         giTemplate.size.width = pred_rectangle.width;
-//       if (pred_rectangle.height != 0)
-//         giTemplate.size.height = pred_rectangle.height;
-//       giTemplate.addTo(pred_filename);
-//     }
-//   }
-//   // save dictionary to file
-//   if (!SAVEDICT_options.empty()) {
-//     bool success = true;
-//     std::string dictPath = SAVEDICT_options;
-//     unsigned int chans = mri->getAny().channels();
-//     if (chans == 1) {
-//       success = spsf.getDictionary().save(dictPath);
-//       if (success)
-//         if(verbose){Rcout  << "Saved dictionary to " << dictPath << "." << std::endl;}
-//         else
-//           Rcpp::Rcerr << "Could not save dictionary to " << dictPath << "." << std::endl;
-//     }
-//     else {
-//       std::filesystem::path p = dictPath;
-//       std::string extension = p.extension().string();
-//       std::string basename  = p.stem().string();
-//       for (unsigned int c = 0; c < chans; ++c) {
-//         p = basename + std::to_string(c) + extension;
-//         auto outpath = p;
-//         
-//         std::string outfilename = outpath.string();
-//         bool saved = spsf.getDictionary(c).save(outfilename);
-//         if (saved)
-//           if(verbose){Rcout  << "Saved dictionary for channel " << c << " to " << outfilename << "." << std::endl;}
-//           success &= saved;
-//       }
-//       
-//       if (success)
-//         if(verbose){Rcout  << "For loading the dictionaries later on, you can still use --load-dict=" << dictPath << "." << std::endl;}
-//     }
-//   }
-//   
-// }
-
-// 
-// //===========================================spstfm=================================
-// // [[Rcpp::export]]
-// void execute_spstfm_job_cpp(CharacterVector input_filenames, 
-//                              CharacterVector input_resolutions, 
-//                              IntegerVector input_dates, 
-//                              IntegerVector pred_dates, 
-//                              CharacterVector pred_filenames,   
-//                              IntegerVector pred_area, 
-//                              int date1,
-//                              int date3,
-//                              int n_cores,
-//                              int dict_size,
-//                              int n_training_samples,
-//                              int patch_size,
-//                              int patch_overlap,
-//                              int min_train_iter,
-//                              int max_train_iter,
-//                              bool output_masks,
-//                              bool use_nodata_value,
-//                              bool random_sampling,
-//                              bool verbose,
-//                              const std::string& hightag,  
-//                              const std::string& lowtag,   
-//                              const std::string& MASKIMG_options,
-//                              const std::string& MASKRANGE_options,
-//                              const std::string& LOADDICT_options,
-//                              const std::string& SAVEDICT_options,
-//                              const std::string& REUSE_options
-//                              
-// )
-// {
-//    
-//    
-//   
-// #ifndef _OPENMP
-//   if(n_cores>1){
-//     Rcout <<"Sorry, if you want to use Parallelizer, you need to install OpenMP first."<<std::endl;
-//   }
-// #endif 
-//   
-//   
-//   using namespace imagefusion;
-//   //Step 1: Prepare the Input
-//   //create a prediction area rectangle
-//   Rectangle pred_rectangle = Rectangle{pred_area[0],pred_area[1],pred_area[2],pred_area[3]};
-//   
-//   // check spelling of reuse dictionary option
-//   std::string reuseOpt = REUSE_options;
-//   if (reuseOpt != "improve" && reuseOpt != "clear" && reuseOpt != "use") {
-//     Rcpp::Rcerr << "For --dict-reuse you must either give 'improve', 'clear' or 'use'. You gave " << reuseOpt << "." << std::endl;
-//   }
-//   
-//   // find the gi the first pair high image 
-//   Rcpp::LogicalVector is_high(input_filenames.size());
-//   for( int i=0; i<input_filenames.size(); i++){
-//     is_high[i] = (input_resolutions[i] == hightag);}
-//   Rcpp::CharacterVector filenames_high = input_filenames[is_high];
-//   std::string high_template_filename = Rcpp::as<std::vector<std::string> >(filenames_high)[0];
-//   GeoInfo  giHighPair1 {high_template_filename};
-//   if(verbose){Rcout <<"Getting High Resolution Geoinformation from File: "<<high_template_filename<<std::endl;}
-//   
-//   // find the gi the first pair low image 
-//   Rcpp::LogicalVector is_low(input_filenames.size());
-//   for( int i=0; i<input_filenames.size(); i++){
-//     is_low[i] = (input_resolutions[i] == lowtag);}
-//   Rcpp::CharacterVector filenames_low = input_filenames[is_low];
-//   std::string low_template_filename = Rcpp::as<std::vector<std::string> >(filenames_low)[0];
-//   if(verbose){Rcout <<"Getting Low Resolution Geoinformation from File: "<<low_template_filename<<std::endl;}
-//   GeoInfo giLowPair1 {low_template_filename};
-//   
-//   
-//   
-//   
-//   
-//   //Step 2: Load the images and set the options
-//   
-//   //Load the images into a mri
-//   auto mri = std::make_shared<MultiResImages>();
-//   int n_inputs = input_filenames.size();
-//   for(int i=0; i< n_inputs;++i){
-//     mri->set(as<std::string>(input_resolutions[i]),
-//              input_dates[i],
-//                         Image(as<std::string>(input_filenames[i])));
-//   }
-//   
-//   //Pass the desired Options
-//   //required arguments
-//   imagefusion::SpstfmOptions o;
-//   o.setHighResTag(hightag);
-//   o.setLowResTag(lowtag);
-//   o.setDate1(date1);
-//   o.setDate3(date3);
-//   //optional arguments
-//   o.setPredictionArea(pred_rectangle);
-//   o.setDictSize(dict_size);
-//   o.setNumberTrainingSamples(n_training_samples);
-//   o.setPatchSize(patch_size);
-//   o.setPatchOverlap(patch_overlap);
-//   o.setMinTrainIter(min_train_iter);
-//   o.setMaxTrainIter(max_train_iter);
-//   if(random_sampling){
-//     o.setSamplingStrategy(imagefusion::SpstfmOptions::SamplingStrategy::random);
-//   }else{
-//     o.setSamplingStrategy(imagefusion::SpstfmOptions::SamplingStrategy::variance);
-//   }
-//   
-// 
-//   
-//   //Step 3: Create the Fusor
-//   //Create the Fusor
-//   SpstfmFusor spsf;
-//   spsf.srcImages(mri); 
-// 
-//   
-//   
-//   //Step 4: Handle the Masking for the Input Pairs
-//   //We create a single base mask "pairMask" derived from applying the ranges(if any are given) to the
-//   //Images for Date1 and Date3
-//   //This is implemented effectively in the c++ code, which is why we simply wrap around its option parser system
-//   //and pass it strings which contain the options we would like, as if on command line
-//   using Descriptor = imagefusion::option::Descriptor;
-//   using ArgChecker = imagefusion::option::ArgChecker;
-//   using Parse      = imagefusion::option::Parse;
-//   std::vector<Descriptor> usage{
-//     Descriptor::text(""),
-//     {"MASKIMG",       "",            "m", "mask-img",                     ArgChecker::Mask,        helpers::usageMaskFile},
-//     {"MASKRANGE",     "HIGHINVALID", "",  "mask-high-res-invalid-ranges", ArgChecker::IntervalSet, "  --mask-high-res-invalid-ranges=<range-list> \tThis is the same as --mask-invalid-ranges, but is applied only for the high resolution images.\n"},
-//     {"MASKRANGE",     "HIGHVALID",   "",  "mask-high-res-valid-ranges",   ArgChecker::IntervalSet, "  --mask-high-res-valid-ranges=<range-list> \tThis is the same as --mask-valid-ranges, but is applied only for the high resolution images.\n"},
-//     {"MASKRANGE",     "INVALID",     "",  "mask-invalid-ranges",          ArgChecker::IntervalSet, helpers::usageInvalidRanges},
-//     {"MASKRANGE",     "LOWINVALID",  "",  "mask-low-res-invalid-ranges",  ArgChecker::IntervalSet, "  --mask-low-res-invalid-ranges=<range-list> \tThis is the same as --mask-invalid-ranges, but is applied only for the low resolution images.\n"},
-//     {"MASKRANGE",     "LOWVALID",    "",  "mask-low-res-valid-ranges",    ArgChecker::IntervalSet, "  --mask-low-res-valid-ranges=<range-list> \tThis is the same as --mask-valid-ranges, but is applied only for the low resolution images.\n"},
-//     {"MASKRANGE",     "VALID",       "",  "mask-valid-ranges",            ArgChecker::IntervalSet, helpers::usageValidRanges},
-//     {"SAVEDICT",      "",            "s", "save-dict",                    ArgChecker::NonEmpty,    "  -s <outfile>, --save-dict=<outfile> \tSave the dictionary after the last training to a file. This can be used later on with --load-dict=outfile and, if you do not want to improve it, --dict-reuse=use.\n"},
-//     {"LOADDICT",      "",            "l", "load-dict",                    ArgChecker::NonEmpty,    "  -l <file>, --load-dict=<file> \tLoad dictionary from a file, which has been written with --save-dict before. You can give the filename you specified with --save-dict, even if there have been generated numbers in the filename (which happens in case of multi-channel images). Do not specify multiple dictionaries. Only the last will be used otherwise.\n"},
-//     
-//     Descriptor::optfile() // 
-//   };
-//   
-//   //LOAD DICT
-//   // load dictionary from file
-//   if (!LOADDICT_options.empty()) {
-//     std::string dictPath = LOADDICT_options;
-//     unsigned int chans = mri->getAny().channels();
-//     if (chans == 1) {
-//       if (!std::filesystem::exists(dictPath)) {
-//         Rcpp::Rcerr << "Could not find the dictionary file " << dictPath << " to load a single-channel dictionary." << std::endl;
-//       }
-//       
-//       arma::mat dict;
-//       bool loadOK = dict.load(dictPath);
-//       if (loadOK) {
-//         if(verbose){Rcout  << "Using dictionary from " << dictPath << "." << std::endl;}
-//         spsf.setDictionary(dict);
-//       }
-//       else
-//         Rcpp::Rcerr << "Could not load dictionary from " << dictPath << " although the file exists. Defect file? Ignoring option --load-dict." << std::endl;
-//     }
-//     else {
-//       std::filesystem::path p = dictPath;
-//       std::string extension = p.extension().string();
-//       std::string basename  = p.stem().string();
-//       if (std::filesystem::exists(dictPath))
-//         basename.pop_back(); // drop channel number
-//       
-//       for (unsigned int c = 0; c < chans; ++c) {
-//         p = basename + std::to_string(c) + extension;
-//         auto outpath = p;
-//         
-//         std::string infilename = outpath.string();
-//         if (!std::filesystem::exists(infilename)) {
-//           Rcpp::Rcerr << "Could not find the dictionary file " << infilename << " to load a part of a multi-channel dictionary. "
-//           "Give either the same filename as specified with --save-dict or one of the actual files with channel number." << std::endl;
-//         }
-//         
-//         arma::mat dict;
-//         bool loadOK = dict.load(infilename);
-//         if (loadOK) {
-//           if(verbose){Rcout  << "Using dictionary from " << infilename << " for channel " << c << "." << std::endl;}
-//           spsf.setDictionary(dict, c);
-//         }
-//         else {
-//           Rcpp::Rcerr << "Could not load dictionary from " << infilename << " although the file exists. Defect file? Ignoring option --load-dict completely." << std::endl;
-//           // remove eventual dictionaries set to previous channels
-//           for (unsigned int i = 0; i < chans; ++i)
-//             spsf.setDictionary(dict, i);
-//           break;
-//         }
-//       }
-//     }
-//   }
-//   
-//   
-//   //MASK
-//   //First, parse the MASKIMG options, if given
-//   auto maskoptions = imagefusion::option::OptionParser::parse(usage,MASKIMG_options);
-//   std::vector<std::string> maskImgArgs;
-//   for (auto const& opt : maskoptions["MASKIMG"])
-//     maskImgArgs.push_back(opt.arg);
-//   //Gets the Mask if one was given in the options, otherwise create a base mask
-//   // from scratch. Uses first pair high image  as template.
-//   imagefusion::Image baseMask = helpers::parseAndCombineMaskImages<Parse>(maskImgArgs, giHighPair1.channels, !maskoptions["MASKRANGE"].empty());
-//   
-//   //get ranges
-//   auto rangeoptions = imagefusion::option::OptionParser::parse(usage,MASKRANGE_options);
-//   auto baseValidSets = helpers::parseAndCombineRanges<Parse>(rangeoptions["MASKRANGE"]);
-//   auto pairValidSets = baseValidSets;
-//   
-//   //adjust ranges by including the nodata value, if desired
-//   if (use_nodata_value) { //Only in case we want to include the nodatavalue
-//     if (!pairValidSets.hasHigh)//If there are NO ranges given for the highrez
-//       //set high limits to entire datarange
-//       pairValidSets.high += imagefusion::Interval::closed(-std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity());
-//     if (!pairValidSets.hasLow)//If there are NO ranges given for the lowrez
-//       //set low limits to entire datarange
-//       pairValidSets.low  += imagefusion::Interval::closed(-std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity());
-//     //Now ranges are given.
-//     pairValidSets.hasHigh = pairValidSets.hasLow = true;
-//     
-//     //Then we get the NoDataValue from the GeoInfo (if there is one),
-//     //make an interval of it, and subtract it from the high rez ranges
-//     if (giHighPair1.hasNodataValue()) {
-//       imagefusion::Interval nodataInt = imagefusion::Interval::closed(giHighPair1.getNodataValue(), giHighPair1.getNodataValue());
-//       pairValidSets.high -= nodataInt;
-//     }
-//     //Then we get the NoDataValue from the GeoInfo (if there is one),
-//     // make an interval of it, and subtract it from the low rez ranges
-//     if (giLowPair1.hasNodataValue()) {
-//       imagefusion::Interval nodataInt = imagefusion::Interval::closed(giLowPair1.getNodataValue(), giLowPair1.getNodataValue());
-//       pairValidSets.low -= nodataInt;
-//     }
-//   }
-//   
-//   imagefusion::Image pairMask = baseMask;
-//   if (pairValidSets.hasHigh) //If there are any ranges given for the highrez :
-//     //apply the ranges and update the mask accordingly
-//     pairMask = helpers::processSetMask(std::move(pairMask), mri->get(hightag, date1), pairValidSets.high);
-//   pairMask = helpers::processSetMask(std::move(pairMask), mri->get(hightag, date3), pairValidSets.high);
-//   if (pairValidSets.hasLow) //If there are any ranges given for the lowrez :
-//     //apply the ranges and update the mask accordingly
-//     pairMask = helpers::processSetMask(std::move(pairMask), mri->get(lowtag,  date1), pairValidSets.low);
-//   pairMask = helpers::processSetMask(std::move(pairMask), mri->get(lowtag,  date3), pairValidSets.low);
-//   
-//   
-//   //Step 6: Training
-//   // train dictionary (if there is one from a previous time series, improve it)
-//   if(verbose){Rcout  << "Training with dates " << date1 << " and " << date3 << std::endl;}
-//   if (reuseOpt == "improve")
-//     o.setDictionaryReuse(imagefusion::SpstfmOptions::ExistingDictionaryHandling::improve);
-//   else if (reuseOpt == "clear")
-//     o.setDictionaryReuse(imagefusion::SpstfmOptions::ExistingDictionaryHandling::clear);
-//   else // (reuseOpt == "use")
-//     o.setDictionaryReuse(imagefusion::SpstfmOptions::ExistingDictionaryHandling::use);
-//   
-//   spsf.processOptions(o);
-//   spsf.train(pairMask);
-//   
-//   
-//   //Step 6: Predictions
-//   //Predict for desired Dates
-//   int n_outputs = pred_dates.size();
-//   for(int i=0; i< n_outputs;++i){
-//     //Get the destination filename
-//     std::string pred_filename=as<std::string>(pred_filenames[i]);
-//     
-//     //Make the Mask
-//     //We use the basic ranges
-//     auto predValidSets = baseValidSets;
-//     
-//     if (use_nodata_value) {
-//       if (!predValidSets.hasLow)
-//         predValidSets.low  += imagefusion::Interval::closed(-std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity());
-//       predValidSets.hasLow = true;
-//       if (giHighPair1.hasNodataValue()) { 
-//         imagefusion::Interval nodataInt = imagefusion::Interval::closed(giHighPair1.getNodataValue(), giHighPair1.getNodataValue());
-//         predValidSets.low -= nodataInt;
-//       }
-//     }
-//     //For every prediction, we start out with the pairMask, which we obtained earlier through a combination of Date1 and Date3 masks 
-//     imagefusion::Image predMask = pairMask;
-//     
-//     //Apply the low res ranges, if there are any 
-//     //(pred will always be a high res image, so we only need the low ranges)
-//     if (predValidSets.hasLow)
-//       //Adjust the mask by also applying those ranges.
-//       predMask = helpers::processSetMask(std::move(predMask), mri->get(lowtag, pred_dates[i]), predValidSets.low);
-//     if(verbose){Rcout  <<"Predicting for date"<< pred_dates[i]<< " using both pairs from dates " << date1 << " and " << date3 << "." << std::endl;}
-//     
-//     spsf.predict(pred_dates[i],predMask);  
-//     spsf.outputImage().write(pred_filename);
-//     
-//     //Write the masks if desired
-//     if (output_masks){
-//       imagefusion::FileFormat outformat = imagefusion::FileFormat::fromFile(pred_filename);
-//       std::string outmaskfilename = helpers::outputImageFile(predMask, giHighPair1, "MaskImage", pred_filename, "MaskImage", outformat, date1, pred_dates[i], date3);}
-//     
-//     //Add the Geoinformation of the template to the written file
-//     // and adjust it, if we have used a pred area
-//     GeoInfo giTemplate {giHighPair1};
-//     if (giTemplate.hasGeotransform()) {
-//       giTemplate.geotrans.translateImage(pred_rectangle.x, pred_rectangle.y);
-//       if (pred_rectangle.width != 0)
-//         giTemplate.size.width = pred_rectangle.width;
-//       if (pred_rectangle.height != 0)
-//         giTemplate.size.height = pred_rectangle.height;
-//       giTemplate.addTo(pred_filename);
-//     }
-//   }
-//   // save dictionary to file
-//   if (!SAVEDICT_options.empty()) {
-//     bool success = true;
-//     std::string dictPath = SAVEDICT_options;
-//     unsigned int chans = mri->getAny().channels();
-//     if (chans == 1) {
-//       success = spsf.getDictionary().save(dictPath);
-//       if (success)
-//         if(verbose){Rcout  << "Saved dictionary to " << dictPath << "." << std::endl;}
-//       else
-//         Rcpp::Rcerr << "Could not save dictionary to " << dictPath << "." << std::endl;
-//     }
-//     else {
-//       std::filesystem::path p = dictPath;
-//       std::string extension = p.extension().string();
-//       std::string basename  = p.stem().string();
-//       for (unsigned int c = 0; c < chans; ++c) {
-//         p = basename + std::to_string(c) + extension;
-//         auto outpath = p;
-//         
-//         std::string outfilename = outpath.string();
-//         bool saved = spsf.getDictionary(c).save(outfilename);
-//         if (saved)
-//           if(verbose){Rcout  << "Saved dictionary for channel " << c << " to " << outfilename << "." << std::endl;}
-//         success &= saved;
-//       }
-//       
-//       if (success)
-//         if(verbose){Rcout  << "For loading the dictionaries later on, you can still use --load-dict=" << dictPath << "." << std::endl;}
-//     }
-//   }
-//   
-// }
-// 
-
+static bool saveSpstfmDictionary(std::string const& path, cv::Mat const& dict) {
+  try {
+    cv::FileStorage fs(path, cv::FileStorage::WRITE);
+    if (!fs.isOpened())
+      return false;
+    fs << "dictionary" << dict;
+  }
+  catch (cv::Exception const&) {
+    return false;
+  }
+  return true;
+}
 
+// For multi-channel images there is one dictionary file per channel with the channel number appended to the basename
+static std::string spstfmChannelDictionaryPath(std::string const& dictPath, std::string const& basename, unsigned int channel) {
+  std::string extension = imagefusion::filesystem::extension(dictPath);
+  std::string filename = basename + std::to_string(channel) + (extension.empty() ? "" : "." + extension);
+  std::string dir = imagefusion::filesystem::directory(dictPath);
+  return dir.empty() ? filename : imagefusion::filesystem::join(dir, filename);
+}
 
+// [[Rcpp::export]]
+void execute_spstfm_job_cpp(CharacterVector input_filenames, 
+                            CharacterVector input_resolutions, 
+                            IntegerVector input_dates, 
+                            IntegerVector pred_dates, 
+                            CharacterVector pred_filenames,   
+                            IntegerVector pred_area, 
+                            int date1,
+                            int date3,
+                            int n_cores,
+                            int dict_size,
+                            int n_training_samples,
+                            int patch_size,
+                            int patch_overlap,
+                            int min_train_iter,
+                            int max_train_iter,
+                            bool output_masks,
+                            bool use_nodata_value,
+                            bool random_sampling,
+                            bool verbose,
+                            const std::string& hightag,  
+                            const std::string& lowtag,   
+                            const std::string& MASKIMG_options,
+                            const std::string& MASKRANGE_options,
+                            const std::string& LOADDICT_options,
+                            const std::string& SAVEDICT_options,
+                            const std::string& REUSE_options,
+                            const std::string& dict_cache_dir,
+                            CharacterVector output_options
+)
+{
+  
+  
+  
+#ifndef _OPENMP
+  if(n_cores>1){
+    Rcout <<"Sorry, if you want to use multiple cores, you need to install OpenMP first."<<std::endl;
+  }
+#else
+  // SpstfmFusor cannot be used with the Parallelizer, it parallelizes itself with OpenMP
+  // the guard restores the previous number of threads when the job ends or fails
+  helpers::OmpThreadsGuard threadsGuard{n_cores};
+#endif 
+  
+  
+  using namespace imagefusion;
+  //Step 1: Prepare the Input
+  //create a prediction area rectangle
+  Rectangle pred_rectangle = Rectangle{pred_area[0],pred_area[1],pred_area[2],pred_area[3]};
+  //parse the GDAL creation options for the output images, like COMPRESS=DEFLATE
+  std::vector<std::pair<std::string,std::string>> writeOptions = helpers::parseWriteOptions(as<std::vector<std::string>>(output_options));
+  
+  // check spelling of reuse dictionary option
+  std::string reuseOpt = REUSE_options;
+  if (reuseOpt != "improve" && reuseOpt != "clear" && reuseOpt != "use")
+    IF_THROW_EXCEPTION(imagefusion::invalid_argument_error(
+                           "For REUSE_options you must either give 'improve', 'clear' or 'use'. You gave '" + reuseOpt + "'."));
+  
+  // find the gi the first pair high image 
+  Rcpp::LogicalVector is_high(input_filenames.size());
+  for( int i=0; i<input_filenames.size(); i++){
+    is_high[i] = (input_resolutions[i] == hightag);}
+  Rcpp::CharacterVector filenames_high = input_filenames[is_high];
+  std::string high_template_filename = Rcpp::as<std::vector<std::string> >(filenames_high)[0];
+  GeoInfo giHighPair1;
+  if(verbose){Rcout <<"Getting High Resolution Geoinformation from File: "<<high_template_filename<<std::endl;}
+  
+  // find the gi the first pair low image 
+  Rcpp::LogicalVector is_low(input_filenames.size());
+  for( int i=0; i<input_filenames.size(); i++){
+    is_low[i] = (input_resolutions[i] == lowtag);}
+  Rcpp::CharacterVector filenames_low = input_filenames[is_low];
+  std::string low_template_filename = Rcpp::as<std::vector<std::string> >(filenames_low)[0];
+  if(verbose){Rcout <<"Getting Low Resolution Geoinformation from File: "<<low_template_filename<<std::endl;}
+  GeoInfo giLowPair1;
+  
+  
+  
+  
+  
+  //Step 2: Load the images and set the options
+  
+  //Load the images into a mri
+  //Deferred whole-image loading: only the pair images are loaded up front, since the training uses them in full.
+  //The other images are just registered with their filename and loaded completely when a prediction needs them (see Step 6).
+  auto mri = std::make_shared<MultiResImages>();
+  MultiResCollection<std::string> lazyFilenames;
+  int n_inputs = input_filenames.size();
+  for(int i=0; i< n_inputs;++i){
+    std::string filename = as<std::string>(input_filenames[i]);
+    std::string res = as<std::string>(input_resolutions[i]);
+    int date = input_dates[i];
+    if(!(date == date1 || date == date3)){
+      lazyFilenames.set(res, date, filename);
+      if(filename == high_template_filename){giHighPair1 = GeoInfo{filename};}
+      if(filename == low_template_filename){giLowPair1 = GeoInfo{filename};}
+      continue;
+    }
+    
+    // the geoinformation of the template images is taken from the same read, so each file is opened only once
+    GeoInfo gi;
+    Image img;
+    img.read(filename, gi);
+    if(filename == high_template_filename){giHighPair1 = gi;}
+    if(filename == low_template_filename){giLowPair1 = gi;}
+    mri->set(res, date, std::move(img));
+  }
+  
+  //Pass the desired Options
+  //required arguments
+  imagefusion::SpstfmOptions o;
+  o.setHighResTag(hightag);
+  o.setLowResTag(lowtag);
+  o.setDate1(date1);
+  o.setDate3(date3);
+  //optional arguments
+  o.setPredictionArea(pred_rectangle);
+  o.setDictSize(dict_size);
+  o.setNumberTrainingSamples(n_training_samples);
+  o.setPatchSize(patch_size);
+  o.setPatchOverlap(patch_overlap);
+  o.setMinTrainIter(min_train_iter);
+  o.setMaxTrainIter(max_train_iter);
+  if(random_sampling){
+    o.setSamplingStrategy(imagefusion::SpstfmOptions::SamplingStrategy::random);
+  }else{
+    o.setSamplingStrategy(imagefusion::SpstfmOptions::SamplingStrategy::variance);
+  }
+  
+  
+  
+  //Step 3: Create the Fusor
+  //Create the Fusor
+  SpstfmFusor spsf;
+  spsf.srcImages(mri); 
+  
+  
+  
+  //Step 4: Handle the Masking for the Input Pairs
+  //We create a single base mask "pairMask" derived from applying the ranges(if any are given) to the
+  //Images for Date1 and Date3
+  //This is implemented effectively in the c++ code, which is why we simply wrap around its option parser system
+  //and pass it strings which contain the options we would like, as if on command line
+  using Descriptor = imagefusion::option::Descriptor;
+  using ArgChecker = imagefusion::option::ArgChecker;
+  using Parse      = imagefusion::option::Parse;
+  std::vector<Descriptor> usage{
+    Descriptor::text(""),
+    {"MASKIMG",       "",            "m", "mask-img",                     ArgChecker::Mask,        helpers::usageMaskFile},
+    {"MASKRANGE",     "HIGHINVALID", "",  "mask-high-res-invalid-ranges", ArgChecker::IntervalSet, "  --mask-high-res-invalid-ranges=<range-list> \tThis is the same as --mask-invalid-ranges, but is applied only for the high resolution images.\n"},
+    {"MASKRANGE",     "HIGHVALID",   "",  "mask-high-res-valid-ranges",   ArgChecker::IntervalSet, "  --mask-high-res-valid-ranges=<range-list> \tThis is the same as --mask-valid-ranges, but is applied only for the high resolution images.\n"},
+    {"MASKRANGE",     "INVALID",     "",  "mask-invalid-ranges",          ArgChecker::IntervalSet, helpers::usageInvalidRanges},
+    {"MASKRANGE",     "LOWINVALID",  "",  "mask-low-res-invalid-ranges",  ArgChecker::IntervalSet, "  --mask-low-res-invalid-ranges=<range-list> \tThis is the same as --mask-invalid-ranges, but is applied only for the low resolution images.\n"},
+    {"MASKRANGE",     "LOWVALID",    "",  "mask-low-res-valid-ranges",    ArgChecker::IntervalSet, "  --mask-low-res-valid-ranges=<range-list> \tThis is the same as --mask-valid-ranges, but is applied only for the low resolution images.\n"},
+    {"MASKRANGE",     "VALID",       "",  "mask-valid-ranges",            ArgChecker::IntervalSet, helpers::usageValidRanges},
+    {"SAVEDICT",      "",            "s", "save-dict",                    ArgChecker::NonEmpty,    "  -s <outfile>, --save-dict=<outfile> \tSave the dictionary after the last training to a file. This can be used later on with --load-dict=outfile and, if you do not want to improve it, --dict-reuse=use.\n"},
+    {"LOADDICT",      "",            "l", "load-dict",                    ArgChecker::NonEmpty,    "  -l <file>, --load-dict=<file> \tLoad dictionary from a file, which has been written with --save-dict before. You can give the filename you specified with --save-dict, even if there have been generated numbers in the filename (which happens in case of multi-channel images). Do not specify multiple dictionaries. Only the last will be used otherwise.\n"},
+    
+    Descriptor::optfile() // 
+  };
+  
+  //LOAD DICT
+  // load dictionary from file
+  if (!LOADDICT_options.empty()) {
+    std::string dictPath = LOADDICT_options;
+    unsigned int chans = mri->getAny().channels();
+    if (chans == 1) {
+      if (!imagefusion::filesystem::exists(dictPath)) {
+        Rcpp::Rcerr << "Could not find the dictionary file " << dictPath << " to load a single-channel dictionary." << std::endl;
+      }
+      
+      cv::Mat dict;
+      bool loadOK = loadSpstfmDictionary(dictPath, dict);
+      if (loadOK) {
+        if(verbose){Rcout  << "Using dictionary from " << dictPath << "." << std::endl;}
+        spsf.setDictionary(dict);
+      }
+      else
+        Rcpp::Rcerr << "Could not load dictionary from " << dictPath << " although the file exists. Defect file? Ignoring option --load-dict." << std::endl;
+    }
+    else {
+      std::string basename = imagefusion::filesystem::stem(dictPath);
+      if (imagefusion::filesystem::exists(dictPath))
+        basename.pop_back(); // drop channel number
+      
+      for (unsigned int c = 0; c < chans; ++c) {
+        std::string infilename = spstfmChannelDictionaryPath(dictPath, basename, c);
+        if (!imagefusion::filesystem::exists(infilename)) {
+          Rcpp::Rcerr << "Could not find the dictionary file " << infilename << " to load a part of a multi-channel dictionary. "
+          "Give either the same filename as specified with --save-dict or one of the actual files with channel number." << std::endl;
+        }
+        
+        cv::Mat dict;
+        bool loadOK = loadSpstfmDictionary(infilename, dict);
+        if (loadOK) {
+          if(verbose){Rcout  << "Using dictionary from " << infilename << " for channel " << c << "." << std::endl;}
+          spsf.setDictionary(dict, c);
+        }
+        else {
+          Rcpp::Rcerr << "Could not load dictionary from " << infilename << " although the file exists. Defect file? Ignoring option --load-dict completely." << std::endl;
+          // remove eventual dictionaries set to previous channels
+          for (unsigned int i = 0; i < chans; ++i)
+            spsf.setDictionary(cv::Mat{}, i);
+          break;
+        }
+      }
+    }
+  }
+  
+  
+  //MASK
+  //First, parse the MASKIMG options, if given
+  auto maskoptions = imagefusion::option::OptionParser::parse(usage,MASKIMG_options);
+  std::vector<std::string> maskImgArgs;
+  for (auto const& opt : maskoptions["MASKIMG"])
+    maskImgArgs.push_back(opt.arg);
+  //Gets the Mask if one was given in the options, otherwise create a base mask
+  // from scratch. Uses first pair high image  as template.
+  imagefusion::Image baseMask = helpers::parseAndCombineMaskImages<Parse>(maskImgArgs, giHighPair1.channels, !maskoptions["MASKRANGE"].empty());
+  
+  //get ranges
+  auto rangeoptions = imagefusion::option::OptionParser::parse(usage,MASKRANGE_options);
+  auto baseValidSets = helpers::parseAndCombineRanges<Parse>(rangeoptions["MASKRANGE"]);
+  auto pairValidSets = baseValidSets;
+  
+  //adjust ranges by including the nodata value, if desired
+  if (use_nodata_value) { //Only in case we want to include the nodatavalue
+    if (!pairValidSets.hasHigh)//If there are NO ranges given for the highrez
+      //set high limits to entire datarange
+      pairValidSets.high += imagefusion::Interval::closed(-std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity());
+    if (!pairValidSets.hasLow)//If there are NO ranges given for the lowrez
+      //set low limits to entire datarange
+      pairValidSets.low  += imagefusion::Interval::closed(-std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity());
+    //Now ranges are given.
+    pairValidSets.hasHigh = pairValidSets.hasLow = true;
+    
+    //Then we get the NoDataValue from the GeoInfo (if there is one),
+    //make an interval of it, and subtract it from the high rez ranges
+    if (giHighPair1.hasNodataValue()) {
+      imagefusion::Interval nodataInt = imagefusion::Interval::closed(giHighPair1.getNodataValue(), giHighPair1.getNodataValue());
+      pairValidSets.high -= nodataInt;
+    }
+    //Then we get the NoDataValue from the GeoInfo (if there is one),
+    // make an interval of it, and subtract it from the low rez ranges
+    if (giLowPair1.hasNodataValue()) {
+      imagefusion::Interval nodataInt = imagefusion::Interval::closed(giLowPair1.getNodataValue(), giLowPair1.getNodataValue());
+      pairValidSets.low -= nodataInt;
+    }
+  }
+  
+  imagefusion::Image pairMask = baseMask;
+  if (pairValidSets.hasHigh) { //If there are any ranges given for the highrez :
+    //apply the ranges and update the mask accordingly
+    pairMask = helpers::processSetMask(std::move(pairMask), mri->get(hightag, date1), pairValidSets.high);
+    pairMask = helpers::processSetMask(std::move(pairMask), mri->get(hightag, date3), pairValidSets.high);
+  }
+  if (pairValidSets.hasLow) { //If there are any ranges given for the lowrez :
+    //apply the ranges and update the mask accordingly
+    pairMask = helpers::processSetMask(std::move(pairMask), mri->get(lowtag,  date1), pairValidSets.low);
+    pairMask = helpers::processSetMask(std::move(pairMask), mri->get(lowtag,  date3), pairValidSets.low);
+  }
+  
+  
+  //Step 6: Training
+  // train dictionary (if there is one from a previous time series, improve it)
+  if(verbose){Rcout  << "Training with dates " << date1 << " and " << date3 << std::endl;}
+  if (reuseOpt == "improve")
+    o.setDictionaryReuse(imagefusion::SpstfmOptions::ExistingDictionaryHandling::improve);
+  else if (reuseOpt == "clear")
+    o.setDictionaryReuse(imagefusion::SpstfmOptions::ExistingDictionaryHandling::clear);
+  else // (reuseOpt == "use")
+    o.setDictionaryReuse(imagefusion::SpstfmOptions::ExistingDictionaryHandling::use);
+  
+  spsf.processOptions(o);
+  
+  //Dictionary cache
+  //A dictionary trained for the same pair with the same training options by a previous job is reused.
+  //An explicitly loaded dictionary takes precedence, since training might start from it. A cached
+  //dictionary is only used with REUSE 'use', since 'clear' and 'improve' ask for training.
+  unsigned int n_chans = mri->getAny().channels();
+  bool use_cache = !dict_cache_dir.empty() && LOADDICT_options.empty();
+  bool cache_hit = false;
+  //The pair images are identified by filename, size and modification time, so a replaced file gives a new key
+  std::string cache_source;
+  for (int i = 0; i < n_inputs; ++i) {
+    if (input_dates[i] == date1 || input_dates[i] == date3) {
+      std::string filename = as<std::string>(input_filenames[i]);
+      cache_source += as<std::string>(input_resolutions[i]) + ":" + std::to_string(input_dates[i]) + ":" + filename
+                    + ":" + std::to_string(imagefusion::filesystem::file_size(filename))
+                    + ":" + std::to_string(imagefusion::filesystem::last_write_time(filename)) + "\n";
+    }
+  }
+  //Mask images are identified the same way, their options (crop, layers, ranges) are part of MASKIMG_options
+  for (auto const& arg : maskImgArgs) {
+    std::string filename = Parse::ImageFileName(arg);
+    cache_source += "mask:" + filename
+                  + ":" + std::to_string(imagefusion::filesystem::file_size(filename))
+                  + ":" + std::to_string(imagefusion::filesystem::last_write_time(filename)) + "\n";
+  }
+  cache_source += MASKIMG_options + "\n" + MASKRANGE_options + "\n" + std::to_string(use_nodata_value);
+  imagefusion::SpstfmDictionaryCache dict_cache{dict_cache_dir, cache_source};
+  if (use_cache && reuseOpt == "use") {
+    cache_hit = dict_cache.load(spsf, n_chans);
+    if (cache_hit) {
+      if(verbose){Rcout  << "Using cached dictionary " << dict_cache.path(spsf.getOptions(), 0) << (n_chans > 1 ? " (and the other channels)" : "") << ", skipping training." << std::endl;}
+      o.setDictionaryReuse(imagefusion::SpstfmOptions::ExistingDictionaryHandling::use);
+      spsf.processOptions(o);
+    }
+  }
+  
+  spsf.train(pairMask);
+  
+  if (use_cache && !cache_hit) {
+    if (!dict_cache.store(spsf, n_chans))
+      Rcpp::Rcerr << "Could not write the dictionary to the cache directory " << dict_cache_dir << "." << std::endl;
+    else if (verbose)
+      Rcout  << "Cached the trained dictionary in " << dict_cache_dir << "." << std::endl;
+  }
+  
+  
+  //Step 6: Predictions
+  //Predict for desired Dates
+  int n_outputs = pred_dates.size();
+  for(int i=0; i< n_outputs;++i){
+    //Get the destination filename
+    std::string pred_filename=as<std::string>(pred_filenames[i]);
+    
+    //Load the low resolution image of the prediction date, unless it is a pair image
+    bool isLazyLoaded = !mri->has(lowtag, pred_dates[i]);
+    if (isLazyLoaded)
+      mri->set(lowtag, pred_dates[i], Image(lazyFilenames.get(lowtag, pred_dates[i])));
+    
+    //Make the Mask
+    //We use the basic ranges
+    auto predValidSets = baseValidSets;
+    
+    if (use_nodata_value) {
+      if (!predValidSets.hasLow)
+        predValidSets.low  += imagefusion::Interval::closed(-std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity());
+      predValidSets.hasLow = true;
+      if (giHighPair1.hasNodataValue()) { 
+        imagefusion::Interval nodataInt = imagefusion::Interval::closed(giHighPair1.getNodataValue(), giHighPair1.getNodataValue());
+        predValidSets.low -= nodataInt;
+      }
+    }
+    //For every prediction, we start out with the pairMask, which we obtained earlier through a combination of Date1 and Date3 masks 
+    imagefusion::Image predMask = pairMask;
+    
+    //Apply the low res ranges, if there are any 
+    //(pred will always be a high res image, so we only need the low ranges)
+    if (predValidSets.hasLow)
+      //Adjust the mask by also applying those ranges.
+      predMask = helpers::processSetMask(std::move(predMask), mri->get(lowtag, pred_dates[i]), predValidSets.low);
+    
+    //The Geoinformation of the template is written together with the prediction
+    // adjust it, if we have used a pred area
+    GeoInfo giTemplate = helpers::predictionGeoInfo(giHighPair1, pred_rectangle);
+    
+    //Predict using the new mask we have made
+    if(verbose){Rcout  <<"Predicting for date"<< pred_dates[i]<< " using both pairs from dates " << date1 << " and " << date3 << "." << std::endl;}
+    helpers::predictAndWrite(spsf, pred_dates[i], predMask, pred_filename, giTemplate, writeOptions);
+    
+    //Write the masks if desired
+    if (output_masks){
+      imagefusion::FileFormat outformat = imagefusion::FileFormat::fromFile(pred_filename);
+      std::string outmaskfilename = helpers::outputImageFile(predMask, giHighPair1, "MaskImage", pred_filename, "MaskImage", outformat, date1, pred_dates[i], date3, writeOptions);}
+    
+    //Release the image of the prediction date again
+    if (isLazyLoaded)
+      mri->remove(lowtag, pred_dates[i]);
+  }
+  // save dictionary to file
+  if (!SAVEDICT_options.empty()) {
+    bool success = true;
+    std::string dictPath = SAVEDICT_options;
+    unsigned int chans = mri->getAny().channels();
+    if (chans == 1) {
+      success = saveSpstfmDictionary(dictPath, spsf.getDictionary());
+      if (!success)
+        Rcpp::Rcerr << "Could not save dictionary to " << dictPath << "." << std::endl;
+      else if (verbose)
+        Rcout  << "Saved dictionary to " << dictPath << "." << std::endl;
+    }
+    else {
+      std::string basename = imagefusion::filesystem::stem(dictPath);
+      for (unsigned int c = 0; c < chans; ++c) {
+        std::string outfilename = spstfmChannelDictionaryPath(dictPath, basename, c);
+        bool saved = saveSpstfmDictionary(outfilename, spsf.getDictionary(c));
+        if (!saved)
+          Rcpp::Rcerr << "Could not save dictionary for channel " << c << " to " << outfilename << "." << std::endl;
+        else if (verbose)
+          Rcout  << "Saved dictionary for channel " << c << " to " << outfilename << "." << std::endl;
+        success &= saved;
+      }
+      
+      if (success && verbose)
+        Rcout  << "For loading the dictionaries later on, you can still use --load-dict=" << dictPath << "." << std::endl;
+    }
+  }
+}
@@ -2,10 +2,13 @@
 #include <iostream>
 #include <iomanip>
 #include <string>
+#include <future>
+#include <vector>
 
 #include "optionparser.h"
 #include "geoinfo.h"
 #include "multiresimages.h"
+#include "bitmask.h"
 #include "utils_common.h"
 #include "fileformat.h"
 
@@ -99,6 +102,31 @@ std::vector<Descriptor> usage{
 };
 
 
+namespace {
+
+// images, quality layer and mask of a date. The quality layer and mask are bit-packed, since
+// they are kept for all dates of the interpolation window
+struct DateInputs {
+  int date;
+  imagefusion::Image img;
+  imagefusion::BitMask ql;
+  imagefusion::BitMask mask;
+};
+
+// output of an interpolated date, which is written in the background
+struct PendingOutput {
+  imagefusion::Image img;
+  imagefusion::Image pixelState;
+  imagefusion::GeoInfo gi;
+  std::string inputfilename;
+  imagefusion::FileFormat format;
+  bool doOutputPS = false;
+  std::future<std::string> status;
+};
+
+} /* anonymous namespace */
+
+
 //===========================================imginterp=================================
 // [[Rcpp::export]]
 void execute_imginterp_job_cpp(
@@ -237,6 +265,55 @@ void execute_imginterp_job_cpp(
   bool useNodataValue = options["USENODATA"].back().prop() == "ENABLE";
   bool doInterpInvalid = options["INTINV"].back().prop() == "ENABLE";
   
+  // write the interpolated image and the pixel state, this is used from a background thread
+  auto writeOutput = [&] (PendingOutput const& o) {
+    std::string outfilename = helpers::outputImageFilename(o.inputfilename, prefix_new, postfix_new, o.format);
+    o.img.write(outfilename, o.gi, o.format);
+    std::string printStatus = "Interpolated and wrote file " + outfilename + ".";
+    if (o.doOutputPS) {
+      std::string outPSFilename = helpers::outputImageFilename(outfilename, prefixPS_new, postfixPS_new, o.format);
+      o.pixelState.write(outPSFilename, o.gi, o.format);
+      printStatus += " Wrote pixel state bitfield to " + outPSFilename + ".";
+    }
+    return printStatus;
+  };
+  
+  // wait for the pending output and print its status. If writing in the background failed or has
+  // not been started, write synchronously with the fallbacks of helpers::outputImageFile
+  auto finishOutput = [&] (PendingOutput& o) {
+    if (o.img.empty())
+      return;
+    
+    std::string printStatus;
+    if (o.status.valid()) {
+      try {
+        printStatus = o.status.get();
+      }
+      catch (imagefusion::runtime_error&) {
+      }
+    }
+    
+    if (printStatus.empty()) {
+      try {
+        std::string outfilename = helpers::outputImageFile(o.img, o.gi, o.inputfilename, prefix_new, postfix_new, o.format);
+        printStatus = "Interpolated and wrote file " + outfilename + ".";
+        
+        // output pixel state
+        if (o.doOutputPS) {
+          std::string outPSFilename = helpers::outputImageFile(o.pixelState, o.gi, outfilename, prefixPS_new, postfixPS_new, o.format);
+          printStatus += " Wrote pixel state bitfield to " + outPSFilename + ".";
+        }
+      }
+      catch (imagefusion::runtime_error&) {
+        printStatus = "Could not write the output of processing " + o.inputfilename + ", sorry. Going on with the next one.";
+      }
+    }
+    Rcout << printStatus << std::endl;
+    
+    o.img = Image{};
+    o.pixelState = Image{};
+  };
+  
   
   // process tags independendly
   if(verbose) Rcout << "Starting Interpolations" << std::endl;
@@ -247,8 +324,8 @@ void execute_imginterp_job_cpp(
     i+=1;
       
     auto imgs   = std::make_shared<imagefusion::MultiResImages>();
-    auto qlImgs = std::make_shared<imagefusion::MultiResImages>();
-    auto masks  = std::make_shared<imagefusion::MultiResImages>();
+    auto qlImgs = std::make_shared<imagefusion::MultiResCollection<imagefusion::BitMask>>();
+    auto masks  = std::make_shared<imagefusion::MultiResCollection<imagefusion::BitMask>>();
     
     // find the dates to interpolate (image && QL available) and QL image dates
     std::vector<int> imgDates = imgArgs.getDates(tag);
@@ -273,8 +350,133 @@ void execute_imginterp_job_cpp(
     if(verbose) Rcout << "interpDates:" << interpDates.size() << std::endl;
     if(verbose) Rcout << "qlDates:" << qlDates.size() <<std::endl;
     
+    // read the image, the quality layer and the mask of a date and generate and combine masks and
+    // QLs. This does not modify any shared state, so it can run in a background thread.
+    auto readDate = [&] (int addDate) {
+      // image
+      DateInputs in;
+      in.date = addDate;
+      imagefusion::Size sz;
+      {
+        std::string arg = imgArgs.get(tag, addDate);
+        auto imgInput = Parse::MRImage(arg, "", true, false, /* isTagOpt */ true);
+        sz = imgInput.i.size();
+        in.img = std::move(imgInput.i);
+      }
+      
+      // QL
+      imagefusion::Image ql;
+      if (qlImgArgs.has(tag, addDate)) {
+        std::string arg = qlImgArgs.get(tag, addDate);
+        auto imgInput = Parse::QL(arg, "", true, false, /* isTagOpt */ true);
+        ql = std::move(imgInput.i);
+      }
+      if (qlImgArgs.has("", addDate)) {
+        std::string arg = qlImgArgs.get("", addDate);
+        auto imgInput = Parse::QL(arg, "", true, false, /* isTagOpt */ true);
+        if (!ql.empty())
+          ql = ql.bitwise_or(std::move(imgInput.i));
+        else
+          ql = std::move(imgInput.i);
+      }
+      if (!ql.empty() && ql.size() != sz) {
+        using std::to_string;
+        using imagefusion::to_string;
+        std::string arg = qlImgArgs.has(tag, addDate) ? qlImgArgs.get(tag, addDate) : qlImgArgs.get("", addDate);
+        IF_THROW_EXCEPTION(imagefusion::size_error("The quality layer sizes must be equal to the image sizes. At date " + to_string(addDate)
+                                                     + " the quality layer from argument (" + arg + ") has got a size of " + to_string(ql.size())
+                                                     + " while the image on the same date from argument (" + imgArgs.get(tag, addDate)
+                                                     + ") has got a size of " + to_string(sz) + "."))
+                                                     << errinfo_size(ql.size());
+      }
+      
+      
+      if (hasInterpRanges) {
+        imagefusion::Image rangeQL = in.img.createSingleChannelMaskFromSet({baseInterpSet}, /*useAnd*/ false);
+        if (!ql.empty())
+          ql = ql.bitwise_or(std::move(rangeQL));
+        else
+          ql = std::move(rangeQL);
+      }
+      
+      // mask
+      imagefusion::Image mask;
+      if (maskArgs.has(tag, addDate)) {
+        std::string arg = maskArgs.get(tag, addDate);
+        auto imgInput = Parse::MRMask(arg, "", true, false, /* isTagOpt */ true);
+        mask = std::move(imgInput.i);
+      }
+      if (maskArgs.has("", addDate)) {
+        std::string arg = maskArgs.get("", addDate);
+        auto imgInput = Parse::MRMask(arg, "", true, false, /* isTagOpt */ true);
+        if (!mask.empty())
+          mask = mask.bitwise_and(std::move(imgInput.i));
+        else
+          mask = std::move(imgInput.i);
+      }
+      if (!mask.empty() && mask.size() != sz) {
+        using std::to_string;
+        using imagefusion::to_string;
+        std::string arg = maskArgs.has(tag, addDate) ? maskArgs.get(tag, addDate) : maskArgs.get("", addDate);
+        IF_THROW_EXCEPTION(imagefusion::size_error("The mask sizes must be equal to the image sizes. At date " + to_string(addDate)
+                                                     + " the mask from argument (" + arg + ") has got a size of " + to_string(mask.size())
+                                                     + " while the image on the same date from argument (" + imgArgs.get(tag, addDate)
+                                                     + ") has got a size of " + to_string(sz) + "."))
+                                                     << errinfo_size(ql.size());
+      }
+      
+      imagefusion::IntervalSet validSet = baseValidSet;
+      if (!hasValidRanges)
+        validSet += imagefusion::Interval::closed(-std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity());
+      
+      GeoInfo const& gi = gis->get(tag, addDate);
+      if (useNodataValue && gi.hasNodataValue()) {
+        imagefusion::Interval nodataInt = imagefusion::Interval::closed(gi.getNodataValue(), gi.getNodataValue());
+        validSet -= nodataInt;
+      }
+      
+      if (hasValidRanges || (useNodataValue && gi.hasNodataValue())) {
+        if (mask.empty())
+          mask = in.img.createMultiChannelMaskFromSet({validSet});
+        else if (mask.channels() > 1)
+          mask = in.img.createMultiChannelMaskFromSet({validSet}, mask);
+        else
+          mask = in.img.createSingleChannelMaskFromSet({validSet}, /*useAnd*/ true, mask);
+      }
+      
+      if (!mask.empty()) {
+        if (doInterpInvalid)
+          // ql is always single-channel, so reduce mask and invert, since 0 in mask should be interpolated ==> 255 in ql
+          ql = mask.createSingleChannelMaskFromRange({imagefusion::Interval::closed(0, 0)}, /*useAnd*/ false /*because it is inverted*/).bitwise_or(ql);
+        else
+          in.mask = imagefusion::BitMask{mask};
+      }
+      in.ql = imagefusion::BitMask{ql};
+      return in;
+    };
+    auto readDates = [readDate] (std::vector<int> const& dates) {
+      std::vector<DateInputs> inputs;
+      for (int d : dates)
+        inputs.push_back(readDate(d));
+      return inputs;
+    };
+    auto addInputs = [&] (DateInputs& in) {
+      imgs->set(tag, in.date, std::move(in.img));
+      if (!in.mask.empty())
+        masks->set(tag, in.date, std::move(in.mask));
+      if (!in.ql.empty())
+        qlImgs->set(tag, in.date, std::move(in.ql));
+    };
+    
+    // the images entering the window of the next date are read while the current date is
+    // interpolated and the output of the previous date is written while the current one is
+    // interpolated. So at most the images of one date ahead and one output are held additionally.
+    std::future<std::vector<DateInputs>> prefetched;
+    PendingOutput pending;
+    
     // interpolate each date
-    for (int interpDate : interpDates) {
+    for (std::size_t k = 0; k < interpDates.size(); ++k) {
+      int interpDate = interpDates[k];
       if(verbose) Rcout << "performing Interpolation"<<std::endl;
       int firstDate = interpDate - dateLimit;
       int lastDate = interpDate + dateLimit;
@@ -302,115 +504,29 @@ void execute_imginterp_job_cpp(
           qlImgs->remove("", remDate);
       }
       
-      // read missing images, mask images and QL images and generate and combine masks and QLs
-      for (int addDate : boost::adaptors::reverse(currentImgDates)) {
+      // take the prefetched images and read the ones that are still missing
+      if (prefetched.valid()) {
+        std::vector<DateInputs> inputs = prefetched.get();
+        for (DateInputs& in : inputs)
+          addInputs(in);
+      }
+      for (int addDate : currentImgDates) {
         if (imgs->has(tag, addDate))
-          break;
-        
-        // image
-        imagefusion::Size sz;
-        {
-          std::string arg = imgArgs.get(tag, addDate);
-          auto imgInput = Parse::MRImage(arg, "", true, false, /* isTagOpt */ true);
-          sz = imgInput.i.size();
-          imgs->set(imgInput.tag, imgInput.date, std::move(imgInput.i));
-        }
-        
-        // QL
-        imagefusion::Image ql;
-        if (qlImgArgs.has(tag, addDate)) {
-          std::string arg = qlImgArgs.get(tag, addDate);
-          auto imgInput = Parse::QL(arg, "", true, false, /* isTagOpt */ true);
-          ql = std::move(imgInput.i);
-        }
-        if (qlImgArgs.has("", addDate)) {
-          std::string arg = qlImgArgs.get("", addDate);
-          auto imgInput = Parse::QL(arg, "", true, false, /* isTagOpt */ true);
-          if (!ql.empty())
-            ql = ql.bitwise_or(std::move(imgInput.i));
-          else
-            ql = std::move(imgInput.i);
-        }
-        if (!ql.empty() && ql.size() != sz) {
-          using std::to_string;
-          using imagefusion::to_string;
-          std::string arg = qlImgArgs.has(tag, addDate) ? qlImgArgs.get(tag, addDate) : qlImgArgs.get("", addDate);
-          IF_THROW_EXCEPTION(imagefusion::size_error("The quality layer sizes must be equal to the image sizes. At date " + to_string(addDate)
-                                                       + " the quality layer from argument (" + arg + ") has got a size of " + to_string(ql.size())
-                                                       + " while the image on the same date from argument (" + imgArgs.get(tag, addDate)
-                                                       + ") has got a size of " + to_string(sz) + "."))
-                                                       << errinfo_size(ql.size());
-        }
-        
-        
-        if (hasInterpRanges) {
-          imagefusion::Image rangeQL = imgs->get(tag, addDate).createSingleChannelMaskFromSet({baseInterpSet}, /*useAnd*/ false);
-          if (!ql.empty())
-            ql = ql.bitwise_or(std::move(rangeQL));
-          else
-            ql = std::move(rangeQL);
-        }
-        
-        // mask
-        imagefusion::Image mask;
-        if (maskArgs.has(tag, addDate)) {
-          std::string arg = maskArgs.get(tag, addDate);
-          auto imgInput = Parse::MRMask(arg, "", true, false, /* isTagOpt */ true);
-          mask = std::move(imgInput.i);
-        }
-        if (maskArgs.has("", addDate)) {
-          std::string arg = maskArgs.get("", addDate);
-          auto imgInput = Parse::MRMask(arg, "", true, false, /* isTagOpt */ true);
-          if (!mask.empty())
-            mask = mask.bitwise_and(std::move(imgInput.i));
-          else
-            mask = std::move(imgInput.i);
-        }
-        if (!mask.empty() && mask.size() != sz) {
-          using std::to_string;
-          using imagefusion::to_string;
-          std::string arg = maskArgs.has(tag, addDate) ? maskArgs.get(tag, addDate) : maskArgs.get("", addDate);
-          IF_THROW_EXCEPTION(imagefusion::size_error("The mask sizes must be equal to the image sizes. At date " + to_string(addDate)
-                                                       + " the mask from argument (" + arg + ") has got a size of " + to_string(mask.size())
-                                                       + " while the image on the same date from argument (" + imgArgs.get(tag, addDate)
-                                                       + ") has got a size of " + to_string(sz) + "."))
-                                                       << errinfo_size(ql.size());
-        }
-        
-        imagefusion::IntervalSet validSet = baseValidSet;
-        if (!hasValidRanges)
-          validSet += imagefusion::Interval::closed(-std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity());
-        
-        GeoInfo& gi = gis->get(tag, addDate);
-        if (useNodataValue && gi.hasNodataValue()) {
-          imagefusion::Interval nodataInt = imagefusion::Interval::closed(gi.getNodataValue(), gi.getNodataValue());
-          validSet -= nodataInt;
-        }
-        
-        if (hasValidRanges || (useNodataValue && gi.hasNodataValue())) {
-          if (mask.empty())
-            mask = imgs->get(tag, addDate).createMultiChannelMaskFromSet({validSet});
-          else {
-            Image temp_mask;
-            if (mask.channels() > 1)
-              temp_mask = imgs->get(tag, addDate).createMultiChannelMaskFromSet({validSet});
-            else
-              temp_mask = imgs->get(tag, addDate).createSingleChannelMaskFromSet({validSet});
-            mask = mask.bitwise_and(std::move(temp_mask));
-          }
-        }
-        
-        if (!mask.empty()) {
-          if (doInterpInvalid)
-            // ql is always single-channel, so reduce mask and invert, since 0 in mask should be interpolated ==> 255 in ql
-            ql = mask.createSingleChannelMaskFromRange({imagefusion::Interval::closed(0, 0)}, /*useAnd*/ false /*because it is inverted*/).bitwise_or(ql);
-          else
-            masks->set(tag, addDate, std::move(mask));
-        }
-        
-        if (!ql.empty())
-          qlImgs->set(tag, addDate, std::move(ql));
-        
+          continue;
+        DateInputs in = readDate(addDate);
+        addInputs(in);
+      }
+      
+      // start reading the images that enter the window of the next date
+      if (k + 1 < interpDates.size()) {
+        auto next_first_it = std::lower_bound(std::begin(imgDates), std::end(imgDates), interpDates[k + 1] - dateLimit);
+        auto next_last_it  = std::upper_bound(std::begin(imgDates), std::end(imgDates), interpDates[k + 1] + dateLimit);
+        std::vector<int> nextDates;
+        for (auto it = next_first_it; it != next_last_it; ++it)
+          if (!imgs->has(tag, *it))
+            nextDates.push_back(*it);
+        if (!nextDates.empty())
+          prefetched = std::async(std::launch::async, readDates, std::move(nextDates));
       }
       
       // interpolate
@@ -448,22 +564,19 @@ void execute_imginterp_job_cpp(
       if (gi.hasNodataValue())
         imgInterped.set(gi.getNodataValue(), maskNowInvalid);
       
-      try {
-        // output
-        auto outformat = imagefusion::FileFormat::fromFile(inputfilename);
-        std::string outfilename = helpers::outputImageFile(imgInterped, gi, inputfilename, prefix_new, postfix_new, outformat);
-        std::string printStatus = "Interpolated and wrote file " + outfilename + ".";
-        
-        // output pixel state
-        if (doOutputPS || !gi.hasNodataValue()) {
-          std::string outPSFilename = helpers::outputImageFile(pixelState, gi, outfilename, prefixPS_new, postfixPS_new, outformat);
-          printStatus += " Wrote pixel state bitfield to " + outPSFilename + ".";
-        }
-        Rcout << printStatus << std::endl;
-      }
-      catch (imagefusion::runtime_error&) {
-        Rcout << "Could not write the output of processing " << inputfilename << ", sorry. Going on with the next one." << std::endl;
-      }
+      // wait for the output of the previous date and then write the output of this date in the background
+      finishOutput(pending);
+      pending.img = std::move(imgInterped);
+      pending.pixelState = std::move(pixelState);
+      pending.gi = gi;
+      pending.inputfilename = inputfilename;
+      pending.format = imagefusion::FileFormat::fromFile(inputfilename);
+      pending.doOutputPS = doOutputPS || !gi.hasNodataValue();
+      if (gi.colorTable.empty())
+        pending.status = std::async(std::launch::async, writeOutput, std::cref(pending));
+      else
+        // the color table might have to be checked and removed, which is done by writing synchronously
+        finishOutput(pending);
       
       // collect stats
       if (doOutputStats) {
@@ -471,6 +584,7 @@ void execute_imginterp_job_cpp(
         allStats.push_back(stats);
       }
     } /*interpDate loop*/
+    finishOutput(pending);
   } /*tag loop*/
   
   
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "image.h"
+#include "geoinfo.h"
+#include "fileformat.h"
+#include "exceptions.h"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class GDALDataset;
+
+namespace imagefusion {
+
+/**
+ * @brief Write an image band by band to a file in a background thread
+ *
+ * A BandWriter creates the output file with its final size, type and GeoInfo on construction.
+ * Then horizontal bands of the image can be given to write() in any order. They are written by a
+ * background thread with GDAL `RasterIO`, so the caller can already compute the next band while
+ * the previous one is compressed and written. This is meant for predictions that are too large to
+ * be held in memory completely, see Parallelizer::predictBands(). Example:
+ * @code
+ * BandWriter writer{"predicted.tif", Size{width, height}, Type::int16x6, gi};
+ * for (int y = 0; y < height; y += bandHeight) {
+ *     Image band = ...; // compute band with full width
+ *     writer.write(band, y);
+ * }
+ * writer.close();
+ * @endcode
+ *
+ * While a band is being written, write() blocks for the next band until the writer thread is
+ * done. So the output buffers are bounded by two bands: the one being written and the one the
+ * caller currently computes. This does not bound the memory of the inputs, which are usually still
+ * loaded completely, nor of a pair context that covers the whole prediction area.
+ *
+ * Like ConstImage::write(), a color table of a single-channel 8 bit image is removed again, if
+ * the driver changed it on writing.
+ *
+ * Only formats with a GDAL driver that supports creating a file directly can be written like this,
+ * e. g. GeoTIFF, but not PNG or JPEG. Check this with supportsFormat(). For compressed tiled
+ * GeoTIFFs the band height should be a multiple of the tile height, otherwise GDAL has to
+ * recompress partially written tiles.
+ */
+class BandWriter {
+public:
+    /**
+     * @brief Create the output file
+     *
+     * @param filename is the image file to write to.
+     *
+     * @param size is the size of the complete image.
+     *
+     * @param type is the type of the image, including the number of channels.
+     *
+     * @param gi is the GeoInfo that will be added to the image file before any band is written.
+     *
+     * @param format is the image file format. When left to FileFormat::unsupported, the format is
+     * guessed from the file extension.
+     *
+     * @param options are additional GDAL creation options as name value pairs. For GeoTIFF the
+     * default is `COMPRESS=LZW`, like in ConstImage::write().
+     *
+     * @throws file_format_error if guessing from the file extension fails or the driver cannot
+     * create files directly, see supportsFormat().
+     *
+     * @throws runtime_error if the output file cannot be created.
+     */
+    BandWriter(std::string const& filename, Size size, Type type, GeoInfo const& gi = {},
+               FileFormat format = FileFormat::unsupported,
+               std::vector<std::pair<std::string,std::string>> const& options = {});
+
+    BandWriter(BandWriter const&) = delete;
+    BandWriter& operator=(BandWriter const&) = delete;
+
+    /**
+     * @brief Wait for pending bands and close the file
+     *
+     * Errors of the writer thread are ignored here. Call close() to get them.
+     */
+    ~BandWriter();
+
+
+    /**
+     * @brief Queue a band for writing
+     *
+     * @param band is the band with the full image width. The BandWriter keeps a shared copy of it
+     * until it is written, so do not modify its pixel values afterwards. Use a new image for the
+     * next band instead.
+     *
+     * @param y is the row in the output image of the first row of `band`.
+     *
+     * This blocks while the previous band is still being written.
+     *
+     * @throws size_error if the band does not fit into the image.
+     *
+     * @throws image_type_error if the band has a different type than the image.
+     *
+     * @throws runtime_error if writing a previous band failed or the writer has been closed.
+     */
+    void write(ConstImage const& band, int y);
+
+
+    /**
+     * @brief Write all pending bands and close the file
+     *
+     * Calling close() a second time has no effect.
+     *
+     * @throws runtime_error if writing any band failed.
+     */
+    void close();
+
+
+    /**
+     * @brief Check whether a format can be written band by band
+     *
+     * @param format is the image file format.
+     *
+     * @return true if the GDAL driver of `format` is available and can create files directly.
+     */
+    static bool supportsFormat(FileFormat const& format);
+
+private:
+    void run();
+
+    std::string filename;
+    Size size;
+    Type type;
+    GDALDataset* ds = nullptr;
+
+    std::thread worker;
+    std::mutex mtx;
+    std::condition_variable cond;
+    std::deque<std::pair<ConstImage, int>> queue;
+    bool closing = false;
+    std::exception_ptr error;
+};
+
+} /* namespace imagefusion */
@@ -0,0 +1,319 @@
+#pragma once
+
+#include "image.h"
+#include "exceptions.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace imagefusion {
+
+/**
+ * @brief Bit-packed mask with one bit per pixel and channel
+ *
+ * Masks in imagefusion are usually Image%s of base type Type::uint8 with the values 0 and 255.
+ * These need one byte per pixel and channel, which is as much memory as the data of an 8 bit
+ * image. A BitMask stores the same information with one bit, so it takes 8 times less memory. It
+ * is meant for masks that are kept for a longer time, like the masks and quality layers of all
+ * images in a time series, and for loops that want to skip invalid or valid runs of a row in bulk.
+ *
+ * The channels are stored as separate planes and each row starts at a new 64 bit word. The bits
+ * behind the last pixel of a row are always 0. So all operations work on whole words, e. g.
+ * bitwise_and() combines 64 pixels at once and count() uses the popcount instruction.
+ *
+ * A BitMask interoperates with the usual masks. It can be constructed from a mask Image, e. g.
+ * from ConstImage::createSingleChannelMaskFromSet() or ConstImage::createMultiChannelMaskFromSet(),
+ * and can be converted back with toImage(). DataFusor::predict() also accepts BitMask%s directly:
+ * @code
+ * BitMask valid{img.createMultiChannelMaskFromSet({validSet})};
+ * valid = std::move(valid).bitwise_and(BitMask{cloudMask}.bitwise_not());
+ * df.predict(date, valid);
+ * @endcode
+ *
+ * The STARFM, ESTARFM and Fit-FC prediction loops pack their prediction mask into a BitMask and
+ * use findNextSet() to skip runs of locations that should not be predicted. STARFM and Fit-FC
+ * take a bit-packed prediction mask directly and only crop() it to the prediction area. The valid
+ * mask is still unpacked, since it is used for OpenCV statistics.
+ *
+ * To iterate over the set locations of a row, use findNextSet() and findNextUnset():
+ * @code
+ * for (int x = m.findNextSet(0, y); x < m.width(); ) {
+ *     int end = m.findNextUnset(x, y);
+ *     // locations x, ..., end - 1 are set
+ *     x = m.findNextSet(end, y);
+ * }
+ * @endcode
+ *
+ * Like for Image%s, an empty BitMask means that all locations are valid, when it is used as a
+ * mask.
+ */
+class BitMask {
+public:
+    /// Storage type of the bits
+    using word_t = uint64_t;
+
+    /// Number of bits in a word
+    static constexpr int wordBits = 64;
+
+
+    /**
+     * @brief Construct an empty mask
+     */
+    BitMask() = default;
+
+
+    /**
+     * @brief Construct a mask with all bits set to the same value
+     *
+     * @param s is the size of the mask.
+     *
+     * @param channels is the number of channels.
+     *
+     * @param val is the initial value of all locations.
+     */
+    explicit BitMask(Size s, unsigned int channels = 1, bool val = false);
+
+
+    /**
+     * @brief Pack a mask image
+     *
+     * @param mask is a mask image of base type Type::uint8 with any number of channels. All
+     * values different from 0 are set. If it is empty, the BitMask will be empty as well.
+     *
+     * @throws image_type_error if the base type of `mask` is not Type::uint8.
+     */
+    explicit BitMask(ConstImage const& mask);
+
+
+    /**
+     * @brief Unpack to a mask image
+     *
+     * @return mask image of base type Type::uint8 with the same number of channels. Set locations
+     * are 255, the other ones 0. If this BitMask is empty, the image is empty as well.
+     */
+    Image toImage() const;
+
+
+    /// Width of the mask
+    int width() const {
+        return w;
+    }
+
+    /// Height of the mask
+    int height() const {
+        return h;
+    }
+
+    /// Size of the mask
+    Size size() const {
+        return Size{w, h};
+    }
+
+    /// Number of channels of the mask
+    unsigned int channels() const {
+        return chans;
+    }
+
+    /// Check whether the mask is empty, i. e. has no pixels
+    bool empty() const {
+        return bits.empty();
+    }
+
+    /**
+     * @brief Copy a rectangular part of the mask
+     *
+     * @param r is the rectangle to copy. It must lie completely inside of the mask.
+     *
+     * The bits are shifted word by word, so this does not unpack the mask. This is used to get the
+     * prediction area of a prediction mask, which has the size of the source images.
+     *
+     * @throws size_error if `r` is not inside of the mask.
+     *
+     * @return mask with the size of `r` and the same number of channels. If this BitMask is empty,
+     * the result is empty as well.
+     */
+    BitMask crop(Rectangle const& r) const;
+
+
+    /// Number of words per row of a channel
+    int wordsPerRow() const {
+        return wpr;
+    }
+
+
+    /**
+     * @brief Get the bool value at the specified coordinates and channel
+     *
+     * @param x
+     * @param y
+     * @param channel
+     *
+     * The coordinates are not checked for performance reasons.
+     *
+     * @return true if the location is set.
+     */
+    bool boolAt(unsigned int x, unsigned int y, unsigned int channel) const {
+        return (rowWords(y, channel)[x / wordBits] >> (x % wordBits)) & 1;
+    }
+
+
+    /**
+     * @brief Set the bool value at the specified coordinates and channel
+     *
+     * @param x
+     * @param y
+     * @param channel
+     * @param val is the new value.
+     *
+     * The coordinates are not checked for performance reasons.
+     */
+    void setBoolAt(unsigned int x, unsigned int y, unsigned int channel, bool val) {
+        word_t& word = rowWords(y, channel)[x / wordBits];
+        word_t bit = word_t{1} << (x % wordBits);
+        word = val ? (word | bit) : (word & ~bit);
+    }
+
+
+    /**
+     * @brief Get the words of a row
+     *
+     * @param y is the row.
+     * @param channel is the channel.
+     *
+     * The bit `x % 64` of word `x / 64` holds the value of column `x`. See wordsPerRow() for the
+     * number of words.
+     *
+     * @return pointer to the first word of the row.
+     */
+    word_t const* rowWords(unsigned int y, unsigned int channel = 0) const {
+        return bits.data() + (static_cast<std::size_t>(channel) * h + y) * wpr;
+    }
+
+    /// \copydoc rowWords()
+    word_t* rowWords(unsigned int y, unsigned int channel = 0) {
+        return bits.data() + (static_cast<std::size_t>(channel) * h + y) * wpr;
+    }
+
+
+    /**
+     * @brief Find the next set location in a row
+     *
+     * @param x is the column to start the search from.
+     * @param y is the row.
+     * @param channel is the channel.
+     *
+     * This skips 64 unset locations at once.
+     *
+     * @return the first column `>= x` that is set or width() if there is none.
+     */
+    int findNextSet(int x, int y, unsigned int channel = 0) const {
+        return findNext(x, y, channel, /*set*/ true);
+    }
+
+
+    /**
+     * @brief Find the next unset location in a row
+     *
+     * @param x is the column to start the search from.
+     * @param y is the row.
+     * @param channel is the channel.
+     *
+     * This skips 64 set locations at once.
+     *
+     * @return the first column `>= x` that is not set or width() if there is none.
+     */
+    int findNextUnset(int x, int y, unsigned int channel = 0) const {
+        return findNext(x, y, channel, /*set*/ false);
+    }
+
+
+    /**
+     * @brief Count the set locations of all channels
+     *
+     * @return number of set bits.
+     */
+    std::size_t count() const;
+
+
+    /**
+     * @brief Count the set locations of a channel
+     *
+     * @param channel is the channel to count.
+     *
+     * @return number of set bits in `channel`.
+     */
+    std::size_t count(unsigned int channel) const;
+
+
+    /**
+     * @brief Perform a locationwise 'and'-operation
+     *
+     * @param B is the second operand, first is the calling BitMask A.
+     *
+     * `B` must have the same size as A and either the same number of channels or a single
+     * channel, which is then used for all channels of A. Like for Image::bitwise_and(), if one of
+     * the operands is empty, the other one is returned unchanged.
+     *
+     * Move semantics are supported to reuse memory.
+     *
+     * @throws size_error if the sizes do not match.
+     * @throws image_type_error if the number of channels does not match.
+     *
+     * @return resulting mask
+     */
+    BitMask bitwise_and(BitMask const& B) const&;
+
+    /// \copydoc bitwise_and()
+    BitMask bitwise_and(BitMask const& B) &&;
+
+
+    /**
+     * @brief Perform a locationwise 'or'-operation
+     *
+     * @param B is the second operand, first is the calling BitMask A.
+     *
+     * `B` must have the same size as A and either the same number of channels or a single
+     * channel, which is then used for all channels of A. Like for Image::bitwise_or(), if one of
+     * the operands is empty, the other one is returned unchanged.
+     *
+     * Move semantics are supported to reuse memory.
+     *
+     * @throws size_error if the sizes do not match.
+     * @throws image_type_error if the number of channels does not match.
+     *
+     * @return resulting mask
+     */
+    BitMask bitwise_or(BitMask const& B) const&;
+
+    /// \copydoc bitwise_or()
+    BitMask bitwise_or(BitMask const& B) &&;
+
+
+    /**
+     * @brief Perform a locationwise 'not'-operation
+     *
+     * If the mask is empty, the result is also empty.
+     *
+     * Move semantics are supported to reuse memory.
+     *
+     * @return resulting mask
+     */
+    BitMask bitwise_not() const&;
+
+    /// \copydoc bitwise_not()
+    BitMask bitwise_not() &&;
+
+private:
+    int findNext(int x, int y, unsigned int channel, bool set) const;
+
+    template<class Op>
+    void combineWith(BitMask const& B, Op op);
+
+    int w = 0;
+    int h = 0;
+    unsigned int chans = 0;
+    int wpr = 0;
+    std::vector<word_t> bits;
+};
+
+} /* namespace imagefusion */
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "bitmask.h"
 #include "multiresimages.h"
 #include "options.h"
 
@@ -136,6 +137,25 @@ public:
     virtual void predict(int date, ConstImage const& validMask = {}, ConstImage const& predMask = {}) = 0;
 
 
+    /**
+     * @brief Predict an image at a specified date with bit-packed masks
+     *
+     * @param date is the date for which the image should be predicted.
+     *
+     * @param validMask is a BitMask in the size of the input images to mark valid and invalid
+     * input data, see predict(int, ConstImage const&, ConstImage const&). It may be empty.
+     *
+     * @param predMask is an optional single-channel BitMask in the size of the input images to
+     * mark the locations that should be predicted.
+     *
+     * This allows to keep the masks of a time series as BitMask%s and give them directly to a data
+     * fusor. By default the masks are unpacked only for the duration of the prediction. Data
+     * fusors can override this to use the packed masks directly. StarfmFusor and FitFCFusor do
+     * that for the prediction mask, which they only crop to the prediction area.
+     */
+    virtual void predict(int date, BitMask const& validMask, BitMask const& predMask = BitMask{});
+
+
     /**
      * @brief Set options for the data fusor to predict an image
      *
@@ -189,10 +209,85 @@ protected:
      * @endcode
      */
     Image output;
+
+
+    /**
+     * @brief Check whether two masks are equal
+     *
+     * @param a is the first mask.
+     * @param b is the second mask.
+     *
+     * This can be used to check whether cached data, which depends on a mask, can be reused. It
+     * compares size, type and all values. Two empty masks are equal.
+     *
+     * @return true if both masks are empty or have the same size, type and values.
+     */
+    static bool isSameMask(ConstImage const& a, ConstImage const& b);
+
+    /**
+     * @brief Check whether two masks use the same memory
+     *
+     * @param a is the first mask.
+     * @param b is the second mask.
+     *
+     * This is a cheap alternative to isSameMask(), when a mask has already been compared by
+     * content and the same mask object (or a shared copy of it) is given again, like for each tile
+     * of a Parallelizer prediction. It does not recognize modifications of the mask values.
+     *
+     * @return true if both masks are empty or have the same data pointer, size and type.
+     */
+    static bool isSameMaskData(ConstImage const& a, ConstImage const& b);
+
+    /**
+     * @brief Check a bit-packed prediction mask
+     *
+     * @param predMask is either empty or the prediction mask, see predict(int, BitMask const&, BitMask const&).
+     *
+     * @param s is the size of the source images.
+     *
+     * This does the same checks for a BitMask as the data fusors do for a prediction mask image.
+     *
+     * @throws size_error if `predMask` is not empty and does not have the size `s`.
+     *
+     * @throws image_type_error if `predMask` is not empty and has more than one channel.
+     */
+    static void checkPredMask(BitMask const& predMask, Size s);
 };
 
 
 
+inline bool DataFusor::isSameMask(ConstImage const& a, ConstImage const& b) {
+    if (a.empty() || b.empty())
+        return a.empty() && b.empty();
+
+    if (a.size() != b.size() || a.type() != b.type())
+        return false;
+
+    return cv::norm(a.cvMat(), b.cvMat(), cv::NORM_INF) == 0;
+}
+
+inline bool DataFusor::isSameMaskData(ConstImage const& a, ConstImage const& b) {
+    if (a.empty() || b.empty())
+        return a.empty() && b.empty();
+
+    return a.cvMat().data == b.cvMat().data && a.cvMat().step == b.cvMat().step && a.size() == b.size() && a.type() == b.type();
+}
+
+inline void DataFusor::checkPredMask(BitMask const& predMask, Size s) {
+    if (!predMask.empty() && predMask.size() != s)
+        IF_THROW_EXCEPTION(size_error("The predMask has a wrong size: " + to_string(predMask.size()) +
+                                      ". It must have the same size as the images: " + to_string(s) + "."))
+                << errinfo_size(predMask.size());
+
+    if (!predMask.empty() && predMask.channels() != 1)
+        IF_THROW_EXCEPTION(image_type_error("The predMask must be a single-channel mask, but it has "
+                                            + std::to_string(predMask.channels()) + " channels."));
+}
+
+inline void DataFusor::predict(int date, BitMask const& validMask, BitMask const& predMask) {
+    predict(date, validMask.toImage(), predMask.toImage());
+}
+
 inline MultiResImages const& DataFusor::srcImages() const {
     return *imgs;
 }
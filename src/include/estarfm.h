@@ -3,8 +3,10 @@
 #include "datafusor.h"
 #include "estarfm_options.h"
 
+#include <algorithm>
 #include <cmath>
 #include <iostream>
+#include <memory>
 
 #include <opencv2/opencv.hpp>
 
@@ -16,66 +18,163 @@ namespace imagefusion {
  * @brief Implementation details of ESTARFM -- not to be used by library users
  *
  * This namespace holds three functors. They are all called from StarfmFusor::predict():
- *  * ComputeLocalWeights is called via EstarfmFusor::computeLocalWeights() before the
- *    moving window loops.
+ *  * ComputeLocalWeights is called via EstarfmFusor::computeLocalWeights() when the
+ *    PairContext is created.
  *  * SumAndTolHelper is called via its constructor before the moving window
- *    loops as well.
- *  * PredictPixel is called via a CallBaseTypeFunctor::run() to predict
+ *    loops as well. It uses IntegralStats for the window sums.
+ *  * PredictArea is called via a CallBaseTypeFunctor::run() to predict
  *    values of all channels for the central pixel in the moving window loops.
+ *
+ * Additionally it holds the PairContext, which can be shared between multiple EstarfmFusor
+ * objects.
  */
 namespace estarfm_impl_detail {
 
 /**
- * @brief This functor predicts the values for all channels of the central pixel of a window
+ * @brief Precomputed data that only depends on the input pairs
+ *
+ * This is computed by EstarfmFusor::preparePairContext() or by the first call of
+ * EstarfmFusor::predict() and can be shared between multiple EstarfmFusor objects, see
+ * EstarfmFusor::pairContext(std::shared_ptr<PairContext const>). The Parallelizer does that
+ * automatically to compute it only once for all threads.
+ *
+ * Besides the precomputed data the context stores what it has been computed from, i. e. the
+ * relevant options, the pair images and the valid mask. So an EstarfmFusor can check whether the
+ * context is still valid and reuse it for all prediction dates.
+ */
+struct PairContext {
+    /// Options the context has been computed with, only the pair dates, tags, window size, number of classes and tolerance mode are relevant
+    EstarfmOptions opt;
+
+    /// Shared copies of the full pair images \f$ h_1, h_3, l_1, l_3 \f$
+    std::vector<ConstImage> pairImages;
+
+    /// Copy of the valid mask the context has been computed with or empty if none was used
+    ConstImage mask;
+
+    /// Area covered by #localWeights in full image coordinates
+    Rectangle area;
+
+    /// Local weights in the size of #area, see ComputeLocalWeights
+    Image localWeights;
+
+    /// Global similarity tolerances for each channel of pair 1 or empty when using local tolerances
+    std::vector<double> tol1;
+
+    /// Global similarity tolerances for each channel of pair 3 or empty when using local tolerances
+    std::vector<double> tol3;
+
+    /// Distance weights, see EstarfmFusor::computeDistanceWeights()
+    Image distWeights;
+};
+
+
+struct SumAndTolHelper;
+
+
+/**
+ * @brief Running sums for the regression of the high on the low resolution candidates
+ *
+ * PredictArea does not collect the candidates of a window, but adds them to these sums. That is
+ * enough for the regression and the standard deviation of the low resolution candidates, see
+ * regress(RegressionSums const&, bool). The values should be shifted by a value close to the
+ * data, e. g. the central pixel, before adding them. The regression slope and the errors do not
+ * depend on a shift, but the sums of squares lose less precision.
+ */
+struct RegressionSums {
+    /// Number of samples
+    double n = 0;
+
+    /// Sum of the low resolution values \f$ \sum_i x_i \f$
+    double x = 0;
+
+    /// Sum of the high resolution values \f$ \sum_i y_i \f$
+    double y = 0;
+
+    /// Sum of the squared low resolution values \f$ \sum_i x_i^2 \f$
+    double xx = 0;
+
+    /// Sum of the products \f$ \sum_i x_i \, y_i \f$
+    double xy = 0;
+
+    /// Sum of the squared high resolution values \f$ \sum_i y_i^2 \f$
+    double yy = 0;
+
+    /// Add a sample
+    void add(double xi, double yi) {
+        n  += 1;
+        x  += xi;
+        y  += yi;
+        xx += xi * xi;
+        xy += xi * yi;
+        yy += yi * yi;
+    }
+
+    /// Population variance of the low resolution values
+    double varianceX() const {
+        double mean = x / n;
+        return std::max(0.0, xx / n - mean * mean);
+    }
+
+    /// Population variance of the high resolution values
+    double varianceY() const {
+        double mean = y / n;
+        return std::max(0.0, yy / n - mean * mean);
+    }
+};
+
+
+/**
+ * @brief This functor predicts the values for all channels of all pixels of the prediction area
  *
- * @param opt holds the ESTARFM options. It is only used to get the data range limits via
+ * @param opt holds the ESTARFM options. It is used to get the window size and the data range
+ * limits via
  * @ref EstarfmOptions::isDataRangeSet() "isDataRangeSet()",
  * @ref EstarfmOptions::getDataRangeMin() "getDataRangeMin()" and
  * @ref EstarfmOptions::getDataRangeMax() "getDataRangeMax()".
  *
- * @param x_center is the center x-coordinate relative to the window origin.
+ * @param predArea is the prediction area relative to the sample area.
  *
- * @param y_center is the center y-coordinate relative to the window origin.
-
- * @param h1_win is the current window of the high resolution image at date 1.
- * @param h3_win is the current window of the high resolution image at date 3.
- * @param l1_win is the current window of the low resolution image at date 1.
- * @param l2_win is the current window of the low resolution image at date 2.
- * @param l3_win is the current window of the low resolution image at date 3.
+ * @param h1 is the high resolution image at date 1 in the size of the sample area.
+ * @param h3 is the high resolution image at date 3 in the size of the sample area.
+ * @param l1 is the low resolution image at date 1 in the size of the sample area.
+ * @param l2 is the low resolution image at date 2 in the size of the sample area.
+ * @param l3 is the low resolution image at date 3 in the size of the sample area.
  *
- * @param lw_win is the current window of the local weights, see ComputeLocalWeights. It is denoted
- * by \f$ L \f$ below.
+ * @param localWeights are the local weights in the size of the sample area, see
+ * ComputeLocalWeights. They are denoted by \f$ L \f$ below.
  *
- * @param dw_win contains the current window of the distance weights defined as
+ * @param distWeights contains the distance weights in the size of the window defined as
  * \f$ D(x,y) = 1 + \frac{\sqrt{(x - x_c)^2 + (y - y_c)^2}}{\tfrac s 2} \f$.
- * This is generally always the same but on image boundaries it is cropped. See
+ * On image boundaries only the part of it that overlaps the sample area is used. See
  * computeDistanceWeights().
  *
- * @param sm_win is the current window of the (sample) mask. This may have multiple channels or be
- * empty (for no mask).
+ * @param sampleMask is the mask in the size of the sample area. This may have multiple channels
+ * or be empty (for no mask).
  *
- * @param tol1 contains the tolerance values for the current window for all channels for the input
- * pair at date 1. This tolerance is denoted by \f$ \varepsilon_1 \f$ below for the considered
- * channel.
+ * @param sumTol holds the window sums of the low resolution images for all pixels of the
+ * prediction area and the local tolerances, if they are used. Their values for the current pixel
+ * are denoted by \f$ \varepsilon_1 \f$ and \f$ \varepsilon_3 \f$ below.
  *
- * @param tol3 contains the tolerance values for the current window for all channels for the input
- * pair at date 3. This tolerance is denoted by \f$ \varepsilon_3 \f$ below for the considered
- * channel.
+ * @param globalTol1 contains the tolerance values for all channels for the input pair at date 1.
+ * These are used when `sumTol` has no local tolerances.
  *
- * @param sumL1 contains the sums of the valid values of the low resolution image at date 1 of the
- * current window for all channels.
+ * @param globalTol3 contains the tolerance values for all channels for the input pair at date 3.
+ * These are used when `sumTol` has no local tolerances.
  *
- * @param sumL2 contains the sums of the valid values of the low resolution image at date 2 of the
- * current window for all channels.
+ * @param writeMask is the bit-packed single-channel prediction mask in the size of the prediction
+ * area. Runs of unset locations are skipped with BitMask::findNextSet().
  *
- * @param sumL3 contains the sums of the valid values of the low resolution image at date 3 of the
- * current window for all channels.
+ * @param output is the output image in the size of the prediction area.
  *
- * @param out_pixel is the (shared copy of the) central pixel of the output image.
+ * This functor is called from EstarfmFusor::predict() with help of CallBaseTypeFunctor::run(). So
+ * the dispatch on the image type happens only once for the whole prediction area. Like in the
+ * STARFM kernel the window of each pixel is not cropped as shared copy, but walked through row by
+ * row with plain pointers. The candidates are not collected either. Instead their values are added
+ * to RegressionSums, so no memory is allocated for a pixel.
  *
- * So basically it receives all relevant variables for the current window and it loops over all
- * channels doing the same procedure for each channel. This procedure is described in the
- * following.
+ * For each pixel of the prediction area it loops over all channels doing the same procedure for
+ * each channel. This procedure is described in the following.
  *
  * The algorithm relies on using only pixels of the window, which are similar to the central pixels
  * in all channels. This is done for both pairs. Let the central pixel be at \f$ (x_c, y_c) \f$ and
@@ -121,25 +220,24 @@ namespace estarfm_impl_detail {
  * Note, the regression coefficient is different for every channel, but the same for the whole
  * window (currently). The local weight (correlation coefficient) is the same for all channels, but
  * different for each location in the window.
+ *
  */
-struct PredictPixel {
+struct PredictArea {
     EstarfmOptions const& opt;
-    unsigned int x_center;
-    unsigned int y_center;
-    ConstImage const& h1_win;
-    ConstImage const& h3_win;
-    ConstImage const& l1_win;
-    ConstImage const& l2_win;
-    ConstImage const& l3_win;
-    ConstImage const& lw_win;
-    ConstImage const& dw_win;
-    ConstImage const& sm_win;
-    std::vector<double> const& tol1;
-    std::vector<double> const& tol3;
-    std::vector<double> const& sumL1;
-    std::vector<double> const& sumL2;
-    std::vector<double> const& sumL3;
-    Image& out_pixel;
+    Rectangle const& predArea;
+    ConstImage const& h1;
+    ConstImage const& h3;
+    ConstImage const& l1;
+    ConstImage const& l2;
+    ConstImage const& l3;
+    ConstImage const& localWeights;
+    ConstImage const& distWeights;
+    ConstImage const& sampleMask;
+    SumAndTolHelper const& sumTol;
+    std::vector<double> const& globalTol1;
+    std::vector<double> const& globalTol3;
+    BitMask const& writeMask;
+    Image& output;
 
     template<Type basetype>
     void operator()() const;
@@ -155,10 +253,10 @@ struct PredictPixel {
  * @param l3 is the low resolution image at date 3.
  * @param m is either empty, a single-channel mask or a multi-channel mask.
  *
- * This calculates the local weights. These are pointwise operations and used in PredictPixel. This
- * precalculation saves PredictPixel to calculate the same values over and over again. This functor
- * is called in StarfmFusor::predict() before the moving window with a call to
- * CallBaseTypeFunctor::run().
+ * This calculates the local weights. These are pointwise operations and used in PredictArea. This
+ * precalculation saves PredictArea to calculate the same values over and over again. Since they
+ * only depend on the input pairs, this functor is called with a call to CallBaseTypeFunctor::run()
+ * when the PairContext is created and the result is reused for all prediction dates.
  *
  * The local weights correspond to the correlation coefficient of high and low resolution.
  * Considering the pixels at one single location, let \f$ H_1 \f$ be the vector of all channel
@@ -172,7 +270,9 @@ struct PredictPixel {
  * \f[ \rho_{H,L} = \frac{\mathrm{cov}(H, L)}{\sigma_H \, \sigma_L}
  *                = \frac{\sum_i (h_i - \bar h) \, (l_i - \bar l)}
  *                       {\sqrt{\sum_i (h_i - \bar h)^2} \, \sqrt{\sum_i (l_i - \bar l)^2}}. \f]
- * This is calculated once for every location.
+ * This is calculated once for every location. Values masked out by `m` are used as 0. The rows
+ * are distributed to the available OpenMP threads and each row is processed in passes over its
+ * pixels without any per-pixel allocations.
  *
  * @return double image with the local weights. It has the same size and number of channels as the
  * input images.
@@ -205,25 +305,18 @@ struct ComputeLocalWeights {
  * @param m is either empty, a single-channel mask or a multi-channel mask.
  *
  * @param predArea is the prediction area. This is used to loop through all windows with central
- * pixels exactly like EstarfmFusor::predict() does it before calling PredictPixel.
- *
- * This fusor is used just by calling the constructor. This internally uses
- * CallBaseTypeFunctor::run() on itself. The constructed object will hold all output objects.
- *
- * This functor calculates the window sums of the low resolution images and maybe the window
- * tolerances, which require the window sums of the high resolution images. The sums of moving
- * windows can be calculated very efficiently. Its basic idea is to start with an initial sum and
- * add the new values and subtract the old. In a 1D moving sum, this would be like follows:
- *
- *     | 1 + 6 + 3 + 2 | 8   4   would be 12. Moving one to the right gives
- *       -               +
- *       1 | 6 + 3 + 2 + 8 | 4   would be 12 - 1 + 8 = 19. And again
- *           -               +
- *       1   6 | 3 + 2 + 8 + 4 | would be 19 - 6 + 4 = 17.
- *
- * This is what this helper does, but in 2D, with sums of h1, h3, l1, l2 and l3, sum of squares of
- * h1 and h3 and valid pixel counts of h1 and h3. The tolerances are calculated for the high
- * resolution images, like
+ * pixels exactly like PredictArea does it.
+ *
+ * This helper is used just by calling the constructor. The constructed object will hold all
+ * output objects.
+ *
+ * This helper calculates the window sums of the low resolution images and maybe the window
+ * tolerances, which require the window sums of the high resolution images. The sums are taken from
+ * summed-area tables, see IntegralStats, which give the sums of a window in constant time. To
+ * limit the memory usage, the tables are made for one channel and a stripe of
+ * #bandHeight window rows (plus the window size) at a time. So the required sums of h1, h3, l1,
+ * l2 and l3, sums of squares of h1 and h3 and valid pixel counts are available for each window.
+ * The tolerances are calculated for the high resolution images, like
  * \f[ \sigma_1 = \sqrt{\frac{\sum_i^N h_{1,i}^2}{N} - \left( \frac{\sum_i^N h_{1,i}}{N} \right)^2} \f]
  * and
  * \f[ \emph{tol}_1 := \frac{2 \, \sigma_1}{C}, \f]
@@ -248,44 +341,8 @@ struct ComputeLocalWeights {
  * will be empty images.
  */
 struct SumAndTolHelper {
-    /**
-     * @brief The Stats struct helps the SumAndTolHelper with all required values
-     */
-    struct Stats {
-        double sum_h1    = 0;
-        double sum_h3    = 0;
-        double sqrsum_h1 = 0;
-        double sqrsum_h3 = 0;
-        size_t cnt_h1    = 0;
-        size_t cnt_h3    = 0;
-        double sum_l1    = 0;
-        double sum_l2    = 0;
-        double sum_l3    = 0;
-
-        void operator+=(Stats const& s) {
-            sum_h1    += s.sum_h1;
-            sum_h3    += s.sum_h3;
-            sqrsum_h1 += s.sqrsum_h1;
-            sqrsum_h3 += s.sqrsum_h3;
-            cnt_h1    += s.cnt_h1;
-            cnt_h3    += s.cnt_h3;
-            sum_l1    += s.sum_l1;
-            sum_l2    += s.sum_l2;
-            sum_l3    += s.sum_l3;
-        }
-
-        void operator-=(Stats const& s) {
-            sum_h1    -= s.sum_h1;
-            sum_h3    -= s.sum_h3;
-            sqrsum_h1 -= s.sqrsum_h1;
-            sqrsum_h3 -= s.sqrsum_h3;
-            cnt_h1    -= s.cnt_h1;
-            cnt_h3    -= s.cnt_h3;
-            sum_l1    -= s.sum_l1;
-            sum_l2    -= s.sum_l2;
-            sum_l3    -= s.sum_l3;
-        }
-    };
+    /// Number of window rows, for which the summed-area tables are made at once
+    static constexpr int bandHeight = 256;
 
     // input arguments
     EstarfmOptions const& opt;
@@ -317,30 +374,17 @@ struct SumAndTolHelper {
             tol3 = Image{sumL1.size(), sumL1.type()};
         }
 
-        CallBaseTypeFunctor::run(*this, l2.type());
+        compute();
     }
 
-    /**
-     * @brief Compute a Stats object from the cropped input arguments and channel
-     *
-     * For the very first window this will be called for the whole window. For all successive calls
-     * this will be called with the new stripe, where the window moved to and the old stripe, where
-     * the window came from.
-     */
-    template<Type basetype>
-    Stats collectStats(ConstImage h1_win, ConstImage h3_win, ConstImage l1_win, ConstImage l2_win, ConstImage l3_win, ConstImage m_win, unsigned int c) const;
-
-    template<Type basetype>
-    void operator()();
+    /// Fills the output objects
+    void compute();
 };
 
 /**
- * @brief Compute the linear regression for the input data
- *
- * @tparam val_t is the value type of the input data
+ * @brief Compute the linear regression from the sums of the input data
  *
- * @param x_vec is the input data for X
- * @param y_vec is the input data for Y
+ * @param sums are the sums of the samples of X and Y, see RegressionSums.
  * @param smooth is a setting to blend linear with the quality the regression coefficient into 1.
  *
  * This assumes a model \f$ Y = 1 \, a + X \, b + \varepsilon \f$, where a and b are the parameters
@@ -383,40 +427,22 @@ struct SumAndTolHelper {
  * coefficient b. Otherwise b is finally returned. In the case that smooth is true b * Q + (1 - Q)
  * is returned.
  */
-template<class val_t>
-inline double regress(std::vector<val_t> const& x_vec, std::vector<val_t> const& y_vec, bool smooth = false) {
-    assert(x_vec.size() == y_vec.size() && "Regress function: vectors have a different number of elements.");
-    unsigned int n = x_vec.size();
-    cv::Mat x_cv(x_vec);
-    cv::Mat y_cv(y_vec);
-
-    // regress
-    cv::Scalar mean_y, stddev_y;
-    cv::meanStdDev(y_cv, mean_y, stddev_y);
-    double y_dot_1 = mean_y[0] * n;
-    double x_dot_1 = cv::sum(x_cv)[0];
-    double x_dot_x = x_cv.dot(x_cv);
-    double x_dot_y = x_cv.dot(y_cv);
-
-    double det = n * x_dot_x - x_dot_1 * x_dot_1;
+inline double regress(RegressionSums const& sums, bool smooth = false) {
+    double n = sums.n;
+    double det = n * sums.xx - sums.x * sums.x;
     if (std::abs(det) < 1e-14)
         return 1;
-    double a = (x_dot_x * y_dot_1 - x_dot_1 * x_dot_y) / det;
-    double b = (n * x_dot_y - x_dot_1 * y_dot_1) / det;
+    double b = (n * sums.xy - sums.x * sums.y) / det;
 
     // exclude strange cases
     if (b < 0 || 5 < b || n - 2 <= 0)
         return 1;
 
-    // get fvalue
-    double sqrerr = 0;
-    for (unsigned int i = 0; i < n; ++i) {
-        double x = x_vec.at(i);
-        double y = y_vec.at(i);
-        double err = y - x * b - a;
-        sqrerr += err * err;
-    }
-    double r2 = 1 - sqrerr / (stddev_y[0] * stddev_y[0] * n);
+    // get fvalue, the residual sum of squares is the centered sum of squares of Y minus b times the centered sum of products
+    double centered_xy = sums.xy - sums.x * sums.y / n;
+    double centered_yy = sums.yy - sums.y * sums.y / n;
+    double sqrerr = std::max(0.0, centered_yy - b * centered_xy);
+    double r2 = 1 - sqrerr / centered_yy;
     double fvalue = (n - 2) / (1 / r2 - 1);
 
     // check regression quality
@@ -433,6 +459,26 @@ inline double regress(std::vector<val_t> const& x_vec, std::vector<val_t> const&
     return b * fisher + (1 - fisher);
 }
 
+/**
+ * @brief Compute the linear regression for the input data
+ *
+ * @tparam val_t is the value type of the input data
+ *
+ * @param x_vec is the input data for X
+ * @param y_vec is the input data for Y
+ * @param smooth is a setting to blend linear with the quality the regression coefficient into 1.
+ *
+ * This just sums up the data and calls regress(RegressionSums const&, bool).
+ */
+template<class val_t>
+inline double regress(std::vector<val_t> const& x_vec, std::vector<val_t> const& y_vec, bool smooth = false) {
+    assert(x_vec.size() == y_vec.size() && "Regress function: vectors have a different number of elements.");
+    RegressionSums sums;
+    for (std::size_t i = 0; i < x_vec.size(); ++i)
+        sums.add(x_vec[i], y_vec[i]);
+    return regress(sums, smooth);
+}
+
 /**
  * @brief Get the Pearson correlation coefficient
  *
@@ -587,10 +633,127 @@ public:
      */
     void predict(int date2, ConstImage const& validMask = {}, ConstImage const& predMask = {}) override;
 
+    // the overload with bit-packed masks unpacks them and calls the one above
+    using DataFusor::predict;
+
+    /**
+     * @brief Predict with a separate mask for the input pairs
+     *
+     * @param date2 is the prediction date, see predict().
+     *
+     * @param pairMask is either empty or a mask in the size of the source images, which marks the
+     * valid locations of the input pairs. It is used for the pair context, i. e. the global
+     * tolerances and the local weights.
+     *
+     * @param validMask is either empty or a mask in the size of the source images, see predict().
+     * It is used for everything else and should not mark locations as valid that are invalid in
+     * `pairMask`. Usually it is `pairMask` combined with the invalid locations of the low
+     * resolution image at `date2`.
+     *
+     * @param predMask is either empty or a single-channel mask in the size of the source images,
+     * see predict().
+     *
+     * predict() uses the `validMask` for the pair context as well. So with a different valid mask
+     * for each date, the local weights would be recomputed for each date. With this method the
+     * pair context is reused for all dates as long as `pairMask` does not change.
+     *
+     * @throws logic_error if source images have not been set.
+     * @throws not_found_error if not all required images are available.
+     * @throws image_type_error if the types (basetypes or channels) of images or masks mismatch
+     * @throws size_error if the sizes of images or masks mismatch
+     */
+    void predictWithPairMask(int date2, ConstImage const& pairMask, ConstImage const& validMask = {}, ConstImage const& predMask = {});
+
+    /**
+     * @brief Compute the pair context for the current options
+     *
+     * @param validMask is either empty or a mask in the size of the source images, see predict().
+     * It is used for the global tolerances and the local weights. For predictions with
+     * predictWithPairMask() this is the pair mask.
+     *
+     * The pair context holds everything that only depends on the input pairs and not on the
+     * prediction date: the global similarity tolerances (if local tolerances are not used), the
+     * distance weights and the local weights in the sample area of the prediction area set in the
+     * options. The next calls of predict() will use it instead of computing these for each call.
+     * The source images and the options have to be set before.
+     *
+     * If the current context is still valid for the options, the pair images and the mask, it is
+     * kept. predict() does the same check, so usually this does not have to be called
+     * explicitly. It is useful to compute the context for a large prediction area before
+     * predicting smaller parts of it.
+     *
+     * @throws logic_error if source images have not been set.
+     * @throws not_found_error if the images of the input pairs are not available.
+     */
+    void preparePairContext(ConstImage const& validMask = {});
+
+
+    /**
+     * @brief Get the pair context
+     * @return pair context or `nullptr` if none has been prepared or set.
+     * @see preparePairContext()
+     */
+    std::shared_ptr<estarfm_impl_detail::PairContext const> const& pairContext() const {
+        return pairCtx;
+    }
+
+
+    /**
+     * @brief Set the pair context
+     *
+     * @param ctx is a pair context prepared by another EstarfmFusor or `nullptr` to drop the
+     * current context. A context is only used if it has been computed with the same pair images,
+     * valid mask and relevant options and if it covers the sample area of the prediction area.
+     * Otherwise predict() replaces it by a new one.
+     *
+     * This allows to share the pair context between multiple fusors, like done by the
+     * Parallelizer.
+     */
+    void pairContext(std::shared_ptr<estarfm_impl_detail::PairContext const> ctx) {
+        pairCtx = std::move(ctx);
+    }
+
 protected:
     /// EstarfmOptions to use for the next prediction
     options_type opt;
 
+    /// Context, which only depends on the pairs, or `nullptr`
+    std::shared_ptr<estarfm_impl_detail::PairContext const> pairCtx;
+
+    /// Context and mask of the last successful content comparison
+    mutable std::weak_ptr<estarfm_impl_detail::PairContext const> checkedCtx;
+    mutable ConstImage checkedMask;
+
+    /**
+     * @brief Compute the pair context for a given area
+     * @param validMask is used for the global tolerances and the local weights.
+     * @param sampleArea is the area for the local weights.
+     * @return new pair context.
+     */
+    std::shared_ptr<estarfm_impl_detail::PairContext const> makePairContext(ConstImage const& validMask, Rectangle const& sampleArea) const;
+
+    /**
+     * @brief Check whether the current pair context can be used
+     * @param validMask is the mask for the pair context, i. e. the valid mask or the pair mask of the prediction.
+     * @param sampleArea is the area, which the context has to cover.
+     * @param trustCheckedMasks allows to skip comparing the mask contents, if the same mask (same
+     * memory) has already been compared successfully with the current context. This is used for
+     * predictions, which are called for each tile by the Parallelizer, while
+     * preparePairContext() always compares the contents.
+     * @return true if there is a context, it has been computed from the same pair images, options
+     * and mask and covers the sample area.
+     */
+    bool isPairContextValid(ConstImage const& validMask, Rectangle const& sampleArea, bool trustCheckedMasks = false) const;
+
+    /**
+     * @brief Common implementation of predict() and predictWithPairMask()
+     * @param date2 is the prediction date.
+     * @param validMask is the valid mask of the prediction.
+     * @param pairMask is the mask for the pair context.
+     * @param predMask is the prediction mask.
+     */
+    void predictImpl(int date2, ConstImage const& validMask, ConstImage const& pairMask, ConstImage const& predMask);
+
     /**
      * @brief Get area where pixels are read
      * @param fullImgSize size of the source image. This is used as bounds.
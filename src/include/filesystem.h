@@ -25,6 +25,7 @@
 #ifndef FILESYSTEM_H
 #define FILESYSTEM_H
 
+#include <cstdint>
 #include <functional>
 #include <string>
 
@@ -60,7 +61,8 @@ class filesystem {
     static bool is_relative(std::string p);
     static bool is_absolute(std::string p);
     static std::string get_tempdir();
-    static uint32_t file_size(std::string p);
+    static uint64_t file_size(std::string p);
+    static int64_t last_write_time(std::string p);
 };
 
 }  // namespace imagefusion
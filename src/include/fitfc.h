@@ -43,26 +43,19 @@ namespace fitfc_impl_detail {
  * to map the central pixel of `h1` to `h2` (prediction), i. e. \f$ h_2 = a\,h_1 + b \f$. Also the
  * residual of the central pixel from `l1` to `l2` is saved, i. e. \f$ R = l_2 - (a\,l_1 + b) \f$.
  *
- * The regression requires some sums of the low resolution images over all pixels in a window. The
- * sums of moving windows can be calculated very efficiently. Its basic idea is to start with an
- * initial sum and add the new values and subtract the old. In a 1D moving sum, this would be like
- * follows:
- *
- *     | 1 + 6 + 3 + 2 | 8   4   would be 12. Moving one to the right
- *       -               +
- *       1 | 6 + 3 + 2 + 8 | 4   would be 12 - 1 + 8 = 19. And again
- *           -               +
- *       1   6 | 3 + 2 + 8 + 4 | would be 19 - 6 + 4 = 17.
- *
- * This is how this helper computes the sums, but in 2D, for the sum of l1, l2, l1*l1 and l1*l2 as
- * well as the pixel count (can vary at borders and by masks). This allows for a runtime complexity
- * of \f$ c \, W \, H \f$ instead of \f$ d \, W \, H \, S^2 \f$ with a naive approach, where \f$ c,
+ * The regression requires some sums of the low resolution images over all pixels in a window, i. e.
+ * the sum of l1, l2, l1*l1 and l1*l2 as well as the pixel count (can vary at borders and by masks).
+ * These are taken from summed-area tables, see IntegralStats, which give the sums of a window in
+ * constant time. To limit the memory usage, the tables are made for a stripe of #bandHeight rows
+ * (plus the window size) at a time. This allows for a runtime complexity of
+ * \f$ c \, W \, H \f$ instead of \f$ d \, W \, H \, S^2 \f$ with a naive approach, where \f$ c,
  * d\f$ are some constants, \f$ W \f$ and \f$ H \f$ are the width and height of the image (or
  * actually the sample area) and \f$ S \f$ is the window size (by default 51).
  *
- * Note: This whole procedure is done for each channel separately. So the most outer loop iterates
- * over the channels. This loop is also parallelized, since due to the independency of the
- * channels, there are no problems and no overhead.
+ * Note: This whole procedure is done for each channel separately. The work is split into blocks of
+ * one channel and #bandHeight rows, which are processed in parallel. Each block makes its own
+ * summed-area tables, so the blocks are independent and the result does not depend on the number
+ * of threads.
  *
  * @return two images. First is the predicted image, which is in the paper denoted by
  * \f$ \hat F_{\mathrm{RM}} \f$. It has the same data type, size and number of channels as `h1`.
@@ -70,29 +63,8 @@ namespace fitfc_impl_detail {
  * type double (Type::float64).
  */
 struct RegressionMapper {
-    struct Stats {
-        double x_dot_1 = 0; ///< \f$ X \cdot 1 = \sum_i x_i \f$ is the sum of all valid pixel values of `l1` in the current window
-        double y_dot_1 = 0; ///< \f$ Y \cdot 1 = \sum_i y_i \f$ is the sum of all valid pixel values of `l2` in the current window
-        double x_dot_x = 0; ///< \f$ X \cdot X = \sum_i x_i^2 \f$ is the sum of squares of all valid pixel values of `l1` in the current window
-        double x_dot_y = 0; ///< \f$ X \cdot Y = \sum_i x_i \, y_i \f$ is the sum of all valid pixel values of `l1` · `l2` in the current window
-        size_t n       = 0; ///< \f$ 1 \cdot 1 = n \f$ is the count of valid pixel values in the current window
-
-        void operator+=(Stats const& s) {
-            x_dot_1 += s.x_dot_1;
-            y_dot_1 += s.y_dot_1;
-            x_dot_x += s.x_dot_x;
-            x_dot_y += s.x_dot_y;
-            n       += s.n;
-        }
-
-        void operator-=(Stats const& s) {
-            x_dot_1 -= s.x_dot_1;
-            y_dot_1 -= s.y_dot_1;
-            x_dot_x -= s.x_dot_x;
-            x_dot_y -= s.x_dot_y;
-            n       -= s.n;
-        }
-    };
+    /// Number of rows, for which the summed-area tables are made at once
+    static constexpr int bandHeight = 256;
 
     // input arguments
     FitFCOptions const& opt;
@@ -101,22 +73,14 @@ struct RegressionMapper {
     ConstImage const& l2;
     ConstImage const& m;
 
-    /**
-     * @brief Compute a Stats object from the cropped input arguments and channel
-     *
-     * For the very first location this will be called for the part of the window that is in the
-     * image. For all successive calls this will be called with the new stripe, where the window
-     * moved to and the old stripe, where the window came from.
-     */
-    template<typename imgval_t>
-    Stats collectStats(ConstImage h1_win, ConstImage l1_win, ConstImage l2_win, ConstImage m_win, int c) const;
-
     /**
      * @brief Regresses linear model and maps with it `h1` to `h2` and finds the residual when mapping `l1` to `l2`
      *
      * @tparam imgval_t is the C++ type of the image pixel values
-     * @param s are the window sums (dot products) on which the regression is based, see the
-     * description of @ref Stats.
+     * @param s are the window sums (dot products) on which the regression is based. With
+     * \f$ X \f$ being `l1` and \f$ Y \f$ being `l2` in the window these are
+     * \f$ X \cdot 1 = \sum_i x_i \f$, \f$ Y \cdot 1 = \sum_i y_i \f$, \f$ X \cdot X = \sum_i x_i^2 \f$,
+     * \f$ X \cdot Y = \sum_i x_i \, y_i \f$ and \f$ 1 \cdot 1 = n \f$.
      * @param h1_val is the central pixel of `h1`.
      * @param l1_val is the central pixel of `l1`.
      * @param l2_val is the central pixel of `l2`.
@@ -154,7 +118,7 @@ struct RegressionMapper {
      * which is equivalent to a = 1 and b = 0.
      */
     template<typename imgval_t>
-    std::pair<imgval_t, double> regressPixel(Stats s, imgval_t h1_val, imgval_t l1_val, imgval_t l2_val) const;
+    std::pair<imgval_t, double> regressPixel(IntegralStats::Sums const& s, imgval_t h1_val, imgval_t l1_val, imgval_t l2_val) const;
 
     template<Type basetype>
     std::pair<Image, Image> operator()() const;
@@ -201,7 +165,9 @@ struct RegressionMapper {
  * \f[ D(x, y) := \frac 1 2 \sqrt{\sum_{b=1}^{n_b} \left( h_1(x, y, b) - h_1(x_c, y_c, b) \right)^2}
  *     \quad \forall x, y. \f]
  * The `N` best pixels will be selected, where `N` is the number of neighbors from the FitFCOptions
- * `opt`. When there are multiple values with the same RMSE, the nearest will be used. Then these
+ * `opt`. When there are multiple values with the same RMSE, the nearest will be used, see Score.
+ * The selection keeps only the `N` best pixels found so far in a bounded max-heap and stops
+ * summing up the squared differences of a pixel as soon as it is worse than all of them. Then these
  * locations are used to collect the inverse distance weights \f$ \frac{1}{d_i} \f$, the regression
  * model pixels from \f$ \hat F_{\mathrm{RM}} \f$ and the bicubic interpolated residuals from
  * \f$ r \f$. Finally, the output is
@@ -210,20 +176,57 @@ struct RegressionMapper {
  *       \sum_{i=1}^N \frac{1}{d_i} \left( \hat F_{\mathrm{RM}}(x_i, y_i, b) + r(x_i, y_i, b) \right) \f]
  */
 struct FilterStep {
+    /**
+     * @brief Score of a candidate neighbor
+     *
+     * Scores are ordered by the spectral difference, then by the squared distance to the central
+     * pixel and finally by the location. So the order is total and the selected neighbors do not
+     * depend on the order in which the candidates are visited.
+     */
     struct Score {
         double diff;
+        unsigned int dist;
         unsigned int x;
         unsigned int y;
-        unsigned int xc;
-        unsigned int yc;
 
         Score(double diff, unsigned int x, unsigned int y, unsigned int xc, unsigned int yc)
-            : diff(diff), x(x), y(y), xc (xc), yc(yc)
+            : diff(diff), dist((x-xc) * (x-xc) + (y-yc) * (y-yc)), x(x), y(y)
         { }
 
         bool operator<(Score const& s) const {
-            return diff < s.diff ||
-                    (diff == s.diff && (x-xc) * (x-xc) + (y-yc) * (y-yc) < (s.x-xc) * (s.x-xc) + (s.y-yc) * (s.y-yc));
+            if (diff != s.diff)
+                return diff < s.diff;
+            if (dist != s.dist)
+                return dist < s.dist;
+            return y < s.y || (y == s.y && x < s.x);
+        }
+    };
+
+    /**
+     * @brief Reusable buffers of the FilterStep
+     *
+     * The best scores of the window pixels are collected for every output pixel. To avoid heap
+     * allocations in this per-pixel path, the buffers are allocated once with the maximum size,
+     * which depends on the window size and the number of channels, and then only reset for every
+     * pixel. Each thread must use its own object.
+     */
+    struct Scratch {
+        /// Bounded max-heap with the best scores found so far, the worst of them at the front
+        std::vector<Score> best;
+
+        /// Values of the central pixel of `h1` for each channel
+        std::vector<double> h1_center;
+
+        /// Weighted sums of the prediction for each channel
+        std::vector<double> f2;
+
+        /**
+         * @brief Allocate the buffers
+         * @param winSize is the window size, which limits the number of scores.
+         * @param chans is the number of channels.
+         */
+        Scratch(unsigned int winSize, unsigned int chans) : h1_center(chans), f2(chans) {
+            best.reserve(winSize * winSize);
         }
     };
 
@@ -236,6 +239,7 @@ struct FilterStep {
     ConstImage const& mask_win;
     ConstImage const& dw_win;
     Image& out_pixel;
+    Scratch& scratch;
 
     /**
      * @brief This function is required for the functor pattern for dynamic
@@ -253,9 +257,12 @@ struct FilterStep {
  * @brief Downscale with averaging and upscale with cubic interpolation again
  *
  * This is used for the *bicubic interpolation* of the residual image. The scale factor is taken
- * from the FitFCOptions::getResolutionFactor().
+ * from the FitFCOptions::getResolutionFactor(). The channels are filtered in parallel with
+ * `numThreads` threads. If there are fewer channels than threads, the planes are filtered one
+ * after the other and OpenCV parallelizes each resize over row stripes with `numThreads` threads.
+ * Both ways give the same result as filtering all channels at once.
  */
-Image cubic_filter(Image i, double scale);
+Image cubic_filter(Image i, double scale, unsigned int numThreads = 1);
 
 } /* namespace fitfc_impl_detail */
 
@@ -372,6 +379,18 @@ public:
      */
     void predict(int date2, ConstImage const& validMask = {}, ConstImage const& predMask = {}) override;
 
+    /**
+     * @brief Predict with bit-packed masks
+     *
+     * @param date2 is the prediction date, see predict(int, ConstImage const&, ConstImage const&).
+     *
+     * @param validMask is unpacked for the prediction, since the regression needs it as mask
+     * image.
+     *
+     * @param predMask is used as BitMask. It is only cropped to the prediction area.
+     */
+    void predict(int date2, BitMask const& validMask, BitMask const& predMask = BitMask{}) override;
+
 protected:
     /// FitFCOptions to use for the next prediction
     options_type opt;
@@ -415,6 +434,15 @@ protected:
      */
     void checkInputImages(ConstImage const& validMask, ConstImage const& predMask, int date2) const;
 
+    /**
+     * @brief Common implementation of both predict() overloads
+     * @param date2 is the prediction date.
+     * @param validMask is the checked valid mask.
+     * @param predMask is the checked prediction mask.
+     * @param predBits is either empty or the bit-packed prediction mask. Then `predMask` is empty.
+     */
+    void predictImpl(int date2, ConstImage const& validMask, ConstImage const& predMask, BitMask const& predBits);
+
     /**
      * @brief Regress coarse images
      *
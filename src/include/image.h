@@ -1,5 +1,6 @@
 #pragma once
 
+#include <array>
 #include <string>
 #include <memory>
 #include <iterator>
@@ -21,6 +22,7 @@ namespace imagefusion {
 
 class Image;
 class ConstImage;
+class IntegralStats;
 
 template<typename T>
 using enable_if_not_image_and_not_arithmetic = typename std::enable_if<!std::is_base_of<ConstImage, T>::value && !std::is_arithmetic<T>::value, int>::type;
@@ -601,6 +603,24 @@ inline std::string to_string(ColorMapping map) {
 }
 
 
+/**
+ * @brief Get the coefficients of a tasseled cap transformation
+ *
+ * @param map is either ColorMapping::Landsat_to_TasseledCap or ColorMapping::Modis_to_TasseledCap.
+ *
+ * The coefficients are normalized, such that an image with all values one has a brightness of one.
+ * They are the same as used by ConstImage::convertColor(), so this can be used to fuse the
+ * transformation into other pixel-wise operations.
+ *
+ * @return the coefficients for brightness (indices 0 - 6), greeness (7 - 13) and wetness
+ * (14 - 20). The coefficients for the source channels are in the order of the channels required by
+ * ConstImage::convertColor(). For Landsat the last coefficient of each row is 0.
+ *
+ * @throws invalid_argument_error if `map` is not a tasseled cap mapping.
+ */
+std::array<double, 3*7> getTasseledCapCoefficients(ColorMapping map);
+
+
 /**
  * @brief A value of a single channel with location
  *
@@ -850,6 +870,18 @@ public:
      * @param format is the image file format. When left to FileFormat::unsupported, the format is
      * guessed from the file extension.
      *
+     * @param options are additional GDAL creation options as name value pairs. For GeoTIFF the
+     * default is `COMPRESS=LZW`, which can be overridden, e. g. by
+     * @code
+     * img.write("out.tif", gi, FileFormat("GTiff"), {{"COMPRESS", "ZSTD"}, {"PREDICTOR", "2"},
+     *                                                {"TILED", "YES"}, {"BIGTIFF", "IF_SAFER"},
+     *                                                {"NUM_THREADS", "ALL_CPUS"}});
+     * @endcode
+     * See the documentation of the GDAL driver for the available options.
+     *
+     * The file is written in a single pass with all geo information, nodata values and metadata
+     * from `gi`, so there is no need to update the file afterwards with GeoInfo::addTo.
+     *
      * @throws file_format_error if guessing from the file extension fails.
      *
      * -------------
@@ -858,7 +890,7 @@ public:
      * caused by the output driver, when it does not support writing in general or an Image with a
      * specific Type (like Type::float32).
      */
-    void write(std::string const& filename, GeoInfo const& gi = {}, FileFormat format = FileFormat::unsupported) const;
+    void write(std::string const& filename, GeoInfo const& gi = {}, FileFormat format = FileFormat::unsupported, std::vector<std::pair<std::string,std::string>> const& options = {}) const;
 
 
     /**
@@ -2220,6 +2252,26 @@ public:
     std::pair<std::vector<double>, std::vector<double>> meanStdDev(ConstImage const& mask = {}, bool sampleCorrection = false) const;
 
 
+    /**
+     * @brief Summed-area tables for fast window statistics
+     *
+     * @param mask can be single or multi channel to specify the valid locations.
+     *
+     * @param other is either empty or a second image with the same size and number of channels.
+     * It is required to get window sums of it and window sums of the products of both images.
+     *
+     * @param channel is either -1 to make the tables for all channels or a channel index to make
+     * them only for this channel, which saves memory.
+     *
+     * While meanStdDev() gives the statistics of the whole image, the returned object gives the
+     * masked sums, sums of squares, sums of products and valid pixel counts of arbitrary
+     * rectangular windows in constant time, see IntegralStats.
+     *
+     * @returns the summed-area tables of this image.
+     */
+    IntegralStats integralStats(ConstImage const& mask = {}, ConstImage const& other = {}, int channel = -1) const;
+
+
     /**
      * @brief Find unique elements of a single-channel image
      *
@@ -2324,7 +2376,7 @@ public:
      * change in future.
      *
      * @see createMultiChannelMaskFromRange(std::vector<Interval> const& channelRanges) const
-     * createSingleChannelMaskFromSet(std::vector<IntervalSet> const& channelSets) const
+     * createSingleChannelMaskFromSet()
      */
     Image createSingleChannelMaskFromRange(std::vector<Interval> const& channelRanges, bool useAnd = true) const;
 
@@ -2340,6 +2392,11 @@ public:
      * conjunction) or with a bitwise *or* (logical disjunction). This only applies to
      * multi-channel images.
      *
+     * @param baseMask is either empty or a single-channel mask of the same size as the image. If
+     * given, the result is combined with it by a bitwise *and*, which is the same as
+     * `baseMask.bitwise_and(img.createSingleChannelMaskFromSet(channelSets, useAnd))`, but
+     * without the intermediate mask.
+     *
      * This method is a generalization of createSingleChannelMaskFromRange(). So, if your set
      * consists of one contiguous interval, you can use createSingleChannelMaskFromRange().
      * However, it might still be convenient to use an #IntervalSet, since it is easy to make a
@@ -2403,10 +2460,15 @@ public:
      * @image html gray_values_single_mask_from_set_disjunction.png
      * See createMultiChannelMaskFromSet() for a visualization of the intermediate result.
      *
+     * All sets of all channels and the base mask are evaluated in a single pass over the image,
+     * which is parallelized over the rows if OpenMP is available.
+     *
      * @return single-channel mask Image with Type::uint8x1
      *
      * @throws image_type_error if the number of sets is invalid, i. e. it is neither 1 nor matches
-     * the number of channels of the image.
+     * the number of channels of the image, or if `baseMask` is not a single-channel uint8 mask.
+     *
+     * @throws size_error if `baseMask` has a different size than the image.
      *
      * @note You can use open or half open intervals. For integer images the intervals (10, 15),
      * (10.5, 14.5) and [11, 14] specify all the same values. For floating point images the round
@@ -2414,9 +2476,9 @@ public:
      * (0.1, 0.15) would be [0.1, 0.15] currently for floating point images. This behaviour might
      * change in future.
      *
-     * @see createMultiChannelMaskFromSet(std::vector<IntervalSet> const& channelSets) const
+     * @see createMultiChannelMaskFromSet()
      */
-    Image createSingleChannelMaskFromSet(std::vector<IntervalSet> const& channelSets, bool useAnd = true) const;
+    Image createSingleChannelMaskFromSet(std::vector<IntervalSet> const& channelSets, bool useAnd = true, ConstImage const& baseMask = {}) const;
 
 
     /**
@@ -2484,6 +2546,12 @@ public:
      * channel. A set (#IntervalSet) S is a union of Interval%s, like S = [1, 100] ∪ [200, 250] ∪
      * (300, 305).
      *
+     * @param baseMask is either empty or a mask of the same size as the image with a single
+     * channel or as many channels as the image. If given, the result is combined with it by a
+     * bitwise *and*, which is the same as
+     * `baseMask.bitwise_and(img.createMultiChannelMaskFromSet(channelSets))`, but without the
+     * intermediate mask.
+     *
      * This method is a generalization of createMultiChannelMaskFromRange(). So, if your set
      * consists of one contiguous interval, you can use createMultiChannelMaskFromRange(). However,
      * it might still be convenient to use an #IntervalSet, since it is easy to make a union of
@@ -2524,11 +2592,17 @@ public:
      * @endcode
      * @image html gray_values_mask_channels_from_set.png
      *
+     * All sets of all channels and the base mask are evaluated in a single pass over the
+     * interleaved image values, which is parallelized over the rows if OpenMP is available.
+     *
      * @return multi-channel mask Image with Type::uint8 base type and the same number of channels
      * as the image.
      *
      * @throws image_type_error if the number of sets is invalid, i. e. it is neither 1 nor matches
-     * the number of channels of the image.
+     * the number of channels of the image, or if `baseMask` is not a uint8 mask with a single
+     * channel or as many channels as the image.
+     *
+     * @throws size_error if `baseMask` has a different size than the image.
      *
      * @note You can use open or half open intervals. For integer images the intervals (10, 15),
      * (10.5, 14.5) and [11, 14] specify all the same values. For floating point images the round
@@ -2536,9 +2610,9 @@ public:
      * (0.1, 0.15) would be [0.1, 0.15] currently for floating point images. This behaviour might
      * change in future.
      *
-     * @see createSingleChannelMaskFromSet(std::vector<IntervalSet> const& channelSets) const
+     * @see createSingleChannelMaskFromSet()
      */
-    Image createMultiChannelMaskFromSet(std::vector<IntervalSet> const& channelSets) const;
+    Image createMultiChannelMaskFromSet(std::vector<IntervalSet> const& channelSets, ConstImage const& baseMask = {}) const;
 
     /**
      * @brief Current size
@@ -3163,7 +3237,7 @@ public:
      * will get decoupled.
      *
      * This method reads only image contents; no meta data or geo information. For the latter see
-     * GeoInfo. This is also helpful if the region should be limited or not all channels should be
+     * GeoInfo or the overload that reads both with a single open of the file. This is also helpful if the region should be limited or not all channels should be
      * read, since GeoInfo provides also the size and the number of channels available before
      * reading.
      *
@@ -3182,6 +3256,43 @@ public:
     void read(std::string const& filename, std::vector<int> channels = {}, Rectangle r = {0, 0, 0, 0}, bool flipH = false, bool flipV = false, bool ignoreColorTable = false, InterpMethod interp = InterpMethod::bilinear);
 
 
+    /**
+     * @brief Read an image and its geo information from a file
+     *
+     * @param filename is the image file to read from
+     *
+     * @param gi will be overwritten with the geo information of the read image.
+     *
+     * @param channels specifies optionally which channels (0-based) to read, see
+     * read(std::string const&, std::vector<int>, Rectangle, bool, bool, bool, InterpMethod).
+     *
+     * @param r limits optionally the region to read.
+     *
+     * @param flipH sets whether to read the image flipped horizontally.
+     *
+     * @param flipV sets whether to read the image flipped vertically.
+     *
+     * @param ignoreColorTable determines, whether a possibly existing color table will be ignored.
+     *
+     * @param interp is the interpolation method for multi-image-files with different resolutions.
+     *
+     * This does the same as the other `read` method, but fills additionally `gi` from the same
+     * GDAL dataset, so the file is opened only once. `gi` corresponds to
+     * GeoInfo(std::string const& filename, std::vector<int> const& selChans, Rectangle crop, bool flipH, bool flipV, bool recurseSubdatasets)
+     * with `recurseSubdatasets` set to `true`, i. e. its size, number of channels and geotransform
+     * fit to the read region and channels. Note, the number of channels refers to the file
+     * contents, so it is not changed by a color table conversion.
+     *
+     * @throws runtime_error if `filename` cannot be found or opened with any GDAL driver.
+     *
+     * @throws size_error if `r` is ill-formed, i. e. out of the bounds of the image or has
+     * negative width or height.
+     *
+     * @throws image_type_error if `channels` specifies channels that do not exist.
+     */
+    void read(std::string const& filename, GeoInfo& gi, std::vector<int> channels = {}, Rectangle r = {0, 0, 0, 0}, bool flipH = false, bool flipV = false, bool ignoreColorTable = false, InterpMethod interp = InterpMethod::bilinear);
+
+
     /**
      * @brief Copy pixel values from an image
      *
@@ -3784,6 +3895,114 @@ Image merge(std::vector<ConstImage> const& images);
 
 
 
+/**
+ * @brief Summed-area tables for masked sums over arbitrary windows
+ *
+ * This holds for every channel the summed-area tables (integral images) of the valid values
+ * \f$ x_i \f$ of an image, their squares \f$ x_i^2 \f$ and the number of valid locations. If a
+ * second image is given, it holds additionally the tables of its valid values \f$ y_i \f$ and of
+ * the products \f$ x_i \, y_i \f$. A location is valid if the mask is empty or non-zero at this
+ * location (in the corresponding channel for multi-channel masks).
+ *
+ * After building the tables in one pass over the image, the sums of any rectangular window are
+ * queried with sums() from four table entries each. So the cost of a query does not depend on the
+ * window size, which is what moving window algorithms, like ESTARFM or Fit-FC, require. Example:
+ * @code
+ * IntegralStats is = l1.integralStats(mask, l2);
+ * IntegralStats::Sums s = is.sums(Rectangle{x - 25, y - 25, 51, 51}, 0);
+ * double mean_l1 = s.sum_x / s.n;
+ * @endcode
+ *
+ * Before summing, the values are shifted by the mean of each channel. This keeps the table
+ * entries small and reduces the cancellation when taking the difference of large table entries.
+ * For integer images the shift is rounded, so all sums are integers. These are exact as long as
+ * they are smaller than \f$ 2^{53} \f$, which gives the same result as summing up the window
+ * directly.
+ *
+ * The tables require five `double` values per location and channel. So for large images it is
+ * advisable to make the tables only for a stripe of the image and a single channel, see
+ * ConstImage::integralStats().
+ */
+class IntegralStats {
+public:
+    /**
+     * @brief Sums of one channel in a window
+     */
+    struct Sums {
+        double sum_x    = 0; ///< \f$ \sum_i x_i \f$ is the sum of all valid values of the first image
+        double sum_y    = 0; ///< \f$ \sum_i y_i \f$ is the sum of all valid values of the second image or 0 without second image
+        double sqrsum_x = 0; ///< \f$ \sum_i x_i^2 \f$ is the sum of squares of all valid values of the first image
+        double sum_xy   = 0; ///< \f$ \sum_i x_i \, y_i \f$ is the sum of products of all valid values or 0 without second image
+        size_t n        = 0; ///< number of valid locations
+    };
+
+    /**
+     * @brief Construct empty tables
+     *
+     * Every query gives zero sums.
+     */
+    IntegralStats() = default;
+
+    /**
+     * @brief Build the summed-area tables
+     *
+     * @param x is the first image. It can have any type.
+     * @param mask is either empty or a single- or multi-channel mask of type uint8 in the size of
+     * `x` to mark the valid locations.
+     * @param y is either empty or a second image with the same size and number of channels as `x`.
+     * @param channel is either -1 for all channels or the only channel to make the tables for.
+     *
+     * @throws size_error if `mask` or `y` have a different size than `x`.
+     * @throws image_type_error if `mask` or `y` have a bad type or number of channels.
+     * @throws invalid_argument_error if `channel` is out of range.
+     */
+    IntegralStats(ConstImage const& x, ConstImage const& mask = {}, ConstImage const& y = {}, int channel = -1);
+
+    /**
+     * @brief Get the sums of a window
+     *
+     * @param r is the window. It may exceed the image bounds, then only the part inside the image
+     * is used.
+     * @param c is the channel. If the tables have been made for a single channel, only this
+     * channel can be queried.
+     *
+     * @return the sums of all valid locations in the window. If no location is valid, all sums
+     * are 0.
+     */
+    Sums sums(Rectangle r, unsigned int c) const;
+
+    /// Size of the image the tables have been made for
+    Size size() const {
+        return s;
+    }
+
+    /// Whether the tables contain the sums of a second image and of the products
+    bool hasSecondImage() const {
+        return withY;
+    }
+
+private:
+    struct Builder;
+
+    std::size_t index(int x, int y, unsigned int k) const {
+        return (static_cast<std::size_t>(y) * (s.width + 1) + x) * offX.size() + k;
+    }
+
+    Size s{0, 0};
+    int firstChannel = 0;
+    bool withY = false;
+
+    std::vector<double> offX;
+    std::vector<double> offY;
+    std::vector<double> sumX;
+    std::vector<double> sumY;
+    std::vector<double> sqrSumX;
+    std::vector<double> sumXY;
+    std::vector<double> count;
+};
+
+
+
 /**
  * @brief General inplace point operation
  * @tparam OP is the type of the operation `op`. It can be e. g. the type of a lambda function
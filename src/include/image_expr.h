@@ -0,0 +1,538 @@
+#pragma once
+
+#include "image.h"
+#include "exceptions.h"
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace imagefusion {
+
+/**
+ * @brief Lazy evaluation of elementwise Image arithmetic
+ *
+ * Chains of Image operations like `hk.add(l2, resType).subtract(lk, resType)` create a full-size
+ * temporary image for every operation. The expressions in this namespace build a typed expression
+ * tree instead, which is evaluated in a single pass over the images when it is assigned to an
+ * Image. Example:
+ * @code
+ * using namespace imagefusion::expr;
+ * Image localValues = (lazy(hk) + lazy(l2) - lazy(lk)).eval(l2.type());
+ * ((lazy(img) - mean) * scale).evalInto(img, mask); // in place, only at valid locations
+ * @endcode
+ *
+ * The operands can be images wrapped with lazy(), scalars (`double`) and per-channel scalars
+ * (`std::vector<double>` with one value per channel). The supported operations are `+`, `-`,
+ * `*`, `/`, abs(), absdiff(), min() and max(). All images of an expression must have the same size
+ * and number of channels. Otherwise building the expression throws an image_type_error or a
+ * size_error. A per-channel scalar with a number of values different from 1 and from the number of
+ * channels of the images throws a size_error as well.
+ *
+ * The evaluation is done row by row. Each row of every image is converted to `double`, then the
+ * operations are applied on the row buffers in loops that can be vectorized and finally the result
+ * row is saturated to the result type. The rows are processed in parallel, if OpenMP is
+ * available. So only the result image and a few row buffers per thread are allocated. Since all
+ * arithmetic is done in `double` and rounded only once at the end, the results can differ in the
+ * last bit from a chain of float32 Image operations. Division by zero gives 0.
+ *
+ * Note, an expression only references its images, so they must be alive until the expression is
+ * evaluated. To write the result only to some locations of an existing image, use
+ * Expr::evalInto() with a mask.
+ */
+namespace expr {
+
+/// Tag base class of all expressions
+struct ExprBase { };
+
+
+/// Check whether a type is an expression
+template<class T>
+constexpr bool is_expr_v = std::is_base_of<ExprBase, T>::value;
+
+
+/**
+ * @brief Base class of all expressions
+ *
+ * An expression `E` must provide:
+ *  * `Size size() const` and `unsigned int channels() const`, which are 0 for scalars,
+ *  * `unsigned int buffers() const`, the number of row buffers it needs for evaluation,
+ *  * `bool fitsChannels(unsigned int chans) const`, which checks whether all per-channel scalars
+ *    in it have either one value or `chans` values, and
+ *  * `void evalRow(int y, int n, unsigned int chans, double* out, double* scratch) const`, which
+ *    writes the `n` values of row `y` to `out` and may use `buffers() * n` values in `scratch`.
+ */
+template<class E>
+struct Expr : ExprBase {
+    /// Get the derived expression
+    E const& derived() const {
+        return static_cast<E const&>(*this);
+    }
+
+
+    /**
+     * @brief Evaluate the expression to a new image
+     *
+     * @param resultType is the type of the result image. Only its base type is used, the number of
+     * channels is taken from the expression.
+     *
+     * @throws logic_error if the expression does not contain an image.
+     *
+     * @return image with the values of the expression, saturated to `resultType`.
+     */
+    Image eval(Type resultType) const {
+        E const& e = derived();
+        if (e.channels() == 0)
+            IF_THROW_EXCEPTION(logic_error("An expression without any image cannot be evaluated."));
+
+        Image dst{e.size(), getFullType(getBaseType(resultType), e.channels())};
+        evalInto(dst);
+        return dst;
+    }
+
+
+    /**
+     * @brief Evaluate the expression into an existing image
+     *
+     * @param dst is the destination image. It must have the size and number of channels of the
+     * expression. It may also be an image of the expression, since every row is read completely
+     * before it is written.
+     *
+     * @param mask is either empty or a mask with a single channel or the number of channels of
+     * `dst`. Only locations with non-zero mask values are written.
+     *
+     * @throws logic_error if the expression does not contain an image.
+     * @throws size_error if `dst` or `mask` do not have the size of the expression.
+     * @throws image_type_error if `dst` or `mask` have a wrong number of channels or if `mask` is
+     * not of base type Type::uint8.
+     */
+    void evalInto(Image& dst, ConstImage const& mask = {}) const;
+};
+
+
+/// Image operand, see lazy()
+class Ref : public Expr<Ref> {
+public:
+    explicit Ref(ConstImage const& i)
+        : img{&i} { }
+
+    Size size() const {
+        return img->size();
+    }
+
+    unsigned int channels() const {
+        return img->channels();
+    }
+
+    unsigned int buffers() const {
+        return 0;
+    }
+
+    bool fitsChannels(unsigned int /*chans*/) const {
+        return true;
+    }
+
+    void evalRow(int y, int n, unsigned int /*chans*/, double* out, double* /*scratch*/) const {
+        switch (img->basetype()) {
+        case Type::uint8:
+            convertRow(img->cvMat().ptr<uint8_t>(y), n, out);
+            break;
+        case Type::int8:
+            convertRow(img->cvMat().ptr<int8_t>(y), n, out);
+            break;
+        case Type::uint16:
+            convertRow(img->cvMat().ptr<uint16_t>(y), n, out);
+            break;
+        case Type::int16:
+            convertRow(img->cvMat().ptr<int16_t>(y), n, out);
+            break;
+        case Type::int32:
+            convertRow(img->cvMat().ptr<int32_t>(y), n, out);
+            break;
+        case Type::float32:
+            convertRow(img->cvMat().ptr<float>(y), n, out);
+            break;
+        default: // Type::float64
+            convertRow(img->cvMat().ptr<double>(y), n, out);
+        }
+    }
+
+private:
+    template<typename T>
+    static void convertRow(T const* src, int n, double* out) {
+        #pragma omp simd
+        for (int i = 0; i < n; ++i)
+            out[i] = src[i];
+    }
+
+    ConstImage const* img;
+};
+
+
+/// Scalar or per-channel scalar operand
+class Constant : public Expr<Constant> {
+public:
+    explicit Constant(double val)
+        : vals{val} { }
+
+    explicit Constant(std::vector<double> vals)
+        : vals{std::move(vals)}
+    {
+        if (this->vals.empty())
+            IF_THROW_EXCEPTION(invalid_argument_error("A per-channel scalar in an expression must have at least one value."));
+    }
+
+    Size size() const {
+        return Size{0, 0};
+    }
+
+    unsigned int channels() const {
+        return 0;
+    }
+
+    unsigned int buffers() const {
+        return 0;
+    }
+
+    bool fitsChannels(unsigned int chans) const {
+        return vals.size() == 1 || vals.size() == chans;
+    }
+
+    void evalRow(int /*y*/, int n, unsigned int chans, double* out, double* /*scratch*/) const {
+        if (vals.size() == 1) {
+            std::fill_n(out, n, vals.front());
+            return;
+        }
+
+        for (int i = 0; i < n; ++i)
+            out[i] = vals[i % chans];
+    }
+
+    /// Number of values, 1 for a scalar
+    std::size_t count() const {
+        return vals.size();
+    }
+
+private:
+    std::vector<double> vals;
+};
+
+
+/// Elementwise unary operation
+template<class A, class Op>
+class Unary : public Expr<Unary<A, Op>> {
+public:
+    explicit Unary(A a)
+        : a{std::move(a)} { }
+
+    Size size() const {
+        return a.size();
+    }
+
+    unsigned int channels() const {
+        return a.channels();
+    }
+
+    unsigned int buffers() const {
+        return a.buffers();
+    }
+
+    bool fitsChannels(unsigned int chans) const {
+        return a.fitsChannels(chans);
+    }
+
+    void evalRow(int y, int n, unsigned int chans, double* out, double* scratch) const {
+        a.evalRow(y, n, chans, out, scratch);
+        Op op;
+        #pragma omp simd
+        for (int i = 0; i < n; ++i)
+            out[i] = op(out[i]);
+    }
+
+private:
+    A a;
+};
+
+
+/// Elementwise binary operation
+template<class L, class R, class Op>
+class Binary : public Expr<Binary<L, R, Op>> {
+public:
+    Binary(L l, R r)
+        : l{std::move(l)}, r{std::move(r)}
+    {
+        unsigned int lc = this->l.channels();
+        unsigned int rc = this->r.channels();
+        if (lc != 0 && rc != 0 && this->l.size() != this->r.size())
+            IF_THROW_EXCEPTION(size_error("The operands of an expression have different sizes: "
+                                          + to_string(this->l.size()) + " and " + to_string(this->r.size()) + "."))
+                    << errinfo_size(this->r.size());
+        if (lc != 0 && rc != 0 && lc != rc)
+            IF_THROW_EXCEPTION(image_type_error("The operands of an expression have a different number of channels: "
+                                                + std::to_string(lc) + " and " + std::to_string(rc) + "."));
+
+        // per-channel scalars must have one value or one for each channel of the images
+        unsigned int chans = channels();
+        if (chans != 0 && !fitsChannels(chans))
+            IF_THROW_EXCEPTION(size_error("A per-channel scalar in an expression does not fit to the "
+                                          + std::to_string(chans) + " channels of the images. It must have 1 or "
+                                          + std::to_string(chans) + " values."));
+    }
+
+    Size size() const {
+        return l.channels() != 0 ? l.size() : r.size();
+    }
+
+    unsigned int channels() const {
+        return l.channels() != 0 ? l.channels() : r.channels();
+    }
+
+    unsigned int buffers() const {
+        // the left operand is evaluated into out, then the right operand into the first buffer
+        return std::max(l.buffers(), 1 + r.buffers());
+    }
+
+    bool fitsChannels(unsigned int chans) const {
+        return l.fitsChannels(chans) && r.fitsChannels(chans);
+    }
+
+    void evalRow(int y, int n, unsigned int chans, double* out, double* scratch) const {
+        l.evalRow(y, n, chans, out, scratch);
+        r.evalRow(y, n, chans, scratch, scratch + n);
+        Op op;
+        #pragma omp simd
+        for (int i = 0; i < n; ++i)
+            out[i] = op(out[i], scratch[i]);
+    }
+
+private:
+    L l;
+    R r;
+};
+
+
+namespace expr_impl_detail {
+
+struct Add {
+    double operator()(double a, double b) const {
+        return a + b;
+    }
+};
+
+struct Subtract {
+    double operator()(double a, double b) const {
+        return a - b;
+    }
+};
+
+struct Multiply {
+    double operator()(double a, double b) const {
+        return a * b;
+    }
+};
+
+struct Divide {
+    double operator()(double a, double b) const {
+        return b == 0 ? 0 : a / b;
+    }
+};
+
+struct AbsDiff {
+    double operator()(double a, double b) const {
+        return std::abs(a - b);
+    }
+};
+
+struct Min {
+    double operator()(double a, double b) const {
+        return std::min(a, b);
+    }
+};
+
+struct Max {
+    double operator()(double a, double b) const {
+        return std::max(a, b);
+    }
+};
+
+struct Abs {
+    double operator()(double a) const {
+        return std::abs(a);
+    }
+};
+
+
+inline Constant wrap(double val) {
+    return Constant{val};
+}
+
+inline Constant wrap(std::vector<double> const& vals) {
+    return Constant{vals};
+}
+
+template<class E>
+E const& wrap(Expr<E> const& e) {
+    return e.derived();
+}
+
+template<class A, class B>
+using enable_if_any_expr = std::enable_if_t<is_expr_v<A> || is_expr_v<B>, int>;
+
+template<class Op, class A, class B>
+auto makeBinary(A const& a, B const& b) {
+    using L = std::decay_t<decltype(wrap(a))>;
+    using R = std::decay_t<decltype(wrap(b))>;
+    return Binary<L, R, Op>{wrap(a), wrap(b)};
+}
+
+
+template<typename T>
+void writeRow(double const* row, int n, unsigned int chans, T* dst, uint8_t const* mask, unsigned int maskChans) {
+    if (!mask) {
+        #pragma omp simd
+        for (int i = 0; i < n; ++i)
+            dst[i] = cv::saturate_cast<T>(row[i]);
+        return;
+    }
+
+    for (int i = 0; i < n; ++i)
+        if (mask[maskChans == 1 ? i / chans : i])
+            dst[i] = cv::saturate_cast<T>(row[i]);
+}
+
+} /* namespace expr_impl_detail */
+
+
+/**
+ * @brief Use an image as operand of an expression
+ *
+ * @param i is the image. It is only referenced, so it must be alive until the expression is
+ * evaluated.
+ *
+ * @return image operand.
+ */
+inline Ref lazy(ConstImage const& i) {
+    return Ref{i};
+}
+
+
+/// Elementwise sum of two operands, one must be an expression
+template<class A, class B, expr_impl_detail::enable_if_any_expr<A, B> = 0>
+auto operator+(A const& a, B const& b) {
+    return expr_impl_detail::makeBinary<expr_impl_detail::Add>(a, b);
+}
+
+/// Elementwise difference of two operands, one must be an expression
+template<class A, class B, expr_impl_detail::enable_if_any_expr<A, B> = 0>
+auto operator-(A const& a, B const& b) {
+    return expr_impl_detail::makeBinary<expr_impl_detail::Subtract>(a, b);
+}
+
+/// Elementwise product of two operands, one must be an expression
+template<class A, class B, expr_impl_detail::enable_if_any_expr<A, B> = 0>
+auto operator*(A const& a, B const& b) {
+    return expr_impl_detail::makeBinary<expr_impl_detail::Multiply>(a, b);
+}
+
+/// Elementwise quotient of two operands, one must be an expression. Division by zero gives 0.
+template<class A, class B, expr_impl_detail::enable_if_any_expr<A, B> = 0>
+auto operator/(A const& a, B const& b) {
+    return expr_impl_detail::makeBinary<expr_impl_detail::Divide>(a, b);
+}
+
+/// Elementwise absolute difference of two operands, one must be an expression
+template<class A, class B, expr_impl_detail::enable_if_any_expr<A, B> = 0>
+auto absdiff(A const& a, B const& b) {
+    return expr_impl_detail::makeBinary<expr_impl_detail::AbsDiff>(a, b);
+}
+
+/// Elementwise minimum of two operands, one must be an expression
+template<class A, class B, expr_impl_detail::enable_if_any_expr<A, B> = 0>
+auto min(A const& a, B const& b) {
+    return expr_impl_detail::makeBinary<expr_impl_detail::Min>(a, b);
+}
+
+/// Elementwise maximum of two operands, one must be an expression
+template<class A, class B, expr_impl_detail::enable_if_any_expr<A, B> = 0>
+auto max(A const& a, B const& b) {
+    return expr_impl_detail::makeBinary<expr_impl_detail::Max>(a, b);
+}
+
+/// Elementwise absolute value of an expression
+template<class E>
+auto abs(Expr<E> const& e) {
+    return Unary<E, expr_impl_detail::Abs>{e.derived()};
+}
+
+
+template<class E>
+void Expr<E>::evalInto(Image& dst, ConstImage const& mask) const {
+    E const& e = derived();
+    unsigned int chans = e.channels();
+    if (chans == 0)
+        IF_THROW_EXCEPTION(logic_error("An expression without any image cannot be evaluated."));
+
+    if (dst.size() != e.size())
+        IF_THROW_EXCEPTION(size_error("The destination image has a different size (" + to_string(dst.size())
+                                      + ") than the expression (" + to_string(e.size()) + ")."))
+                << errinfo_size(dst.size());
+    if (dst.channels() != chans)
+        IF_THROW_EXCEPTION(image_type_error("The destination image has " + std::to_string(dst.channels())
+                                            + " channels, but the expression has " + std::to_string(chans) + "."))
+                << errinfo_image_type(dst.type());
+
+    unsigned int maskChans = mask.empty() ? 0 : mask.channels();
+    if (maskChans > 0 && mask.size() != e.size())
+        IF_THROW_EXCEPTION(size_error("The mask has a different size (" + to_string(mask.size())
+                                      + ") than the expression (" + to_string(e.size()) + ")."))
+                << errinfo_size(mask.size());
+    if (maskChans > 0 && (mask.basetype() != Type::uint8 || (maskChans != 1 && maskChans != chans)))
+        IF_THROW_EXCEPTION(image_type_error("The mask must be of base type uint8 and have one channel or " + std::to_string(chans)
+                                            + " channels, but it has type " + to_string(mask.type()) + "."))
+                << errinfo_image_type(mask.type());
+
+    int h = e.size().height;
+    int n = e.size().width * chans;
+    unsigned int nBuffers = e.buffers();
+    #pragma omp parallel
+    {
+        std::vector<double> row(n);
+        std::vector<double> scratch(static_cast<std::size_t>(nBuffers) * n);
+
+        #pragma omp for schedule(static)
+        for (int y = 0; y < h; ++y) {
+            e.evalRow(y, n, chans, row.data(), scratch.data());
+
+            uint8_t const* maskRow = maskChans > 0 ? mask.cvMat().ptr<uint8_t>(y) : nullptr;
+            cv::Mat& d = dst.cvMat();
+            switch (dst.basetype()) {
+            case Type::uint8:
+                expr_impl_detail::writeRow(row.data(), n, chans, d.ptr<uint8_t>(y), maskRow, maskChans);
+                break;
+            case Type::int8:
+                expr_impl_detail::writeRow(row.data(), n, chans, d.ptr<int8_t>(y), maskRow, maskChans);
+                break;
+            case Type::uint16:
+                expr_impl_detail::writeRow(row.data(), n, chans, d.ptr<uint16_t>(y), maskRow, maskChans);
+                break;
+            case Type::int16:
+                expr_impl_detail::writeRow(row.data(), n, chans, d.ptr<int16_t>(y), maskRow, maskChans);
+                break;
+            case Type::int32:
+                expr_impl_detail::writeRow(row.data(), n, chans, d.ptr<int32_t>(y), maskRow, maskChans);
+                break;
+            case Type::float32:
+                expr_impl_detail::writeRow(row.data(), n, chans, d.ptr<float>(y), maskRow, maskChans);
+                break;
+            default: // Type::float64
+                expr_impl_detail::writeRow(row.data(), n, chans, d.ptr<double>(y), maskRow, maskChans);
+            }
+        }
+    }
+}
+
+} /* namespace expr */
+} /* namespace imagefusion */
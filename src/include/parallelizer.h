@@ -15,10 +15,41 @@
 #include <cmath>
 #include <iostream>
 #include <memory>
+#include <type_traits>
+#include <utility>
 #include <Rcpp.h>
 
 namespace imagefusion {
 
+/**
+ * @brief Implementation details of the Parallelizer -- not to be used by library users
+ */
+namespace parallelizer_impl_detail {
+
+/**
+ * @brief Check whether a DataFusor can share a pair context
+ *
+ * A DataFusor, which has the methods
+ * @code
+ * void preparePairContext(ConstImage const& validMask);
+ * std::shared_ptr<SomeContext const> const& pairContext() const;
+ * void pairContext(std::shared_ptr<SomeContext const> ctx);
+ * @endcode
+ * can precompute everything that only depends on the input pairs once and share it with other
+ * instances, like StarfmFusor and EstarfmFusor. The Parallelizer uses this to prepare the context
+ * once before the threads start and hands it to all of them.
+ */
+template<class Alg, class = void>
+struct has_pair_context : std::false_type { };
+
+template<class Alg>
+struct has_pair_context<Alg, std::void_t<decltype(std::declval<Alg&>().preparePairContext(std::declval<ConstImage const&>())),
+                                         decltype(std::declval<Alg&>().pairContext(std::declval<Alg const&>().pairContext()))>>
+    : std::true_type { };
+
+} /* namespace parallelizer_impl_detail */
+
+
 
 /**
  * @brief Meta DataFusor to parallelize a DataFusor
@@ -150,15 +181,15 @@ public:
      * @brief Process options for the parallelizer and the underlying DataFusor
      * @param o are the options of type ParallelizerOptions<AlgOpt>.
      *
-     * The parallelizer options `o` are used to copy-construct DataFusor%s from the sample
-     * according to the number of threads specified in the options. Then the prediction area of `o`
-     * (not of the underlying options object) is used to determine and set the stripes for all
-     * underlying options objects as prediction area. This is visualized in the image below. These
-     * options are then given to the underlying DataFusor%s to process them.
+     * The parallelizer options `o` are used on prediction to copy-construct DataFusor%s from the
+     * sample according to the number of threads specified in the options. The prediction area of
+     * `o` (not of the underlying options object) is split up into tiles, see
+     * ParallelizerOptions::setTileSize(). For each tile the tile is set as prediction area in the
+     * underlying options object, which is then given to one of the underlying DataFusor%s to
+     * process it. With the default tile size these are horizontal stripes, like visualized in the
+     * image below, but more stripes than threads.
      *
      * @image html predarea_stripes.png
-     *
-     * @throws size_error if the prediction area is too small, i. e. width < 1 or height / threads < 1
      */
     void processOptions(Options const& o) override;
 
@@ -181,12 +212,20 @@ public:
      *
      * To predict the image at the specified date, the underlying DataFusor%s are called. But
      * before this, the output image buffer is constructed in the size of the prediction area if
-     * not already there. Then each DataFusor gets a shared copy stripe of this output image buffer
-     * cropped to the underlying DataFusor's prediction area. The DataFusor%s should use this
-     * preconstructed image to write the result into. But if they do not use it and construct a new
-     * output image buffer, the Parallelizer will merge them afterwareds. So notice, for best
-     * performance a DataFusor should check if there is an image available as result, for example
-     * like this:
+     * not already there. If the DataFusor supports a pair context (see
+     * parallelizer_impl_detail::has_pair_context), it is prepared once for the whole prediction
+     * area and shared with all DataFusor%s, so they do not compute the same data that only depends
+     * on the input pairs, like global tolerances, over and over again. Since the DataFusor%s are
+     * kept, a still valid context is also reused for the next prediction dates. So predicting
+     * several dates with the same pairs only computes the pair context once. Then the tiles are
+     * distributed dynamically to the threads, i. e. a thread
+     * fetches the next tile as soon as it has finished its previous one. Each thread has its own
+     * DataFusor, which is reused for all of its tiles. For each tile the DataFusor gets a shared
+     * copy of this output image buffer cropped to the tile, i. e. the DataFusor's prediction area.
+     * The DataFusor%s should use this preconstructed image to write the result into. But if they do
+     * not use it and construct a new output image buffer, the Parallelizer will merge them
+     * afterwareds. So notice, for best performance a DataFusor should check if there is an image
+     * available as result, for example like this:
      * @code
      * void predict(int date, ConstImage const& validMask, ConstImage const& predMask) {
      *     Rectangle predArea = options.getPredictionArea();
@@ -199,7 +238,99 @@ public:
      */
     void predict(int date, ConstImage const& validMask = {}, ConstImage const& predMask = {}) override;
 
+    // the overload with bit-packed masks unpacks them and calls the one above
+    using DataFusor::predict;
+
+
+    /**
+     * @brief Predict the image band by band and hand over each finished band
+     * @param date to predict
+     *
+     * @param handleBand is a callable like `void(ConstImage const& band, Rectangle const& area)`.
+     * It is called from the calling thread for each finished band in order from top to bottom.
+     * `area` is the location of the band in the source images, i. e. a part of the prediction
+     * area.
+     *
+     * @param validMask see predict().
+     *
+     * @param predMask see predict().
+     *
+     * This does the same as predict(), but the prediction area is split up into horizontal bands
+     * with the height set by ParallelizerOptions::setBandHeight() and the output image buffer is
+     * only as large as a band. Each band is split up into tiles and predicted in parallel like in
+     * predict(). The pair context is still prepared only once for the whole prediction area.
+     *
+     * For every band a new output image buffer is created, so `handleBand` can keep a shared copy
+     * of it, while the next band is predicted. This allows to write a band asynchronously with a
+     * BandWriter:
+     * @code
+     * BandWriter writer{"predicted.tif", predArea.size(), imgs->getAny().type(), gi};
+     * p.predictBands(date, [&] (ConstImage const& band, Rectangle const& area) {
+     *     writer.write(band, area.y - predArea.y);
+     * });
+     * writer.close();
+     * @endcode
+     * So the memory for the output is bounded by a few bands instead of the whole prediction
+     * area. The source images and the pair context (e. g. the difference images of STARFM) still
+     * cover the whole prediction area. After this, outputImage() only contains the last band.
+     */
+    template<class BandHandler>
+    void predictBands(int date, BandHandler&& handleBand, ConstImage const& validMask = {}, ConstImage const& predMask = {});
+
+
+    /**
+     * @brief Predict the image with a custom prediction call for each tile
+     *
+     * @param prepareContext is a callable like `void(Alg& fusor)`. It is only called if the
+     * DataFusor supports a pair context. Then it is called once with a DataFusor, which has the
+     * source images and the options with the whole prediction area set, and should prepare the
+     * pair context, which is then shared with all DataFusor%s.
+     *
+     * @param predictTile is a callable like `void(Alg& fusor)`. It is called for each tile with
+     * the DataFusor of the thread, which has the tile set as prediction area, and should predict
+     * it.
+     *
+     * This does the same as predict(), but allows to use other prediction methods of the
+     * DataFusor than DataFusor::predict(). Since the callables might not be instantiated for all
+     * DataFusor%s, generic lambdas should be used, e. g. for STARFM with pair selection:
+     * @code
+     * p.predictWith([&] (auto& f) { f.preparePairContext(validMask, singlePairMasks); },
+     *               [&] (auto& f) { f.predictWithPairSelection(date, pairSelection, validMask, singlePairMasks); });
+     * @endcode
+     */
+    template<class PrepareContext, class PredictTile>
+    void predictWith(PrepareContext&& prepareContext, PredictTile&& predictTile);
+
+
+    /**
+     * @brief Predict the image band by band with a custom prediction call for each tile
+     *
+     * @param handleBand is a callable like `void(ConstImage const& band, Rectangle const& area)`,
+     * see predictBands().
+     *
+     * @param prepareContext is a callable like `void(Alg& fusor)`, see predictWith().
+     *
+     * @param predictTile is a callable like `void(Alg& fusor)`, see predictWith().
+     *
+     * This combines predictBands() and predictWith(), e. g. for STARFM with a separate pair mask:
+     * @code
+     * p.predictBandsWith(handleBand,
+     *                    [&] (auto& f) { f.preparePairContext(pairMask); },
+     *                    [&] (auto& f) { f.predictWithPairMask(date, pairMask, validMask); });
+     * @endcode
+     */
+    template<class BandHandler, class PrepareContext, class PredictTile>
+    void predictBandsWith(BandHandler&& handleBand, PrepareContext&& prepareContext, PredictTile&& predictTile);
+
 private:
+    Rectangle checkedPredictionArea() const;
+
+    template<class PrepareContext>
+    void prepareFusors(Rectangle const& pa, PrepareContext&& prepareContext);
+
+    template<class PredictTile>
+    void predictTiles(PredictTile&& predictTile, Rectangle const& area);
+
     ParallelizerOptions<AlgOpt> options;
     std::vector<Alg> fusors;
     Alg fusorSample;
@@ -218,7 +349,7 @@ inline ParallelizerOptions<AlgOpt> const& Parallelizer<Alg,AlgOpt>::getOptions()
 }
 
 template<class Alg, class AlgOpt>
-inline void Parallelizer<Alg,AlgOpt>::predict(int date, ConstImage const& validMask, ConstImage const& predMask) {
+inline Rectangle Parallelizer<Alg,AlgOpt>::checkedPredictionArea() const {
     if (!imgs)
         IF_THROW_EXCEPTION(not_found_error("Parallelizer's source image collection is empty. You have to give it one via srcImages."));
 
@@ -233,64 +364,148 @@ inline void Parallelizer<Alg,AlgOpt>::predict(int date, ConstImage const& validM
         pa.width  = imgs->getAny().width();
         pa.height = imgs->getAny().height();
     }
+    return pa;
+}
 
-    // get full size target image
-    if (output.size() != pa.size() || output.type() != imgs->getAny().type())
-        output = Image{pa.width, pa.height, imgs->getAny().type()}; // create a new one
-
-    // reduce number of threads if height too less
-    if ((unsigned int)pa.height < options.getNumberOfThreads())
-        options.setNumberOfThreads(pa.height);
-    unsigned int nt = options.getNumberOfThreads();
-
+template<class Alg, class AlgOpt>
+template<class PrepareContext>
+inline void Parallelizer<Alg,AlgOpt>::prepareFusors(Rectangle const& pa, PrepareContext&& prepareContext) {
     // using fusorSample allows to use classes, which are not default constructible
     fusorSample.outputImage() = Image{};
-    fusors.resize(nt, fusorSample);
+    fusors.resize(options.getNumberOfThreads(), fusorSample);
 
-    AlgOpt ao = options.getAlgOptions();
-    if (ao.getPredictionArea().x != 0 || ao.getPredictionArea().y != 0 || ao.getPredictionArea().width != 0 || ao.getPredictionArea().height != 0)
+    AlgOpt const& algOpt = options.getAlgOptions();
+    if (algOpt.getPredictionArea().x != 0 || algOpt.getPredictionArea().y != 0 || algOpt.getPredictionArea().width != 0 || algOpt.getPredictionArea().height != 0)
         Rcpp::Rcout << "Warning: Note that the algorithm option's prediction area is ignored and replaced by the split up ParallelizerOption's prediction area." << std::endl;
 
-    double stepsize = (double)(pa.height) / nt;
-    double curY = pa.y;
-    Rectangle fusorPredArea = pa;
-    for (unsigned int i = 0; i < fusors.size(); ++i) {
-        // set all child options to use a horizontal stripe as prediction window
-        fusorPredArea.y = static_cast<int>(std::lround(curY));
-        curY += stepsize;
-        fusorPredArea.height = static_cast<int>(std::lround(curY)) - fusorPredArea.y;
-        ao.setPredictionArea(fusorPredArea);
-        fusors.at(i).processOptions(ao);
+    // compute the data that only depends on the input pairs once and share it with all fusors
+    if constexpr (parallelizer_impl_detail::has_pair_context<Alg>::value) {
+        Alg& first = fusors.front();
+        AlgOpt ao = algOpt;
+        ao.setPredictionArea(pa);
+        first.srcImages(imgs);
+        first.processOptions(ao);
+        prepareContext(first);
+        for (Alg& f : fusors)
+            f.pairContext(first.pairContext());
     }
+}
 
+template<class Alg, class AlgOpt>
+template<class PredictTile>
+inline void Parallelizer<Alg,AlgOpt>::predictTiles(PredictTile&& predictTile, Rectangle const& area) {
+    // split up area into tiles, by default full width stripes, about four per thread
+    unsigned int nt = options.getNumberOfThreads();
+    Size tileSize = options.getTileSize();
+    if (tileSize.width == 0 || tileSize.width > area.width)
+        tileSize.width = area.width;
+    if (tileSize.height == 0)
+        tileSize.height = static_cast<int>(std::ceil(area.height / (4.0 * nt)));
+    tileSize.height = std::max(1, std::min(tileSize.height, area.height));
+
+    std::vector<Rectangle> tiles;
+    for (int y = area.y; y < area.y + area.height; y += tileSize.height)
+        for (int x = area.x; x < area.x + area.width; x += tileSize.width)
+            tiles.emplace_back(x, y,
+                               std::min(tileSize.width,  area.x + area.width  - x),
+                               std::min(tileSize.height, area.y + area.height - y));
+
+    // reduce number of threads if there are too less tiles
+    if (tiles.size() < nt)
+        nt = tiles.size();
+
+    AlgOpt const& algOpt = options.getAlgOptions();
     ThreadExceptionHelper ex;
-    #pragma omp parallel for num_threads(fusors.size())
-    for (unsigned int i = 0; i < fusors.size(); ++i) {
-        // give fusor algorithm access to the source images and the (yet full sized) target image
-        fusors.at(i).srcImages(imgs);
-
-        // crop the target image to the individual prediction area, so the algorithm does not need to create an image
-        Rectangle roi = fusors.at(i).getOptions().getPredictionArea();
-        roi.x = 0;
-        roi.y -= pa.y;
-        Image outputPart{output.sharedCopy(roi)};
-        fusors.at(i).outputImage() = Image{outputPart.sharedCopy()};
-
-        // let them work and catch exceptions to escort the last one out of the parallel section
-        ex.run([&]{
-            fusors.at(i).predict(date, validMask, predMask);
-        });
-
-        // check if the fusors used the available cropped image and if so continue
-        // if they created an own image each, merge them to the big image, which is already available
-        Image& out = fusors.at(i).outputImage();
-        if (!out.isSharedWith(output))
-            outputPart.copyValuesFrom(out);
+    #pragma omp parallel num_threads(nt)
+    {
+        // each thread reuses its own fusor for all of its tiles
+        Alg& fusor = fusors.at(omp_get_thread_num());
+        AlgOpt ao = algOpt;
+
+        // give fusor algorithm access to the source images
+        fusor.srcImages(imgs);
+
+        #pragma omp for schedule(dynamic, 1)
+        for (unsigned int i = 0; i < tiles.size(); ++i) {
+            // crop the target image to the tile, so the algorithm does not need to create an image
+            Rectangle roi = tiles[i];
+            roi.x -= area.x;
+            roi.y -= area.y;
+            Image outputPart{output.sharedCopy(roi)};
+            fusor.outputImage() = Image{outputPart.sharedCopy()};
+
+            // let them work and catch exceptions to escort the last one out of the parallel section
+            ex.run([&]{
+                // set the tile as prediction area
+                ao.setPredictionArea(tiles[i]);
+                fusor.processOptions(ao);
+                predictTile(fusor);
+            });
+
+            // check if the fusor used the available cropped image and if so continue
+            // if it created an own image, merge it to the big image, which is already available
+            Image& out = fusor.outputImage();
+            if (!out.isSharedWith(output))
+                outputPart.copyValuesFrom(out);
+        }
     }
 
     // if ex caught an exception, rethrow it
     ex.rethrow();
 }
 
+template<class Alg, class AlgOpt>
+inline void Parallelizer<Alg,AlgOpt>::predict(int date, ConstImage const& validMask, ConstImage const& predMask) {
+    Rectangle pa = checkedPredictionArea();
+
+    // get full size target image
+    if (output.size() != pa.size() || output.type() != imgs->getAny().type())
+        output = Image{pa.width, pa.height, imgs->getAny().type()}; // create a new one
+
+    prepareFusors(pa, [&] (auto& f) { f.preparePairContext(validMask); });
+    predictTiles([&] (Alg& f) { f.predict(date, validMask, predMask); }, pa);
+}
+
+template<class Alg, class AlgOpt>
+template<class BandHandler>
+inline void Parallelizer<Alg,AlgOpt>::predictBands(int date, BandHandler&& handleBand, ConstImage const& validMask, ConstImage const& predMask) {
+    predictBandsWith(std::forward<BandHandler>(handleBand),
+                     [&] (auto& f) { f.preparePairContext(validMask); },
+                     [&] (Alg& f) { f.predict(date, validMask, predMask); });
+}
+
+template<class Alg, class AlgOpt>
+template<class BandHandler, class PrepareContext, class PredictTile>
+inline void Parallelizer<Alg,AlgOpt>::predictBandsWith(BandHandler&& handleBand, PrepareContext&& prepareContext, PredictTile&& predictTile) {
+    Rectangle pa = checkedPredictionArea();
+    prepareFusors(pa, prepareContext);
+
+    int bandHeight = options.getBandHeight();
+    if (bandHeight == 0 || bandHeight > pa.height)
+        bandHeight = pa.height;
+
+    for (int y = pa.y; y < pa.y + pa.height; y += bandHeight) {
+        Rectangle band{pa.x, y, pa.width, std::min(bandHeight, pa.y + pa.height - y)};
+
+        // a new buffer for each band, since the handler might still use the previous one
+        output = Image{band.width, band.height, imgs->getAny().type()};
+        predictTiles(predictTile, band);
+        handleBand(output.constSharedCopy(), band);
+    }
+}
+
+template<class Alg, class AlgOpt>
+template<class PrepareContext, class PredictTile>
+inline void Parallelizer<Alg,AlgOpt>::predictWith(PrepareContext&& prepareContext, PredictTile&& predictTile) {
+    Rectangle pa = checkedPredictionArea();
+
+    // get full size target image
+    if (output.size() != pa.size() || output.type() != imgs->getAny().type())
+        output = Image{pa.width, pa.height, imgs->getAny().type()}; // create a new one
+
+    prepareFusors(pa, prepareContext);
+    predictTiles(predictTile, pa);
+}
+
 
 } /* namespace imagefusion */
@@ -13,8 +13,8 @@ namespace imagefusion {
 /**
  * @brief Options for the Parallelizer meta DataFusor
  *
- * The ParallelizerOptions add to the inherited prediction area the number of threads and nested
- * options for the underlying DataFusor algorithm.
+ * The ParallelizerOptions add to the inherited prediction area the number of threads, the tile
+ * size, the band height and nested options for the underlying DataFusor algorithm.
  *
  * Note that although the nested options also have a prediction area like every Options sub class,
  * these are ignored and only the prediction area of the ParallelizerOptions are used. However, the
@@ -45,6 +45,60 @@ public:
     void setNumberOfThreads(unsigned int num);
 
 
+    /**
+     * @brief Get the tile size
+     * @return tile size as set by setTileSize(). Zero values mean automatic.
+     */
+    Size getTileSize() const;
+
+
+    /**
+     * @brief Set the size of the tiles the prediction area is split into
+     * @param s is the tile size. A width of 0 means the full width of the prediction area and a
+     * height of 0 means a height, which gives about four tiles per thread.
+     *
+     * The Parallelizer splits up the prediction area into tiles of this size (tiles at the right
+     * and bottom border can be smaller) and the threads fetch the next tile to predict as soon as
+     * they finish their last one. So the load is balanced, even if some parts of the image, e. g.
+     * with clouds or water, are skipped due to the masks and are therefore very fast.
+     *
+     * Smaller tiles give a better load balance, but note that each tile is predicted separately by
+     * the underlying DataFusor. So everything that the DataFusor does for a whole prediction area
+     * is repeated for each tile. For window-based algorithms the sample area of a tile includes
+     * the half window around it, which is also read for each tile.
+     *
+     * By default (on construction) this is set to 0 x 0, i. e. full width stripes with about four
+     * stripes per thread.
+     *
+     * @throws invalid_argument_error if the width or height is negative.
+     */
+    void setTileSize(Size s);
+
+
+    /**
+     * @brief Get the band height
+     * @return band height as set by setBandHeight(). Zero means the full prediction area.
+     */
+    int getBandHeight() const;
+
+
+    /**
+     * @brief Set the height of the bands for Parallelizer::predictBands()
+     * @param h is the number of rows of a band. 0 means the full height of the prediction area.
+     *
+     * Parallelizer::predictBands() predicts the prediction area in horizontal bands of this height
+     * (the last band can be smaller) and hands each finished band over, e. g. to a BandWriter. The
+     * tiles (see setTileSize()) are then distributed band by band, with a default tile height
+     * that gives about four tiles per thread in each band. So the band height should be large
+     * compared to the number of threads. Parallelizer::predict() ignores the band height.
+     *
+     * By default (on construction) this is set to 0.
+     *
+     * @throws invalid_argument_error if the height is negative.
+     */
+    void setBandHeight(int h);
+
+
     /**
      * @brief Get the nested DataFusor algorithm options object
      * @return nested options
@@ -56,13 +110,15 @@ public:
      * @brief Set the nested DataFusor algorithm options
      * @param o are the nested options of the algorithm.
      *
-     * When processing the options in the Parallelizer, the prediction area is set to a horizontal
-     * stripe according to the DataFusor%s thread number. The remaining options stay as set in `o`.
+     * When predicting with the Parallelizer, the prediction area is set to the tile that is
+     * currently predicted. The remaining options stay as set in `o`.
      */
     void setAlgOptions(AlgOpt const& o);
 
 private:
     unsigned int numberThreads = omp_get_num_procs();
+    Size tileSize{0, 0};
+    int bandHeight = 0;
     AlgOpt algOpt;
 };
 
@@ -81,6 +137,35 @@ inline void ParallelizerOptions<AlgOpt>::setNumberOfThreads(unsigned int num) {
 }
 
 
+template<class AlgOpt>
+inline Size ParallelizerOptions<AlgOpt>::getTileSize() const {
+    return tileSize;
+}
+
+
+template<class AlgOpt>
+inline void ParallelizerOptions<AlgOpt>::setTileSize(Size s) {
+    if (s.width < 0 || s.height < 0)
+        IF_THROW_EXCEPTION(invalid_argument_error("The tile size must not be negative. You chose " + to_string(s) + "."))
+                << errinfo_size(s);
+    tileSize = s;
+}
+
+
+template<class AlgOpt>
+inline int ParallelizerOptions<AlgOpt>::getBandHeight() const {
+    return bandHeight;
+}
+
+
+template<class AlgOpt>
+inline void ParallelizerOptions<AlgOpt>::setBandHeight(int h) {
+    if (h < 0)
+        IF_THROW_EXCEPTION(invalid_argument_error("The band height must not be negative. You chose " + std::to_string(h) + "."));
+    bandHeight = h;
+}
+
+
 template<class AlgOpt>
 inline AlgOpt const& ParallelizerOptions<AlgOpt>::getAlgOptions() const {
     return algOpt;
@@ -114,6 +114,9 @@ public:
      */
     void predict(int date, ConstImage const& validMask = {}, ConstImage const& predMask = {}) override;
 
+    // the overload with bit-packed masks unpacks them and calls the one above
+    using DataFusor::predict;
+
 
     /**
      * @brief Get the MultiResImages collection from the real DataFusor
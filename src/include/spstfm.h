@@ -11,7 +11,14 @@
     #include "parallelizer.h"
 #endif /* _OPENMP */
 
-#include <armadillo>
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace imagefusion {
 
@@ -1451,6 +1458,82 @@ protected:
  */
 namespace spstfm_impl_detail {
 
+/**
+ * @brief Batched sparse coding with the GPSR algorithm for a fixed dictionary
+ *
+ * Finding sparse representation coefficients is the expensive part of SPSTFM, both in training
+ * and in reconstruction. There are always many samples that are coded with respect to the same
+ * dictionary. So a SparseCoder precomputes everything that depends only on the dictionary A once:
+ * the Gram matrix \f$ G = A^\top A \f$ and the transposed dictionary. Then for each sample y only
+ * \f$ A^\top y \f$ is required, which is computed for all samples with a single matrix product in
+ * solve().
+ *
+ * The GPSR iterations (see gpsr()) mainly need the gradient \f$ A^\top A \, x - A^\top y \f$.
+ * With the Gram matrix it is updated incrementally with the rows of G that belong to the non-zero
+ * elements of the search direction, which is usually sparse. So an iteration costs much less than
+ * two dense products with A.
+ *
+ * The samples are coded in parallel, if OpenMP is available. A SparseCoder is immutable after
+ * construction, so it can be shared between threads.
+ */
+class SparseCoder {
+public:
+    /**
+     * @brief Precompute the Gram matrix for a dictionary
+     *
+     * @param dict is the dictionary with one atom per column. It must have the element type
+     * `CV_64FC1`.
+     *
+     * @param opt are the options for the GPSR algorithm.
+     */
+    SparseCoder(cv::Mat const& dict, SpstfmOptions::GPSROptions const& opt);
+
+    /**
+     * @brief Find the sparse representation coefficients of many samples
+     *
+     * @param samples are the samples with one sample per column. They must have the same number
+     * of rows as the dictionary and the element type `CV_64FC1`.
+     *
+     * @param taus_out can be a pointer to a vector, which receives the tau value used for each
+     * sample, see gpsr().
+     *
+     * @return the coefficients with one column per sample and one row per atom.
+     */
+    cv::Mat solve(cv::Mat const& samples, std::vector<double>* taus_out = nullptr) const;
+
+    /**
+     * @brief Find the sparse representation coefficients of a single sample
+     *
+     * @param y is a column vector with the sample.
+     *
+     * @param x is the output for the coefficients. It must have space for atoms() elements.
+     *
+     * @param tau_out can be a pointer to a double where the tau will be written to.
+     *
+     * This does not parallelize itself and is meant to be called from parallel loops, like in
+     * DictTrainer::reconstructPatchRow().
+     */
+    void solveOne(cv::Mat const& y, double* x, double* tau_out = nullptr) const;
+
+    /// Number of atoms of the dictionary
+    int atoms() const {
+        return G.rows;
+    }
+
+    /// Dimension of the samples, i. e. the number of rows of the dictionary
+    int dim() const {
+        return At.cols;
+    }
+
+private:
+    void solveImpl(double const* y, double const* Aty, double* x, double* tau_out) const;
+
+    cv::Mat At; // transposed dictionary, atoms x dim
+    cv::Mat G;  // Gram matrix, atoms x atoms
+    SpstfmOptions::GPSROptions opt;
+};
+
+
 /**
  * @brief Trains and holds dictionaries and reconstructs from them
  *
@@ -1487,9 +1570,9 @@ struct DictTrainer {
      *
      * It saves one concatenated dictionary matrix for each channel. A concatenated matrix consists
      * of the high resolution dictionary in the head rows and the corresponding low resolution
-     * dictionary in the tail rows.
+     * dictionary in the tail rows. The matrices have the element type `CV_64FC1`.
      */
-    std::vector<arma::mat> dictsConcat;
+    std::vector<cv::Mat> dictsConcat;
 //    std::vector<unsigned int> trainedAtoms;
 
 
@@ -1499,16 +1582,17 @@ struct DictTrainer {
      *
      * This is set in initWeights() and used in reconstructPatchRow(), which gets called from
      * reconstructImage(). If the weights should be different for each channel, this has to be
-     * overwritten right before calling reconstructImage().
+     * overwritten right before calling reconstructImage(). It is a `CV_64FC1` matrix with one
+     * element per patch.
      */
-    arma::mat weights1;
+    cv::Mat weights1;
 
     /**
      * @brief Temporary storage for weights from date 3
      *
      * \copydetails weights1
      */
-    arma::mat weights3;
+    cv::Mat weights3;
 
 
     // normalization values
@@ -1610,14 +1694,14 @@ struct DictTrainer {
      * @return training samples and validation samples. Each as concatenated matrix with the high
      * resolution part in the head rows and the low resolution part in the tail rows.
      */
-    std::pair<arma::mat, arma::mat> getSamples(ConstImage const& highDiff, ConstImage const& lowDiff, Rectangle sampleArea, unsigned int channel) const;
+    std::pair<cv::Mat, cv::Mat> getSamples(ConstImage const& highDiff, ConstImage const& lowDiff, Rectangle sampleArea, unsigned int channel) const;
 
     /**
      * @brief Initialize the dictionaries from training samples
      * @param samplesConcat are the training samples from getSamples()
      * @param channel to initialize the dicitonary
      */
-    void initDictsFromSamples(arma::mat const& samplesConcat, unsigned int channel);
+    void initDictsFromSamples(cv::Mat const& samplesConcat, unsigned int channel);
 
     /**
      * @brief Train the dictionaries
@@ -1627,9 +1711,10 @@ struct DictTrainer {
      *
      * The training of the dictionaries is the main contribution of the SPSTFM. It includes finding
      * sparse coefficients with the GPSR algorithm and improving the dictionary with the K-SVD
-     * algorithm.
+     * algorithm. The sparse coefficients of all samples are found in parallel by a SparseCoder,
+     * which is made once per training iteration for the current dictionary.
      */
-    void train(arma::mat& samplesConcat, arma::mat& validationSamplesConcat, unsigned int channel); // Algorithm 1
+    void train(cv::Mat& samplesConcat, cv::Mat& validationSamplesConcat, unsigned int channel); // Algorithm 1
 
     // reconstruct patch-wise to save memory
     /**
@@ -1649,16 +1734,21 @@ struct DictTrainer {
      *
      * @param channel to reconstruct.
      *
+     * @param coder is the SparseCoder for the low resolution dictionary of `channel`. It is made
+     * once in reconstructImage() and shared by all patch rows.
+     *
      * This will sample difference patches from dates 1 and 3 to date 2 from the low resolution
      * image the source images, find sparse representation coefficients with respect to the trained
      * dictionary pair and use the corresponding high resolution representation to add to the high
      * resolution patches from dates 1 and 3, respectively. Invalid values will be replaced with
      * `fillL21` or `fillL23` before finding sparse coefficients to minimize their influence.
-     * Normalization is applied inbetween according to the options.
+     * Normalization is applied inbetween according to the options. The patches of the row are
+     * reconstructed in parallel, if OpenMP is available.
      *
-     * @return one row of patches.
+     * @return one row of patches. Each patch is a `patchSize` x `patchSize` matrix of type
+     * `CV_64FC1`.
      */
-    std::vector<arma::mat> reconstructPatchRow(ConstImage const& high1, ConstImage const& high3, ConstImage const& low1, ConstImage const& low2, ConstImage const& low3, double fillL21, double fillL23, unsigned int pyi, imagefusion::Rectangle sampleArea, unsigned int channel) const;
+    std::vector<cv::Mat> reconstructPatchRow(ConstImage const& high1, ConstImage const& high3, ConstImage const& low1, ConstImage const& low2, ConstImage const& low3, double fillL21, double fillL23, unsigned int pyi, imagefusion::Rectangle sampleArea, unsigned int channel, SparseCoder const& coder) const;
 
     /**
      * @brief Average and output one row of patches
@@ -1692,7 +1782,7 @@ struct DictTrainer {
      * The case `pyi == npy - 1` is an exception, since there the lower border is also averaged.
      * Note, the averaged region will be modified in the `bottomPatches`
      */
-    void outputAveragedPatchRow(std::vector<arma::mat> const& topPatches, std::vector<arma::mat>& bottomPatches, unsigned int pyi, Rectangle crop, unsigned int npx, unsigned int npy, unsigned int channel);
+    void outputAveragedPatchRow(std::vector<cv::Mat> const& topPatches, std::vector<cv::Mat>& bottomPatches, unsigned int pyi, Rectangle crop, unsigned int npx, unsigned int npy, unsigned int channel);
 
     /**
      * @brief Reconstruct the image from the source images and the trained dictionary pair
@@ -1786,8 +1876,8 @@ struct DictTrainer {
  * results. However, the default options should give good results.
  *
  * From the code perspective, please note that Parallelizer<SpstfmFusor> will not work and give a
- * compile error. The parallelization of SpstfmFusor is done on a micro level (matrix operations).
- * This requires to use an appropriate BLAS library as OpenBLAS, though.
+ * compile error. SpstfmFusor parallelizes itself with OpenMP where it matters: the sparse coding
+ * of the samples, the K-SVD atom updates (in offline mode) and the reconstruction of the patches.
  */
 class SpstfmFusor : public DataFusor {
 public:
@@ -1839,6 +1929,9 @@ public:
      */
     void predict(int date2, ConstImage const& validMask = {}, ConstImage const& predMask = {}) override;
 
+    // the overload with bit-packed masks unpacks them and calls the one above
+    using DataFusor::predict;
+
     /**
      * @brief Train the dictionary-pair only, without reconstructing afterwards
      *
@@ -1854,7 +1947,7 @@ public:
      *
      * This will only perform the training of the dictionary using the difference of the input
      * image pair. Then, the dictionary can be saved to a file with getDictionary() and
-     * [save()](http://arma.sourceforge.net/docs.html#save_load_mat) or used for reconstruction
+     * `cv::FileStorage` or used for reconstruction
      * with predict() combined with the option SpstfmOptions::ExistingDictionaryHandling::use in
      * SpstfmOptions::setDictionaryReuse() to avoid clearing or improving the dictionary.
      *
@@ -1875,15 +1968,15 @@ public:
      * resolution part, use the heading or trailing half, of the matrix, or use
      * spstfm_impl_detail::highMatView() or spstfm_impl_detail::lowMatView().
      *
-     * To save the dictionary to a file, just use
-     * [arma::save()](http://arma.sourceforge.net/docs.html#save_load_mat), like
+     * The dictionary is a `CV_64FC1` matrix. To save it to a file, just use `cv::FileStorage`, like
      * @code
-     * df.getDictionary().save("trained_dict");
+     * cv::FileStorage fs{"trained_dict.yml", cv::FileStorage::WRITE};
+     * fs << "dictionary" << df.getDictionary();
      * @endcode
      *
      * @return the dictionary in concatenated format.
      */
-    arma::mat const& getDictionary(unsigned int channel = 0) const {
+    cv::Mat const& getDictionary(unsigned int channel = 0) const {
         return t.dictsConcat.at(channel);
     }
 
@@ -1900,13 +1993,14 @@ public:
      * This overwrites a maybe existing dictionary by the specified one. A common use case is to
      * load a pre-trained dictionary from a file, like
      * @code
-     * arma::mat dict;
-     * dict.load("trained_dict");
+     * cv::Mat dict;
+     * cv::FileStorage fs{"trained_dict.yml", cv::FileStorage::READ};
+     * fs["dictionary"] >> dict;
      * df.setDictionary(dict);
      * @endcode
-     * See [arma::load()](http://arma.sourceforge.net/docs.html#save_load_mat).
+     * The dictionary must have the element type `CV_64FC1`.
      */
-    void setDictionary(arma::mat dict, unsigned int channel = 0) {
+    void setDictionary(cv::Mat dict, unsigned int channel = 0) {
         if (t.dictsConcat.size() < channel + 1)
             t.dictsConcat.resize(channel + 1);
         t.dictsConcat.at(channel) = std::move(dict);
@@ -1964,50 +2058,174 @@ struct specialization_not_allowed : std::false_type
  *
  * Since parallelization on a macro level would require to parallelize specific parts explicitly
  * (mainly for loops for GPSR algorithms) and let others run in serial the implementation would be
- * different to what Parallelizer automatically does. However, SpstfmFusor itself should already
- * run in parallel on a micro level. This is because armadillo is used for matrix operations and
- * armadillo uses BLAS and choosing open BLAS makes the matrix operations run in parallel.
- * Therefore there is no need in additional parallelization.
+ * different to what Parallelizer automatically does. However, SpstfmFusor itself already runs in
+ * parallel: the sparse coding, the K-SVD atom updates and the patch reconstruction are parallel
+ * loops. Therefore there is no need in additional parallelization.
  */
 template <class AlgOpt>
 class Parallelizer<SpstfmFusor, AlgOpt> {
-    static_assert(spstfm_impl_detail::specialization_not_allowed<AlgOpt>::value, "Parallelizer not supported for SpstfmFusor. Armadillo and underlying BLAS library should make the code run in parallel (when using OpenBLAS) automatically.");
+    static_assert(spstfm_impl_detail::specialization_not_allowed<AlgOpt>::value, "Parallelizer not supported for SpstfmFusor. SpstfmFusor runs in parallel with OpenMP by itself.");
 };
 #endif /* _OPENMP */
 /// \endcond
 
 
+/**
+ * @brief Persistent cache of trained SPSTFM dictionaries
+ *
+ * Training the dictionary is by far the most expensive part of SPSTFM, but it only depends on the
+ * input pair and the training options, not on the prediction date. When the same pair is fused
+ * with many low resolution images in several jobs or processes, a cache directory can be used to
+ * train the dictionaries only once. Each channel dictionary is stored in its own file, which is
+ * named after the pair dates, the channel, the patch size, the dictionary size and a hash of the
+ * remaining training options, e. g.
+ * `spstfm_20160101_20160301_c0_p7_d256_0123456789abcdef.dict`.
+ *
+ * The files use a compact binary format: a small header (magic, version, size and options hash)
+ * followed by the raw `double` elements of the concatenated dictionary. Files are written to a
+ * temporary name first and then renamed, so concurrent processes never read a partially written
+ * dictionary.
+ *
+ * Usage:
+ * @code
+ * SpstfmDictionaryCache cache{"dict_cache", pairFilenames};
+ * sf.processOptions(o);
+ * if (cache.load(sf, channels)) {
+ *     o.setDictionaryReuse(SpstfmOptions::ExistingDictionaryHandling::use);
+ *     sf.processOptions(o);
+ * }
+ * sf.train(mask);
+ * cache.store(sf, channels);
+ * @endcode
+ *
+ * Note, the pair images themselves are not part of the key. Give something that identifies them,
+ * like the filenames together with their size and modification time, as `sourceId`. Everything
+ * else that influences the training (masks, for example) should go there as well.
+ */
+class SpstfmDictionaryCache {
+public:
+    /**
+     * @brief Create a cache in the specified directory
+     *
+     * @param directory is the cache directory. It will be created on the first store(), if it
+     * does not exist.
+     *
+     * @param sourceId identifies the input pair and everything else that is not part of the
+     * SpstfmOptions, but influences the training. It is folded into the options hash.
+     */
+    explicit SpstfmDictionaryCache(std::string directory, std::string sourceId = "")
+        : dir{std::move(directory)}, source{std::move(sourceId)}
+    { }
+
+    /**
+     * @brief Get the cache file path for a channel dictionary
+     *
+     * @param o are the options used for training. Only the training relevant options are used.
+     *
+     * @param channel is the image channel the dictionary belongs to.
+     *
+     * @return path of the cache file, which might not exist.
+     */
+    std::string path(SpstfmOptions const& o, unsigned int channel) const;
+
+    /**
+     * @brief Load the dictionaries of all channels into a fusor
+     *
+     * @param sf is the SpstfmFusor, which must have processed the options that will be used for
+     * training. On success its dictionaries are set.
+     *
+     * @param channels is the number of image channels.
+     *
+     * Either all channel dictionaries are loaded or none. A file with an unexpected header, size
+     * (patch dimension or dictionary size) or options hash counts as cache miss.
+     *
+     * @return true if all dictionaries have been found and loaded, false otherwise.
+     */
+    bool load(SpstfmFusor& sf, unsigned int channels) const;
+
+    /**
+     * @brief Store the trained dictionaries of all channels from a fusor
+     *
+     * @param sf is the SpstfmFusor, which has been trained.
+     *
+     * @param channels is the number of image channels.
+     *
+     * @return true if all dictionaries have been written, false otherwise.
+     */
+    bool store(SpstfmFusor const& sf, unsigned int channels) const;
+
+    /**
+     * @brief Hash of all options that influence the training and of the source id
+     *
+     * @param o are the options used for training.
+     *
+     * This does not include options that are only used for prediction, like the weighting options
+     * or the GPSR reconstruction options, and not the dictionary reuse setting. So dictionaries
+     * stay valid when only those change.
+     *
+     * @return 64 bit FNV-1a hash
+     */
+    uint64_t trainingHash(SpstfmOptions const& o) const;
+
+    /**
+     * @brief Read a dictionary in the binary cache format
+     *
+     * @param path is the file to read.
+     * @param hash is the expected options hash.
+     * @param dict receives the `CV_64FC1` dictionary on success.
+     *
+     * @return true on success, false if the file cannot be read or does not match.
+     */
+    static bool readDictionary(std::string const& path, uint64_t hash, cv::Mat& dict);
+
+    /**
+     * @brief Write a dictionary in the binary cache format
+     *
+     * @param path is the file to write.
+     * @param hash is the options hash to put into the header.
+     * @param dict is the `CV_64FC1` dictionary.
+     *
+     * @return true on success, false otherwise.
+     */
+    static bool writeDictionary(std::string const& path, uint64_t hash, cv::Mat const& dict);
+
+private:
+    std::string dir;
+    std::string source;
+};
+
+
 // More implementation details
 namespace spstfm_impl_detail {
 
 /**
- * @brief Copy a Armadillo matrix to a spcified channel of an Image
+ * @brief Copy a matrix to a spcified channel of an Image
  *
  * @tparam T is the C++ data type, like `uint8_t`, that will be used to write into the Image.
- * @tparam mattype arma matrix type with double elements as arma::mat or some submatrix view.
- * @param from is the single-channel source matrix.
+ * @param from is the single-channel source matrix of type `CV_64FC1`. It can be a submatrix.
  * @param to is the multi-channel destination image.
  * @param channel is the channel to write to.
  *
  * This copies the whole matrix `from` to the Image `to`, which might be larger. This function is
  * only called from CopyFromToFunctor and never directly.
  */
-template<typename T, typename mattype> // TODO: protect signed integer from underflow (< 0)
-inline void copy(mattype const& from, imagefusion::Image& to, unsigned int channel) {
-    const int rows = from.n_rows;
-    const int cols = from.n_cols;
+template<typename T> // TODO: protect signed integer from underflow (< 0)
+inline void copy(cv::Mat const& from, imagefusion::Image& to, unsigned int channel) {
+    const int rows = from.rows;
+    const int cols = from.cols;
     assert(rows <= to.height());
     assert(cols <= to.width());
-    for (int y = 0; y < rows; ++y)
+    for (int y = 0; y < rows; ++y) {
+        double const* src = from.ptr<double>(y);
         for (int x = 0; x < cols; ++x)
-            to.at<T>(x, y, channel) = cv::saturate_cast<T>(from(y, x));
+            to.at<T>(x, y, channel) = cv::saturate_cast<T>(src[x]);
+    }
 }
 
 /**
- * @brief Copy a Armadillo matrix to a spcified channel of an Image
+ * @brief Copy a matrix to a spcified channel of an Image
  *
- * @tparam mattype arma matrix type with double elements as arma::mat or some submatrix view.
- * @param from is the single-channel source matrix.
+ * @param from is the single-channel source matrix of type `CV_64FC1`. It can be a submatrix.
  * @param to is the multi-channel destination image.
  * @param channel is the channel to write to.
  *
@@ -2015,9 +2233,8 @@ inline void copy(mattype const& from, imagefusion::Image& to, unsigned int chann
  * only used in DictTrainer::outputAveragedPatchRow to help to write an averaged patch into the
  * output Image.
  */
-template<typename mattype>
 struct CopyFromToFunctor {
-    mattype const& from;
+    cv::Mat const& from;
     imagefusion::Image& to;
     unsigned int channel;
 
@@ -2029,15 +2246,16 @@ struct CopyFromToFunctor {
 };
 
 /**
- * @brief Extract a patch from a source image as Armadillo matrix (column vector)
+ * @brief Extract a patch from a source image as matrix (column vector)
  *
  * @param src is the source Image from which the patch is extracted.
  * @param p0 is the top-left point of the patch to extract.
  * @param patchSize is the patch size, so `patchSize == 7` would extract a 7 by 7 patch.
  * @param channel is the channel to use from `src`.
  *
- * This samples a patch from the source image and copies the values to an armadillo matrix of
- * double type. The matrix will be a column vector of size `patchSize` · `patchSize`. The
+ * This samples a patch from the source image and copies the values to a matrix of type
+ * `CV_64FC1`. The values are stored row by row, so reshaping the result to `patchSize` rows gives
+ * the patch in image orientation. The matrix will be a column vector of size `patchSize` · `patchSize`. The
  * coordinates may be out of bounds in which case a mirror bound will be applied.
  *
  * @return patch as column vector
@@ -2049,7 +2267,7 @@ struct GetPatchFunctor {
     unsigned int channel;
 
     template<imagefusion::Type imfutype>
-    arma::mat operator()() {
+    cv::Mat operator()() {
         static_assert(getChannels(imfutype) == 1, "GetPatchFunctor can only be used as base type functor."); // full type functors have been removed anyways
         if (p0.x < -src.width()  || p0.x + (int)patchSize - 1 >= 2 * src.width()  ||
             p0.y < -src.height() || p0.y + (int)patchSize - 1 >= 2 * src.height()   )
@@ -2064,8 +2282,8 @@ struct GetPatchFunctor {
                     << errinfo_size(src.size());
 
         using srcbasetype = typename imagefusion::BaseType<imfutype>::base_type;
-        arma::mat dst(patchSize * patchSize, 1);
-        auto it_dst = dst.begin();
+        cv::Mat dst(patchSize * patchSize, 1, CV_64FC1);
+        double* it_dst = dst.ptr<double>();
         for (int y = p0.y; y < p0.y + (int)patchSize; ++y) {
             for (int x = p0.x; x < p0.x + (int)patchSize; ++x) {
                 // mirror coordinates if required
@@ -2090,7 +2308,7 @@ struct GetPatchFunctor {
 };
 
 /**
- * @brief Extract a patch from a source image as Armadillo matrix (column vector)
+ * @brief Extract a patch from a source image as matrix (column vector)
  *
  * @param img is the source Image from which the patch is extracted.
  * @param pxi is the patch x index (patch column).
@@ -2100,16 +2318,16 @@ struct GetPatchFunctor {
  * @param sampleArea is used to as origin for patch (0, 0).
  * @param channel is the channel to use from `src`.
  *
- * This samples a patch from the source image and copies the values to an armadillo matrix of
- * double type. The matrix will be a column vector of size `patchSize`². The coordinates may be out
+ * This samples a patch from the source image and copies the values to a matrix of type
+ * `CV_64FC1`. The matrix will be a column vector of size `patchSize`². The coordinates may be out
  * of bounds in which case a mirror bound will be applied.
  *
  * @return patch as column vector
  */
-arma::mat extractPatch(imagefusion::ConstImage const& img, int pxi, int pyi, unsigned int patchSize, unsigned int patchOverlap, imagefusion::Rectangle sampleArea, unsigned int channel = 0);
+cv::Mat extractPatch(imagefusion::ConstImage const& img, int pxi, int pyi, unsigned int patchSize, unsigned int patchOverlap, imagefusion::Rectangle sampleArea, unsigned int channel = 0);
 
 /**
- * @brief Extract a patch from the diff of two source images as Armadillo matrix (column vector)
+ * @brief Extract a patch from the diff of two source images as matrix (column vector)
  *
  * @param img1 is the first source Image
  * @param img2 is the first source Image
@@ -2120,13 +2338,13 @@ arma::mat extractPatch(imagefusion::ConstImage const& img, int pxi, int pyi, uns
  * @param sampleArea is used to as origin for patch (0, 0).
  * @param channel is the channel to use from `src`.
  *
- * This samples a patch from the `img1 - img2` and copies the values to an armadillo matrix of
- * double type. The matrix will be a column vector of size `patchSize`². The coordinates may be out
+ * This samples a patch from the `img1 - img2` and copies the values to a matrix of type
+ * `CV_64FC1`. The matrix will be a column vector of size `patchSize`². The coordinates may be out
  * of bounds in which case a mirror bound will be applied.
  *
  * @return patch as column vector
  */
-arma::mat extractPatch(imagefusion::ConstImage const& img1, imagefusion::ConstImage const& img2, int pxi, int pyi, unsigned int patchSize, unsigned int patchOverlap, imagefusion::Rectangle sampleArea, unsigned int channel = 0);
+cv::Mat extractPatch(imagefusion::ConstImage const& img1, imagefusion::ConstImage const& img2, int pxi, int pyi, unsigned int patchSize, unsigned int patchOverlap, imagefusion::Rectangle sampleArea, unsigned int channel = 0);
 
 /**
  * @brief Calculate the rectangle that is required to have an area of full patches that cover the prediction area
@@ -2189,28 +2407,43 @@ imagefusion::Rectangle calcRequiredArea(imagefusion::Rectangle predArea, unsigne
  * its parameters, giving it initial vectors to reduce the number of iterations or just decreasing
  * the number of calls to it by caching or so.
  *
- * @return the sparse representation coefficients x of `y` w.r.t. `A`.
+ * This function is a convenience wrapper for a single sample. It computes the Gram matrix of `A`
+ * for every call. To code many samples with the same dictionary, use a SparseCoder instead.
+ *
+ * @return the sparse representation coefficients x of `y` w.r.t. `A` as column vector.
  */
-arma::vec gpsr(arma::mat const& y, arma::mat const& A, imagefusion::SpstfmOptions::GPSROptions const& opt, double* tau_out = nullptr);
+cv::Mat gpsr(cv::Mat const& y, cv::Mat const& A, imagefusion::SpstfmOptions::GPSROptions const& opt, double* tau_out = nullptr);
 
 /**
  * @brief Inner iteration of the standard K-SVD algorithm
  * @param k is the column of the dictionary to update.
- * @param samples are the training samples.
- * @param dict is the concatenated dictionary, but is only used as input in block mode (online mode
- * off). Otherwise it is unused.
- * @param new_dict is the output for the updated columns and also the input in online mode.
+ *
+ * @param residual is the residual \f$ P - D \, \Lambda \f$ of the training samples P with respect
+ * to the dictionary D and the coefficients \f$ \Lambda \f$. In online mode it is updated together
+ * with the atom and its coefficients. In block mode it is the residual before any update and is
+ * not modified.
+ *
+ * @param dict is the concatenated dictionary. Only column `k` is updated. For
+ * SpstfmOptions::DictionaryNormalization::fixed the column 0 is used for scaling, so it must have
+ * been updated already for `k > 0`.
+ *
  * @param coeff are the sparse representation coefficients for the training samples. In online mode
  * these are updated, too.
+ *
  * @param useOnlineMode determines whether coefficients and dictionary gets updated while iterating
  * through all dictionary columns.
+ *
  * @param singularValueHandling specifies whether the dictionary column should be normed or not.
  * See SpstfmOptions::setDictionaryKSVDNormalization().
  *
+ * The error matrix without atom `k` is not computed from the other atoms, but from the residual by
+ * adding the contribution of atom `k` back. So the cost of an update only depends on the number of
+ * samples that use atom `k`. In block mode different `k` can be updated in parallel.
+ *
  * This should not be called by any other code than ksvd(). It is just one iteration in the
  * `for`-loop of ksvd().
  */
-void ksvd_iteration(unsigned int k, arma::mat const& samples, arma::mat const& dict,  arma::mat& new_dict, arma::mat& coeff, bool useOnlineMode, SpstfmOptions::DictionaryNormalization singularValueHandling);
+void ksvd_iteration(unsigned int k, cv::Mat& residual, cv::Mat& dict, cv::Mat& coeff, bool useOnlineMode, SpstfmOptions::DictionaryNormalization singularValueHandling);
 
 /**
  * @brief Standard K-SVD algorithm to update a concatenated dictionary
@@ -2230,32 +2463,32 @@ void ksvd_iteration(unsigned int k, arma::mat const& samples, arma::mat const& d
  * input images. In test situations with rather simple visible object structures the training is
  * very important and improves the outcome considerably.
  *
+ * In block mode (online mode off) all atoms are updated from the same coefficients and thus
+ * independent of each other. Then they are updated in parallel, if OpenMP is available. The online
+ * mode requires the atoms to be updated one after another.
+ *
  * @return the updated dictionary. Note the coefficients are also updated, when online mode is
  * selected. Usually the coefficients are not used after the dictionary update anymore, but could
  * be valueable for performance speedup in the training procedure.
  */
-arma::mat ksvd(arma::mat const& samples, arma::mat const& dict, arma::mat& coeff, bool useOnlineMode, SpstfmOptions::DictionaryNormalization singularValueHandling);
+cv::Mat ksvd(cv::Mat const& samples, cv::Mat const& dict, cv::Mat& coeff, bool useOnlineMode, SpstfmOptions::DictionaryNormalization singularValueHandling);
 
 /**
  * @brief Inner iteration of the double K-SVD algorithm
  *
  * @param k is the column of the dictionary to update.
  *
- * @param highSamples are the high resolution training samples.
- *
- * @param highDict is the high resolution dictionary, but is only used as input in block mode
- * (online mode off). Otherwise it is unused.
- *
- * @param highDictNew is the output for the updated high resolution columns and also the input in
- * online mode.
+ * @param highResidual is the residual of the high resolution training samples with respect to the
+ * high resolution dictionary and the coefficients. In online mode it is updated, in block mode it
+ * is not modified.
  *
- * @param lowSamples are the low resolution training samples.
+ * @param highDict is the high resolution dictionary. Only column `k` is updated.
  *
- * @param lowDict is the low resolution dictionary, but is only used as input in block mode (online
- * mode off). Otherwise it is unused.
+ * @param lowResidual is the residual of the low resolution training samples with respect to the
+ * low resolution dictionary and the coefficients. In online mode it is updated, in block mode it
+ * is not modified.
  *
- * @param lowDictNew is the output for the updated low resolution columns and also the input in
- * online mode.
+ * @param lowDict is the low resolution dictionary. Only column `k` is updated.
  *
  * @param coeff are the sparse representation coefficients for the training samples. In online mode
  * these are updated, too. The updated value depends on `res`.
@@ -2271,15 +2504,17 @@ arma::mat ksvd(arma::mat const& samples, arma::mat const& dict, arma::mat& coeff
  * through all dictionary columns.
  *
  * @param singularValueHandling specifies whether the dictionary column should be normed or not.
- * See SpstfmOptions::setDictionaryKSVDNormalization().
+ * See SpstfmOptions::setDictionaryKSVDNormalization(). For
+ * SpstfmOptions::DictionaryNormalization::fixed the column 0 of `highDict` is used for scaling, so
+ * it must have been updated already for `k > 0`.
  *
  * This should not be called by any other code than doubleKSVD(). It is just one iteration in the
- * `for`-loop of doubleKSVD().
+ * `for`-loop of doubleKSVD(). See ksvd_iteration() for how the residuals are used.
  */
 void doubleKSVDIteration(unsigned int k,
-                         arma::mat const& highSamples, arma::mat const& highDict, arma::mat& highDictNew,
-                         arma::mat const& lowSamples,  arma::mat const& lowDict,  arma::mat& lowDictNew,
-                         arma::mat& coeff, imagefusion::SpstfmOptions::TrainingResolution res, bool useOnlineMode, SpstfmOptions::DictionaryNormalization singularValueHandling);
+                         cv::Mat& highResidual, cv::Mat& highDict,
+                         cv::Mat& lowResidual,  cv::Mat& lowDict,
+                         cv::Mat& coeff, imagefusion::SpstfmOptions::TrainingResolution res, bool useOnlineMode, SpstfmOptions::DictionaryNormalization singularValueHandling);
 
 /**
  * @brief Double K-SVD algorithm to update a dictionary pair
@@ -2317,13 +2552,15 @@ void doubleKSVDIteration(unsigned int k,
  * input images. In test situations with rather simple visible object structures the training is
  * very important and improves the outcome considerably.
  *
+ * Like in ksvd(), the atoms are updated in parallel in block mode.
+ *
  * @return the updated dictionary. Note the coefficients are also updated, when online mode is
  * selected. Usually the coefficients are not used after the dictionary update anymore, but could
  * be valueable for performance speedup in the training procedure.
  */
-std::pair<arma::mat,arma::mat> doubleKSVD(arma::mat const& highSamples, arma::mat const& highDict,
-                                          arma::mat const& lowSamples,  arma::mat const& lowDict,
-                                          arma::mat& coeff, imagefusion::SpstfmOptions::TrainingResolution res, bool useOnlineMode, SpstfmOptions::DictionaryNormalization singularValueHandling);
+std::pair<cv::Mat,cv::Mat> doubleKSVD(cv::Mat const& highSamples, cv::Mat const& highDict,
+                                      cv::Mat const& lowSamples,  cv::Mat const& lowDict,
+                                      cv::Mat& coeff, imagefusion::SpstfmOptions::TrainingResolution res, bool useOnlineMode, SpstfmOptions::DictionaryNormalization singularValueHandling);
 
 /**
  * @brief Calculate a simple version of the objective function with a scalar tau
@@ -2342,7 +2579,7 @@ std::pair<arma::mat,arma::mat> doubleKSVD(arma::mat const& highSamples, arma::ma
  * where N is the number of samples and n is the dimension of a sample (number of elements in a
  * column).
  */
-double objective_simple(arma::mat const& samples, arma::mat const& dict, arma::mat const& coeff, double tau);
+double objective_simple(cv::Mat const& samples, cv::Mat const& dict, cv::Mat const& coeff, double tau);
 
 /**
  * @brief Calculates an improved version of the objective function with the taus corresponding to the coefficients
@@ -2363,30 +2600,28 @@ double objective_simple(arma::mat const& samples, arma::mat const& dict, arma::m
  * \, n} \f$, where N is the number of samples and n is the dimension of a sample (number of
  * elements in a column).
  */
-double objective_improved(arma::mat const& samples, arma::mat const& dict, arma::mat const& coeff, std::vector<double> const& taus);
+double objective_improved(cv::Mat const& samples, cv::Mat const& dict, cv::Mat const& coeff, std::vector<double> const& taus);
 
 /**
  * @brief Get the high resolution part of the concatenated dictionary matrix
- * @tparam mattype arma matrix type with double elements as arma::mat or some submatrix view.
  * @param m is the concatenated dictionary.
- * @return a submatrix view on the upper half of `m`.
+ * @return a matrix header on the upper half of `m`, which shares the data with `m`. Use
+ * `clone()` for an independent copy.
  * @see lowMatView()
  */
-template<typename mattype>
-inline arma::subview<double> highMatView(mattype& m) {
-    return m.rows(0, m.n_rows / 2 - 1); // head_rows
+inline cv::Mat highMatView(cv::Mat const& m) {
+    return m.rowRange(0, m.rows / 2); // head rows
 }
 
 /**
  * @brief Get the low resolution part of the concatenated dictionary matrix
- * @tparam mattype arma matrix type with double elements as arma::mat or some submatrix view.
  * @param m is the concatenated dictionary.
- * @return a submatrix view on the lower half of `m`.
+ * @return a matrix header on the lower half of `m`, which shares the data with `m`. Use
+ * `clone()` for an independent copy.
  * @see highMatView()
  */
-template<typename mattype>
-inline arma::subview<double> lowMatView(mattype& m) {
-    return m.rows(m.n_rows / 2, m.n_rows - 1); // tail_rows
+inline cv::Mat lowMatView(cv::Mat const& m) {
+    return m.rowRange(m.rows / 2, m.rows); // tail rows
 }
 
 /**
@@ -2409,7 +2644,7 @@ inline arma::subview<double> lowMatView(mattype& m) {
  * Q_{\mathrm f} \f$ are the reconstructed high resolution samples, K is the number of validation
  * samples and n is the dimension of a high (or low) resolution validation sample.
  */
-double testSetError(arma::mat const& highTestSamples, arma::mat const& lowTestSamples, arma::mat const& dictConcat, imagefusion::SpstfmOptions::GPSROptions const& gpsrOpts, double normFactorForHigh);
+double testSetError(cv::Mat const& highTestSamples, cv::Mat const& lowTestSamples, cv::Mat const& dictConcat, imagefusion::SpstfmOptions::GPSROptions const& gpsrOpts, double normFactorForHigh);
 
 
 /**
@@ -2552,7 +2787,6 @@ std::vector<size_t> mostlyInvalidPatches(imagefusion::ConstImage const& mask, do
 
 /**
  * @brief Fill a sample matrix with samples
- * @tparam mattype arma matrix type with double elements as arma::mat or some submatrix view for the samples.
  * @param diff is the difference image to sample from.
  * @param samples is the single-resolution sample matrix (half concatenated matrix, see
  * highMatView() and lowMatView()) to fill with samples. It must be initialized to the correct size
@@ -2568,19 +2802,18 @@ std::vector<size_t> mostlyInvalidPatches(imagefusion::ConstImage const& mask, do
  *
  * This is a small helper function for samples().
  */
-template<typename mattype>
-inline void initSingleSamples(imagefusion::ConstImage const& diff, mattype& samples, imagefusion::ConstImage const& mask, double fillVal, std::vector<size_t> const& patch_indices, unsigned int patchSize, unsigned int patchOverlap, imagefusion::Rectangle sampleArea, unsigned int channel) {
+inline void initSingleSamples(imagefusion::ConstImage const& diff, cv::Mat& samples, imagefusion::ConstImage const& mask, double fillVal, std::vector<size_t> const& patch_indices, unsigned int patchSize, unsigned int patchOverlap, imagefusion::Rectangle sampleArea, unsigned int channel) {
     // init samples
 
     unsigned int dist = patchSize - patchOverlap;
     unsigned int npx = (sampleArea.width  - patchOverlap) / dist;
 #ifndef NDEBUG
     unsigned int npy = (sampleArea.height - patchOverlap) / dist;
-    unsigned int nsamples = samples.n_cols;
+    unsigned int nsamples = samples.cols;
     unsigned int dim = patchSize * patchSize;
 #endif
     assert(nsamples == patch_indices.size());
-    assert(static_cast<unsigned int>(samples.n_rows) == dim);
+    assert(static_cast<unsigned int>(samples.rows) == dim);
     assert(npx * npy >= nsamples);
     unsigned int maskChannel = mask.channels() > channel ? channel : 0;
 
@@ -2588,10 +2821,10 @@ inline void initSingleSamples(imagefusion::ConstImage const& diff, mattype& samp
         size_t pi = patch_indices[sidx];
         unsigned int pyi = pi / npx;
         unsigned int pxi = pi % npx;
-        arma::mat diffPatch = extractPatch(diff, pxi, pyi, patchSize, patchOverlap, sampleArea, channel);
-        arma::mat maskPatch = extractPatch(mask, pxi, pyi, patchSize, patchOverlap, sampleArea, maskChannel);
-        diffPatch.elem(arma::find(maskPatch == 0)).fill(fillVal);
-        samples.col(sidx) = diffPatch;
+        cv::Mat diffPatch = extractPatch(diff, pxi, pyi, patchSize, patchOverlap, sampleArea, channel);
+        cv::Mat maskPatch = extractPatch(mask, pxi, pyi, patchSize, patchOverlap, sampleArea, maskChannel);
+        diffPatch.setTo(fillVal, maskPatch == 0);
+        diffPatch.copyTo(samples.col(sidx));
     }
 }
 
@@ -2619,21 +2852,21 @@ inline void initSingleSamples(imagefusion::ConstImage const& diff, mattype& samp
  * @return a concatenated sample matrix with the high resolution samples in the upper half and the
  * corresponding low resolution samples in the lower half.
  */
-arma::mat samples(imagefusion::ConstImage const& highDiff, imagefusion::ConstImage const& lowDiff, imagefusion::ConstImage const& mask, std::vector<size_t> patch_indices, double meanForHigh, double meanForLow, double normFactorForHigh, double normFactorForLow, double fillHigh, double fillLow, unsigned int patchSize, unsigned int patchOverlap, Rectangle sampleArea, unsigned int channel);
+cv::Mat samples(imagefusion::ConstImage const& highDiff, imagefusion::ConstImage const& lowDiff, imagefusion::ConstImage const& mask, std::vector<size_t> patch_indices, double meanForHigh, double meanForLow, double normFactorForHigh, double normFactorForLow, double fillHigh, double fillLow, unsigned int patchSize, unsigned int patchOverlap, Rectangle sampleArea, unsigned int channel);
 
 /**
  * @brief Debug function to draw a concatenated dictionary to an image file
  * @param dictConcat is the concatenated dictionary.
  * @param filename is the filename of the iamge file to write to.
  */
-void drawDictionary(arma::mat const& dictConcat, std::string const& filename);
+void drawDictionary(cv::Mat const& dictConcat, std::string const& filename);
 
 /**
  * @brief Debug function to draw the reconstruction weights to an image file
  * @param weights is the weights matrix.
  * @param filename is the filename of the iamge file to write to.
  */
-void drawWeights(arma::mat const& weights, std::string const& filename);
+void drawWeights(cv::Mat const& weights, std::string const& filename);
 
 } /* namespace spstfm_impl_detail */
 
@@ -83,121 +83,6 @@ Image standardize(Image i, ConstImage const& mask = {});
  */
 std::vector<int> getUniqueLandClasses(ConstImage const& clustered);
 
-struct AveragingFunctor {
-    std::vector<Image>& imgs;
-    std::vector<Image>& masks;
-    unsigned int n_imgs_window;
-    StaarchOptions::MovingAverageWindow alignment;
-    AveragingFunctor(std::vector<Image>& imgs, std::vector<Image>& masks, unsigned int n_imgs_window, StaarchOptions::MovingAverageWindow alignment)
-        : imgs{imgs}, masks{masks}, n_imgs_window{n_imgs_window}, alignment{alignment} { }
-
-    template<Type t>
-    void operator()() {
-        static_assert(getChannels(t) == 1, "This functor only accepts base type to reduce code size.");
-        //static_assert(t == Type::float32 || t == Type::float64, "This functor is only made for disturbance indices and thus requires floating point type."); // For testing we use uint8
-        using type = typename DataType<t>::base_type;
-        int w = imgs.front().width();
-        int h = imgs.front().height();
-        unsigned int nimg = imgs.size();
-        assert(imgs.front().channels() == 1 && "Disturbance Index must be single-channel");
-
-        if (alignment == StaarchOptions::MovingAverageWindow::forward || alignment == StaarchOptions::MovingAverageWindow::backward) {
-            bool forward = alignment == StaarchOptions::MovingAverageWindow::forward;
-            // use forward average, e. g. for d2 average d2, d3, d4 by using (d2 + d3 + d4) / 3 or (d2 + d4) / 2 if d3 is invalid
-            // or backward average, e. g. for d4 average d4, d3, d2 by using (d4 + d3 + d2) / 3 or (d4 + d2) / 2 if d3 is invalid
-            for (unsigned int i = 0; i < nimg; ++i) {
-                unsigned int tgt_iter = forward ? i : nimg - 1 - i;
-                for (int y = 0; y < h; ++y) {
-                    for (int x = 0; x < w; ++x) {
-                        // Evaluate whether it is faster to work vectorwise here (add masked images and sum up masks/255, then imgs/masks)
-                        double val = 0;
-                        int count = 0;
-                        for (unsigned int j = i; j < i + n_imgs_window && j < nimg; ++j) {
-                            unsigned int win_iter = forward ? j : nimg - 1 - j;
-                            if (masks.at(win_iter).empty() || masks.at(win_iter).boolAt(x, y, 0)) {
-                                val += imgs.at(win_iter).at<type>(x, y);
-                                ++count;
-                            }
-                        }
-                        if (count > 0)
-                            imgs.at(tgt_iter).at<type>(x, y) = cv::saturate_cast<type>(val / count);
-                    }
-                }
-            }
-
-            for (unsigned int i = 0; i < nimg; ++i) {
-                unsigned int tgt_iter = forward ? i : nimg - 1 - i;
-                if (!masks.at(tgt_iter).empty()) {
-                    for (unsigned int j = i + 1; j < i + n_imgs_window && j < nimg; ++j) {
-                        unsigned int win_iter = forward ? j : nimg - 1 - j;
-                        if (masks.at(win_iter).empty()) {
-                            // empty image means "all valid", so just remove mask
-                            masks.at(tgt_iter) = Image{};
-                            break;
-                        }
-                        masks.at(tgt_iter) = std::move(masks.at(tgt_iter)).bitwise_or(masks.at(win_iter));
-                    }
-                }
-            }
-        }
-        else { // alignment == StaarchOptions::MovingAverageWindow::center
-            int n_img_win_sym = n_imgs_window / 2;
-            {
-                // copy all images as source and use `imgs` as target
-                std::vector<ConstImage> src_imgs;
-                for (Image const& i : imgs)
-                    src_imgs.emplace_back(i.clone());
-
-                // calculate average and save in `imgs`
-                for (int i = 0; i < static_cast<int>(nimg); ++i) {
-                    for (int y = 0; y < h; ++y) {
-                        for (int x = 0; x < w; ++x) {
-                            // Evaluate whether it is faster to work vectorwise here (add masked images and sum up masks/255, then imgs/masks)
-                            double val = 0;
-                            int count = 0;
-                            for (int j = i - n_img_win_sym; j <= i + n_img_win_sym && j < static_cast<int>(nimg); ++j) {
-                                if (j < 0)
-                                    continue;
-
-                                if (masks.at(j).empty() || masks.at(j).boolAt(x, y, 0)) {
-                                    val += src_imgs.at(j).at<type>(x, y);
-                                    ++count;
-                                }
-                            }
-                            if (count > 0)
-                                imgs.at(i).at<type>(x, y) = cv::saturate_cast<type>(val / count);
-                        }
-                    }
-                }
-            }
-
-            {
-                // copy all masks as source and use `masks` as target
-                std::vector<ConstImage> src_masks;
-                for (Image const& m : masks)
-                    src_masks.emplace_back(m.clone());
-
-                // combine masks and save in `masks`
-                for (int i = 0; i < static_cast<int>(nimg); ++i) {
-                    if (!masks.at(i).empty()) {
-                        for (int j = i - n_img_win_sym; j <= i + n_img_win_sym && j < static_cast<int>(nimg); ++j) {
-                            if (i == j || j < 0)
-                                continue;
-
-                            if (src_masks.at(j).empty()) {
-                                // empty image means "all valid", so just remove mask
-                                masks.at(i) = Image{};
-                                break;
-                            }
-                            masks.at(i) = std::move(masks.at(i)).bitwise_or(src_masks.at(j));
-                        }
-                    }
-                }
-            }
-        }
-    }
-};
-
 } /* staarch_impl_detail */
 
 
@@ -701,6 +586,9 @@ public:
      */
     void predict(int date, ConstImage const& baseMask = {}, ConstImage const& predMask = {}) override;
 
+    // the overload with bit-packed masks unpacks them and calls the one above
+    using DataFusor::predict;
+
     /**
      * @brief Generate the date of disturbance image
      *
@@ -778,45 +666,45 @@ protected:
      *
      * This converts all low resolution images in the specified interval (see
      * StaarchOptions::setIntervalDates()) to tasseled cap color space, normalizes the channels
-     * (using the respective mask) and then converts it to disturbance index.
+     * (using the respective mask) and then converts it to disturbance index. These steps are
+     * fused into one pass for the statistics and one pass for the disturbance index, so no
+     * intermediate images are created. The images are processed in parallel, if OpenMP is
+     * available.
      *
      * @return vector of disturbance indexes of the low resolution images.
      */
     std::vector<Image> getLowStdDI(Rectangle const& predArea, ConstImage const& baseMask = {}) const;
 
     /**
-     * @brief Average the disturbance indexes of neighboring images and combine their masks
+     * @brief Find the date of disturbance from the low resolution disturbance indexes
      * @param lowDI are the disturbance indexes of the low resolution images, see getLowStdDI().
-     * @param predArea is the prediction area. Only this region of the masks will be combined.
-     *
-     * This uses the setting from StaarchOptions::setNumberImagesForAveraging() and averages this
-     * number of images and combines (using OR) the respective masks. Assume now the number is 3,
-     * as in the paper, then to get the average for date i the images at dates i, i+1 and i+2 are
-     * used, like described in the paper. The denominator in the average takes the masks into
-     * account. So if e. g. a pixel location is valid at all dates the result is
+     * @param predArea is the prediction area, in which `lowDI` have been computed.
+     * @param changeMask is the high resolution change mask, see generateChangeMask(). Only
+     * locations marked as changed get a date of disturbance.
+     *
+     * First the disturbance indexes of neighboring images are averaged. This uses the setting
+     * from StaarchOptions::setNumberImagesForAveraging() and
+     * StaarchOptions::setDIMovingAverageWindow(). Assume now the number is 3 and the window is
+     * forward, as in the paper, then to get the average for date i the images at dates i, i+1 and
+     * i+2 are used. The denominator in the average takes the masks into account. So if e. g. a
+     * pixel location is valid at all dates the result is
      * \f$ \frac 1 3 \cdot (I_i + I_{i+1} + I_{i+2}) \f$, but if say the pixel location at date i+1
      * is invalid the result is \f$ \frac 1 2 \cdot (I_i + I_{i+2}) \f$. If a location is invalid
-     * at all of the dates the combined mask will be invalid at that location, too.
+     * at all of the dates, the averaged value is invalid, too.
      *
-     * @return a vector of the averaged images and a vector of the respective masks.
-     */
-    std::pair<std::vector<Image>, std::vector<Image>> averageDI(std::vector<Image> lowDI, Rectangle const& predArea) const;
-
-    /**
-     * @brief Generate a distubance index threshold image
-     * @param lowAvgDI are the averaged disturbance index images, see getLowStdDI() and averageDI().
-     * @param lowCombinedMasks are the masks corresponding to the averaged DI, see averageDI().
-     *
-     * The date of disturbance is determined pixel-wise using a thresh between min and max DI
-     * values, i. e. min + (max - min) * t. The min and max values are determined over time, for
-     * every pixel independently. Masked values are not considered. If there are locations, that
-     * are invalid for all dates, their values are undefined (in practice -inf, inf or nan).
-     *
-     * @return per-pixel threshold values to find the date of disturbance. The first date at which
-     * a value exceeds the threshold is used as date of disturbance. This assumes the disturbance
-     * is monotonic, which might not be the case in reality.
+     * Then a threshold between the min and max of the valid averaged values over time is
+     * determined for every pixel independently, i. e. min + (max - min) * t, see
+     * StaarchOptions::setLowResDIRatio(). The first date at which the averaged value exceeds the
+     * threshold is used as date of disturbance. This assumes the disturbance is monotonic, which
+     * might not be the case in reality.
+     *
+     * All of this is done pixel by pixel in a single pass, parallelized over rows, so the
+     * averaged images, combined masks and the threshold image are never created.
+     *
+     * @return date of disturbance image of type Type::int32x1 with the size of `predArea`.
+     * Locations without disturbance are set to the maximum `int32_t` value.
      */
-    Image getLowThresh(std::vector<Image> const& lowAvgDI, std::vector<Image> const& lowCombinedMasks) const;
+    Image getLowDOD(std::vector<Image> const& lowDI, Rectangle const& predArea, ConstImage const& changeMask) const;
 
     /**
      * @brief Generate the high resolution change mask
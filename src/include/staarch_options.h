@@ -1070,29 +1070,29 @@ public:
         return outputBands;
     }
 
-//#ifdef _OPENMP
-//    /**
-//     * @brief Set the number of threads to use
-//     *
-//     * @param t is the number of threads &le; number of processors. Choosing it greater than
-//     * [`omp_get_num_procs()`](https://gcc.gnu.org/onlinedocs/libgomp/omp_005fget_005fnum_005fprocs.html)
-//     * will set it to `omp_get_num_procs()`.
-//     *
-//     * By default (on construction) this is set to `omp_get_num_procs()`.
-//     */
-//    void setNumberThreads(unsigned int t) {
-//        threads = std::min((int)t, std::max(omp_get_num_procs(), 1));
-//    }
+#ifdef _OPENMP
+    /**
+     * @brief Set the number of threads to use
+     *
+     * @param t is the number of threads &le; number of processors. Choosing it greater than
+     * [`omp_get_num_procs()`](https://gcc.gnu.org/onlinedocs/libgomp/omp_005fget_005fnum_005fprocs.html)
+     * will set it to `omp_get_num_procs()`.
+     *
+     * By default (on construction) this is set to `omp_get_num_procs()`.
+     */
+    void setNumberThreads(unsigned int t) {
+        threads = std::min((int)t, std::max(omp_get_num_procs(), 1));
+    }
 
-//    /**
-//     * @brief Get the number of threads used for parallelization
-//     * @return number of threads
-//     * @see setNumberThreads()
-//     */
-//    unsigned int getNumberThreads() const {
-//        return threads;
-//    }
-//#endif /* _OPENMP*/
+    /**
+     * @brief Get the number of threads used for parallelization
+     * @return number of threads
+     * @see setNumberThreads()
+     */
+    unsigned int getNumberThreads() const {
+        return threads;
+    }
+#endif /* _OPENMP*/
 
 protected:
     /**
@@ -1176,9 +1176,9 @@ protected:
     /// Output bands used for fusion
     std::vector<std::string> outputBands = {"red", "green", "blue"};
 
-//#ifdef _OPENMP
-//    unsigned int threads = omp_get_num_procs();
-//#endif /* _OPENMP*/
+#ifdef _OPENMP
+    unsigned int threads = omp_get_num_procs();
+#endif /* _OPENMP*/
 
     friend class StaarchFusor;
 
@@ -4,6 +4,7 @@
 #include "starfm_options.h"
 #include <cmath>
 #include <iostream>
+#include <memory>
 #include <opencv2/opencv.hpp>
 
 namespace imagefusion {
@@ -11,67 +12,136 @@ namespace imagefusion {
 /**
  * @brief Implementation details of STARFM -- not to be used by library users
  *
- * This namespace just contains the functor, which predicts one pixel in a window.
+ * This namespace contains the functor, which predicts all pixels of a prediction area, and the
+ * pair context, which holds everything that only depends on the input pairs.
  */
 namespace starfm_impl_detail {
 
 /**
- * @brief This functor predicts the value for one channel of the central pixel of a window
+ * @brief Precomputed data that only depends on the input pairs
+ *
+ * This is computed by StarfmFusor::preparePairContext() or by the first call of
+ * StarfmFusor::predict() and can be shared between multiple StarfmFusor objects, see
+ * StarfmFusor::pairContext(std::shared_ptr<PairContext const>). The Parallelizer does that
+ * automatically to compute it only once for all threads.
+ *
+ * Besides the precomputed data the context stores what it has been computed from, i. e. the
+ * relevant options, the pair images and the valid mask. So a StarfmFusor can check whether the
+ * context is still valid and reuse it for all prediction dates.
+ */
+struct PairContext {
+    /// Options the context has been computed with, only the pair dates, tags, window size and number of classes are relevant
+    StarfmOptions opt;
+
+    /// Shared copies of the full pair images $ h_1, l_1 $ and, in double pair mode, $ h_3, l_3 $
+    std::vector<ConstImage> pairImages;
+
+    /// Copy of the valid mask the tolerances have been computed with or empty if none was used
+    ConstImage mask;
+
+    /// Area covered by #diffS_vec in full image coordinates
+    Rectangle area;
+
+    /// Similarity tolerances for each pair and channel, derived from the full high resolution images
+    std::vector<std::vector<double>> tol_vec;
+
+    /// Similarity tolerances for each pair and channel when the pair is used alone, see
+    /// StarfmFusor::predictWithPairSelection(). Empty if they have not been requested.
+    std::vector<std::vector<double>> singleTol_vec;
+
+    /// Copies of the single pair masks #singleTol_vec has been computed with (empty images if none were used)
+    std::vector<ConstImage> singleMasks;
+
+    /// Distance weights, see StarfmFusor::computeDistanceWeights()
+    Image distWeights;
+
+    /// Spectral differences \f$ |h_k - l_k| \f$ for each pair in the size of #area
+    std::vector<Image> diffS_vec;
+};
+
+
+/**
+ * @brief This functor predicts all pixels of the prediction area (or stripe) with a moving window
  *
  * @param opt holds the STARFM options. This is used for getting the mode (via @ref
  * StarfmOptions::isSinglePairModeConfigured() "isSinglePairModeConfigured()" and @ref
  * StarfmOptions::isDoublePairModeConfigured() "isDoublePairModeConfigured()"), uncertainties (via
  * @ref StarfmOptions::getTemporalUncertainty() "getTemporalUncertainty()" and @ref
  * StarfmOptions::getSpectralUncertainty() "getSpectralUncertainty()"), temporal difference usage
- * (via @ref StarfmOptions::getUseTempDiffForWeights() "getUseTempDiffForWeights()") and the strict
- * filtering configuration (via @ref StarfmOptions::getUseStrictFiltering()
- * "getUseStrictFiltering()").
- *
- * @param x_center is the center x-coordinate relative to the window origin
+ * (via @ref StarfmOptions::getUseTempDiffForWeights() "getUseTempDiffForWeights()"), the
+ * strict filtering configuration (via @ref StarfmOptions::getUseStrictFiltering()
+ * "getUseStrictFiltering()") and the window size (via @ref StarfmOptions::getWinSize()
+ * "getWinSize()").
  *
- * @param y_center is the center y-coordinate relative to the window origin
+ * @param predArea is the prediction area relative to the sample area, i. e. relative to the
+ * origin of the following images.
  *
- * @param c is the channel in which the pixel value should be predicted. So this functor predicts
- * only one value for a single channel.
+ * @param tol_vec is a vector conaining one or two vectors (depending on the mode configuration;
+ * single or double pair). Each vector contains the tolerances for the input pairs for all
+ * channels. In the formulae below the tolerance for the current channel of input pair \f$ k \f$
+ * is called \f$ \varepsilon_k \f$.
  *
- * @param tol_vec is a vector conaining one or two cv::Scalar objects (depending on the mode
- * configuration; single or double pair). Each cv::Scalar object contains the tolerances for the
- * input pairs for all channels. In the formulae below the tolerance for the current channel of
- * input pair \f$ k \f$ is called \f$ \varepsilon_k \f$.
+ * @param hk_vec contains the high resolution images (one for single pair mode, two for double pair
+ * mode) in the size of the sample area.
  *
- * @param dt_win_vec contains the current window of the temporal difference images (one for single
- * pair mode, two for double pair mode).
+ * @param dt_vec contains the temporal difference images (one for single pair mode, two for double
+ * pair mode) in the size of the sample area.
  *
- * @param ds_win_vec contains the current window of the spatial difference images (one for single
- * pair mode, two for double pair mode).
+ * @param ds_vec contains the spatial difference images (one for single pair mode, two for double
+ * pair mode) in the size of the sample area.
  *
- * @param lv_win_vec contains the current window of the local value images (one for single pair
- * mode, two for double pair mode). The local values are the trivial prediction like
+ * @param lv_vec contains the local value images (one for single pair mode, two for double pair
+ * mode) in the size of the sample area. The local values are the trivial prediction like
  * lv = h1 + l2 - l1.
  *
- * @param hk_win_vec contains the current window of the high resolution images (one for single pair
- * mode, two for double pair mode).
+ * @param sampleMask is either empty or the given single-channel or multi-channel mask in the size
+ * of the sample area.
+ *
+ * @param pairSelection is either empty or a single-channel image in the size of the sample area,
+ * which selects the pairs to use for each pixel in double pair mode, see
+ * StarfmFusor::predictWithPairSelection(). When it is empty, all pairs are used.
  *
- * @param mask_win is either empty or contains the current window of the given single-channel or
- * multi-channel mask.
+ * @param singleMasks is empty or contains for each pair the mask in the size of the sample area,
+ * which is used instead of `sampleMask` for pixels that only use this pair.
  *
- * @param dw_win contains the current window of the distance weights defined as
- * \f$ 1 + \frac{\sqrt{(x - x_c)^2 + (y - y_c)^2}}{\tfrac s 2} \f$. This is generally always the
- * same but on image boundaries it is cropped.
+ * @param singleTol_vec is empty or contains for each pair the tolerances, which are used instead of
+ * the ones from `tol_vec` for pixels that only use this pair.
  *
- * @param out_pixel is the (shared copy of the) central pixel of the output image.
+ * @param writeMask is the bit-packed single-channel prediction mask in the size of the prediction
+ * area. Runs of unset locations are skipped with BitMask::findNextSet().
+ *
+ * @param diffZero is either empty or a multi-channel mask in the size of the sample area, which
+ * marks the values that have already been copied due to zero spectral or temporal difference.
+ * These are skipped.
+ *
+ * @param distWeights contains the distance weights in the size of the window, defined as
+ * \f$ 1 + \frac{\sqrt{(x - x_c)^2 + (y - y_c)^2}}{\tfrac s 2} \f$. On image boundaries only
+ * the part of it that overlaps the sample area is used.
+ *
+ * @param output is the output image in the size of the prediction area.
  *
  * This functor is called from StarfmFusor::predict() with help of CallBaseTypeFunctor::run():
  * @code
- * CallBaseTypeFunctor::run(starfm_impl_detail::PredictPixel{
- *         opt, x_win, y_win, c, tol_vec, dt_win_vec, ds_win_vec, lv_win_vec, hk_win_vec, mask_win, dw_win, out_pixel},
+ * CallBaseTypeFunctor::run(starfm_impl_detail::PredictArea{
+ *         opt, predArea, tol_vec, hk_vec, diffT_vec, diffS_vec, localValues_vec,
+ *         sampleMask, pairSelection, singleMasks, singleTol_vec, writeMask, diffZero, distWeights, output},
  *         output.type());
  * @endcode
+ * So the dispatch on the image type happens only once for the whole prediction area. The window
+ * of each pixel is not cropped as shared copy, but walked through row by row with plain pointers,
+ * which saves the construction of the image headers for every pixel and allows the compiler to
+ * optimize the inner loop. For each window row the candidate filtering and the weighting are done
+ * by a row kernel on contiguous channel planes, see selectRowKernel(). On CPUs with AVX2 or
+ * AVX-512 support this kernel is vectorized. The weights are accumulated in the same order for
+ * all kernels. The spectral and temporal part of the weights, see spectralTemporalFactor(), is
+ * precomputed for each pair over the sample area, so the window loop only has to combine it with
+ * the distance weight.
  *
- * Firstly, it calculates the temporal uncertainty \f$ \sigma_t \f$, spectral uncertainty \f$
- * \sigma_s \f$ and combined uncertainty \f$ \sigma_c := \sqrt{\sigma_t^2 + \sigma_s^2} \f$. Then
- * each pixel in each input pair is checked for similarity to the central pixel at \f$ (x_c, y_c)
- * \f$. The pixel at \f$ (x, y) \f$ of pair \f$ k \f$ is similar if
+ * For each pixel and channel it works as follows. Firstly, it calculates the temporal uncertainty
+ * \f$ \sigma_t \f$, spectral uncertainty \f$ \sigma_s \f$ and combined uncertainty
+ * \f$ \sigma_c := \sqrt{\sigma_t^2 + \sigma_s^2} \f$. Then each pixel in the window of each
+ * input pair is checked for similarity to the central pixel at \f$ (x_c, y_c) \f$. The pixel at
+ * \f$ (x, y) \f$ of pair \f$ k \f$ is similar if
  *  * the high resolution reflectance value is similar to the central one, i. e.
  *    \f$ |h_k(x, y) - h_k(x_c, y_c)| < \varepsilon_k \f$
  *  * the temporal difference is lower than the central one, i. e.
@@ -87,9 +157,9 @@ namespace starfm_impl_detail {
  *   1                                  & \text{if } (S + 1) \, (T + 1) < \sigma_c
  * \end{cases},
  * \f]
- * where \f$ S = |h_k(x, y) - l_k(x, y)| \f$ = `ds_win`(x, y) is the spectral distance,
- *       \f$ T = |l_2(x, y) - l_k(x, y)| \f$ = `dt_win`(x, y) is the temporal distance and
- *       \f$ D = 1 + \dfrac{\sqrt{(x - x_c)^2 + (y - y_c)^2}}{\tfrac s 2} \f$ = `dw_win`(x, y)
+ * where \f$ S = |h_k(x, y) - l_k(x, y)| \f$ = `ds`(x, y) is the spectral distance,
+ *       \f$ T = |l_2(x, y) - l_k(x, y)| \f$ = `dt`(x, y) is the temporal distance and
+ *       \f$ D = 1 + \dfrac{\sqrt{(x - x_c)^2 + (y - y_c)^2}}{\tfrac s 2} \f$ = `distWeights`(x, y)
  * with \f$ s \f$ being the window size. Depending on the @ref
  * StarfmOptions::setUseTempDiffForWeights() "option" whether the temporal difference should be
  * used for weighting, \f$ T \f$ can also be 0 here. For the sake of simplicity in following
@@ -105,25 +175,32 @@ namespace starfm_impl_detail {
  * In the rare case that there is no similar pixel in the current window the local prediction value
  * is used directly for single-pair mode and the average of both local prediction values for
  * double-pair mode.
+ *
+ * With a `pairSelection` each pixel is predicted as in single pair mode with the first or second
+ * pair or as in double pair mode, which includes the choice of the mask, the tolerances and whether
+ * the temporal difference is used for the weights.
  */
-struct PredictPixel {
+struct PredictArea {
     StarfmOptions const& opt;
-    unsigned int x_center;
-    unsigned int y_center;
-    unsigned int c;
+    Rectangle const& predArea;
     std::vector<std::vector<double>> const& tol_vec;
-    std::vector<ConstImage> const& dt_win_vec;
-    std::vector<ConstImage> const& ds_win_vec;
-    std::vector<ConstImage> const& lv_win_vec;
-    std::vector<ConstImage> const& hk_win_vec;
-    ConstImage const& mask_win;
-    ConstImage const& dw_win;
-    Image& out_pixel;
+    std::vector<ConstImage> const& hk_vec;
+    std::vector<Image> const& dt_vec;
+    std::vector<ConstImage> const& ds_vec;
+    std::vector<Image> const& lv_vec;
+    ConstImage const& sampleMask;
+    ConstImage const& pairSelection;
+    std::vector<ConstImage> const& singleMasks;
+    std::vector<std::vector<double>> const& singleTol_vec;
+    BitMask const& writeMask;
+    ConstImage const& diffZero;
+    ConstImage const& distWeights;
+    Image& output;
 
     /**
      * @brief This function is required for the functor pattern for dynamic image type paradigm.
      *
-     * @see CallBaseTypeFunctor for the pattern and the detailed description of PredictPixel above
+     * @see CallBaseTypeFunctor for the pattern and the detailed description of PredictArea above
      * for a description of what this method actually does.
      */
     template<Type basetype>
@@ -280,10 +357,185 @@ public:
      */
     void predict(int date2, ConstImage const& validMask = {}, ConstImage const& predMask = {}) override;
 
+    /**
+     * @brief Predict with bit-packed masks
+     *
+     * @param date2 is the prediction date, see predict(int, ConstImage const&, ConstImage const&).
+     *
+     * @param validMask is unpacked for the prediction, since the statistics of the pair images
+     * need it as mask image.
+     *
+     * @param predMask is used as BitMask. It is only cropped to the prediction area.
+     */
+    void predict(int date2, BitMask const& validMask, BitMask const& predMask = BitMask{}) override;
+
+    /**
+     * @brief Predict with a separate mask for the input pairs
+     *
+     * @param date2 is the prediction date, see predict().
+     *
+     * @param pairMask is either empty or a mask in the size of the source images, which marks the
+     * valid locations of the input pairs. It is used for the pair context, i. e. the tolerances.
+     *
+     * @param validMask is either empty or a mask in the size of the source images, see predict().
+     * It is used for everything else and should not mark locations as valid that are invalid in
+     * `pairMask`. Usually it is `pairMask` combined with the invalid locations of the low
+     * resolution image at `date2`.
+     *
+     * @param predMask is either empty or a single-channel mask in the size of the source images,
+     * see predict().
+     *
+     * predict() uses the `validMask` for the pair context as well. So with a different valid mask
+     * for each date, the pair context would be recomputed for each date. With this method the pair
+     * context is reused for all dates as long as `pairMask` does not change.
+     *
+     * @throws logic_error if source images have not been set.
+     * @throws not_found_error if not all required images are available.
+     * @throws image_type_error if the types (basetypes or channels) of images or masks mismatch
+     * @throws size_error if the sizes of images or masks mismatch
+     */
+    void predictWithPairMask(int date2, ConstImage const& pairMask, ConstImage const& validMask = {}, ConstImage const& predMask = {});
+
+    /**
+     * @brief Predict an image with a per-pixel selection of the input pairs
+     *
+     * @param date2 is the prediction date, see predict().
+     *
+     * @param pairSelection is a single-channel image of type Type::uint8 in the size of the source
+     * images. It selects for each pixel the pairs that are used for its prediction: 1 for only the
+     * pair at date 1, 2 for only the pair at date 3 and 3 for both pairs. Pixels with other values
+     * are not predicted.
+     *
+     * @param validMask is either empty or a mask in the size of the source images, see predict().
+     * It is used for the pixels that use both pairs.
+     *
+     * @param singlePairMasks is either empty or contains two masks (each may be empty) in the size
+     * of the source images. The first is used for pixels that only use the pair at date 1, the
+     * second for pixels that only use the pair at date 3. An empty vector means no masks.
+     *
+     * @param predMask is either empty or a single-channel mask in the size of the source images,
+     * see predict().
+     *
+     * This requires the double pair mode to be configured. Each pixel gets the same value as with
+     * predict() in the corresponding single pair or double pair configuration with the
+     * corresponding mask. However, the temporal differences, the local values and the pair
+     * context are computed only once for all three configurations. This allows to combine
+     * differently configured predictions, like required by STAARCH, in a single pass.
+     *
+     * @throws logic_error if source images have not been set or the double pair mode is not
+     * configured.
+     * @throws not_found_error if not all required images are available.
+     * @throws image_type_error if the types (basetypes or channels) of images or masks mismatch
+     * @throws size_error if the sizes of images or masks mismatch
+     * @throws invalid_argument_error if `singlePairMasks` has neither zero nor two elements.
+     */
+    void predictWithPairSelection(int date2, ConstImage const& pairSelection, ConstImage const& validMask = {},
+                                  std::vector<ConstImage> const& singlePairMasks = {}, ConstImage const& predMask = {});
+
+    /**
+     * @brief Compute the pair context for the current options
+     *
+     * @param validMask is either empty or a mask in the size of the source images, see predict().
+     * It is used for the tolerances. For predictions with predictWithPairMask() this is the pair
+     * mask.
+     *
+     * @param singlePairMasks is either empty or contains the two masks of
+     * predictWithPairSelection(). If given, the tolerances for pixels that only use one pair are
+     * computed as well.
+     *
+     * The pair context holds everything that only depends on the input pairs and not on the
+     * prediction date: the similarity tolerances, the distance weights and the spectral
+     * differences in the sample area of the prediction area set in the options. The next calls of
+     * predict() will use it instead of computing these for each call. The source images and the
+     * options have to be set before.
+     *
+     * If the current context is still valid for the options, the pair images and the mask, it is
+     * kept. predict() does the same check, so usually this does not have to be called
+     * explicitly. It is useful to compute the context for a large prediction area before
+     * predicting smaller parts of it.
+     *
+     * @throws logic_error if source images have not been set.
+     * @throws not_found_error if the images of the input pairs are not available.
+     */
+    void preparePairContext(ConstImage const& validMask = {}, std::vector<ConstImage> const& singlePairMasks = {});
+
+
+    /**
+     * @brief Get the pair context
+     * @return pair context or `nullptr` if none has been prepared or set.
+     * @see preparePairContext()
+     */
+    std::shared_ptr<starfm_impl_detail::PairContext const> const& pairContext() const {
+        return pairCtx;
+    }
+
+
+    /**
+     * @brief Set the pair context
+     *
+     * @param ctx is a pair context prepared by another StarfmFusor or `nullptr` to drop the
+     * current context. A context is only used if it has been computed with the same pair images,
+     * valid mask and relevant options and if it covers the sample area of the prediction area.
+     * Otherwise predict() replaces it by a new one.
+     *
+     * This allows to share the pair context between multiple fusors, like done by the
+     * Parallelizer.
+     */
+    void pairContext(std::shared_ptr<starfm_impl_detail::PairContext const> ctx) {
+        pairCtx = std::move(ctx);
+    }
+
 protected:
     /// StarfmOptions to use for the next prediction
     options_type opt;
 
+    /// Context, which only depends on the pairs, or `nullptr`
+    std::shared_ptr<starfm_impl_detail::PairContext const> pairCtx;
+
+    /// Context and masks (valid mask first, then single pair masks) of the last successful content comparison
+    mutable std::weak_ptr<starfm_impl_detail::PairContext const> checkedCtx;
+    mutable std::vector<ConstImage> checkedMasks;
+
+    /**
+     * @brief Compute the pair context for a given area
+     * @param validMask is used for the tolerances.
+     * @param sampleArea is the area for the spectral differences.
+     * @param singlePairMasks is either empty or contains two masks for the single pair tolerances.
+     * @return new pair context.
+     */
+    std::shared_ptr<starfm_impl_detail::PairContext const> makePairContext(ConstImage const& validMask, Rectangle const& sampleArea,
+                                                                           std::vector<ConstImage> const& singlePairMasks = {}) const;
+
+    /**
+     * @brief Check whether the current pair context can be used
+     * @param validMask is the mask for the pair context, i. e. the valid mask or the pair mask of the prediction.
+     * @param sampleArea is the area, which the context has to cover.
+     * @param singlePairMasks is either empty or contains two masks for the single pair tolerances,
+     * which the context then has to provide as well.
+     * @param trustCheckedMasks allows to skip comparing the mask contents, if the same masks (same
+     * memory) have already been compared successfully with the current context. This is used for
+     * predictions, which are called for each tile by the Parallelizer, while
+     * preparePairContext() always compares the contents.
+     * @return true if there is a context, it has been computed from the same pair images, options
+     * and mask and covers the sample area.
+     */
+    bool isPairContextValid(ConstImage const& validMask, Rectangle const& sampleArea,
+                            std::vector<ConstImage> const& singlePairMasks = {}, bool trustCheckedMasks = false) const;
+
+    /**
+     * @brief Common implementation of predict(), predictWithPairMask() and predictWithPairSelection()
+     * @param date2 is the prediction date.
+     * @param validMask is the mask for the pixels that use all configured pairs.
+     * @param pairMask is the mask for the pair context.
+     * @param predMask is the prediction mask.
+     * @param pairSelection is either empty or the pair selection in full image size.
+     * @param singlePairMasks is empty or contains two masks for pixels that use one pair only.
+     * @param predBits is either empty or the bit-packed prediction mask. Then `predMask` is empty.
+     */
+    void predictImpl(int date2, ConstImage const& validMask, ConstImage const& pairMask, ConstImage const& predMask,
+                     ConstImage const& pairSelection, std::vector<ConstImage> const& singlePairMasks,
+                     BitMask const& predBits = BitMask{});
+
     /**
      * @brief Get area where pixels are read
      * @param fullImgSize size of the source image. This is used as bounds.
@@ -0,0 +1,174 @@
+#pragma once
+
+#include "type.h"
+
+#include <cmath>
+#include <cstdint>
+
+namespace imagefusion {
+namespace starfm_impl_detail {
+
+/**
+ * @brief Arguments for weighing one row of a STARFM window
+ *
+ * All row pointers point to contiguous single-channel data, i. e. to the first window pixel of
+ * the current row in a channel plane. They have at least #n valid elements.
+ *
+ * @see RowKernel
+ */
+template<Type basetype>
+struct RowKernelArgs {
+    /// Value type of the image planes
+    using imgval_t = typename DataType<basetype>::base_type;
+
+    /// High resolution values of the pair \f$ h_k \f$
+    imgval_t const* hk;
+
+    /// Temporal differences \f$ |l_2 - l_k| \f$
+    imgval_t const* dt;
+
+    /// Spectral differences \f$ |h_k - l_k| \f$
+    imgval_t const* ds;
+
+    /// Valid mask (0 or 255) or `nullptr`, if all locations are valid
+    uint8_t const* mask;
+
+    /// Distance weights of the window row
+    double const* dw;
+
+    /// Precomputed spectral and temporal weight factors, see spectralTemporalFactor()
+    double const* st;
+
+    /// Number of elements in the row
+    int n;
+
+    /// High resolution value of the central pixel
+    double hk_center;
+
+    /// Similarity tolerance of the pair for the current channel
+    double tol;
+
+    /// Temporal difference filter threshold from the central pixel
+    imgval_t dt_center;
+
+    /// Spectral difference filter threshold from the central pixel
+    imgval_t ds_center;
+
+    /// Combined uncertainty \f$ \sigma_c \f$, used for the weighting if #logScale is 0
+    double sigma_combined;
+
+    /// Logarithmic scale factor, see StarfmOptions::setLogScaleFactor()
+    double logScale;
+
+    /// Whether a candidate must satisfy both difference filters, see StarfmOptions::setUseStrictFiltering()
+    bool useStrict;
+};
+
+
+/**
+ * @brief Row kernel that filters candidates and computes their weights
+ *
+ * A row kernel writes for every element `i` of the row either the weight of the candidate to
+ * `weights[i]` or -1, if the location is not a candidate. Valid weights are never negative.
+ *
+ * The weights are accumulated by the caller in the original order, so all kernels give the same
+ * weighted sums.
+ */
+template<Type basetype>
+using RowKernel = void (*)(RowKernelArgs<basetype> const& args, double* weights);
+
+
+/**
+ * @brief Check whether a location in the window is a candidate
+ *
+ * @param args are the row arguments.
+ * @param i is the index in the row.
+ *
+ * This is the scalar reference for all row kernels.
+ *
+ * @return true if the location is valid, similar to the central pixel and passes the temporal and
+ * spectral difference filter.
+ */
+template<Type basetype>
+inline bool isCandidate(RowKernelArgs<basetype> const& args, int i) {
+    using imgval_t = typename DataType<basetype>::base_type;
+    imgval_t dt = args.dt[i];
+    imgval_t ds = args.ds[i];
+    imgval_t hk = args.hk[i];
+
+    return !((args.mask && args.mask[i] == 0) ||                                                                    // check mask
+             std::abs(args.hk_center - hk) >= args.tol  ||                                                          // check similarity
+             (args.useStrict  ?  (dt >= args.dt_center || ds >= args.ds_center)  :  (dt >= args.dt_center && ds >= args.ds_center))); // check valid or invalid
+}
+
+
+/**
+ * @brief Compute the spectral and temporal weight factor of a location
+ *
+ * @param dt is the temporal difference \f$ T \f$.
+ * @param ds is the spectral difference \f$ S \f$.
+ * @param logScale is the logarithmic scale factor \f$ b \f$, see
+ * StarfmOptions::setLogScaleFactor().
+ * @param useTempDiff specifies whether the temporal difference is used for the weights, see
+ * StarfmOptions::setUseTempDiffForWeights(). If not, \f$ T = 0 \f$ is used.
+ *
+ * This is the part of the weight that does not depend on the window, i. e.
+ * \f$ \ln(2 + T \, b) \, \ln(2 + S \, b) \f$ for \f$ b > 0 \f$ or \f$ (1 + T) \, (1 + S) \f$
+ * otherwise. The arithmetic is done in the image value type, like the original STARFM
+ * implementation. Since it only depends on the location, it is precomputed once for all pixels of
+ * the sample area and then used by the row kernels, see RowKernelArgs::st.
+ *
+ * @return weight factor of the location.
+ */
+template<typename imgval_t>
+inline double spectralTemporalFactor(imgval_t dt, imgval_t ds, double logScale, bool useTempDiff) {
+    if (!useTempDiff)
+        dt = 0;
+
+    if (logScale > 0)
+        return std::log(2 + dt * logScale) * std::log(2 + ds * logScale);
+    return (1 + dt) * (1 + ds);
+}
+
+
+/**
+ * @brief Compute the weight of a candidate
+ *
+ * @param args are the row arguments.
+ * @param i is the index in the row.
+ *
+ * This is the scalar reference for all row kernels. With the precomputed spectral and temporal
+ * weight factor \f$ F \f$ and the distance weight \f$ D \f$ the weight is \f$ 1 / (D \, F) \f$
+ * in log scale mode. Otherwise it is the same, but 1 if \f$ F < \sigma_c \f$.
+ *
+ * @return weight of the candidate.
+ */
+template<Type basetype>
+inline double candidateWeight(RowKernelArgs<basetype> const& args, int i) {
+    double st = args.st[i];
+    double dw = args.dw[i];
+
+    double weight = 1;
+    if (args.logScale > 0 || st >= args.sigma_combined)
+        weight = 1 / (dw * st);
+    return weight;
+}
+
+
+/**
+ * @brief Get the fastest row kernel for the current CPU
+ *
+ * On x86 processors with AVX-512F or AVX2 support a vectorized kernel is returned, which processes
+ * 8 or 4 window pixels at once. Otherwise a scalar kernel is returned. The CPU is only queried on
+ * the first call.
+ *
+ * The vectorized kernels convert the image values exactly to `double` and give the same weights
+ * as the scalar kernel.
+ *
+ * @return kernel function pointer.
+ */
+template<Type basetype>
+RowKernel<basetype> selectRowKernel();
+
+} /* namespace starfm_impl_detail */
+} /* namespace imagefusion */
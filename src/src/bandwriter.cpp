@@ -0,0 +1,181 @@
+#include "bandwriter.h"
+
+#include <gdal.h>
+#include <gdal_priv.h>
+#include <cpl_string.h>
+
+namespace imagefusion {
+
+BandWriter::BandWriter(std::string const& filename, Size size, Type type, GeoInfo const& gi,
+                       FileFormat format, std::vector<std::pair<std::string,std::string>> const& options)
+    : filename{filename}, size{size}, type{type}
+{
+    GDALAllRegister();
+    if (format == FileFormat::unsupported) {
+        std::string ext = imagefusion::filesystem::extension(filename);
+        format = FileFormat::fromFileExtension(ext);
+        if (format == FileFormat::unsupported) {
+            IF_THROW_EXCEPTION(file_format_error("Cannot auto detect image format for file extension " + ext +
+                                                 ". Please specify image format explicitly!"))
+                    << boost::errinfo_file_name(filename);
+        }
+    }
+
+    if (!supportsFormat(format))
+        IF_THROW_EXCEPTION(file_format_error("The GDAL driver " + to_string(format) + " cannot create files directly, "
+                                             "so the image cannot be written band by band. Use ConstImage::write instead."))
+                << errinfo_file_format(to_string(format))
+                << boost::errinfo_file_name(filename);
+
+    // default options come first, so they are overridden by the user options, like in ConstImage::write
+    char **optionList = nullptr;
+    if (format == FileFormat("GTiff"))
+        optionList = CSLSetNameValue(optionList, "COMPRESS", "LZW");
+    for (auto const& p : options)
+        optionList = CSLSetNameValue(optionList, p.first.c_str(), p.second.c_str());
+
+    GDALDriver* driver = GetGDALDriverManager()->GetDriverByName(to_string(format).c_str());
+    ds = driver->Create(filename.c_str(), size.width, size.height, getChannels(type), toGDALDepth(type), optionList);
+    if (optionList)
+        CSLDestroy(optionList);
+    if (!ds)
+        IF_THROW_EXCEPTION(runtime_error("Could not create the output file " + filename + " with driver " + to_string(format) +
+                                         " and type " + to_string(type) + "."))
+                << errinfo_file_format(to_string(format))
+                << errinfo_image_type(type)
+                << boost::errinfo_file_name(filename);
+
+    // geo information, nodata values, color table and metadata are written before the pixel values
+    gi.addTo(ds);
+
+    // check for changed color table and remove it, like ConstImage::write does
+    if (!gi.colorTable.empty() && type == Type::uint8x1) {
+        GeoInfo test;
+        test.readFrom(ds);
+        if (!gi.compareColorTables(test, false) && ds->GetRasterCount() == 1)
+            ds->GetRasterBand(1)->SetColorTable(nullptr);
+    }
+
+    worker = std::thread{&BandWriter::run, this};
+}
+
+
+BandWriter::~BandWriter() {
+    try {
+        close();
+    }
+    catch (...) {
+    }
+}
+
+
+void BandWriter::write(ConstImage const& band, int y) {
+    if (band.width() != size.width || y < 0 || y + band.height() > size.height)
+        IF_THROW_EXCEPTION(size_error("The band of size " + to_string(band.size()) + " at row " + std::to_string(y)
+                                      + " does not fit into the image of size " + to_string(size) + "."))
+                << errinfo_size(band.size())
+                << boost::errinfo_file_name(filename);
+
+    if (band.type() != type)
+        IF_THROW_EXCEPTION(image_type_error("The band has type " + to_string(band.type()) + ", but the image "
+                                            "has type " + to_string(type) + "."))
+                << errinfo_image_type(band.type())
+                << boost::errinfo_file_name(filename);
+
+    std::unique_lock<std::mutex> lock{mtx};
+    cond.wait(lock, [this] { return queue.empty() || error; });
+    if (error)
+        std::rethrow_exception(error);
+    if (closing)
+        IF_THROW_EXCEPTION(runtime_error("Cannot write a band to " + filename + ", since the writer has been closed."))
+                << boost::errinfo_file_name(filename);
+
+    queue.emplace_back(band.constSharedCopy(), y);
+    cond.notify_all();
+}
+
+
+void BandWriter::close() {
+    {
+        std::lock_guard<std::mutex> lock{mtx};
+        closing = true;
+    }
+    cond.notify_all();
+
+    if (worker.joinable())
+        worker.join();
+
+    if (ds) {
+        GDALClose(ds);
+        ds = nullptr;
+    }
+
+    if (error) {
+        std::exception_ptr e = error;
+        error = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+
+void BandWriter::run() {
+    GDALDataType gdalType = toGDALDepth(type);
+    int chans = getChannels(type);
+    while (true) {
+        std::unique_lock<std::mutex> lock{mtx};
+        cond.wait(lock, [this] { return !queue.empty() || closing; });
+        if (queue.empty())
+            return;
+
+        // keep the band in the queue while it is being written, so write() waits until it is done
+        ConstImage band = queue.front().first;
+        int y = queue.front().second;
+        lock.unlock();
+
+        cv::Mat const& m = band.cvMat();
+        auto ret = ds->RasterIO(
+                    GF_Write,
+                    0, /* nXOff */
+                    y, /* nYOff */
+                    band.width(), /* nXSize */
+                    band.height(), /* nYSize */
+                    const_cast<uint8_t*>(m.data), /* pData */
+                    band.width(), /* nBufXSize */
+                    band.height(), /* nBufYSize */
+                    gdalType, /* eBufType */
+                    chans, /* nBandCount */
+                    nullptr, /* panBandMap, nullptr means all bands */
+                    m.elemSize(), /* nPixelSpace */
+                    m.step, /* nLineSpace */
+                    m.elemSize1() /* nBandSpace */
+        );
+
+        lock.lock();
+        queue.pop_front();
+        if (ret == CE_Failure) {
+            try {
+                IF_THROW_EXCEPTION(runtime_error("Could not write the band at row " + std::to_string(y) + " to " + filename + "."))
+                        << errinfo_image_type(type)
+                        << boost::errinfo_file_name(filename);
+            }
+            catch (...) {
+                error = std::current_exception();
+            }
+            queue.clear();
+            cond.notify_all();
+            return;
+        }
+        cond.notify_all();
+    }
+}
+
+
+bool BandWriter::supportsFormat(FileFormat const& format) {
+    GDALAllRegister();
+    if (format == FileFormat::unsupported)
+        return false;
+    GDALDriver* driver = GetGDALDriverManager()->GetDriverByName(to_string(format).c_str());
+    return driver && driver->GetMetadataItem(GDAL_DCAP_CREATE) != nullptr;
+}
+
+} /* namespace imagefusion */
@@ -0,0 +1,236 @@
+#include "bitmask.h"
+
+#include <algorithm>
+#include <bitset>
+#include <string>
+
+namespace imagefusion {
+
+namespace {
+
+inline int countTrailingZeros(BitMask::word_t word) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(word);
+#else
+    int n = 0;
+    while (!(word & 1)) {
+        word >>= 1;
+        ++n;
+    }
+    return n;
+#endif
+}
+
+inline std::size_t popcount(BitMask::word_t word) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(word);
+#else
+    return std::bitset<BitMask::wordBits>(word).count();
+#endif
+}
+
+} /* anonymous namespace */
+
+
+BitMask::BitMask(Size s, unsigned int channels, bool val)
+    : w{s.width}, h{s.height}, chans{channels}, wpr{(s.width + wordBits - 1) / wordBits}
+{
+    bits.assign(static_cast<std::size_t>(chans) * h * wpr, val ? ~word_t{0} : word_t{0});
+    if (!val || w % wordBits == 0)
+        return;
+
+    // keep the bits behind the last pixel of each row 0
+    word_t lastWordMask = (word_t{1} << (w % wordBits)) - 1;
+    for (unsigned int c = 0; c < chans; ++c)
+        for (int y = 0; y < h; ++y)
+            rowWords(y, c)[wpr - 1] = lastWordMask;
+}
+
+
+BitMask::BitMask(ConstImage const& mask) {
+    if (mask.empty())
+        return;
+
+    if (mask.basetype() != Type::uint8)
+        IF_THROW_EXCEPTION(image_type_error("A BitMask can only be made from a mask with base type uint8, but the image has type " + to_string(mask.type()) + "."))
+                << errinfo_image_type(mask.type());
+
+    *this = BitMask{mask.size(), mask.channels()};
+    for (unsigned int c = 0; c < chans; ++c) {
+        for (int y = 0; y < h; ++y) {
+            uint8_t const* src = mask.cvMat().ptr<uint8_t>(y);
+            word_t* dst = rowWords(y, c);
+            for (int wi = 0; wi < wpr; ++wi) {
+                int xbegin = wi * wordBits;
+                int xend = std::min(w, xbegin + wordBits);
+                word_t word = 0;
+                for (int x = xbegin; x < xend; ++x)
+                    word |= static_cast<word_t>(src[x * chans + c] != 0) << (x - xbegin);
+                dst[wi] = word;
+            }
+        }
+    }
+}
+
+
+Image BitMask::toImage() const {
+    if (empty())
+        return Image{};
+
+    Image mask{size(), getFullType(Type::uint8, chans)};
+    for (unsigned int c = 0; c < chans; ++c) {
+        for (int y = 0; y < h; ++y) {
+            word_t const* src = rowWords(y, c);
+            uint8_t* dst = mask.cvMat().ptr<uint8_t>(y);
+            for (int x = 0; x < w; ++x)
+                dst[x * chans + c] = ((src[x / wordBits] >> (x % wordBits)) & 1) ? 255 : 0;
+        }
+    }
+    return mask;
+}
+
+
+BitMask BitMask::crop(Rectangle const& r) const {
+    if (empty())
+        return BitMask{};
+
+    if (r.x < 0 || r.y < 0 || r.width < 0 || r.height < 0 || r.x + r.width > w || r.y + r.height > h)
+        IF_THROW_EXCEPTION(size_error("The crop rectangle " + to_string(r) + " is not inside of the mask of size " + to_string(size()) + "."))
+                << errinfo_size(r.size());
+
+    BitMask m{r.size(), chans};
+    int first = r.x / wordBits;
+    int shift = r.x % wordBits;
+    int srcWords = wpr - first;
+    for (unsigned int c = 0; c < chans; ++c) {
+        for (int y = 0; y < m.h; ++y) {
+            word_t const* src = rowWords(r.y + y, c) + first;
+            word_t* dst = m.rowWords(y, c);
+            for (int wi = 0; wi < m.wpr; ++wi) {
+                word_t word = src[wi] >> shift;
+                if (shift != 0 && wi + 1 < srcWords)
+                    word |= src[wi + 1] << (wordBits - shift);
+                dst[wi] = word;
+            }
+        }
+    }
+
+    // clear the bits behind the last pixel of each row, which were copied from the source
+    if (m.w % wordBits != 0) {
+        word_t lastWordMask = (word_t{1} << (m.w % wordBits)) - 1;
+        for (unsigned int c = 0; c < chans; ++c)
+            for (int y = 0; y < m.h; ++y)
+                m.rowWords(y, c)[m.wpr - 1] &= lastWordMask;
+    }
+    return m;
+}
+
+
+int BitMask::findNext(int x, int y, unsigned int channel, bool set) const {
+    if (x >= w)
+        return w;
+
+    word_t const* row = rowWords(y, channel);
+    int wi = x / wordBits;
+    word_t word = set ? row[wi] : ~row[wi];
+    word &= ~word_t{0} << (x % wordBits);
+    while (!word) {
+        if (++wi >= wpr)
+            return w;
+        word = set ? row[wi] : ~row[wi];
+    }
+    // for unset bits the zero padding behind the last pixel would be found, so limit to the width
+    return std::min(wi * wordBits + countTrailingZeros(word), w);
+}
+
+
+std::size_t BitMask::count() const {
+    std::size_t n = 0;
+    for (word_t word : bits)
+        n += popcount(word);
+    return n;
+}
+
+
+std::size_t BitMask::count(unsigned int channel) const {
+    std::size_t n = 0;
+    word_t const* plane = rowWords(0, channel);
+    std::size_t nWords = static_cast<std::size_t>(h) * wpr;
+    for (std::size_t i = 0; i < nWords; ++i)
+        n += popcount(plane[i]);
+    return n;
+}
+
+
+template<class Op>
+void BitMask::combineWith(BitMask const& B, Op op) {
+    if (B.size() != size())
+        IF_THROW_EXCEPTION(size_error("The masks have different sizes: " + to_string(size()) + " and " + to_string(B.size()) + "."))
+                << errinfo_size(B.size());
+
+    if (B.chans != chans && B.chans != 1)
+        IF_THROW_EXCEPTION(image_type_error("The second mask must have the same number of channels as the first or a single channel. "
+                                            "The first has " + std::to_string(chans) + " channels, the second " + std::to_string(B.chans) + "."));
+
+    // the planes are contiguous, so each channel can be combined as one array
+    std::size_t nWords = static_cast<std::size_t>(h) * wpr;
+    for (unsigned int c = 0; c < chans; ++c) {
+        word_t* a = rowWords(0, c);
+        word_t const* b = B.rowWords(0, B.chans == 1 ? 0 : c);
+        for (std::size_t i = 0; i < nWords; ++i)
+            a[i] = op(a[i], b[i]);
+    }
+}
+
+
+BitMask BitMask::bitwise_and(BitMask const& B) const& {
+    BitMask A = *this;
+    return std::move(A).bitwise_and(B);
+}
+
+
+BitMask BitMask::bitwise_and(BitMask const& B) && {
+    if (empty())
+        return B;
+    if (!B.empty())
+        combineWith(B, [] (word_t a, word_t b) { return a & b; });
+    return std::move(*this);
+}
+
+
+BitMask BitMask::bitwise_or(BitMask const& B) const& {
+    BitMask A = *this;
+    return std::move(A).bitwise_or(B);
+}
+
+
+BitMask BitMask::bitwise_or(BitMask const& B) && {
+    if (empty())
+        return B;
+    if (!B.empty())
+        combineWith(B, [] (word_t a, word_t b) { return a | b; });
+    return std::move(*this);
+}
+
+
+BitMask BitMask::bitwise_not() const& {
+    BitMask A = *this;
+    return std::move(A).bitwise_not();
+}
+
+
+BitMask BitMask::bitwise_not() && {
+    for (word_t& word : bits)
+        word = ~word;
+
+    // clear the bits behind the last pixel of each row again
+    if (w % wordBits != 0) {
+        word_t lastWordMask = (word_t{1} << (w % wordBits)) - 1;
+        for (unsigned int c = 0; c < chans; ++c)
+            for (int y = 0; y < h; ++y)
+                rowWords(y, c)[wpr - 1] &= lastWordMask;
+    }
+    return std::move(*this);
+}
+
+} /* namespace imagefusion */
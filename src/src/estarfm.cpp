@@ -147,141 +147,247 @@ Image estarfm_impl_detail::ComputeLocalWeights::operator()() const {
     using imgval_t = typename DataType<basetype>::base_type;
 
     Image weights{l1.size(), Type::float64x1};
-    unsigned int ymax  = l1.height();
-    unsigned int xmax  = l1.width();
-    unsigned int cmax  = l1.channels();
-    unsigned int mcmax = m.channels();
-    for (unsigned int y = 0; y < ymax; ++y) {
-        for (unsigned int x = 0; x < xmax; ++x) {
-            std::vector<imgval_t> lowVec(2*cmax);
-            std::vector<imgval_t> highVec(2*cmax);
-            for (unsigned int c = 0; c < cmax; ++c) {
-                unsigned int maskChannel = c < mcmax ? c : 0;
-                if (!m.empty() && !m.boolAt(x, y, maskChannel))
-                    continue;
-
-                highVec.at(2*c)   = h1.at<imgval_t>(x, y, c);
-                highVec.at(2*c+1) = h3.at<imgval_t>(x, y, c);
-                lowVec.at( 2*c)   = l1.at<imgval_t>(x, y, c);
-                lowVec.at( 2*c+1) = l3.at<imgval_t>(x, y, c);
+    int ymax  = l1.height();
+    int xmax  = l1.width();
+    int cmax  = l1.channels();
+    int mcmax = m.channels();
+    double n  = 2 * cmax;
+
+    // The correlation is computed for all pixels of a row at once in channel-major passes, so the
+    // inner loops run over contiguous pixels without any per-pixel allocations. Like in the
+    // original implementation masked values count as 0.
+    bool hasNaN = false;
+    #pragma omp parallel
+    {
+        // row buffers, allocated once per thread
+        std::vector<double> firstH(xmax), firstL(xmax), meanH(xmax), meanL(xmax), sxx(xmax), syy(xmax), sxy(xmax);
+        std::vector<uint8_t> constH(xmax), constL(xmax);
+
+        #pragma omp for schedule(static) reduction(||:hasNaN)
+        for (int y = 0; y < ymax; ++y) {
+            imgval_t const* h1r = &h1.at<imgval_t>(0, y, 0);
+            imgval_t const* h3r = &h3.at<imgval_t>(0, y, 0);
+            imgval_t const* l1r = &l1.at<imgval_t>(0, y, 0);
+            imgval_t const* l3r = &l3.at<imgval_t>(0, y, 0);
+            uint8_t const*  mr  = m.empty() ? nullptr : &m.at<uint8_t>(0, y, 0);
+            double* wr = &weights.at<double>(0, y, 0);
+
+            auto value = [&] (imgval_t const* r, int x, int c) -> double {
+                int maskChannel = c < mcmax ? c : 0;
+                return mr && mr[x * mcmax + maskChannel] == 0 ? 0 : r[x * cmax + c];
+            };
+
+            // means and check for constant vectors
+            for (int x = 0; x < xmax; ++x) {
+                firstH[x] = value(h1r, x, 0);
+                firstL[x] = value(l1r, x, 0);
+                meanH[x] = meanL[x] = sxx[x] = syy[x] = sxy[x] = 0;
+                constH[x] = constL[x] = 1;
+            }
+            for (int c = 0; c < cmax; ++c) {
+                #pragma omp simd
+                for (int x = 0; x < xmax; ++x) {
+                    double vh1 = value(h1r, x, c);
+                    double vh3 = value(h3r, x, c);
+                    double vl1 = value(l1r, x, c);
+                    double vl3 = value(l3r, x, c);
+                    meanH[x] += vh1 + vh3;
+                    meanL[x] += vl1 + vl3;
+                    constH[x] &= vh1 == firstH[x] && vh3 == firstH[x];
+                    constL[x] &= vl1 == firstL[x] && vl3 == firstL[x];
+                }
+            }
+            for (int x = 0; x < xmax; ++x) {
+                meanH[x] /= n;
+                meanL[x] /= n;
             }
 
-            if (std::equal(highVec.begin() + 1, highVec.end(), highVec.begin()) ||
-                std::equal( lowVec.begin() + 1,  lowVec.end(),  lowVec.begin()))
-            {
-                weights.at<double>(x, y, 0) = 1;
+            // centered sums
+            for (int c = 0; c < cmax; ++c) {
+                #pragma omp simd
+                for (int x = 0; x < xmax; ++x) {
+                    double dh1 = value(h1r, x, c) - meanH[x];
+                    double dh3 = value(h3r, x, c) - meanH[x];
+                    double dl1 = value(l1r, x, c) - meanL[x];
+                    double dl3 = value(l3r, x, c) - meanL[x];
+                    sxx[x] += dl1 * dl1 + dl3 * dl3;
+                    syy[x] += dh1 * dh1 + dh3 * dh3;
+                    sxy[x] += dl1 * dh1 + dl3 * dh3;
+                }
             }
-            else {
-                weights.at<double>(x, y, 0) = correlate(lowVec, highVec);
-                if (std::isnan(weights.at<double>(x, y, 0)))
-                    IF_THROW_EXCEPTION(logic_error("Correlation coefficient NaN, although elements differen!?!"));
+
+            for (int x = 0; x < xmax; ++x) {
+                if (constH[x] || constL[x]) {
+                    wr[x] = 1;
+                    continue;
+                }
+
+                wr[x] = sxy[x] / std::sqrt(sxx[x] * syy[x]);
+                if (std::isnan(wr[x]))
+                    hasNaN = true;
             }
         }
     }
+
+    if (hasNaN)
+        IF_THROW_EXCEPTION(logic_error("Correlation coefficient NaN, although elements differen!?!"));
     return weights;
 }
 
 
-template<Type basetype>
-estarfm_impl_detail::SumAndTolHelper::Stats estarfm_impl_detail::SumAndTolHelper::collectStats(
-        ConstImage h1_win, ConstImage h3_win, ConstImage l1_win, ConstImage l2_win, ConstImage l3_win, ConstImage m_win, unsigned int c) const
-{
-    using imgval_t = typename DataType<basetype>::base_type;
-    Stats s;
-    unsigned int maskChannel = c < m_win.channels() ? c : 0;
-    int xmax = h1_win.width();
-    int ymax = h1_win.height();
-    for (int y = 0; y < ymax; ++y) {
-        for (int x = 0; x < xmax; ++x) {
-            if (!m_win.empty() && !m_win.boolAt(x, y, maskChannel))
-                continue;
-
+void estarfm_impl_detail::SumAndTolHelper::compute() {
+    unsigned int imgChans = l2.channels();
+    int winSize = opt.getWinSize();
+    int halfWin = winSize / 2;
+    Rectangle full{0, 0, l2.width(), l2.height()};
+    for (unsigned int c = 0; c < imgChans; ++c) {
+        for (int y_band = 0; y_band < predArea.height; y_band += bandHeight) {
+            int y_end = std::min(y_band + bandHeight, predArea.height);
+
+            // rows read by the windows of this band
+            Rectangle band = Rectangle(0, predArea.y + y_band - halfWin, l2.width(), y_end - y_band + winSize - 1) & full;
+            ConstImage m_band = m.empty() ? m.sharedCopy() : m.sharedCopy(band);
+            IntegralStats l12_stats = l1.sharedCopy(band).integralStats(m_band, l2.sharedCopy(band), c);
+            IntegralStats l3_stats  = l3.sharedCopy(band).integralStats(m_band, {}, c);
+            IntegralStats h1_stats, h3_stats;
             if (opt.getUseLocalTol()) {
-                imgval_t h1w = h1_win.at<imgval_t>(x, y, c);
-                imgval_t h3w = h3_win.at<imgval_t>(x, y, c);
-
-                s.sum_h1 += h1w;
-                s.sum_h3 += h3w;
-                s.sqrsum_h1 += (double)h1w * h1w;
-                s.sqrsum_h3 += (double)h3w * h3w;
-                ++s.cnt_h1;
-                ++s.cnt_h3;
+                h1_stats = h1.sharedCopy(band).integralStats(m_band, {}, c);
+                h3_stats = h3.sharedCopy(band).integralStats(m_band, {}, c);
             }
 
-            s.sum_l1 += l1_win.at<imgval_t>(x, y, c);
-            s.sum_l2 += l2_win.at<imgval_t>(x, y, c);
-            s.sum_l3 += l3_win.at<imgval_t>(x, y, c);
+            for (int y_off = y_band; y_off < y_end; ++y_off) {
+                for (int x_off = 0; x_off < predArea.width; ++x_off) {
+                    Rectangle window(predArea.x + x_off - halfWin, predArea.y + y_off - halfWin - band.y, winSize, winSize);
+
+                    // set results
+                    if (opt.getUseLocalTol()) {
+                        IntegralStats::Sums s1 = h1_stats.sums(window, c);
+                        double stddev1 = std::sqrt(s1.sqrsum_x / s1.n - (s1.sum_x / s1.n) * (s1.sum_x / s1.n));
+                        tol1.at<double>(x_off, y_off, c) = stddev1 * (2.0 / opt.getNumberClasses());
+
+                        IntegralStats::Sums s3 = h3_stats.sums(window, c);
+                        double stddev3 = std::sqrt(s3.sqrsum_x / s3.n - (s3.sum_x / s3.n) * (s3.sum_x / s3.n));
+                        tol3.at<double>(x_off, y_off, c) = stddev3 * (2.0 / opt.getNumberClasses());
+                    }
+
+                    IntegralStats::Sums s12 = l12_stats.sums(window, c);
+                    sumL1.at<double>(x_off, y_off, c) = s12.sum_x;
+                    sumL2.at<double>(x_off, y_off, c) = s12.sum_y;
+                    sumL3.at<double>(x_off, y_off, c) = l3_stats.sums(window, c).sum_x;
+                }
+            }
         }
     }
-    return s;
 }
 
-template<Type basetype>
-void estarfm_impl_detail::SumAndTolHelper::operator()() {
-    unsigned int imgChans = l2.channels();
-    Rectangle window(predArea.x - opt.getWinSize() / 2, predArea.y - opt.getWinSize() / 2, opt.getWinSize(), opt.getWinSize());
-    for (unsigned int c = 0; c < imgChans; ++c) {
+std::shared_ptr<estarfm_impl_detail::PairContext const> EstarfmFusor::makePairContext(ConstImage const& validMask, Rectangle const& sampleArea) const {
+    auto ctx = std::make_shared<estarfm_impl_detail::PairContext>();
+    ctx->opt = opt;
+    ctx->area = sampleArea;
+    ctx->distWeights = computeDistanceWeights();
+    if (!validMask.empty())
+        ctx->mask = validMask.clone();
+
+    ConstImage const& h1 = imgs->get(opt.getHighResTag(), opt.getDate1());
+    ConstImage const& h3 = imgs->get(opt.getHighResTag(), opt.getDate3());
+    ConstImage const& l1 = imgs->get(opt.getLowResTag(),  opt.getDate1());
+    ConstImage const& l3 = imgs->get(opt.getLowResTag(),  opt.getDate3());
+    ctx->pairImages = {h1.sharedCopy(), h3.sharedCopy(), l1.sharedCopy(), l3.sharedCopy()};
+
+    // local weights are pointwise, so they can be computed for the whole area at once
+    ConstImage sampleMask = validMask.empty() ? validMask.sharedCopy() : validMask.sharedCopy(sampleArea);
+    ctx->localWeights = computeLocalWeights(h1.sharedCopy(sampleArea), h3.sharedCopy(sampleArea),
+                                            l1.sharedCopy(sampleArea), l3.sharedCopy(sampleArea), sampleMask);
 
-        // stats for y movement
-        Stats stats_y = collectStats<basetype>(h1.sharedCopy(window), h3.sharedCopy(window), l1.sharedCopy(window), l2.sharedCopy(window), l3.sharedCopy(window), m.empty() ? m.sharedCopy() : m.sharedCopy(window), c);
-
-        // move window in y direction
-        for (int y_off = 0; y_off < predArea.height; ++y_off) {
-            if (y_off != 0) {
-                // subtract old upper bound
-                int y_up = window.y + y_off - 1;
-                if (y_up >= 0 && y_up < l2.height()) {
-                    Rectangle upper(window.x, y_up, window.width, 1);
-                    stats_y -= collectStats<basetype>(h1.sharedCopy(upper), h3.sharedCopy(upper), l1.sharedCopy(upper), l2.sharedCopy(upper), l3.sharedCopy(upper), m.empty() ? m.sharedCopy() : m.sharedCopy(upper), c);
-                }
+    if (!opt.getUseLocalTol()) {
+        // full images used to ensure that prediction area has no influence
+        auto meanStdDev1 = imgs->get(opt.getHighResTag(), opt.getDate1()).meanStdDev(validMask);
+        auto meanStdDev3 = imgs->get(opt.getHighResTag(), opt.getDate3()).meanStdDev(validMask);
+        unsigned int chans = meanStdDev1.second.size();
+        ctx->tol1.resize(chans);
+        ctx->tol3.resize(chans);
+        for (unsigned int c = 0; c < chans; ++c) {
+            ctx->tol1.at(c) = meanStdDev1.second.at(c) * (2.0 / opt.getNumberClasses());
+            ctx->tol3.at(c) = meanStdDev3.second.at(c) * (2.0 / opt.getNumberClasses());
+        }
+    }
+    return ctx;
+}
 
-                // add new lower bound
-                int y_low = window.y + window.height + y_off - 1;
-                if (y_low >= 0 && y_low < l2.height()) {
-                    Rectangle lower(window.x, y_low, window.width, 1);
-                    stats_y += collectStats<basetype>(h1.sharedCopy(lower), h3.sharedCopy(lower), l1.sharedCopy(lower), l2.sharedCopy(lower), l3.sharedCopy(lower), m.empty() ? m.sharedCopy() : m.sharedCopy(lower), c);
-                }
-            }
 
-            // stats for x movement
-            Stats stats_x = stats_y;
-
-            // move window in x direction
-            for (int x_off = 0; x_off < predArea.width; ++x_off) {
-                if (x_off != 0) {
-                    // subtract old left bound
-                    int x_left = window.x + x_off - 1;
-                    if (x_left >= 0 && x_left < l2.width()) {
-                        Rectangle left(x_left, window.y + y_off, 1, window.height);
-                        stats_x -= collectStats<basetype>(h1.sharedCopy(left), h3.sharedCopy(left), l1.sharedCopy(left), l2.sharedCopy(left), l3.sharedCopy(left), m.empty() ? m.sharedCopy() : m.sharedCopy(left), c);
-                    }
+bool EstarfmFusor::isPairContextValid(ConstImage const& validMask, Rectangle const& sampleArea, bool trustCheckedMasks) const {
+    if (!pairCtx || (pairCtx->area & sampleArea) != sampleArea)
+        return false;
 
-                    // add new right bound
-                    int x_right = window.x + window.width + x_off - 1;
-                    if (x_right >= 0 && x_right < l2.width()) {
-                        Rectangle right(x_right, window.y + y_off, 1, window.height);
-                        stats_x += collectStats<basetype>(h1.sharedCopy(right), h3.sharedCopy(right), l1.sharedCopy(right), l2.sharedCopy(right), l3.sharedCopy(right), m.empty() ? m.sharedCopy() : m.sharedCopy(right), c);
-                    }
-                }
+    // options that influence the context
+    EstarfmOptions const& o = pairCtx->opt;
+    if (o.date1 != opt.date1 || o.date3 != opt.date3 || o.highTag != opt.highTag || o.lowTag != opt.lowTag ||
+        o.winSize != opt.winSize || o.numClasses != opt.numClasses || o.useLocalTol != opt.useLocalTol)
+    {
+        return false;
+    }
 
-                // set results
-                if (opt.getUseLocalTol()) {
-                    double stddev1 = std::sqrt(stats_x.sqrsum_h1 / stats_x.cnt_h1 - (stats_x.sum_h1 / stats_x.cnt_h1) * (stats_x.sum_h1 / stats_x.cnt_h1));
-                    tol1.at<double>(x_off, y_off, c) = stddev1 * (2.0 / opt.getNumberClasses());
+    // pair images must be the same objects, not just with equal dates
+    std::vector<ConstImage const*> current{&imgs->get(opt.getHighResTag(), opt.getDate1()), &imgs->get(opt.getHighResTag(), opt.getDate3()),
+                                           &imgs->get(opt.getLowResTag(),  opt.getDate1()), &imgs->get(opt.getLowResTag(),  opt.getDate3())};
+    if (pairCtx->pairImages.size() != current.size())
+        return false;
+
+    for (unsigned int i = 0; i < current.size(); ++i)
+        if (!current[i]->isSharedWith(pairCtx->pairImages[i]) || current[i]->size() != pairCtx->pairImages[i].size())
+            return false;
+
+    // a mask that has already been compared with this context is recognized by its memory, so a
+    // prediction in many tiles compares the mask contents only once
+    bool isCheckedCtx = !checkedCtx.owner_before(pairCtx) && !pairCtx.owner_before(checkedCtx);
+    if (trustCheckedMasks && isCheckedCtx && isSameMaskData(checkedMask, validMask))
+        return true;
+
+    // the tolerances and local weights depend on the mask contents
+    if (!isSameMask(pairCtx->mask, validMask))
+        return false;
+
+    checkedCtx = pairCtx;
+    checkedMask = validMask.sharedCopy();
+    return true;
+}
 
-                    double stddev3 = std::sqrt(stats_x.sqrsum_h3 / stats_x.cnt_h3 - (stats_x.sum_h3 / stats_x.cnt_h3) * (stats_x.sum_h3 / stats_x.cnt_h3));
-                    tol3.at<double>(x_off, y_off, c) = stddev3 * (2.0 / opt.getNumberClasses());
-                }
 
-                sumL1.at<double>(x_off, y_off, c) = stats_x.sum_l1;
-                sumL2.at<double>(x_off, y_off, c) = stats_x.sum_l2;
-                sumL3.at<double>(x_off, y_off, c) = stats_x.sum_l3;
-            }
-        }
+void EstarfmFusor::preparePairContext(ConstImage const& validMask) {
+    if (!imgs)
+        IF_THROW_EXCEPTION(logic_error("No MultiResImage object stored in EstarfmFusor while preparing the pair context. This looks like a programming error."));
+
+    if (!imgs->has(opt.getHighResTag(), opt.getDate1()) || !imgs->has(opt.getHighResTag(), opt.getDate3()) ||
+        !imgs->has(opt.getLowResTag(),  opt.getDate1()) || !imgs->has(opt.getLowResTag(),  opt.getDate3()))
+    {
+        IF_THROW_EXCEPTION(not_found_error("Not all images of the input pairs are available to prepare the ESTARFM pair context."));
+    }
+
+    Rectangle predArea = opt.getPredictionArea();
+    Size fullSize = imgs->get(opt.getHighResTag(), opt.getDate1()).size();
+    if (predArea.x == 0 && predArea.y == 0 && predArea.width == 0 && predArea.height == 0) {
+        predArea.width  = fullSize.width;
+        predArea.height = fullSize.height;
     }
+
+    Rectangle sampleArea = findSampleArea(fullSize, predArea);
+    if (!isPairContextValid(validMask, sampleArea))
+        pairCtx = makePairContext(validMask, sampleArea);
 }
 
+
 void EstarfmFusor::predict(int date2, ConstImage const& validMask, ConstImage const& predMask) {
+    predictImpl(date2, validMask, validMask, predMask);
+}
+
+
+void EstarfmFusor::predictWithPairMask(int date2, ConstImage const& pairMask, ConstImage const& validMask, ConstImage const& predMask) {
+    checkInputImages(pairMask, predMask, date2);
+    predictImpl(date2, validMask, pairMask, predMask);
+}
+
+
+void EstarfmFusor::predictImpl(int date2, ConstImage const& validMask, ConstImage const& pairMask, ConstImage const& predMask) {
     checkInputImages(validMask, predMask, date2);
     Rectangle predArea = opt.getPredictionArea();
 
@@ -300,9 +406,15 @@ void EstarfmFusor::predict(int date2, ConstImage const& validMask, ConstImage co
     predArea.x -= sampleArea.x;
     predArea.y -= sampleArea.y;
 
+    // get pair context, which is only computed here if the current one cannot be used, and keep it for the next dates
+    if (!isPairContextValid(pairMask, sampleArea, /*trustCheckedMasks*/ true))
+        pairCtx = makePairContext(pairMask, sampleArea);
+    std::shared_ptr<estarfm_impl_detail::PairContext const> ctx = pairCtx;
+    Rectangle weightsArea = sampleArea;
+    weightsArea.x -= ctx->area.x;
+    weightsArea.y -= ctx->area.y;
+
     // get input images
-    ConstImage const& h1_full = imgs->get(opt.getHighResTag(), opt.getDate1());
-    ConstImage const& h3_full = imgs->get(opt.getHighResTag(), opt.getDate3());
     ConstImage h1 = imgs->get(opt.getHighResTag(), opt.getDate1()).sharedCopy(sampleArea);
     ConstImage h3 = imgs->get(opt.getHighResTag(), opt.getDate3()).sharedCopy(sampleArea);
     ConstImage l1 = imgs->get(opt.getLowResTag(),  opt.getDate1()).sharedCopy(sampleArea);
@@ -311,167 +423,173 @@ void EstarfmFusor::predict(int date2, ConstImage const& validMask, ConstImage co
     ConstImage sampleMask = validMask.empty() ? validMask.sharedCopy() : validMask.sharedCopy(sampleArea);
     ConstImage writeMask = predMask.empty() ? predMask.sharedCopy() : predMask.sharedCopy(sampleArea);
 
-    // init output as double type (for convenience) and get distance weights, local weights
-    Image distWeights = computeDistanceWeights();
-    Image localWeights = computeLocalWeights(h1, h3, l1, l3, sampleMask);
+    // get distance weights and local weights (both from context)
+    ConstImage const& distWeights = ctx->distWeights;
+    ConstImage localWeights = ctx->localWeights.constSharedCopy(weightsArea);
 
-    // calculate the tolerances (local or global)
-    unsigned int chans = l2.channels();
-    std::vector<double> tol1(l2.channels()), tol3(l2.channels()), sumL1(l2.channels()), sumL2(l2.channels()), sumL3(l2.channels());
+    // calculate the window sums and maybe the local tolerances, the global ones are in the context
     estarfm_impl_detail::SumAndTolHelper sum_tol{opt, h1, h3, l1, l2, l3, sampleMask, predArea};
-    if (!opt.getUseLocalTol()) {
-        auto meanStdDev1 = h1_full.meanStdDev(validMask);
-        auto meanStdDev3 = h3_full.meanStdDev(validMask);
-        for (unsigned int c = 0; c < chans; ++c) {
-            tol1.at(c) = meanStdDev1.second.at(c) * (2.0 / opt.getNumberClasses());
-            tol3.at(c) = meanStdDev3.second.at(c) * (2.0 / opt.getNumberClasses());
-        }
-    }
 
-    unsigned int xmax = predArea.x + predArea.width;
-    unsigned int ymax = predArea.y + predArea.height;
+    // pack the prediction mask of the prediction area, so the pixel loop can skip unmarked runs
+    BitMask writeBits = writeMask.empty() ? BitMask{predArea.size(), 1, true} : BitMask{writeMask.sharedCopy(predArea)};
 
     // predict with moving window
-    for (unsigned int y = predArea.y; y < ymax; ++y) {
-        for (unsigned int x = predArea.x; x < xmax; ++x) {
-            if (!writeMask.empty() && !writeMask.boolAt(x, y, 0))
-                continue; // no prediction wanted, skip
-
-            Rectangle window((int)x - opt.getWinSize() / 2, (int)y - opt.getWinSize() / 2, opt.getWinSize(), opt.getWinSize());
-            ConstImage h1_win  = h1.constSharedCopy(window);
-            ConstImage h3_win  = h3.constSharedCopy(window);
-            ConstImage l1_win  = l1.constSharedCopy(window);
-            ConstImage l2_win  = l2.constSharedCopy(window);
-            ConstImage l3_win  = l3.constSharedCopy(window);
-            ConstImage lw_win  = localWeights.constSharedCopy(window);
-            ConstImage sm_win  = sampleMask.empty() ? sampleMask.constSharedCopy() : sampleMask.constSharedCopy(window);
-
-            Rectangle dw_crop{std::max(0, -window.x), std::max(0, -window.y),
-                              h1_win.width(), h1.height()};
-            ConstImage dw_win = distWeights.sharedCopy(dw_crop);
-
-            int x_out = x - predArea.x;
-            int y_out = y - predArea.y;
-            Rectangle out_pixel_crop{x_out, y_out, 1, 1};
-            Image out_pixel{output.sharedCopy(out_pixel_crop)};
-
-            for (unsigned int c = 0; c < chans; ++c) {
-                if (!sum_tol.tol1.empty() && !sum_tol.tol3.empty()) { // i. e. !opt.getUseLocalTol()
-                    tol1.at(c)  = sum_tol.tol1.at<double>(x_out, y_out, c);
-                    tol3.at(c)  = sum_tol.tol3.at<double>(x_out, y_out, c);
-                }
-                sumL1.at(c) = sum_tol.sumL1.at<double>(x_out, y_out, c);
-                sumL2.at(c) = sum_tol.sumL2.at<double>(x_out, y_out, c);
-                sumL3.at(c) = sum_tol.sumL3.at<double>(x_out, y_out, c);
-            }
-
-            unsigned int x_win = opt.getWinSize() / 2 - dw_crop.x;
-            unsigned int y_win = opt.getWinSize() / 2 - dw_crop.y;
-            CallBaseTypeFunctor::run(estarfm_impl_detail::PredictPixel{
-                    opt, x_win, y_win, h1_win, h3_win, l1_win, l2_win, l3_win, lw_win, dw_win, sm_win, tol1, tol3, sumL1, sumL2, sumL3, out_pixel},
-                    output.type());
-        }
-    }
+    CallBaseTypeFunctor::run(estarfm_impl_detail::PredictArea{
+            opt, predArea, h1, h3, l1, l2, l3, localWeights, distWeights, sampleMask, sum_tol, ctx->tol1, ctx->tol3, writeBits, output},
+            output.type());
 }
 
 
 template<Type basetype>
-void estarfm_impl_detail::PredictPixel::operator()() const {
+void estarfm_impl_detail::PredictArea::operator()() const {
     using imgval_t = typename DataType<basetype>::base_type;
 
-    imgval_t const* h1c_p = &h1_win.at<imgval_t>(x_center, y_center, 0);
-    imgval_t const* h3c_p = &h3_win.at<imgval_t>(x_center, y_center, 0);
-
-    unsigned int imgChans = h1_win.channels();
-    unsigned int xmax = l2_win.width();
-    unsigned int ymax = l2_win.height();
-
-    // loop over candidates and collect information, outer vector for channels, inner for candidates
-    std::vector<std::vector<imgval_t>> lowCands_vecs(imgChans);
-    std::vector<std::vector<imgval_t>> highCands_vecs(imgChans);
-    for (unsigned int c = 0; c < imgChans; ++c) {
-        lowCands_vecs.at(c).reserve(xmax * ymax / 10);
-        highCands_vecs.at(c).reserve(xmax * ymax / 10);
+    int halfWin = opt.getWinSize() / 2;
+    int winSize = opt.getWinSize();
+    int width   = h1.width();
+    int height  = h1.height();
+    unsigned int imgChans  = h1.channels();
+    unsigned int maskChans = sampleMask.empty() ? 1 : sampleMask.channels();
+    unsigned int lwChans   = localWeights.channels();
+    bool hasMask = !sampleMask.empty();
+    bool useLocalTol = !sumTol.tol1.empty() && !sumTol.tol3.empty();
+
+    // window sums for each channel, allocated once for the whole area
+    std::vector<double> tol1(imgChans), tol3(imgChans);
+    if (!useLocalTol) {
+        tol1 = globalTol1;
+        tol3 = globalTol3;
     }
+    std::vector<double> weightedPredSums1(imgChans);
+    std::vector<double> weightedPredSums3(imgChans);
+    std::vector<double> weightedFineSums1(imgChans);
+    std::vector<double> weightedFineSums3(imgChans);
+    std::vector<RegressionSums> regSums(imgChans);
 
-    std::vector<double> sumsWeights      (imgChans, 0);
-    std::vector<double> weightedPredSums1(imgChans, 0);
-    std::vector<double> weightedPredSums3(imgChans, 0);
-    std::vector<double> weightedFineSums1(imgChans, 0);
-    std::vector<double> weightedFineSums3(imgChans, 0);
-    for (unsigned int y = 0; y < ymax; ++y) {
-        for (unsigned int x = 0; x < xmax; ++x) {
-            imgval_t const* h1w_p = &h1_win.at<imgval_t>(x, y, 0);
-            imgval_t const* h3w_p = &h3_win.at<imgval_t>(x, y, 0);
-            bool isCand = true;
-            for (unsigned int c = 0; c < imgChans; ++c) {
-                unsigned int maskChannel = sm_win.channels() > c ? c : 0;
-                if ((!sm_win.empty() && !sm_win.boolAt(x, y, maskChannel)) ||
-                    std::abs(h1c_p[c] - h1w_p[c]) > tol1[c] ||
-                    std::abs(h3c_p[c] - h3w_p[c]) > tol3[c]) // (abs would not work for uint32_t, but uint32_t is not supported anyways!)
-                {
-                    isCand = false;
-                    break;
+    unsigned int ymax = predArea.y + predArea.height;
+    for (unsigned int y = predArea.y; y < ymax; ++y) {
+        // window rows, clipped to the sample area, and offset of the window into the distance weights
+        int y_dw = (int)y - halfWin;
+        int y0 = std::max(0, y_dw);
+        int y1 = std::min(height, y_dw + winSize);
+
+        int yw = y - predArea.y;
+        imgval_t const* h1c_row = h1.cvMat().ptr<imgval_t>(y);
+        imgval_t const* h3c_row = h3.cvMat().ptr<imgval_t>(y);
+        imgval_t const* l1c_row = l1.cvMat().ptr<imgval_t>(y);
+        uint8_t const* mc_row = hasMask ? sampleMask.cvMat().ptr<uint8_t>(y) : nullptr;
+        imgval_t* out_row = output.cvMat().ptr<imgval_t>(yw);
+        for (int xw = writeMask.findNextSet(0, yw); xw < predArea.width; xw = writeMask.findNextSet(xw + 1, yw)) {
+            int x = predArea.x + xw;
+
+            // window columns, clipped to the sample area
+            int x_dw = x - halfWin;
+            int x0 = std::max(0, x_dw);
+            int x1 = std::min(width, x_dw + winSize);
+
+            imgval_t const* h1c_p = h1c_row + x * imgChans;
+            imgval_t const* h3c_p = h3c_row + x * imgChans;
+            imgval_t const* l1c_p = l1c_row + x * imgChans;
+
+            if (useLocalTol) {
+                for (unsigned int c = 0; c < imgChans; ++c) {
+                    tol1[c] = sumTol.tol1.at<double>(xw, yw, c);
+                    tol3[c] = sumTol.tol3.at<double>(xw, yw, c);
                 }
             }
-            if (!isCand)
-                continue;
-
-            double lw  = lw_win.at<double>(x, y, 0);
-            double dw  = dw_win.at<double>(x, y, 0);
-            double weight = 1 / ((1 - lw) * dw + 1e-7);
-            imgval_t const* l1w_p = &l1_win.at<imgval_t>(x, y, 0);
-            imgval_t const* l2w_p = &l2_win.at<imgval_t>(x, y, 0);
-            imgval_t const* l3w_p = &l3_win.at<imgval_t>(x, y, 0);
-            for (unsigned int c = 0; c < imgChans; ++c) {
-                lowCands_vecs[c].push_back(l1w_p[c]);
-                lowCands_vecs[c].push_back(l3w_p[c]);
-                highCands_vecs[c].push_back(h1w_p[c]);
-                highCands_vecs[c].push_back(h3w_p[c]);
-
-                sumsWeights[c] += weight;
-                weightedPredSums1[c] += (l2w_p[c] - l1w_p[c]) * weight /* * reg */;
-                weightedPredSums3[c] += (l2w_p[c] - l3w_p[c]) * weight /* * reg */;
-                weightedFineSums1[c] += h1w_p[c] * weight;
-                weightedFineSums3[c] += h3w_p[c] * weight;
+
+            // loop over candidates and sum up, the weights are the same for all channels
+            double sumWeights = 0;
+            unsigned int nCand = 0;
+            std::fill(weightedPredSums1.begin(), weightedPredSums1.end(), 0.);
+            std::fill(weightedPredSums3.begin(), weightedPredSums3.end(), 0.);
+            std::fill(weightedFineSums1.begin(), weightedFineSums1.end(), 0.);
+            std::fill(weightedFineSums3.begin(), weightedFineSums3.end(), 0.);
+            std::fill(regSums.begin(), regSums.end(), RegressionSums{});
+            for (int ywin = y0; ywin < y1; ++ywin) {
+                imgval_t const* h1_row = h1.cvMat().ptr<imgval_t>(ywin);
+                imgval_t const* h3_row = h3.cvMat().ptr<imgval_t>(ywin);
+                imgval_t const* l1_row = l1.cvMat().ptr<imgval_t>(ywin);
+                imgval_t const* l2_row = l2.cvMat().ptr<imgval_t>(ywin);
+                imgval_t const* l3_row = l3.cvMat().ptr<imgval_t>(ywin);
+                double const* lw_row = localWeights.cvMat().ptr<double>(ywin);
+                double const* dw_row = distWeights.cvMat().ptr<double>(ywin - y_dw);
+                uint8_t const* m_row = hasMask ? sampleMask.cvMat().ptr<uint8_t>(ywin) : nullptr;
+                for (int xwin = x0; xwin < x1; ++xwin) {
+                    imgval_t const* h1w_p = h1_row + xwin * imgChans;
+                    imgval_t const* h3w_p = h3_row + xwin * imgChans;
+                    uint8_t const* mw_p = hasMask ? m_row + xwin * maskChans : nullptr;
+                    bool isCand = true;
+                    for (unsigned int c = 0; c < imgChans; ++c) {
+                        unsigned int maskChannel = maskChans > c ? c : 0;
+                        if ((hasMask && mw_p[maskChannel] == 0) ||
+                            std::abs(h1c_p[c] - h1w_p[c]) > tol1[c] ||
+                            std::abs(h3c_p[c] - h3w_p[c]) > tol3[c]) // (abs would not work for uint32_t, but uint32_t is not supported anyways!)
+                        {
+                            isCand = false;
+                            break;
+                        }
+                    }
+                    if (!isCand)
+                        continue;
+
+                    double lw = lw_row[xwin * lwChans];
+                    double dw = dw_row[xwin - x_dw];
+                    double weight = 1 / ((1 - lw) * dw + 1e-7);
+                    imgval_t const* l1w_p = l1_row + xwin * imgChans;
+                    imgval_t const* l2w_p = l2_row + xwin * imgChans;
+                    imgval_t const* l3w_p = l3_row + xwin * imgChans;
+                    ++nCand;
+                    sumWeights += weight;
+                    for (unsigned int c = 0; c < imgChans; ++c) {
+                        // shifted by the central pixel to keep the sums of squares small
+                        regSums[c].add((double)l1w_p[c] - l1c_p[c], (double)h1w_p[c] - h1c_p[c]);
+                        regSums[c].add((double)l3w_p[c] - l1c_p[c], (double)h3w_p[c] - h1c_p[c]);
+
+                        weightedPredSums1[c] += (l2w_p[c] - l1w_p[c]) * weight /* * reg */;
+                        weightedPredSums3[c] += (l2w_p[c] - l3w_p[c]) * weight /* * reg */;
+                        weightedFineSums1[c] += h1w_p[c] * weight;
+                        weightedFineSums3[c] += h3w_p[c] * weight;
+                    }
+                }
             }
-        }
-    }
 
-    // loop over channels and predict pixel
-    for (unsigned int c = 0; c < imgChans; ++c) {
-        unsigned int maskChannel = sm_win.channels() > c ? c : 0;
-        if (!sm_win.empty() && !sm_win.boolAt(x_center, y_center, maskChannel))
-            continue;
-
-        // temporal weights
-        double T12 = 1. / (std::abs(sumL1[c] - sumL2[c]) + 1e-10);
-        double T32 = 1. / (std::abs(sumL3[c] - sumL2[c]) + 1e-10);
-        double T12Norm = T12 / (T12 + T32);
-        double T32Norm = T32 / (T12 + T32);
-
-        // predict
-        imgval_t& out = out_pixel.at<imgval_t>(0, 0, c);
-        unsigned int nCand = lowCands_vecs.front().size() / 2;
-        if (nCand <= 5)
-            out = T12Norm * h1c_p[c] + T32Norm * h3c_p[c];
-        else {
-            // regression coefficient
-            std::vector<imgval_t> const& lowCands  = lowCands_vecs[c];
-            std::vector<imgval_t> const& highCands = highCands_vecs[c];
-            double reg = 1;
-            cv::Scalar mean, stddev;
-            if (opt.isDataRangeSet()) // calculate only, when needed
-                cv::meanStdDev(cv::Mat(lowCands), mean, stddev);
-            if (!opt.isDataRangeSet() || stddev[0] * std::sqrt((double)(2*nCand) / (2*nCand-1)) > opt.getDataRangeMax() * opt.getUncertaintyFactor() * std::sqrt(2))
-                reg = regress(lowCands, highCands, opt.getUseQualityWeightedRegression());
-
-            out = T12Norm * (h1c_p[c] + reg * weightedPredSums1[c] / sumsWeights[c])
-                      + T32Norm * (h3c_p[c] + reg * weightedPredSums3[c] / sumsWeights[c]);
-
-            if (opt.isDataRangeSet() && (out < opt.getDataRangeMin() || out > opt.getDataRangeMax())) {
-                out = T12Norm * weightedFineSums1[c] / sumsWeights[c]
-                          + T32Norm * weightedFineSums3[c] / sumsWeights[c];
+            // loop over channels and predict pixel
+            for (unsigned int c = 0; c < imgChans; ++c) {
+                unsigned int maskChannel = maskChans > c ? c : 0;
+                if (hasMask && mc_row[x * maskChans + maskChannel] == 0)
+                    continue;
+
+                // temporal weights
+                double sumL1 = sumTol.sumL1.at<double>(xw, yw, c);
+                double sumL2 = sumTol.sumL2.at<double>(xw, yw, c);
+                double sumL3 = sumTol.sumL3.at<double>(xw, yw, c);
+                double T12 = 1. / (std::abs(sumL1 - sumL2) + 1e-10);
+                double T32 = 1. / (std::abs(sumL3 - sumL2) + 1e-10);
+                double T12Norm = T12 / (T12 + T32);
+                double T32Norm = T32 / (T12 + T32);
+
+                // predict
+                imgval_t& out = out_row[xw * imgChans + c];
+                if (nCand <= 5)
+                    out = T12Norm * h1c_p[c] + T32Norm * h3c_p[c];
+                else {
+                    // regression coefficient
+                    double reg = 1;
+                    double stddev = 0;
+                    if (opt.isDataRangeSet()) // calculate only, when needed
+                        stddev = std::sqrt(regSums[c].varianceX());
+                    if (!opt.isDataRangeSet() || stddev * std::sqrt((double)(2*nCand) / (2*nCand-1)) > opt.getDataRangeMax() * opt.getUncertaintyFactor() * std::sqrt(2))
+                        reg = regress(regSums[c], opt.getUseQualityWeightedRegression());
+
+                    out = T12Norm * (h1c_p[c] + reg * weightedPredSums1[c] / sumWeights)
+                              + T32Norm * (h3c_p[c] + reg * weightedPredSums3[c] / sumWeights);
+
+                    if (opt.isDataRangeSet() && (out < opt.getDataRangeMin() || out > opt.getDataRangeMax())) {
+                        out = T12Norm * weightedFineSums1[c] / sumWeights
+                                  + T32Norm * weightedFineSums3[c] / sumWeights;
+                    }
+                }
             }
         }
     }
@@ -184,11 +184,18 @@ std::string filesystem::get_tempdir() {
 #endif
 }
 
-uint32_t filesystem::file_size(std::string p) {
+uint64_t filesystem::file_size(std::string p) {
     VSIStatBufL s;
     if (VSIStatL(p.c_str(), &s) != 0)
         return 0;  // File / directory does not exist
     return s.st_size;
 }
 
+int64_t filesystem::last_write_time(std::string p) {
+    VSIStatBufL s;
+    if (VSIStatL(p.c_str(), &s) != 0)
+        return 0;  // File / directory does not exist
+    return s.st_mtime;
+}
+
 }  // namespace imagefusion
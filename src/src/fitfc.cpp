@@ -139,60 +139,36 @@ std::pair<Image, Image> fitfc_impl_detail::RegressionMapper::operator()() const
     unsigned int imgChans = h1.channels();
     unsigned int xmax = h1.width();
     unsigned int ymax = h1.height();
-    Rectangle window(-static_cast<int>(opt.getWinSize()) / 2, -static_cast<int>(opt.getWinSize()) / 2,
-                     opt.getWinSize(), opt.getWinSize());
-
-    #pragma omp parallel for num_threads(opt.getNumberThreads())
-    for (unsigned int c = 0; c < imgChans; ++c) {
-
-        // stats for y movement
-        Stats stats_y = collectStats<imgval_t>(h1.sharedCopy(window), l1.sharedCopy(window), l2.sharedCopy(window), m.empty() ? m.sharedCopy() : m.sharedCopy(window), c);
-
-        // move window in y direction
-        for (unsigned int y_off = 0; y_off < ymax; ++y_off) {
-            if (y_off != 0) {
-                // subtract old upper bound
-                int y_up = window.y + y_off - 1;
-                if (y_up >= 0 && y_up < h1.height()) {
-                    Rectangle upper(window.x, y_up, window.width, 1);
-                    stats_y -= collectStats<imgval_t>(h1.sharedCopy(upper), l1.sharedCopy(upper), l2.sharedCopy(upper), m.empty() ? m.sharedCopy() : m.sharedCopy(upper), c);
-                }
-
-                // add new lower bound
-                int y_low = window.y + window.height + y_off - 1;
-                if (y_low >= 0 && y_low < h1.height()) {
-                    Rectangle lower(window.x, y_low, window.width, 1);
-                    stats_y += collectStats<imgval_t>(h1.sharedCopy(lower), l1.sharedCopy(lower), l2.sharedCopy(lower), m.empty() ? m.sharedCopy() : m.sharedCopy(lower), c);
-                }
-            }
-
-            // stats for x movement
-            Stats stats_x = stats_y;
-
-            // move window in x direction
+    int winSize = opt.getWinSize();
+    int halfWin = winSize / 2;
+    Rectangle full{0, 0, h1.width(), h1.height()};
+
+    // each block of bandHeight rows of a channel gets its own summed-area tables, so the blocks are
+    // independent. The band boundaries do not depend on the number of threads, so the result is
+    // the same as with a single thread.
+    int nBands = (static_cast<int>(ymax) + bandHeight - 1) / bandHeight;
+    int nBlocks = static_cast<int>(imgChans) * nBands;
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(opt.getNumberThreads())
+    for (int block = 0; block < nBlocks; ++block) {
+        unsigned int c = block / nBands;
+        int y_band = (block % nBands) * bandHeight;
+        int y_end = std::min(y_band + bandHeight, static_cast<int>(ymax));
+
+        // rows read by the windows of this band
+        Rectangle band = Rectangle(0, y_band - halfWin, h1.width(), y_end - y_band + winSize - 1) & full;
+        ConstImage m_band = m.empty() ? m.sharedCopy() : m.sharedCopy(band);
+        IntegralStats stats = l1.sharedCopy(band).integralStats(m_band, l2.sharedCopy(band), c);
+
+        for (int y_off = y_band; y_off < y_end; ++y_off) {
             for (unsigned int x_off = 0; x_off < xmax; ++x_off) {
-                if (x_off != 0) {
-                    // subtract old left bound
-                    int x_left = window.x + x_off - 1;
-                    if (x_left >= 0 && x_left < h1.width()) {
-                        Rectangle left(x_left, window.y + y_off, 1, window.height);
-                        stats_x -= collectStats<imgval_t>(h1.sharedCopy(left), l1.sharedCopy(left), l2.sharedCopy(left), m.empty() ? m.sharedCopy() : m.sharedCopy(left), c);
-                    }
-
-                    // add new right bound
-                    int x_right = window.x + window.width + x_off - 1;
-                    if (x_right >= 0 && x_right < h1.width()) {
-                        Rectangle right(x_right, window.y + y_off, 1, window.height);
-                        stats_x += collectStats<imgval_t>(h1.sharedCopy(right), l1.sharedCopy(right), l2.sharedCopy(right), m.empty() ? m.sharedCopy() : m.sharedCopy(right), c);
-                    }
-                }
+                Rectangle window(static_cast<int>(x_off) - halfWin, y_off - halfWin - band.y, winSize, winSize);
 
                 // regress
                 imgval_t h1_val = h1.at<imgval_t>(x_off, y_off, c);
                 imgval_t l1_val = l1.at<imgval_t>(x_off, y_off, c);
                 imgval_t l2_val = l2.at<imgval_t>(x_off, y_off, c);
 
-                auto frmVal_and_rVal = regressPixel<imgval_t>(stats_x, h1_val, l1_val, l2_val);
+                auto frmVal_and_rVal = regressPixel<imgval_t>(stats.sums(window, c), h1_val, l1_val, l2_val);
                 frm.at<imgval_t>(x_off, y_off, c) = frmVal_and_rVal.first;
                 r.at<double>(x_off, y_off, c)     = frmVal_and_rVal.second;
             }
@@ -202,42 +178,18 @@ std::pair<Image, Image> fitfc_impl_detail::RegressionMapper::operator()() const
     return std::make_pair(frm, r);
 }
 
-template<typename imgval_t>
-fitfc_impl_detail::RegressionMapper::Stats fitfc_impl_detail::RegressionMapper::collectStats(
-        ConstImage h1_win, ConstImage l1_win, ConstImage l2_win, ConstImage m_win, int c) const
-{
-    Stats s;
-    int xmax = h1_win.width();
-    int ymax = h1_win.height();
-    for (int y = 0; y < ymax; ++y) {
-        for (int x = 0; x < xmax; ++x) {
-            if (!m_win.empty() && !m_win.boolAt(x, y, 0))
-                continue;
-
-            imgval_t l1xy = l1_win.at<imgval_t>(x, y, c);
-            imgval_t l2xy = l2_win.at<imgval_t>(x, y, c);
-            s.x_dot_1 += l1xy;
-            s.y_dot_1 += l2xy;
-            s.x_dot_x += (double)l1xy * l1xy;
-            s.x_dot_y += (double)l1xy * l2xy;
-            ++s.n;
-        }
-    }
-    return s;
-}
-
 template<typename imgval_t>
 std::pair<imgval_t, double> fitfc_impl_detail::RegressionMapper::regressPixel(
-        Stats s, imgval_t h1_val, imgval_t l1_val, imgval_t l2_val) const
+        IntegralStats::Sums const& s, imgval_t h1_val, imgval_t l1_val, imgval_t l2_val) const
 {
-    double det = s.n * s.x_dot_x - s.x_dot_1 * s.x_dot_1;
+    double det = s.n * s.sqrsum_x - s.sum_x * s.sum_x;
 
     if (std::abs(det) < 1e-14)
         return std::pair<imgval_t, double>(h1_val, l2_val - l1_val);
 
     // find factors a,b in p(x) = a * x + b
-    double a = (s.n * s.x_dot_y - s.x_dot_1 * s.y_dot_1) / det;
-    double b = (s.x_dot_x * s.y_dot_1 - s.x_dot_1 * s.x_dot_y) / det;
+    double a = (s.n * s.sum_xy - s.sum_x * s.sum_y) / det;
+    double b = (s.sqrsum_x * s.sum_y - s.sum_x * s.sum_xy) / det;
 
     double frm_val = a * h1_val + b;
     double res_val = l2_val - (a * l1_val + b);
@@ -250,19 +202,58 @@ std::pair<Image, Image> FitFCFusor::regress(ConstImage const& h1, ConstImage con
     return CallBaseTypeFunctor::run(fitfc_impl_detail::RegressionMapper{opt, h1, l1, l2, mask}, h1.type());
 }
 
-Image fitfc_impl_detail::cubic_filter(Image i, double scale) {
+Image fitfc_impl_detail::cubic_filter(Image i, double scale, unsigned int numThreads) {
     if (scale == 1)
         return i;
 
+    // the channels are resized independently of each other, so filter them in parallel
     auto s = i.size();
-    cv::Mat small;
-    cv::resize(i.cvMat(), small, cv::Size(), 1/scale, 1/scale, cv::INTER_AREA);
-    cv::resize(small, i.cvMat(), s, 0, 0, cv::INTER_CUBIC);
+    std::vector<cv::Mat> planes;
+    cv::split(i.cvMat(), planes);
+
+    auto filterPlane = [&] (cv::Mat& plane) {
+        cv::Mat small;
+        cv::resize(plane, small, cv::Size(), 1/scale, 1/scale, cv::INTER_AREA);
+        cv::resize(small, plane, s, 0, 0, cv::INTER_CUBIC);
+    };
+
+    if (planes.size() >= numThreads || numThreads <= 1) {
+        #pragma omp parallel for schedule(dynamic, 1) num_threads(numThreads)
+        for (int c = 0; c < static_cast<int>(planes.size()); ++c)
+            filterPlane(planes[c]);
+    }
+    else {
+        // fewer channels than threads: filter one plane after the other and let cv::resize split the
+        // rows into stripes itself. Each output row is computed the same way in any stripe, so the
+        // result does not depend on the number of threads.
+        struct CVThreadsGuard {
+            int old = cv::getNumThreads();
+            ~CVThreadsGuard() { cv::setNumThreads(old); }
+        } guard;
+        cv::setNumThreads(static_cast<int>(numThreads));
+        for (cv::Mat& p : planes)
+            filterPlane(p);
+    }
+
+    cv::merge(planes, i.cvMat());
     return i;
 }
 
 void FitFCFusor::predict(int date2, ConstImage const& validMask, ConstImage const& predMask) {
     checkInputImages(validMask, predMask, date2);
+    predictImpl(date2, validMask, predMask, BitMask{});
+}
+
+
+void FitFCFusor::predict(int date2, BitMask const& validMask, BitMask const& predMask) {
+    Image validImg = validMask.toImage();
+    checkInputImages(validImg, ConstImage{}, date2);
+    checkPredMask(predMask, imgs->get(opt.getLowResTag(), opt.getPairDate()).size());
+    predictImpl(date2, validImg, ConstImage{}, predMask);
+}
+
+
+void FitFCFusor::predictImpl(int date2, ConstImage const& validMask, ConstImage const& predMask, BitMask const& predBits) {
     if (opt.getNumberNeighbors() > opt.getWinSize() * opt.getWinSize()) {
         Rcpp::Rcerr << "Warning: You acquired more neighbors (" << opt.getNumberNeighbors()
                   << ") than pixels in the window (" << (opt.getWinSize() * opt.getWinSize()) << "). Using all pixels in the window." << std::endl;
@@ -310,43 +301,59 @@ void FitFCFusor::predict(int date2, ConstImage const& validMask, ConstImage cons
     Image& r   = frm_and_r.second;
 
     // cubic interpolation of residual to make it fine
-    r = fitfc_impl_detail::cubic_filter(std::move(r), opt.getResolutionFactor()); // TODO: What happens with the neighbors of invalid values (e. g. -9999)? How could this be handled better?
+#ifdef _OPENMP
+    unsigned int numThreads = opt.getNumberThreads();
+#else
+    unsigned int numThreads = 1;
+#endif /* _OPENMP */
+    r = fitfc_impl_detail::cubic_filter(std::move(r), opt.getResolutionFactor(), numThreads); // TODO: What happens with the neighbors of invalid values (e. g. -9999)? How could this be handled better?
 
     // get distance weights
     Image distWeights = computeDistanceWeights();
-    unsigned int xmax = predArea.x + predArea.width;
     unsigned int ymax = predArea.y + predArea.height;
 
-    // predict with moving window
-    #pragma omp parallel for num_threads(opt.getNumberThreads())
-    for (unsigned int y = predArea.y; y < ymax; ++y) {
-        for (unsigned int x = predArea.x; x < xmax; ++x) {
-            if (!sampleMask.empty() && !sampleMask.boolAt(x, y, 0))
-                continue;
-            if (!writeMask.empty() && !writeMask.boolAt(x, y, 0))
-                continue; // no prediction wanted, skip
-
-            Rectangle window((int)x - opt.getWinSize() / 2, (int)y - opt.getWinSize() / 2, opt.getWinSize(), opt.getWinSize());
-            ConstImage h1_win = h1.constSharedCopy(window);
-            ConstImage frm_win = frm.constSharedCopy(window);
-            ConstImage r_win = r.constSharedCopy(window);
-            ConstImage mask_win = sampleMask.empty() ? sampleMask.sharedCopy() : sampleMask.constSharedCopy(window);
-
-            Rectangle dw_crop{std::max(0, -window.x), std::max(0, -window.y),
-                              h1_win.width(), h1_win.height()};
-
-            ConstImage dw_win = distWeights.sharedCopy(dw_crop);
-
-            unsigned int x_win = opt.getWinSize() / 2 - dw_crop.x;
-            unsigned int y_win = opt.getWinSize() / 2 - dw_crop.y;
-            int x_out = x - predArea.x;
-            int y_out = y - predArea.y;
-            Rectangle out_pixel_crop{x_out, y_out, 1, 1};
-            Image out_pixel{output.sharedCopy(out_pixel_crop)};
-
-            CallBaseTypeFunctor::run(fitfc_impl_detail::FilterStep{
-                        opt, x_win, y_win, h1_win, frm_win, r_win, mask_win, dw_win, out_pixel},
-                        output.type());
+    // pack the valid and the prediction mask of the prediction area, so the pixel loop can skip runs
+    // of invalid or unmarked locations. A bit-packed prediction mask is just cropped.
+    BitMask writeBits = sampleMask.empty() ? BitMask{} : BitMask{sampleMask.sharedCopy(predArea)};
+    if (!predBits.empty())
+        writeBits = std::move(writeBits).bitwise_and(predBits.crop(Rectangle{sampleArea.x + predArea.x, sampleArea.y + predArea.y, predArea.width, predArea.height}));
+    else if (!writeMask.empty())
+        writeBits = std::move(writeBits).bitwise_and(BitMask{writeMask.sharedCopy(predArea)});
+    if (writeBits.empty())
+        writeBits = BitMask{predArea.size(), 1, true};
+
+    // predict with moving window, each thread reuses its own buffers for all of its pixels
+    #pragma omp parallel num_threads(opt.getNumberThreads())
+    {
+        fitfc_impl_detail::FilterStep::Scratch scratch{opt.getWinSize(), output.channels()};
+        #pragma omp for
+        for (unsigned int y = predArea.y; y < ymax; ++y) {
+            int yw = y - predArea.y;
+            for (int xw = writeBits.findNextSet(0, yw); xw < predArea.width; xw = writeBits.findNextSet(xw + 1, yw)) {
+                unsigned int x = predArea.x + xw;
+
+                Rectangle window((int)x - opt.getWinSize() / 2, (int)y - opt.getWinSize() / 2, opt.getWinSize(), opt.getWinSize());
+                ConstImage h1_win = h1.constSharedCopy(window);
+                ConstImage frm_win = frm.constSharedCopy(window);
+                ConstImage r_win = r.constSharedCopy(window);
+                ConstImage mask_win = sampleMask.empty() ? sampleMask.sharedCopy() : sampleMask.constSharedCopy(window);
+
+                Rectangle dw_crop{std::max(0, -window.x), std::max(0, -window.y),
+                                  h1_win.width(), h1_win.height()};
+
+                ConstImage dw_win = distWeights.sharedCopy(dw_crop);
+
+                unsigned int x_win = opt.getWinSize() / 2 - dw_crop.x;
+                unsigned int y_win = opt.getWinSize() / 2 - dw_crop.y;
+                int x_out = x - predArea.x;
+                int y_out = y - predArea.y;
+                Rectangle out_pixel_crop{x_out, y_out, 1, 1};
+                Image out_pixel{output.sharedCopy(out_pixel_crop)};
+
+                CallBaseTypeFunctor::run(fitfc_impl_detail::FilterStep{
+                            opt, x_win, y_win, h1_win, frm_win, r_win, mask_win, dw_win, out_pixel, scratch},
+                            output.type());
+            }
         }
     }
 }
@@ -356,39 +363,61 @@ void fitfc_impl_detail::FilterStep::operator()() const {
     using imgval_t = typename DataType<basetype>::base_type;
 
     unsigned int imgChans = h1_win.channels();
-    std::vector<imgval_t> h1_center(imgChans);
+    std::vector<double>& h1_center = scratch.h1_center;
     for (unsigned int c = 0; c < imgChans; ++c)
-        h1_center.at(c) = h1_win.at<imgval_t>(x_center, y_center, c);
+        h1_center[c] = h1_win.at<imgval_t>(x_center, y_center, c);
 
     unsigned int ymax  = dw_win.height();
     unsigned int xmax  = dw_win.width();
-    std::vector<Score> allScores;
-    allScores.reserve(xmax * ymax);
+    std::size_t k = opt.getNumberNeighbors();
+    std::vector<Score>& best = scratch.best;
+    best.clear();
+    cv::Mat const& h1_mat = h1_win.cvMat();
     for (unsigned int y = 0; y < ymax; ++y) { // Note: this loop requires the most time (approx. 70%) of the whole algorithm
-        for (unsigned int x = 0; x < xmax; ++x) {
+        imgval_t const* h1_row = h1_mat.ptr<imgval_t>(y);
+        for (unsigned int x = 0; x < xmax; ++x, h1_row += imgChans) {
             if (!mask_win.empty() && !mask_win.boolAt(x, y, 0))
                 continue;
 
+            // the partial sum only grows, so stop as soon as the pixel is worse than the worst selected one
+            bool full = best.size() >= k;
+            double worst = best.empty() ? -1 : best.front().diff;
             double diff = 0;
-            for (unsigned int c = 0; c < imgChans; ++c) {
-                double d = h1_win.at<imgval_t>(x, y, c) - h1_center.at(c);
+            unsigned int c = 0;
+            for (; c < imgChans; ++c) {
+                double d = h1_row[c] - static_cast<imgval_t>(h1_center[c]); // same arithmetic as with imgval_t centers
                 diff += d * d;
+                if (full && diff > worst)
+                    break;
+            }
+            if (c < imgChans)
+                continue;
+
+            Score s{diff, x, y, x_center, y_center};
+            if (!full) {
+                best.push_back(s);
+                std::push_heap(best.begin(), best.end());
+            }
+            else if (!best.empty() && s < best.front()) {
+                std::pop_heap(best.begin(), best.end());
+                best.back() = s;
+                std::push_heap(best.begin(), best.end());
             }
-            allScores.emplace_back(diff, x, y, x_center, y_center);
         }
     }
 
-    unsigned int n = std::min(static_cast<size_t>(opt.getNumberNeighbors()), allScores.size());
-    std::partial_sort(allScores.begin(), allScores.begin() + n, allScores.end());
+    // accumulate from the best to the worst neighbor
+    std::sort_heap(best.begin(), best.end());
 
     double invSumWeights = 0;
-    std::vector<double> f2(imgChans);
-    for (auto it = allScores.begin(), it_last = allScores.begin() + n; it != it_last; ++it) {
-        invSumWeights += dw_win.at<double>(it->x, it->y);
-        double w = dw_win.at<double>(it->x, it->y);
+    std::vector<double>& f2 = scratch.f2;
+    std::fill(f2.begin(), f2.end(), 0);
+    for (Score const& s : best) {
+        invSumWeights += dw_win.at<double>(s.x, s.y);
+        double w = dw_win.at<double>(s.x, s.y);
         for (unsigned int c = 0; c < imgChans; ++c) {
-            double frm_val = frm_win.at<imgval_t>(it->x, it->y, c);
-            double r_val = r_win.at<double>(it->x, it->y, c);
+            double frm_val = frm_win.at<imgval_t>(s.x, s.y, c);
+            double r_val = r_win.at<double>(s.x, s.y, c);
             f2.at(c) += w * (frm_val + r_val);
         }
     }
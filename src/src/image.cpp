@@ -69,7 +69,7 @@ GDALDataset* Image::asGDALDataset() {
 }
 
 
-void ConstImage::write(std::string const& filename, GeoInfo const& gi, FileFormat format) const {
+void ConstImage::write(std::string const& filename, GeoInfo const& gi, FileFormat format, std::vector<std::pair<std::string,std::string>> const& options) const {
     GDALAllRegister();
     if (format == FileFormat::unsupported) {
         // std::filesystem::path p = filename;
@@ -82,11 +82,14 @@ void ConstImage::write(std::string const& filename, GeoInfo const& gi, FileForma
         }
     }
 
+    // default options come first, so they are overridden by the user options
+    std::vector<std::pair<std::string,std::string>> allOptions;
+    if (format == FileFormat("GTiff"))
+        allOptions.emplace_back("COMPRESS", "LZW");
+    allOptions.insert(allOptions.end(), options.begin(), options.end());
+
     try {
-        if (format == FileFormat("GTiff"))
-            write(filename, to_string(format), {std::make_pair<std::string,std::string>("COMPRESS", "LZW")}, gi);
-        else
-            write(filename, to_string(format), {}, gi);
+        write(filename, to_string(format), allOptions, gi);
     }
     catch(boost::exception& ex) {
         ex << errinfo_file_format(to_string(format));
@@ -119,9 +122,6 @@ void ConstImage::write(std::string const& filename, std::string const& driverNam
     for (auto const& p : options_vec)
         options = CSLSetNameValue(options, p.first.c_str(), p.second.c_str());
     GDALDataset* poDstDS = driver->CreateCopy(filename.c_str(), poSrcDS, FALSE, options, nullptr, nullptr);
-
-    // add GeoInfo second time (important for custom metadata domains)
-    gi.addTo(poDstDS);
     bool shouldHaveWrittenColorTable = !gi.colorTable.empty() && type() == Type::uint8x1;
 
     GDALClose(poSrcDS);
@@ -134,40 +134,58 @@ void ConstImage::write(std::string const& filename, std::string const& driverNam
                 << errinfo_image_type(type())
                 << boost::errinfo_file_name(filename);
     }
-    GDALClose(poDstDS);
 
-    // check for changed color table and warn
+    // add GeoInfo second time (important for custom metadata domains)
+    gi.addTo(poDstDS);
+
+    // check for changed color table, warn and remove it, while the dataset is still open
     if (shouldHaveWrittenColorTable) {
-        GeoInfo test{filename};
-        gi.compareColorTables(test, false);
+        GeoInfo test;
+        test.readFrom(poDstDS);
+        if (!gi.compareColorTables(test, false) && poDstDS->GetRasterCount() == 1)
+            poDstDS->GetRasterBand(1)->SetColorTable(nullptr);
     }
+    GDALClose(poDstDS);
+}
+
+
+void Image::read(std::string const& filename,
+                 std::vector<int> channels /* {} means all channels */,
+                 Rectangle r /* {0, 0, 0, 0} means whole image */,
+                 bool flipH, bool flipV, bool ignoreColorTable, InterpMethod interp)
+{
+    GeoInfo gi;
+    read(filename, gi, std::move(channels), r, flipH, flipV, ignoreColorTable, interp);
 }
 
 
 void Image::read(std::string const& filename,
+                 GeoInfo& gi,
                  std::vector<int> channels /* {} means all channels */,
                  Rectangle r /* {0, 0, 0, 0} means whole image */,
                  bool flipH, bool flipV, bool ignoreColorTable, InterpMethod interp)
 {
     GDALAllRegister();
 
-    // open file
-    FileFormat format = FileFormat::fromFile(filename);
-    if (format == FileFormat::unsupported)
+    // open file once and take the geo information from the same dataset
+    GDALDataset* gdal_img = (GDALDataset*) GDALOpen(filename.c_str(), GA_ReadOnly);
+    if (!gdal_img)
         IF_THROW_EXCEPTION(runtime_error("Could not open image '" + filename + "' with GDAL to read the image. "
                                          "Either the file does not exist or GDAL could not find an appropriate driver to read the image."))
                 << boost::errinfo_file_name(filename);
 
-    // open dataset
-    GeoInfo gi{filename};
+    gi = GeoInfo{};
+    gi.readFrom(gdal_img);
     unsigned int rastercount = gi.channels;
-    GDALDataset* gdal_img = nullptr;
     if (gi.hasSubdatasets()) {
+        // the container dataset has no raster data, use a virtual dataset of the subdatasets instead
+        GDALClose(gdal_img);
         gdal_img = gi.openVrtGdalDataset(channels, interp);
         rastercount = gdal_img->GetRasterCount();
 
         GeoInfo gi_sub;
         gi_sub.readFrom(gdal_img);
+        gi = gi_sub;
         if (gi_sub.baseType == Type::invalid) {
             std::string types;
             for (unsigned int i = 1; i <= rastercount; ++i) {
@@ -185,17 +203,18 @@ void Image::read(std::string const& filename,
         // check acquired channels
         if (!channels.empty()) {
             for (int& c : channels) { // in GDAL channels are called bands and are 1 based
-                if (c >= static_cast<int>(rastercount) || c < 0)
+                if (c >= static_cast<int>(rastercount) || c < 0) {
+                    GDALClose(gdal_img);
                     IF_THROW_EXCEPTION(image_type_error("You acquired a channel (" + std::to_string(c)
                                                         + ") that does not exist. The image only has "
                                                         + std::to_string(rastercount) + " channels."))
                             << boost::errinfo_file_name(filename);
+                }
                 ++c;
             }
             rastercount = channels.size();
+            gi.channels = rastercount;
         }
-
-        gdal_img = (GDALDataset*) GDALOpen(filename.c_str(), GA_ReadOnly);
     }
 
     if (!gdal_img)
@@ -221,6 +240,14 @@ void Image::read(std::string const& filename,
                 << boost::errinfo_file_name(filename);
     }
 
+    // adapt geo information to the region, like GeoInfo(filename, channels, r, flipH, flipV)
+    gi.size.width  = r.width;
+    gi.size.height = r.height;
+    if (gi.hasGeotransform()) {
+        gi.geotrans.translateImage(r.x, r.y);
+        gi.geotrans.flipImage(flipH, flipV, gi.size);
+    }
+
     // create image memory
     GDALDataType gdal_type = gdal_img->GetRasterBand(1)->GetRasterDataType();
     int cv_type = CV_MAKETYPE(toCVType(toBaseType(gdal_type)), rastercount);
@@ -1439,6 +1466,175 @@ std::pair<std::vector<double>, std::vector<double>> ConstImage::meanStdDev(Const
 }
 
 
+IntegralStats ConstImage::integralStats(ConstImage const& mask, ConstImage const& other, int channel) const {
+    return IntegralStats{*this, mask, other, channel};
+}
+
+
+struct IntegralStats::Builder {
+    IntegralStats& is;
+    ConstImage const& x;
+    ConstImage const& y;
+    ConstImage const& mask;
+
+    template<Type basetype>
+    void operator()() const {
+        static_assert(getChannels(basetype) == 1, "This functor only accepts base type to reduce code size.");
+        using imgval_t = typename DataType<basetype>::base_type;
+
+        int w = x.width();
+        int h = x.height();
+        unsigned int chans = is.offX.size();
+        unsigned int imgChans = x.channels();
+        unsigned int maskChans = mask.channels();
+        bool withY = is.withY;
+
+        // running sums of the current row for all channels
+        std::vector<double> rowX(chans), rowY(chans), rowXX(chans), rowXY(chans), rowN(chans);
+        for (int yi = 0; yi < h; ++yi) {
+            imgval_t const* xr = &x.at<imgval_t>(0, yi, 0);
+            imgval_t const* yr = withY ? &y.at<imgval_t>(0, yi, 0) : nullptr;
+            uint8_t const*  mr = mask.empty() ? nullptr : &mask.at<uint8_t>(0, yi, 0);
+            std::fill(rowX.begin(),  rowX.end(),  0);
+            std::fill(rowY.begin(),  rowY.end(),  0);
+            std::fill(rowXX.begin(), rowXX.end(), 0);
+            std::fill(rowXY.begin(), rowXY.end(), 0);
+            std::fill(rowN.begin(),  rowN.end(),  0);
+
+            for (int xi = 0; xi < w; ++xi) {
+                for (unsigned int k = 0; k < chans; ++k) {
+                    unsigned int c = is.firstChannel + k;
+                    unsigned int mc = maskChans == 1 ? 0 : c;
+                    if (!mr || mr[xi * maskChans + mc]) {
+                        double vx = xr[xi * imgChans + c] - is.offX[k];
+                        rowX[k]  += vx;
+                        rowXX[k] += vx * vx;
+                        rowN[k]  += 1;
+                        if (withY) {
+                            double vy = yr[xi * imgChans + c] - is.offY[k];
+                            rowY[k]  += vy;
+                            rowXY[k] += vx * vy;
+                        }
+                    }
+
+                    std::size_t above = is.index(xi + 1, yi,     k);
+                    std::size_t cur   = is.index(xi + 1, yi + 1, k);
+                    is.sumX[cur]    = is.sumX[above]    + rowX[k];
+                    is.sqrSumX[cur] = is.sqrSumX[above] + rowXX[k];
+                    is.count[cur]   = is.count[above]   + rowN[k];
+                    if (withY) {
+                        is.sumY[cur]  = is.sumY[above]  + rowY[k];
+                        is.sumXY[cur] = is.sumXY[above] + rowXY[k];
+                    }
+                }
+            }
+        }
+    }
+};
+
+
+IntegralStats::IntegralStats(ConstImage const& x, ConstImage const& mask, ConstImage const& y, int channel) {
+    if (!mask.empty() && mask.size() != x.size())
+        IF_THROW_EXCEPTION(size_error("The mask has a wrong size: " + to_string(mask.size()) +
+                                      ". It must have the same size as the image: " + to_string(x.size()) + "."))
+                << errinfo_size(mask.size());
+
+    if (!mask.empty() && mask.basetype() != Type::uint8)
+        IF_THROW_EXCEPTION(image_type_error("The mask has a wrong base type: " + to_string(mask.basetype()) +
+                                            ". To represent boolean values with 0 or 255, it must have the basetype: " + to_string(Type::uint8) + "."))
+                << errinfo_image_type(mask.basetype());
+
+    if (!mask.empty() && mask.channels() != 1 && mask.channels() != x.channels())
+        IF_THROW_EXCEPTION(image_type_error("The mask must have one channel or the same number of channels as the image"))
+                << errinfo_image_type(mask.type());
+
+    if (!y.empty() && y.size() != x.size())
+        IF_THROW_EXCEPTION(size_error("The second image has a wrong size: " + to_string(y.size()) +
+                                      ". It must have the same size as the first image: " + to_string(x.size()) + "."))
+                << errinfo_size(y.size());
+
+    if (!y.empty() && y.type() != x.type())
+        IF_THROW_EXCEPTION(image_type_error("The second image has a different type (" + to_string(y.type()) +
+                                            ") than the first image (" + to_string(x.type()) + ")."))
+                << errinfo_image_type(y.type());
+
+    if (channel < -1 || channel >= static_cast<int>(x.channels()))
+        IF_THROW_EXCEPTION(invalid_argument_error("The channel " + std::to_string(channel) + " is out of range for an image with "
+                                                  + std::to_string(x.channels()) + " channels."));
+
+    if (x.empty())
+        return;
+
+    s = x.size();
+    withY = !y.empty();
+    firstChannel = channel < 0 ? 0 : channel;
+    unsigned int chans = channel < 0 ? x.channels() : 1;
+
+    // shift values by the mean to keep the table entries small, for integer images by an integer
+    bool isInteger = !isFloatType(x.type());
+    auto offsets = [&] (ConstImage const& img) {
+        std::vector<double> means = img.mean(mask);
+        std::vector<double> off(chans);
+        for (unsigned int k = 0; k < chans; ++k) {
+            double m = means.at(firstChannel + k);
+            if (!std::isfinite(m))
+                m = 0;
+            off[k] = isInteger ? std::round(m) : m;
+        }
+        return off;
+    };
+    offX = offsets(x);
+    if (withY)
+        offY = offsets(y);
+
+    std::size_t tableSize = static_cast<std::size_t>(s.width + 1) * (s.height + 1) * chans;
+    sumX.assign(tableSize, 0);
+    sqrSumX.assign(tableSize, 0);
+    count.assign(tableSize, 0);
+    if (withY) {
+        sumY.assign(tableSize, 0);
+        sumXY.assign(tableSize, 0);
+    }
+
+    CallBaseTypeFunctor::run(Builder{*this, x, y, mask}, x.type());
+}
+
+
+IntegralStats::Sums IntegralStats::sums(Rectangle r, unsigned int c) const {
+    r &= Rectangle{0, 0, s.width, s.height};
+    if (r.area() <= 0)
+        return Sums{};
+
+    if (c < static_cast<unsigned int>(firstChannel) || c - firstChannel >= offX.size())
+        IF_THROW_EXCEPTION(invalid_argument_error("The channel " + std::to_string(c) + " is not available in the summed-area tables."));
+
+    unsigned int k = c - firstChannel;
+    std::size_t i00 = index(r.x,           r.y,            k);
+    std::size_t i01 = index(r.x + r.width, r.y,            k);
+    std::size_t i10 = index(r.x,           r.y + r.height, k);
+    std::size_t i11 = index(r.x + r.width, r.y + r.height, k);
+    auto windowSum = [&] (std::vector<double> const& t) {
+        return t[i11] - t[i01] - t[i10] + t[i00];
+    };
+
+    // undo the shift of the values
+    double n  = windowSum(count);
+    double sx = windowSum(sumX);
+    double ox = offX[k];
+    Sums res;
+    res.n        = static_cast<size_t>(n);
+    res.sum_x    = sx + n * ox;
+    res.sqrsum_x = windowSum(sqrSumX) + 2 * ox * sx + n * ox * ox;
+    if (withY) {
+        double sy = windowSum(sumY);
+        double oy = offY[k];
+        res.sum_y  = sy + n * oy;
+        res.sum_xy = windowSum(sumXY) + oy * sx + ox * sy + n * ox * oy;
+    }
+    return res;
+}
+
+
 namespace {
 
 template<class ForwardImgIt>
@@ -1717,57 +1913,100 @@ Image ConstImage::createMultiChannelMaskFromRange(std::vector<Interval> const& c
 }
 
 
-static std::vector<cv::Mat> getMaskVec(ConstImage const& src, std::vector<IntervalSet> const& channelSets) {
-    assert(static_cast<unsigned int>(src.channels()) == channelSets.size());
+namespace {
+/*
+ * Creates a mask from a set of intervals per channel in a single pass over the interleaved image
+ * values, so the image is not split and no per-channel or per-interval masks are created. The
+ * channel results are either kept (multi-channel mask) or combined with AND or OR (single-channel
+ * mask). An optional base mask is combined with AND in the same pass. The bounds are converted to
+ * the image value type like cv::inRange does, so the result is the same as applying cv::inRange
+ * on every channel for every interval.
+ */
+struct SetMaskFunctor {
+    ConstImage const& src;
+    std::vector<IntervalSet> const& channelSets;
+    ConstImage const& baseMask;
+    bool singleChannel;
+    bool useAnd;
 
-    // apply inRange channel- and interval-wise, use OR to relate the intervals
-    unsigned int chans = src.channels();
-    std::vector<cv::Mat> img_chans(chans);
-    cv::split(src.cvMat(), img_chans);
+    template<Type t>
+    Image operator()() {
+        using imgval_t = typename DataType<t>::base_type;
+        using bound_t = std::conditional_t<std::is_integral<imgval_t>::value, int, imgval_t>;
+        int w = src.width();
+        int h = src.height();
+        unsigned int chans = src.channels();
+        assert(chans == channelSets.size());
+
+        // closed bounds of the intervals of each channel
+        std::vector<std::vector<std::pair<bound_t, bound_t>>> bounds(chans);
+        for (unsigned int c = 0; c < chans; ++c)
+            for (Interval const& i : channelSets[c])
+                bounds[c].emplace_back(cv::saturate_cast<bound_t>(i.lower()), cv::saturate_cast<bound_t>(i.upper()));
+
+        auto inSet = [&] (imgval_t v, unsigned int c) {
+            for (auto const& b : bounds[c])
+                if (b.first <= v && v <= b.second)
+                    return true;
+            return false;
+        };
 
-    std::vector<cv::Mat> mask_chans(chans);
-    cv::Mat temp;
-    for (unsigned int c = 0; c < chans; ++c) {
-        mask_chans[c] = cv::Mat(src.height(), src.width(), CV_8UC1);
-        mask_chans[c] = cv::Scalar::all(0);
-
-        IntervalSet const& is = channelSets.at(c);
-        for (Interval const& i : is) {
-            cv::inRange(img_chans[c], i.lower(), i.upper(), temp);
-            mask_chans[c] |= temp;
+        unsigned int maskChans = baseMask.empty() ? 0 : baseMask.channels();
+        Image ret{src.size(), getFullType(Type::uint8, singleChannel ? 1 : chans)};
+        #pragma omp parallel for schedule(static)
+        for (int y = 0; y < h; ++y) {
+            imgval_t const* srcRow = src.cvMat().ptr<imgval_t>(y);
+            uint8_t const* maskRow = maskChans > 0 ? baseMask.cvMat().ptr<uint8_t>(y) : nullptr;
+            uint8_t* retRow = ret.cvMat().ptr<uint8_t>(y);
+            for (int x = 0; x < w; ++x) {
+                imgval_t const* p = srcRow + x * chans;
+                if (singleChannel) {
+                    bool valid = !maskRow || maskRow[x * maskChans];
+                    if (valid) {
+                        valid = useAnd;
+                        for (unsigned int c = 0; c < chans && valid == useAnd; ++c)
+                            valid = inSet(p[c], c);
+                    }
+                    retRow[x] = valid ? 255 : 0;
+                }
+                else {
+                    for (unsigned int c = 0; c < chans; ++c) {
+                        bool valid = (!maskRow || maskRow[x * maskChans + (maskChans == 1 ? 0 : c)]) && inSet(p[c], c);
+                        retRow[x * chans + c] = valid ? 255 : 0;
+                    }
+                }
+            }
         }
+        return ret;
     }
-    return mask_chans;
-}
+};
 
+void checkBaseMask(ConstImage const& baseMask, ConstImage const& img, bool singleChannel) {
+    if (baseMask.empty())
+        return;
 
-Image ConstImage::createSingleChannelMaskFromSet(std::vector<IntervalSet> const& channelSets, bool useAnd) const {
-    auto sets = fixBounds(channelSets, type());
-    std::vector<cv::Mat> mask_chans = getMaskVec(*this, sets);
+    if (baseMask.size() != img.size())
+        IF_THROW_EXCEPTION(size_error("The base mask has a different size (" + to_string(baseMask.size()) + ") than the image (" + to_string(img.size()) + ")."))
+                << errinfo_size(baseMask.size());
 
-    // combine channel masks with AND
-    Image ret(size(), Type::uint8x1);
-    if (useAnd) {
-        ret.set(255);
-        for (cv::Mat const& m : mask_chans)
-            ret.img &= m;
-    }
-    else {
-        ret.set(0);
-        for (cv::Mat const& m : mask_chans)
-            ret.img |= m;
-    }
+    if (baseMask.basetype() != Type::uint8 || (baseMask.channels() != 1 && (singleChannel || baseMask.channels() != img.channels())))
+        IF_THROW_EXCEPTION(image_type_error("The base mask has type " + to_string(baseMask.type()) + ". It must be a uint8 mask with a single channel"
+                                            + (singleChannel ? std::string{} : " or as many channels as the image (" + std::to_string(img.channels()) + ")") + "."))
+                << errinfo_image_type(baseMask.type());
+}
+} /* anonymous namespace */
 
-    return ret;
+
+Image ConstImage::createSingleChannelMaskFromSet(std::vector<IntervalSet> const& channelSets, bool useAnd, ConstImage const& baseMask) const {
+    auto sets = fixBounds(channelSets, type());
+    checkBaseMask(baseMask, *this, /*singleChannel*/ true);
+    return CallBaseTypeFunctor::run(SetMaskFunctor{*this, sets, baseMask, /*singleChannel*/ true, useAnd}, basetype());
 }
 
-Image ConstImage::createMultiChannelMaskFromSet(std::vector<IntervalSet> const& channelSets) const {
+Image ConstImage::createMultiChannelMaskFromSet(std::vector<IntervalSet> const& channelSets, ConstImage const& baseMask) const {
     std::vector<IntervalSet> sets = fixBounds(channelSets, type());
-    std::vector<cv::Mat> mask_chans = getMaskVec(*this, sets);
-
-    Image ret;
-    cv::merge(mask_chans, ret.img);
-    return ret;
+    checkBaseMask(baseMask, *this, /*singleChannel*/ false);
+    return CallBaseTypeFunctor::run(SetMaskFunctor{*this, sets, baseMask, /*singleChannel*/ false, /*useAnd*/ true}, basetype());
 }
 
 
@@ -1869,26 +2108,7 @@ struct ConvertToTesseledCapFunctor {
         Image dst{src.size(), getFullType(imfu_dst_type, 3)};
         constexpr double scale =  getImageRangeMax(imfu_dst_type) / getImageRangeMax(imfu_src_type) / (std::is_signed<dtype>::value ? 1 : 2);
         constexpr double offset = std::is_signed<dtype>::value ? 0 : getImageRangeMax(imfu_dst_type) / 2;
-        std::array<double, 3*7> f;
-        if (map == ColorMapping::Landsat_to_TasseledCap) {
-            constexpr double max = 1 / 2.3103; // if the pixels are all one, this is one over the sum of brightness
-            f = std::array<double, 3*7>{ // values from: "A Physically-Based Transformation of Thematic Mapper Data - The TM Tasseled Cap" by Crist and Cicone, 1984
-                //       Blue,         Green,           Red,           NIR,         SWIR1,         SWIR2
-                +0.3037 * max, +0.2793 * max, +0.4743 * max, +0.5585 * max, +0.5082 * max, +0.1863 * max, 0, // Brightness  // TODO: Check if values are correct, for which Landsat: 4, 5, 7, Digital Numbers, Reflectance factors??
-                -0.2848 * max, -0.2435 * max, -0.5436 * max, +0.7243 * max, +0.0840 * max, -0.1800 * max, 0, // Greenness
-                +0.1509 * max, +0.1973 * max, +0.3279 * max, +0.3406 * max, -0.7112 * max, -0.4572 * max, 0  // Wetness
-            };
-        }
-        else if (map == ColorMapping::Modis_to_TasseledCap) {
-            constexpr double max = 1 / 2.6206; // if the pixels are all one, this is one over the sum of brightness
-            f = std::array<double, 3*7>{ // values from: "MODIS Tasseled Cap Transformation and its Utility" by Zhang et al, 2016
-                //        Red        Near-IR           Blue          Green           M-IR           M-IR           M-IR
-                //    620-670        841-876        459-479        545-565      1230-1250      1628-1652      2105-2155
-                +0.3956 * max, +0.4718 * max, +0.3354 * max, +0.3834 * max, +0.3946 * max, +0.3434 * max, +0.2964 * max, // Brightness
-                -0.3399 * max, +0.5952 * max, -0.2129 * max, -0.2222 * max, +0.4617 * max, -0.1037 * max, -0.4600 * max, // Greenness
-                +0.10839* max, +0.0912 * max, +0.5065 * max, +0.4040 * max, -0.2410 * max, -0.4658 * max, -0.5306 * max  // Wetness
-            };
-        }
+        std::array<double, 3*7> f = getTasseledCapCoefficients(map);
         for (int y = 0; y < src.height(); ++y) {
             for (int x = 0; x < src.width(); ++x) {
                 double brightness = 0;
@@ -2285,6 +2505,29 @@ constexpr int requiredChannels(ColorMapping map) {
 }
 } /* anonymous namespace */
 
+std::array<double, 3*7> getTasseledCapCoefficients(ColorMapping map) {
+    if (map == ColorMapping::Landsat_to_TasseledCap) {
+        constexpr double max = 1 / 2.3103; // if the pixels are all one, this is one over the sum of brightness
+        return std::array<double, 3*7>{ // values from: "A Physically-Based Transformation of Thematic Mapper Data - The TM Tasseled Cap" by Crist and Cicone, 1984
+            //       Blue,         Green,           Red,           NIR,         SWIR1,         SWIR2
+            +0.3037 * max, +0.2793 * max, +0.4743 * max, +0.5585 * max, +0.5082 * max, +0.1863 * max, 0, // Brightness  // TODO: Check if values are correct, for which Landsat: 4, 5, 7, Digital Numbers, Reflectance factors??
+            -0.2848 * max, -0.2435 * max, -0.5436 * max, +0.7243 * max, +0.0840 * max, -0.1800 * max, 0, // Greenness
+            +0.1509 * max, +0.1973 * max, +0.3279 * max, +0.3406 * max, -0.7112 * max, -0.4572 * max, 0  // Wetness
+        };
+    }
+    if (map == ColorMapping::Modis_to_TasseledCap) {
+        constexpr double max = 1 / 2.6206; // if the pixels are all one, this is one over the sum of brightness
+        return std::array<double, 3*7>{ // values from: "MODIS Tasseled Cap Transformation and its Utility" by Zhang et al, 2016
+            //        Red        Near-IR           Blue          Green           M-IR           M-IR           M-IR
+            //    620-670        841-876        459-479        545-565      1230-1250      1628-1652      2105-2155
+            +0.3956 * max, +0.4718 * max, +0.3354 * max, +0.3834 * max, +0.3946 * max, +0.3434 * max, +0.2964 * max, // Brightness
+            -0.3399 * max, +0.5952 * max, -0.2129 * max, -0.2222 * max, +0.4617 * max, -0.1037 * max, -0.4600 * max, // Greenness
+            +0.10839* max, +0.0912 * max, +0.5065 * max, +0.4040 * max, -0.2410 * max, -0.4658 * max, -0.5306 * max  // Wetness
+        };
+    }
+    IF_THROW_EXCEPTION(invalid_argument_error("There are no tasseled cap coefficients for the color mapping " + to_string(map) + "."));
+}
+
 Image ConstImage::convertColor(ColorMapping map, Type result, std::vector<unsigned int> sourceChannels) const {
 //    using CM = ColorMapping;
     for (unsigned int sc : sourceChannels)
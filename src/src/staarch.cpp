@@ -1,5 +1,10 @@
 #include "staarch.h"
 #include "starfm.h"
+#include "image_expr.h"
+
+#include <algorithm>
+#include <array>
+#include <numeric>
 
 #ifdef _OPENMP
     #include "parallelizer.h"
@@ -199,8 +204,9 @@ Image staarch_impl_detail::standardize(Image i, ConstImage const& mask) {
         else
             s = 1 / s;
 
-    Image copy_std = i.subtract(mean_std.first).multiply(mean_std.second);
-    i.copyValuesFrom(copy_std, mask);
+    // in place and only at valid locations, without a standardized copy
+    using namespace expr;
+    ((lazy(i) - mean_std.first) * mean_std.second).evalInto(i, mask);
 
     return i;
 }
@@ -246,6 +252,91 @@ struct DisturbanceIndexFunctor {
         return di;
     }
 };
+
+
+/*
+ * Computes the standardized disturbance index of a low resolution image in the prediction area.
+ * This fuses the tasseled cap transformation to float32, standardize() and
+ * DisturbanceIndexFunctor. The statistics of the valid locations are collected in a first pass
+ * over the full image, then the disturbance index is computed in a second pass over the
+ * prediction area. Only the disturbance index image is allocated.
+ */
+struct LowStdDIFunctor {
+    ConstImage const& src;
+    ConstImage const& mask;
+    Rectangle const& predArea;
+    std::array<double, 3*7> const& f;
+    std::vector<unsigned int> const& srcChans;
+
+    template<Type t>
+    Image operator()() {
+        using stype = typename DataType<t>::base_type;
+        constexpr double scale = getImageRangeMax(Type::float32) / getImageRangeMax(t); // like in convertColor
+        unsigned int chans = src.channels();
+        unsigned int nSrcChans = srcChans.size();
+
+        auto tasseledCap = [&] (stype const* row, int x) {
+            double brightness = 0;
+            double greeness = 0;
+            double wetness = 0;
+            stype const* p = row + x * chans;
+            for (unsigned int i = 0; i < nSrcChans; ++i) {
+                double src_val = p[srcChans[i]];
+                brightness += f[i]    * src_val;
+                greeness   += f[i+7]  * src_val;
+                wetness    += f[i+14] * src_val;
+            }
+            return std::array<float, 3>{cv::saturate_cast<float>(scale * brightness),
+                                        cv::saturate_cast<float>(scale * greeness),
+                                        cv::saturate_cast<float>(scale * wetness)};
+        };
+
+        // mean and standard deviation of the valid locations in the full image, like ConstImage::meanStdDev
+        std::array<double, 3> sum{};
+        std::array<double, 3> sqsum{};
+        std::size_t n = 0;
+        for (int y = 0; y < src.height(); ++y) {
+            stype const* srcRow = src.cvMat().ptr<stype>(y);
+            uint8_t const* maskRow = mask.empty() ? nullptr : mask.cvMat().ptr<uint8_t>(y);
+            for (int x = 0; x < src.width(); ++x) {
+                if (maskRow && !maskRow[x])
+                    continue;
+
+                std::array<float, 3> tc = tasseledCap(srcRow, x);
+                for (unsigned int c = 0; c < 3; ++c) {
+                    sum[c]   += tc[c];
+                    sqsum[c] += static_cast<double>(tc[c]) * tc[c];
+                }
+                ++n;
+            }
+        }
+
+        std::array<double, 3> mean{};
+        std::array<double, 3> invStd{1, 1, 1};
+        for (unsigned int c = 0; c < 3 && n > 0; ++c) {
+            mean[c] = sum[c] / n;
+            double s = std::sqrt(std::max(sqsum[c] / n - mean[c] * mean[c], 0.));
+            if (s != 0)
+                invStd[c] = 1 / s;
+        }
+
+        // disturbance index in the prediction area, standardized only at valid locations
+        Image di{predArea.width, predArea.height, Type::float32x1};
+        for (int y = 0; y < predArea.height; ++y) {
+            stype const* srcRow = src.cvMat().ptr<stype>(predArea.y + y);
+            uint8_t const* maskRow = mask.empty() ? nullptr : mask.cvMat().ptr<uint8_t>(predArea.y + y);
+            float* diRow = di.cvMat().ptr<float>(y);
+            for (int x = 0; x < predArea.width; ++x) {
+                std::array<float, 3> tc = tasseledCap(srcRow, predArea.x + x);
+                if (!maskRow || maskRow[predArea.x + x])
+                    for (unsigned int c = 0; c < 3; ++c)
+                        tc[c] = static_cast<float>((tc[c] - mean[c]) * invStd[c]);
+                diRow[x] = tc[0] - tc[1] - tc[2];
+            }
+        }
+        return di;
+    }
+};
 } /* anonymous namespace */
 
 
@@ -538,22 +629,29 @@ Image StaarchFusor::generateChangeMask(Rectangle const& predArea, ConstImage con
 }
 
 std::vector<Image> StaarchFusor::getLowStdDI(Rectangle const& predArea, ConstImage const& baseMask) const {
-    // convert all low res images to DI
     std::vector<int> lowDates = getLowDates(); // lowDates is sorted
-    std::vector<Image> lowDI;
-    lowDI.reserve(lowDates.size());
-    for (int d : lowDates) {
-        ConstImage lowImg = imgs->get(opt.getLowResTag(), d);
 
-        // tasseled cap transformation
-        auto tc_mapping = opt.getLowResSensor() == StaarchOptions::SensorType::modis ? ColorMapping::Modis_to_TasseledCap
-                                                                                     : ColorMapping::Landsat_to_TasseledCap; // TODO: Add more sensor types when more color transformations are available
-        Image lowTC = lowImg.convertColor(tc_mapping, /* result */ Type::float32, opt.getLowResSourceChannels());
+    // tasseled cap transformation
+    auto tc_mapping = opt.getLowResSensor() == StaarchOptions::SensorType::modis ? ColorMapping::Modis_to_TasseledCap
+                                                                                 : ColorMapping::Landsat_to_TasseledCap; // TODO: Add more sensor types when more color transformations are available
+    std::array<double, 3*7> tc_coeffs = getTasseledCapCoefficients(tc_mapping);
+    std::vector<unsigned int> srcChans = opt.getLowResSourceChannels();
+    if (srcChans.empty()) {
+        srcChans.resize(tc_mapping == ColorMapping::Modis_to_TasseledCap ? 7 : 6);
+        std::iota(srcChans.begin(), srcChans.end(), 0);
+    }
+
+    // get images and masks before going parallel
+    std::vector<ConstImage> lowImgs;
+    std::vector<ConstImage> lowMasks;
+    lowImgs.reserve(lowDates.size());
+    lowMasks.reserve(lowDates.size());
+    for (int d : lowDates) {
+        lowImgs.push_back(imgs->get(opt.getLowResTag(), d).sharedCopy());
+        for (unsigned int sc : srcChans)
+            if (sc >= lowImgs.back().channels())
+                IF_THROW_EXCEPTION(invalid_argument_error("Source channels must be in the range [0, channels-1]. One is: " + std::to_string(sc)));
 
-        // standardize valid parts
-        ConstImage lowMask = baseMask;
-        if (imgs->has(opt.getLowResMaskTag(), d))
-            lowMask = imgs->get(opt.getLowResMaskTag(), d);
         /* note: standardizing using a different mask for every image can cause issues, when clouds
          * invalidate different large parts of land classes in different images. E. g. sea could
          * be clouded in one image, while in another image forest is clouded. However, combining
@@ -563,64 +661,118 @@ std::vector<Image> StaarchFusor::getLowStdDI(Rectangle const& predArea, ConstIma
          * a lot. However, it might be better to use the same places, but we decided against.
          * What is better could be analyzed in future.
          */
-        lowTC = Image{staarch_impl_detail::standardize(std::move(lowTC), lowMask).sharedCopy(predArea)};
-
-        // disturbance index
-        lowDI.push_back(CallBaseTypeFunctorRestrictBaseTypesTo<Type::float32, Type::float64>::run(DisturbanceIndexFunctor{lowTC, {}}, lowTC.basetype()));
+        if (imgs->has(opt.getLowResMaskTag(), d))
+            lowMasks.push_back(imgs->get(opt.getLowResMaskTag(), d).sharedCopy());
+        else
+            lowMasks.push_back(baseMask.sharedCopy());
     }
 
+    // convert all low res images to standardized DI, the dates are independent
+    std::vector<Image> lowDI(lowDates.size());
+    #pragma omp parallel for schedule(dynamic) num_threads(opt.getNumberThreads())
+    for (int i = 0; i < static_cast<int>(lowDates.size()); ++i)
+        lowDI[i] = CallBaseTypeFunctor::run(LowStdDIFunctor{lowImgs[i], lowMasks[i], predArea, tc_coeffs, srcChans}, lowImgs[i].basetype());
+
      // required: lowDI must have the same order as lowDates
     return lowDI;
 }
 
 
 
-// return averaged DIs and combined masks
-std::pair<std::vector<Image>, std::vector<Image>> StaarchFusor::averageDI(std::vector<Image> lowDI, Rectangle const& predArea) const {
+Image StaarchFusor::getLowDOD(std::vector<Image> const& lowDI, Rectangle const& predArea, ConstImage const& changeMask) const {
     std::vector<int> lowDates = getLowDates(); // lowDates is sorted
+    assert(lowDates.size() == lowDI.size() && "The sizes do not fit! Error.");
+    assert(lowDI.front().type() == Type::float32x1 && "We assumed float32 for simplicity.");
+    int nimg = lowDates.size();
 
-    // copy masks
-    std::vector<Image> masks;
-    masks.reserve(lowDates.size());
+    // masks of the full image size, empty means all valid
+    std::vector<ConstImage> masks;
+    masks.reserve(nimg);
     for (int d : lowDates) {
         if (imgs->has(opt.getLowResMaskTag(), d))
-            masks.push_back(imgs->get(opt.getLowResMaskTag(), d).clone(predArea));
+            masks.push_back(imgs->get(opt.getLowResMaskTag(), d).sharedCopy());
         else
-            masks.push_back(Image{}); // empty mask
+            masks.push_back(ConstImage{}); // empty mask
     }
 
+    // moving average window [i - before, i + after] for date i, see StaarchOptions::setDIMovingAverageWindow()
     unsigned int n_imgs = opt.getNumberImagesForAveraging();
     auto alignment = opt.getDIMovingAverageWindow();
-    if (n_imgs > 1 && !(n_imgs == 2 && alignment == StaarchOptions::MovingAverageWindow::center))
-        CallBaseTypeFunctorRestrictBaseTypesTo<Type::float32, Type::float64>::run(
-                    staarch_impl_detail::AveragingFunctor{lowDI, masks, n_imgs, alignment}, lowDI.front().basetype());
-    return {lowDI, masks};
-
-}
-
-// find per-pixel minimum and maximum disturbance index
-Image StaarchFusor::getLowThresh(std::vector<Image> const& lowAvgDI, std::vector<Image> const& lowCombinedMasks) const {
-    assert(lowAvgDI.front().type() == Type::float32x1 && "We assumed float32 for simplicity.");
-    Image minDI{lowAvgDI.front().size(), lowAvgDI.front().type()};
-    Image maxDI{lowAvgDI.front().size(), lowAvgDI.front().type()};
+    int before = 0;
+    int after = 0;
+    if (n_imgs > 1 && !(n_imgs == 2 && alignment == StaarchOptions::MovingAverageWindow::center)) {
+        if (alignment == StaarchOptions::MovingAverageWindow::forward)
+            after = n_imgs - 1;
+        else if (alignment == StaarchOptions::MovingAverageWindow::backward)
+            before = n_imgs - 1;
+        else
+            before = after = n_imgs / 2;
+    }
+    bool backward = alignment == StaarchOptions::MovingAverageWindow::backward;
 
+    float ratio = opt.getLowResDIRatio();
     constexpr float inf = std::numeric_limits<float>::infinity();
-    minDI.set(inf); // behaviour for Image::minimum() with -inf and inf is tested in Image_test.cpp. Image::maximum() is assumed to behave the same way.
-    maxDI.set(-inf);
+    constexpr int32_t int_nan = std::numeric_limits<int32_t>::max();
+    Image dod{predArea.width, predArea.height, Type::int32x1}; // dates are of type int, could be just day of year like, 234 or 2019234 or a date as integer like 20190523
+
+    #pragma omp parallel num_threads(opt.getNumberThreads())
+    {
+        std::vector<float const*> diRows(nimg);
+        std::vector<uint8_t const*> maskRows(nimg);
+        std::vector<float> avgDI(nimg);
+        std::vector<uint8_t> avgValid(nimg);
+
+        #pragma omp for schedule(static)
+        for (int y = 0; y < predArea.height; ++y) {
+            for (int i = 0; i < nimg; ++i) {
+                diRows[i] = lowDI[i].cvMat().ptr<float>(y);
+                maskRows[i] = masks[i].empty() ? nullptr : masks[i].cvMat().ptr<uint8_t>(predArea.y + y) + predArea.x;
+            }
+            uint8_t const* changeRow = changeMask.cvMat().ptr<uint8_t>(y);
+            int32_t* dodRow = dod.cvMat().ptr<int32_t>(y);
+
+            for (int x = 0; x < predArea.width; ++x) {
+                dodRow[x] = int_nan;
+                if (!changeRow[x])
+                    continue;
+
+                // average the DI over the window, a location is valid if it is valid at any date of the window
+                float minDI = inf;
+                float maxDI = -inf;
+                for (int i = 0; i < nimg; ++i) {
+                    int jbegin = std::max(i - before, 0);
+                    int jend   = std::min(i + after, nimg - 1);
+                    double val = 0;
+                    int count = 0;
+                    for (int k = jbegin; k <= jend; ++k) {
+                        int j = backward ? jend - (k - jbegin) : k; // backward sums from the target date to the past
+                        if (!maskRows[j] || maskRows[j][x]) {
+                            val += diRows[j][x];
+                            ++count;
+                        }
+                    }
 
-    std::vector<int> lowDates = getLowDates();
-    assert(lowDates.size() == lowAvgDI.size() && "The sizes do not fit! Error.");
-    for (unsigned int i = 0; i < lowDates.size(); ++i) {
-        Image const& di = lowAvgDI.at(i);
-        ConstImage const& lowMask = lowCombinedMasks.at(i);
+                    avgValid[i] = count > 0;
+                    avgDI[i] = count > 0 ? cv::saturate_cast<float>(val / count) : diRows[i][x];
+                    if (avgValid[i]) {
+                        minDI = std::min(minDI, avgDI[i]);
+                        maxDI = std::max(maxDI, avgDI[i]);
+                    }
+                }
 
-        minDI = std::move(minDI).minimum(di, lowMask);
-        maxDI = std::move(maxDI).maximum(di, lowMask);
+                // the first valid date, at which the DI reaches the per-pixel threshold min + (max - min) * t, is the date of disturbance
+                float thresh = minDI + (maxDI - minDI) * ratio;
+                for (int i = 0; i < nimg; ++i) {
+                    if (avgValid[i] && avgDI[i] - thresh >= 0) {
+                        dodRow[x] = lowDates[i];
+                        break;
+                    }
+                }
+            }
+        }
     }
 
-    // per-pixel threshold is min + (max - min) * t
-    Image thresh = minDI.add(std::move(maxDI).subtract(minDI).multiply(opt.getLowResDIRatio()));
-    return thresh;
+    return dod;
 }
 
 ConstImage const& StaarchFusor::generateDODImage(ConstImage const& baseMask) {
@@ -638,40 +790,10 @@ ConstImage const& StaarchFusor::generateDODImage(ConstImage const& baseMask) {
     std::vector<Image> lowDI = getLowStdDI(predArea, baseMask); // lowDI have the same order as lowDates
     assert(lowDates.size() == lowDI.size());
 
-    auto lowAvgDI_and_combinedMasks = averageDI(std::move(lowDI), predArea);
-    std::vector<Image>& lowAvgDI = lowAvgDI_and_combinedMasks.first;
-    std::vector<Image>& lowCombinedMasks = lowAvgDI_and_combinedMasks.second;
-    assert(lowAvgDI.size() == lowCombinedMasks.size());
-
-    /* Per-pixel threshold min + (max - min) * t, might contain invalid values (inf, -inf, nan)
-     * for always invalid locations. However, these are not used anyways, since the lowMask below
-     * will have marked these locations as invalid (since they are never valid).
-     */
-    Image thresh = getLowThresh(lowAvgDI, lowCombinedMasks);
-
     Image changeMask = generateChangeMask(predArea, baseMask); // it's enough to use baseMask here, since it will propagate into the change mask
-    Image pixelsLeft = changeMask;
 
-    if (dodImage.size() != changeMask.size())
-        dodImage = Image{changeMask.size(), Type::int32x1}; // dates are of type int, could be just day of year like, 234 or 2019234 or a date as integer like 20190523
-
-    constexpr int32_t int_nan = std::numeric_limits<int32_t>::max();
-    dodImage.set(int_nan);
-    for (unsigned int i = 0; i < lowDates.size(); ++i) {
-        int date = lowDates.at(i);
-        Image& di = lowAvgDI.at(i);
-        di = std::move(di).subtract(thresh);
-
-        ConstImage const& lowMask = lowCombinedMasks.at(i);
-
-        Image disturbed = di.createSingleChannelMaskFromRange({Interval::closed(0, std::numeric_limits<double>::infinity())});
-        disturbed = std::move(disturbed).bitwise_and(pixelsLeft).bitwise_and(lowMask);
-
-        // TODO: Add option to mark a pixel only as disturbed if it is never disturbed before thresh and always after thresh???
-        dodImage.set(date, disturbed); // set date as pixel value
-
-        pixelsLeft = pixelsLeft.bitwise_and(std::move(disturbed).bitwise_not());
-    }
+    // TODO: Add option to mark a pixel only as disturbed if it is never disturbed before thresh and always after thresh???
+    dodImage = getLowDOD(lowDI, predArea, changeMask);
 
 //    // Debug output of DOD image
 //    std::cout << "DOD image with the following values:";
@@ -776,6 +898,7 @@ void StaarchFusor::predict(int date, ConstImage const& baseMask, ConstImage cons
 #ifdef _OPENMP
     imagefusion::ParallelizerOptions<imagefusion::StarfmOptions> parStarfmOpts;
     parStarfmOpts.setPredictionArea(opt.getPredictionArea());
+    parStarfmOpts.setNumberOfThreads(opt.getNumberThreads());
     imagefusion::Parallelizer<imagefusion::StarfmFusor> starfm;
 #else /* _OPENMP not defined */
     starfmOpts.setPredictionArea(opt.getPredictionArea());
@@ -784,55 +907,37 @@ void StaarchFusor::predict(int date, ConstImage const& baseMask, ConstImage cons
 
     starfm.srcImages(predictSrc);
 
-    // prediction mask must have full size, while dodImage is in the size of the output / prediction area
-    Image starfmPredMask{predictSrc->getAny().size(), Type::uint8x1};
-    Image starfmPredMaskCropped = opt.getPredictionArea().area() == 0 ? Image{starfmPredMask.sharedCopy()}
-                                                                      : Image{starfmPredMask.sharedCopy(opt.getPredictionArea())};
-
-    // predict from both sides
+    // select the pairs for each pixel: undisturbed pixels are predicted from both sides, pixels
+    // disturbed after the prediction date from the left and the others from the right. The
+    // selection must have full size, while dodImage is in the size of the output / prediction area
+    Image pairSelection{predictSrc->getAny().size(), Type::uint8x1};
+    Image pairSelectionCropped = opt.getPredictionArea().area() == 0 ? Image{pairSelection.sharedCopy()}
+                                                                     : Image{pairSelection.sharedCopy(opt.getPredictionArea())};
     Image disturbed = dodImage.createSingleChannelMaskFromRange({Interval::closed(-std::numeric_limits<int32_t>::min()+1, std::numeric_limits<int32_t>::max()-1)});
-    starfmPredMask.set(0);
-    starfmPredMaskCropped.copyValuesFrom(disturbed.bitwise_not());
-
-    starfmOpts.setDoublePairDates(opt.dateLeft, opt.dateRight);
-#ifdef _OPENMP
-    parStarfmOpts.setAlgOptions(starfmOpts);
-    starfm.processOptions(parStarfmOpts);
-#else /* _OPENMP not defined */
-    starfm.processOptions(starfmOpts);
-#endif /* _OPENMP */
-    starfm.predict(date, makeStarfmMask(baseMask, *imgs, opt, opt.dateLeft, date, opt.dateRight), starfmPredMask);
-    output = starfm.outputImage().clone();
-
-    // predict from left
-    Image fromLeft = dodImage.createSingleChannelMaskFromRange({Interval::closed(date+1, std::numeric_limits<int32_t>::max()-1)});
-    starfmPredMask.set(0);
-    starfmPredMaskCropped.copyValuesFrom(fromLeft);
-
-    starfmOpts.setSinglePairDate(opt.dateLeft);
-#ifdef _OPENMP
-    parStarfmOpts.setAlgOptions(starfmOpts);
-    starfm.processOptions(parStarfmOpts);
-#else /* _OPENMP not defined */
-    starfm.processOptions(starfmOpts);
-#endif /* _OPENMP */
-    starfm.predict(date, makeStarfmMask(baseMask, *imgs, opt, starfmOpts.getSinglePairDate(), date), starfmPredMask);
-    output.copyValuesFrom(starfm.outputImage(), fromLeft);
-
-    // predict from right
+    Image fromLeft  = dodImage.createSingleChannelMaskFromRange({Interval::closed(date+1, std::numeric_limits<int32_t>::max()-1)});
     Image fromRight = dodImage.createSingleChannelMaskFromRange({Interval::closed(-std::numeric_limits<int32_t>::min()+1, date)});
-    starfmPredMask.set(0);
-    starfmPredMaskCropped.copyValuesFrom(fromRight);
+    pairSelection.set(0);
+    pairSelectionCropped.set(3, disturbed.bitwise_not());
+    pairSelectionCropped.set(1, fromLeft);
+    pairSelectionCropped.set(2, fromRight);
 
-    starfmOpts.setSinglePairDate(opt.dateRight);
+    // masks for the pixels predicted from both sides, from left and from right
+    Image validMask = makeStarfmMask(baseMask, *imgs, opt, opt.dateLeft, date, opt.dateRight);
+    std::vector<ConstImage> singlePairMasks{makeStarfmMask(baseMask, *imgs, opt, opt.dateLeft, date),
+                                            makeStarfmMask(baseMask, *imgs, opt, opt.dateRight, date)};
+
+    // predict all pixels in a single pass, which shares the difference images between the three configurations
+    starfmOpts.setDoublePairDates(opt.dateLeft, opt.dateRight);
 #ifdef _OPENMP
     parStarfmOpts.setAlgOptions(starfmOpts);
     starfm.processOptions(parStarfmOpts);
+    starfm.predictWith([&] (auto& f) { f.preparePairContext(validMask, singlePairMasks); },
+                       [&] (auto& f) { f.predictWithPairSelection(date, pairSelection, validMask, singlePairMasks); });
 #else /* _OPENMP not defined */
     starfm.processOptions(starfmOpts);
+    starfm.predictWithPairSelection(date, pairSelection, validMask, singlePairMasks);
 #endif /* _OPENMP */
-    starfm.predict(date, makeStarfmMask(baseMask, *imgs, opt, starfmOpts.getSinglePairDate(), date), starfmPredMask);
-    output.copyValuesFrom(starfm.outputImage(), fromRight);
+    output = std::move(starfm.outputImage());
 }
 
 
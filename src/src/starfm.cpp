@@ -1,4 +1,6 @@
 #include "starfm.h"
+#include "starfm_kernels.h"
+#include "image_expr.h"
 #include <math.h>
 
 
@@ -140,8 +142,192 @@ void StarfmFusor::checkInputImages(ConstImage const& validMask, ConstImage const
 }
 
 
+std::shared_ptr<starfm_impl_detail::PairContext const> StarfmFusor::makePairContext(ConstImage const& validMask, Rectangle const& sampleArea,
+                                                                                    std::vector<ConstImage> const& singlePairMasks) const
+{
+    auto ctx = std::make_shared<starfm_impl_detail::PairContext>();
+    ctx->opt = opt;
+    ctx->area = sampleArea;
+    ctx->distWeights = computeDistanceWeights();
+    if (!validMask.empty())
+        ctx->mask = validMask.clone();
+
+    std::vector<int> pairDates{opt.date1};
+    if (opt.isDoublePairModeConfigured())
+        pairDates.push_back(opt.date3);
+
+    // full image used to ensure that prediction area has no influence
+    auto tolerances = [this] (ConstImage const& hFull, ConstImage const& mask) {
+        auto meanStdDev = hFull.meanStdDev(mask);
+        for (double& sd : meanStdDev.second)
+            sd *= 2.0 / opt.getNumberClasses();
+        return meanStdDev.second;
+    };
+
+    for (unsigned int ip = 0; ip < pairDates.size(); ++ip) {
+        int date = pairDates[ip];
+        ConstImage const& hFull = imgs->get(opt.getHighResTag(), date);
+        ctx->tol_vec.push_back(tolerances(hFull, validMask));
+        if (!singlePairMasks.empty()) {
+            ConstImage const& m = singlePairMasks.at(ip);
+            ctx->singleTol_vec.push_back(tolerances(hFull, m));
+            ctx->singleMasks.push_back(m.empty() ? ConstImage{} : ConstImage{m.clone()});
+        }
+
+        ConstImage const& lFull = imgs->get(opt.getLowResTag(), date);
+        ctx->pairImages.push_back(hFull.sharedCopy());
+        ctx->pairImages.push_back(lFull.sharedCopy());
+
+        ConstImage hk = hFull.sharedCopy(sampleArea);
+        ConstImage lk = lFull.sharedCopy(sampleArea);
+        ctx->diffS_vec.emplace_back(lk.absdiff(hk));
+    }
+    return ctx;
+}
+
+
+bool StarfmFusor::isPairContextValid(ConstImage const& validMask, Rectangle const& sampleArea,
+                                     std::vector<ConstImage> const& singlePairMasks, bool trustCheckedMasks) const
+{
+    if (!pairCtx || (pairCtx->area & sampleArea) != sampleArea)
+        return false;
+
+    // options that influence the context
+    StarfmOptions const& o = pairCtx->opt;
+    bool isDoublePair = opt.isDoublePairModeConfigured();
+    if (o.isDoublePairModeConfigured() != isDoublePair || o.date1 != opt.date1 || (isDoublePair && o.date3 != opt.date3) ||
+        o.highTag != opt.highTag || o.lowTag != opt.lowTag ||
+        o.winSize != opt.winSize || o.numClasses != opt.numClasses)
+    {
+        return false;
+    }
+
+    // pair images must be the same objects, not just with equal dates
+    std::vector<int> pairDates{opt.date1};
+    if (isDoublePair)
+        pairDates.push_back(opt.date3);
+
+    if (pairCtx->pairImages.size() != 2 * pairDates.size())
+        return false;
+
+    for (unsigned int i = 0; i < pairDates.size(); ++i) {
+        ConstImage const& h = imgs->get(opt.getHighResTag(), pairDates[i]);
+        ConstImage const& l = imgs->get(opt.getLowResTag(),  pairDates[i]);
+        ConstImage const& hCtx = pairCtx->pairImages.at(2 * i);
+        ConstImage const& lCtx = pairCtx->pairImages.at(2 * i + 1);
+        if (!h.isSharedWith(hCtx) || h.size() != hCtx.size() || !l.isSharedWith(lCtx) || l.size() != lCtx.size())
+            return false;
+    }
+
+    // the single pair tolerances are only required for a pair selection
+    if (!singlePairMasks.empty() && pairCtx->singleMasks.size() != singlePairMasks.size())
+        return false;
+
+    // masks that have already been compared with this context are recognized by their memory, so
+    // a prediction in many tiles compares the mask contents only once
+    bool isCheckedCtx = !checkedCtx.owner_before(pairCtx) && !pairCtx.owner_before(checkedCtx);
+    if (trustCheckedMasks && isCheckedCtx && checkedMasks.size() == singlePairMasks.size() + 1) {
+        bool isKnown = isSameMaskData(checkedMasks.front(), validMask);
+        for (unsigned int i = 0; i < singlePairMasks.size(); ++i)
+            isKnown = isKnown && isSameMaskData(checkedMasks[i + 1], singlePairMasks[i]);
+        if (isKnown)
+            return true;
+    }
+
+    // the tolerances depend on the mask contents
+    for (unsigned int i = 0; i < singlePairMasks.size(); ++i)
+        if (!isSameMask(pairCtx->singleMasks[i], singlePairMasks[i]))
+            return false;
+    if (!isSameMask(pairCtx->mask, validMask))
+        return false;
+
+    checkedCtx = pairCtx;
+    checkedMasks.clear();
+    checkedMasks.push_back(validMask.sharedCopy());
+    for (ConstImage const& m : singlePairMasks)
+        checkedMasks.push_back(m.sharedCopy());
+    return true;
+}
+
+
+void StarfmFusor::preparePairContext(ConstImage const& validMask, std::vector<ConstImage> const& singlePairMasks) {
+    if (!imgs)
+        IF_THROW_EXCEPTION(logic_error("No MultiResImage object stored in StarfmFusor while preparing the pair context. This looks like a programming error."));
+
+    if (!imgs->has(opt.getHighResTag(), opt.date1) || !imgs->has(opt.getLowResTag(), opt.date1) ||
+        (opt.isDoublePairModeConfigured() && (!imgs->has(opt.getHighResTag(), opt.date3) || !imgs->has(opt.getLowResTag(), opt.date3))))
+    {
+        IF_THROW_EXCEPTION(not_found_error("Not all images of the input pairs are available to prepare the STARFM pair context."));
+    }
+
+    Rectangle predArea = opt.getPredictionArea();
+    Size fullSize = imgs->get(opt.getHighResTag(), opt.date1).size();
+    if (predArea.x == 0 && predArea.y == 0 && predArea.width == 0 && predArea.height == 0) {
+        predArea.width  = fullSize.width;
+        predArea.height = fullSize.height;
+    }
+
+    Rectangle sampleArea = findSampleArea(fullSize, predArea);
+    if (!isPairContextValid(validMask, sampleArea, singlePairMasks))
+        pairCtx = makePairContext(validMask, sampleArea, singlePairMasks);
+}
+
+
 void StarfmFusor::predict(int date2, ConstImage const& validMask, ConstImage const& predMask) {
+    predictImpl(date2, validMask, validMask, predMask, ConstImage{}, {});
+}
+
+
+void StarfmFusor::predict(int date2, BitMask const& validMask, BitMask const& predMask) {
+    Image validImg = validMask.toImage();
+    checkInputImages(validImg, ConstImage{}, date2);
+    checkPredMask(predMask, imgs->get(opt.getLowResTag(), opt.date1).size());
+    predictImpl(date2, validImg, validImg, ConstImage{}, ConstImage{}, {}, predMask);
+}
+
+
+void StarfmFusor::predictWithPairMask(int date2, ConstImage const& pairMask, ConstImage const& validMask, ConstImage const& predMask) {
+    checkInputImages(pairMask, predMask, date2);
+    predictImpl(date2, validMask, pairMask, predMask, ConstImage{}, {});
+}
+
+
+void StarfmFusor::predictWithPairSelection(int date2, ConstImage const& pairSelection, ConstImage const& validMask,
+                                           std::vector<ConstImage> const& singlePairMasks, ConstImage const& predMask)
+{
+    if (!opt.isDoublePairModeConfigured())
+        IF_THROW_EXCEPTION(logic_error("A prediction with pair selection requires the double pair mode to be configured."));
+
+    if (!singlePairMasks.empty() && singlePairMasks.size() != 2)
+        IF_THROW_EXCEPTION(invalid_argument_error("Either no or two single pair masks are required for a prediction with pair selection, but "
+                                                  + std::to_string(singlePairMasks.size()) + " have been given."));
+
     checkInputImages(validMask, predMask, date2);
+    for (ConstImage const& m : singlePairMasks)
+        checkInputImages(m, predMask, date2);
+
+    Size s = imgs->get(opt.getLowResTag(), opt.date1).size();
+    if (pairSelection.size() != s)
+        IF_THROW_EXCEPTION(size_error("The pairSelection has a wrong size: " + to_string(pairSelection.size()) +
+                                      ". It must have the same size as the images: " + to_string(s) + "."))
+                << errinfo_size(pairSelection.size());
+
+    if (pairSelection.type() != Type::uint8x1)
+        IF_THROW_EXCEPTION(image_type_error("The pairSelection has a wrong type: " + to_string(pairSelection.type()) +
+                                            ". It must be a single-channel image of type " + to_string(Type::uint8) + "."))
+                << errinfo_image_type(pairSelection.type());
+
+    predictImpl(date2, validMask, validMask, predMask, pairSelection,
+                singlePairMasks.empty() ? std::vector<ConstImage>(2) : singlePairMasks);
+}
+
+
+void StarfmFusor::predictImpl(int date2, ConstImage const& validMask, ConstImage const& pairMask, ConstImage const& predMask,
+                              ConstImage const& pairSelection, std::vector<ConstImage> const& singlePairMasks,
+                              BitMask const& predBits)
+{
+    if (pairSelection.empty())
+        checkInputImages(validMask, predMask, date2);
     Rectangle predArea = opt.getPredictionArea();
 
     // if no prediction area has been set, use full img size
@@ -159,31 +345,39 @@ void StarfmFusor::predict(int date2, ConstImage const& validMask, ConstImage con
     predArea.x -= sampleArea.x;
     predArea.y -= sampleArea.y;
 
+    // get pair context, which is only computed here if the current one cannot be used, and keep it for the next dates
+    if (!isPairContextValid(pairMask, sampleArea, singlePairMasks, /*trustCheckedMasks*/ true))
+        pairCtx = makePairContext(pairMask, sampleArea, singlePairMasks);
+    std::shared_ptr<starfm_impl_detail::PairContext const> ctx = pairCtx;
+    Rectangle diffArea = sampleArea;
+    diffArea.x -= ctx->area.x;
+    diffArea.y -= ctx->area.y;
+
     // get input images
     ConstImage sampleMask = validMask.empty() ? validMask.sharedCopy() : validMask.sharedCopy(sampleArea);
     ConstImage writeMask = predMask.empty() ? predMask.sharedCopy() : predMask.sharedCopy(sampleArea);
+    ConstImage sampleSelection = pairSelection.empty() ? pairSelection.sharedCopy() : pairSelection.sharedCopy(sampleArea);
+    std::vector<ConstImage> singleSampleMasks;
+    for (ConstImage const& m : singlePairMasks)
+        singleSampleMasks.push_back(m.empty() ? m.sharedCopy() : m.sharedCopy(sampleArea));
     bool isDoublePairMode = opt.isDoublePairModeConfigured();
-    std::vector<ConstImage> hkFull{imgs->get(opt.getHighResTag(), opt.date1).sharedCopy()}; // full image used to ensure that prediction area has no influence
     std::vector<ConstImage> hk_vec{imgs->get(opt.getHighResTag(), opt.date1).sharedCopy(sampleArea)};
     std::vector<ConstImage> lk_vec{imgs->get(opt.getLowResTag(),  opt.date1).sharedCopy(sampleArea)};
     ConstImage l2                = imgs->get(opt.getLowResTag(),      date2).sharedCopy(sampleArea);
     if (isDoublePairMode) {
-        hkFull.emplace_back(imgs->get(opt.getHighResTag(), opt.date3).sharedCopy());
         hk_vec.emplace_back(imgs->get(opt.getHighResTag(), opt.date3).sharedCopy(sampleArea));
         lk_vec.emplace_back(imgs->get(opt.getLowResTag(),  opt.date3).sharedCopy(sampleArea));
     }
 
-    // spectral and temporal diffs
-    std::vector<Image> diffS_vec;
+    // spectral (from context) and temporal diffs
+    std::vector<ConstImage> diffS_vec;
     std::vector<Image> diffT_vec;
 
     // local values
-    Type resType = getResultType(l2.type());
     std::vector<Image> localValues_vec;
 
-    // set tols
-    unsigned int imgChans = l2.channels();
-    std::vector<std::vector<double>> tol_vec;
+    // tols from context
+    std::vector<std::vector<double>> const& tol_vec = ctx->tol_vec;
 
     // copied pixels
     Image diffZero;
@@ -198,105 +392,85 @@ void StarfmFusor::predict(int date2, ConstImage const& validMask, ConstImage con
         ConstImage const& lk = lk_vec.at(ip);
 
         // spectral and temporal diffs
-        diffS_vec.emplace_back(lk.absdiff(hk));
+        diffS_vec.emplace_back(ctx->diffS_vec.at(ip).constSharedCopy(diffArea));
         diffT_vec.emplace_back(lk.absdiff(l2));
 
-        // local values
-        Image localValues = hk.add(l2, resType).subtract(lk, resType);
-        localValues_vec.emplace_back(localValues.convertTo(l2.type()));
+        // local values, evaluated in a single pass without intermediate images
+        using namespace expr;
+        localValues_vec.emplace_back((lazy(hk) + lazy(l2) - lazy(lk)).eval(l2.type()));
+    }
 
-        // set tols
-        auto meanStdDev = hkFull.at(ip).meanStdDev(validMask);
-        for (double& sd : meanStdDev.second)
-            sd *= 2.0 / opt.getNumberClasses();
-        tol_vec.push_back(std::move(meanStdDev.second));
+    // set trivial pixels with multi-channel masks, restricted to the pixels that use the given pairs
+    auto copyOnZeroDiff = [&] (std::vector<unsigned int> const& pairs, ConstImage const& restriction) {
+        auto restrictTo = [&restriction] (Image zero) {
+            return restriction.empty() ? std::move(zero) : std::move(zero).bitwise_and(restriction);
+        };
 
-        // set trivial pixels (zero spectral diff) with multi-channel masks to new low res pixels
-        if (opt.getDoCopyOnZeroDiff()) {
-            Image diffSZero{diffS_vec.back().cvMat() == 0};
+        // zero spectral diff to new low res pixels
+        for (unsigned int ip : pairs) {
+            Image diffSZero = restrictTo(Image{diffS_vec.at(ip).cvMat() == 0});
             output.copyValuesFrom(l2.sharedCopy(predArea), diffSZero.constSharedCopy(predArea));
             diffZero = std::move(diffZero).bitwise_or(diffSZero);
         }
-    }
 
-    // set trivial pixels (zero temporal diff) with multi-channel masks to high res pixels, maybe average
-    if (opt.getDoCopyOnZeroDiff()) {
+        // zero temporal diff to high res pixels, maybe average
         // high res date 1
-        Image diffT1Zero{diffT_vec.front().cvMat() == 0};
-        output.copyValuesFrom(hk_vec.front().sharedCopy(predArea), diffT1Zero.constSharedCopy(predArea));
+        Image diffT1Zero = restrictTo(Image{diffT_vec.at(pairs.front()).cvMat() == 0});
+        output.copyValuesFrom(hk_vec.at(pairs.front()).sharedCopy(predArea), diffT1Zero.constSharedCopy(predArea));
         diffZero = std::move(diffZero).bitwise_or(diffT1Zero);
 
-        if (isDoublePairMode) {
+        if (pairs.size() == 2) {
             // high res date 3
-            Image diffT2Zero{diffT_vec.back().cvMat() == 0};
-            output.copyValuesFrom(hk_vec.back().sharedCopy(predArea), diffT2Zero.constSharedCopy(predArea));
+            Image diffT2Zero = restrictTo(Image{diffT_vec.at(pairs.back()).cvMat() == 0});
+            output.copyValuesFrom(hk_vec.at(pairs.back()).sharedCopy(predArea), diffT2Zero.constSharedCopy(predArea));
             diffZero = std::move(diffZero).bitwise_or(diffT2Zero);
 
             // (high res date 1  +  high res date 3) / 2
             Image diffT1And2Zero = diffT1Zero.bitwise_and(std::move(diffT2Zero));
-            Image temp{hk_vec.front().constSharedCopy(predArea).cvMat() * 0.5
-                      + hk_vec.back().constSharedCopy(predArea).cvMat() * 0.5};
+            Image temp{hk_vec.at(pairs.front()).constSharedCopy(predArea).cvMat() * 0.5
+                      + hk_vec.at(pairs.back()).constSharedCopy(predArea).cvMat() * 0.5};
             output.copyValuesFrom(temp, diffT1And2Zero.constSharedCopy(predArea));
         }
-    }
-//    output.copyValuesFrom(localValues.sharedCopy(predArea));
-
-    // init output as double type (for convenience) and get distance weights
-    Image distWeights = computeDistanceWeights();
-    unsigned int xmax = predArea.x + predArea.width;
-    unsigned int ymax = predArea.y + predArea.height;
-
-    // predict with moving window
-    for (unsigned int y = predArea.y; y < ymax; ++y) {
-        for (unsigned int x = predArea.x; x < xmax; ++x) {
-            if (!writeMask.empty() && !writeMask.boolAt(x, y, 0))
-                continue; // no prediction wanted, skip
-
-            Rectangle window((int)x - opt.winSize / 2, (int)y - opt.winSize / 2, opt.winSize, opt.winSize);
-            std::vector<ConstImage> hk_win_vec;
-            std::vector<ConstImage> dt_win_vec;
-            std::vector<ConstImage> ds_win_vec;
-            std::vector<ConstImage> lv_win_vec;
-            for (unsigned int ip = 0; ip < hk_vec.size(); ++ip) {
-                hk_win_vec.emplace_back(hk_vec.at(ip).constSharedCopy(window));
-                dt_win_vec.emplace_back(diffT_vec.at(ip).constSharedCopy(window));
-                ds_win_vec.emplace_back(diffS_vec.at(ip).constSharedCopy(window));
-                lv_win_vec.emplace_back(localValues_vec.at(ip).constSharedCopy(window));
-            }
-            ConstImage mask_win = sampleMask.empty() ? sampleMask.sharedCopy() : sampleMask.constSharedCopy(window);
-
-            Rectangle dw_crop{std::max(0, -window.x), std::max(0, -window.y),
-                              hk_win_vec.front().width(), hk_win_vec.front().height()};
-            ConstImage dw_win = distWeights.sharedCopy(dw_crop);
-
-            unsigned int x_win = opt.winSize / 2 - dw_crop.x;
-            unsigned int y_win = opt.winSize / 2 - dw_crop.y;
-            int x_out = x - predArea.x;
-            int y_out = y - predArea.y;
-            Rectangle out_pixel_crop{x_out, y_out, 1, 1};
-            Image out_pixel{output.sharedCopy(out_pixel_crop)};
-
-            for (unsigned int c = 0; c < imgChans; ++c) {
-                unsigned int maskChannel = mask_win.channels() > c ? c : 0;
-                if ((!sampleMask.empty() && !sampleMask.boolAt(x, y, maskChannel)) ||
-                    (!diffZero.empty() && diffZero.boolAt(x, y, c)))
-                {
-                    continue;
-                }
+    };
 
-                CallBaseTypeFunctor::run(starfm_impl_detail::PredictPixel{
-                        opt, x_win, y_win, c, tol_vec, dt_win_vec, ds_win_vec, lv_win_vec, hk_win_vec, mask_win, dw_win, out_pixel},
-                        output.type());
+    if (opt.getDoCopyOnZeroDiff()) {
+        if (sampleSelection.empty())
+            copyOnZeroDiff(isDoublePairMode ? std::vector<unsigned int>{0, 1} : std::vector<unsigned int>{0}, ConstImage{});
+        else {
+            // the selections are disjoint, so each pixel is handled like in its own configuration
+            std::vector<std::pair<uint8_t, std::vector<unsigned int>>> configs{{3, {0, 1}}, {1, {0}}, {2, {1}}};
+            for (auto const& cfg : configs) {
+                cv::Mat selected = sampleSelection.cvMat() == cfg.first;
+                cv::Mat restriction;
+                cv::merge(std::vector<cv::Mat>(l2.channels(), selected), restriction);
+                copyOnZeroDiff(cfg.second, Image{std::move(restriction)});
             }
         }
     }
+//    output.copyValuesFrom(localValues.sharedCopy(predArea));
+
+    // pack the prediction mask of the prediction area, so the pixel loop can skip unmarked runs. A
+    // bit-packed prediction mask is just cropped.
+    BitMask writeBits;
+    if (!predBits.empty())
+        writeBits = predBits.crop(Rectangle{sampleArea.x + predArea.x, sampleArea.y + predArea.y, predArea.width, predArea.height});
+    else if (!writeMask.empty())
+        writeBits = BitMask{writeMask.sharedCopy(predArea)};
+    else
+        writeBits = BitMask{predArea.size(), 1, true};
+
+    // predict with moving window, the type dispatch is done only once for the whole area
+    CallBaseTypeFunctor::run(starfm_impl_detail::PredictArea{
+            opt, predArea, tol_vec, hk_vec, diffT_vec, diffS_vec, localValues_vec,
+            sampleMask, sampleSelection, singleSampleMasks, ctx->singleTol_vec, writeBits, diffZero, ctx->distWeights, output},
+            output.type());
 }
 
 
 template<Type basetype>
-void starfm_impl_detail::PredictPixel::operator()() const {
-    assert((opt.isSinglePairModeConfigured() && hk_win_vec.size() == 1) ||
-           (opt.isDoublePairModeConfigured() && hk_win_vec.size() == 2));
+void starfm_impl_detail::PredictArea::operator()() const {
+    assert((opt.isSinglePairModeConfigured() && hk_vec.size() == 1) ||
+           (opt.isDoublePairModeConfigured() && hk_vec.size() == 2));
     using imgval_t = typename DataType<basetype>::base_type;
 
     // calculate uncertainties
@@ -306,70 +480,172 @@ void starfm_impl_detail::PredictPixel::operator()() const {
     double sigma_ds = std::sqrt(sigma_t * sigma_t + sigma_s * sigma_s);
     double sigma_combined = std::sqrt(sigma_ds * sigma_ds + sigma_dt * sigma_dt);
 
-    // for two pairs choose smaller diffs as filter tolerance
-    imgval_t dt_center = cv::saturate_cast<imgval_t>(dt_win_vec.front().at<imgval_t>(x_center, y_center, c) + sigma_dt);
-    imgval_t ds_center = cv::saturate_cast<imgval_t>(ds_win_vec.front().at<imgval_t>(x_center, y_center, c) + sigma_ds);
-    if (opt.isDoublePairModeConfigured()) {
-        dt_center = std::min(dt_center, cv::saturate_cast<imgval_t>(dt_win_vec.back().at<imgval_t>(x_center, y_center, c) + sigma_dt));
-        ds_center = std::min(ds_center, cv::saturate_cast<imgval_t>(ds_win_vec.back().at<imgval_t>(x_center, y_center, c) + sigma_ds));
-    }
-
-    bool hasCandidate = false;
-    double sumWeights  = 0;
-    double weightedSum = 0;
+    bool isDoublePairMode = opt.isDoublePairModeConfigured();
     bool useTempDiff = opt.getUseTempDiffForWeights() == StarfmOptions::TempDiffWeighting::enable ||
-                       (opt.getUseTempDiffForWeights() == StarfmOptions::TempDiffWeighting::on_double_pair && opt.isDoublePairModeConfigured());
+                       (opt.getUseTempDiffForWeights() == StarfmOptions::TempDiffWeighting::on_double_pair && isDoublePairMode);
+
+    // pixels with a pair selection of only one pair are predicted like in single pair mode
+    bool hasSelection = !pairSelection.empty();
+    bool useTempDiffSingle = opt.getUseTempDiffForWeights() == StarfmOptions::TempDiffWeighting::enable;
+    bool hasSingleST = hasSelection && useTempDiffSingle != useTempDiff;
     double logScale = opt.getLogScaleFactor();
-    unsigned int maskChannel = mask_win.channels() > c ? c : 0;
-
-    // loop over all (1 or 2) pairs
-    unsigned int ymax  = dw_win.height();
-    unsigned int xmax  = dw_win.width();
-    for (unsigned int ip = 0; ip < hk_win_vec.size(); ++ip) {
-        double hk_center = hk_win_vec.at(ip).at<imgval_t>(x_center, y_center, c);
-
-        // loop through window
-        for (unsigned int y = 0; y < ymax; ++y) {
-            for (unsigned int x = 0; x < xmax; ++x) {
-                imgval_t dt = dt_win_vec.at(ip).at<imgval_t>(x, y, c);
-                imgval_t ds = ds_win_vec.at(ip).at<imgval_t>(x, y, c);
-                imgval_t hk = hk_win_vec.at(ip).at<imgval_t>(x, y, c);
-
-                if ((!mask_win.empty() && !mask_win.boolAt(x, y, maskChannel)) ||                                                // check mask
-                    std::abs(hk_center - hk) >= tol_vec.at(ip).at(c)  ||                                                              // check similarity
-                    (opt.getUseStrictFiltering()  ?  (dt >= dt_center || ds >= ds_center)  :  (dt >= dt_center && ds >= ds_center)) // check valid or invalid
-                   )
+
+    RowKernelArgs<basetype> args;
+    args.sigma_combined = sigma_combined;
+    args.logScale = logScale;
+    args.useStrict = opt.getUseStrictFiltering();
+
+    // the row kernel filters the candidates and computes their weights, vectorized if supported by the CPU
+    RowKernel<basetype> weighRow = selectRowKernel<basetype>();
+    std::vector<double> weights(opt.getWinSize());
+
+    int halfWin = opt.getWinSize() / 2;
+    int winSize = opt.getWinSize();
+    int width   = hk_vec.front().width();
+    int height  = hk_vec.front().height();
+    unsigned int imgChans  = output.channels();
+    unsigned int maskChans = sampleMask.empty() ? 1 : sampleMask.channels();
+    unsigned int numPairs  = hk_vec.size();
+
+    // the row kernels require contiguous rows, so the images are split up into channel planes
+    auto channelPlane = [] (ConstImage const& img, unsigned int c) -> cv::Mat {
+        if (img.channels() == 1)
+            return img.cvMat();
+        cv::Mat plane;
+        cv::extractChannel(img.cvMat(), plane, c);
+        return plane;
+    };
+
+    unsigned int ymax = predArea.y + predArea.height;
+    // the spectral and temporal part of the weights only depends on the location, so compute it once per channel
+    auto stPlane = [&] (cv::Mat const& dt_plane, cv::Mat const& ds_plane, bool useTD) {
+        cv::Mat st_plane(height, width, CV_64FC1);
+        for (int ys = 0; ys < height; ++ys) {
+            imgval_t const* dt_row = dt_plane.ptr<imgval_t>(ys);
+            imgval_t const* ds_row = ds_plane.ptr<imgval_t>(ys);
+            double* st_row = st_plane.ptr<double>(ys);
+            for (int xs = 0; xs < width; ++xs)
+                st_row[xs] = spectralTemporalFactor(dt_row[xs], ds_row[xs], logScale, useTD);
+        }
+        return st_plane;
+    };
+
+    for (unsigned int c = 0; c < imgChans; ++c) {
+        unsigned int maskChannel = maskChans > c ? c : 0;
+        cv::Mat mask_plane = sampleMask.empty() ? cv::Mat{} : channelPlane(sampleMask, maskChannel);
+        std::vector<cv::Mat> hk_planes;
+        std::vector<cv::Mat> dt_planes;
+        std::vector<cv::Mat> ds_planes;
+        std::vector<cv::Mat> lv_planes;
+        std::vector<cv::Mat> st_planes;
+        std::vector<cv::Mat> singleMask_planes;
+        std::vector<cv::Mat> singleST_planes;
+        for (unsigned int ip = 0; ip < numPairs; ++ip) {
+            hk_planes.push_back(channelPlane(hk_vec[ip], c));
+            dt_planes.push_back(channelPlane(dt_vec[ip], c));
+            ds_planes.push_back(channelPlane(ds_vec[ip], c));
+            lv_planes.push_back(channelPlane(lv_vec[ip], c));
+            st_planes.push_back(stPlane(dt_planes.back(), ds_planes.back(), useTempDiff));
+
+            if (hasSelection) {
+                ConstImage const& m = singleMasks.at(ip);
+                singleMask_planes.push_back(m.empty() ? cv::Mat{} : channelPlane(m, m.channels() > c ? c : 0));
+                singleST_planes.push_back(hasSingleST ? stPlane(dt_planes.back(), ds_planes.back(), useTempDiffSingle) : st_planes.back());
+            }
+        }
+
+        for (unsigned int y = predArea.y; y < ymax; ++y) {
+            // window rows, clipped to the sample area, and offset of the window into the distance weights
+            int y_dw = (int)y - halfWin;
+            int y0 = std::max(0, y_dw);
+            int y1 = std::min(height, y_dw + winSize);
+
+            int yw = y - predArea.y;
+            for (int xw = writeMask.findNextSet(0, yw); xw < predArea.width; xw = writeMask.findNextSet(xw + 1, yw)) {
+                unsigned int x = predArea.x + xw;
+
+                // pairs to use, mask, tolerances and spectral temporal factors of the configuration of this pixel
+                unsigned int ip_first = 0;
+                unsigned int ip_last  = numPairs - 1;
+                cv::Mat const* px_mask = &mask_plane;
+                std::vector<cv::Mat> const* px_st = &st_planes;
+                bool isSingle = false;
+                if (hasSelection) {
+                    uint8_t sel = pairSelection.at<uint8_t>(x, y, 0);
+                    if (sel == 1 || sel == 2) {
+                        ip_first = ip_last = sel - 1;
+                        px_mask = &singleMask_planes[ip_first];
+                        px_st = &singleST_planes;
+                        isSingle = true;
+                    }
+                    else if (sel != 3)
+                        continue; // not selected
+                }
+                std::vector<std::vector<double>> const& px_tol = isSingle ? singleTol_vec : tol_vec;
+
+                if ((!px_mask->empty() && px_mask->at<uint8_t>(y, x) == 0) ||
+                    (!diffZero.empty() && diffZero.boolAt(x, y, c)))
                 {
                     continue;
                 }
-                hasCandidate = true;
-
-                if (!useTempDiff)
-                    dt = 0;
-
-                double dw = dw_win.at<double>(x, y, 0);
-                double weight = 1;
-                if (logScale > 0)
-                    weight = 1 / (std::log(2 + dt * logScale) * std::log(2 + ds * logScale) * dw);
-                else {
-                    double dts = (1 + dt) * (1 + ds);
-                    if (dts >= sigma_combined)
-                        weight = 1 / (dw * dts);
+
+                // window columns, clipped to the sample area
+                int x_dw = (int)x - halfWin;
+                int x0 = std::max(0, x_dw);
+                int x1 = std::min(width, x_dw + winSize);
+                args.n = x1 - x0;
+
+                // for two pairs choose smaller diffs as filter tolerance
+                args.dt_center = cv::saturate_cast<imgval_t>(dt_planes[ip_first].at<imgval_t>(y, x) + sigma_dt);
+                args.ds_center = cv::saturate_cast<imgval_t>(ds_planes[ip_first].at<imgval_t>(y, x) + sigma_ds);
+                if (ip_last != ip_first) {
+                    args.dt_center = std::min(args.dt_center, cv::saturate_cast<imgval_t>(dt_planes[ip_last].at<imgval_t>(y, x) + sigma_dt));
+                    args.ds_center = std::min(args.ds_center, cv::saturate_cast<imgval_t>(ds_planes[ip_last].at<imgval_t>(y, x) + sigma_ds));
+                }
+
+                bool hasCandidate = false;
+                double sumWeights  = 0;
+                double weightedSum = 0;
+
+                // loop over all (1 or 2) pairs
+                for (unsigned int ip = ip_first; ip <= ip_last; ++ip) {
+                    args.hk_center = hk_planes[ip].at<imgval_t>(y, x);
+                    args.tol = px_tol[ip][c];
+
+                    // loop through window rows
+                    for (int ywin = y0; ywin < y1; ++ywin) {
+                        args.hk   = hk_planes[ip].ptr<imgval_t>(ywin) + x0;
+                        args.dt   = dt_planes[ip].ptr<imgval_t>(ywin) + x0;
+                        args.ds   = ds_planes[ip].ptr<imgval_t>(ywin) + x0;
+                        args.mask = px_mask->empty() ? nullptr : px_mask->ptr<uint8_t>(ywin) + x0;
+                        args.dw   = &distWeights.at<double>(x0 - x_dw, ywin - y_dw, 0);
+                        args.st   = (*px_st)[ip].ptr<double>(ywin) + x0;
+                        weighRow(args, weights.data());
+
+                        // accumulate in order, which makes the result independent of the row kernel
+                        imgval_t const* lv_row = lv_planes[ip].ptr<imgval_t>(ywin) + x0;
+                        for (int i = 0; i < args.n; ++i) {
+                            double weight = weights[i];
+                            if (weight < 0)
+                                continue; // not a candidate
+                            hasCandidate = true;
+
+                            imgval_t lv = lv_row[i];
+                            sumWeights  += weight;
+                            weightedSum += weight * lv;
+                        }
+                    }
                 }
 
-                imgval_t lv = lv_win_vec.at(ip).at<imgval_t>(x, y, c);
-                sumWeights  += weight;
-                weightedSum += weight * lv;
+                imgval_t& out = output.at<imgval_t>(x - predArea.x, y - predArea.y, c);
+                if (hasCandidate)
+                    out = weightedSum / sumWeights;
+                else
+                    out = lv_planes[ip_first].at<imgval_t>(y, x) * 0.5
+                        + lv_planes[ip_last].at<imgval_t>(y, x)  * 0.5;
             }
         }
     }
-
-    imgval_t& out = out_pixel.at<imgval_t>(0, 0, c);
-    if (hasCandidate)
-        out = weightedSum / sumWeights;
-    else
-        out = lv_win_vec.front().at<imgval_t>(x_center, y_center, c) * 0.5
-            + lv_win_vec.back().at<imgval_t>(x_center, y_center, c)  * 0.5;
 }
 
 } /* namespace imagefusion */
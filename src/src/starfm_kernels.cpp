@@ -0,0 +1,259 @@
+#include "starfm_kernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define IMAGEFUSION_X86_ROW_KERNELS
+    #include <cstring>
+    #include <immintrin.h>
+    #define IMAGEFUSION_TARGET_AVX2   __attribute__((target("avx2")))
+    #define IMAGEFUSION_TARGET_AVX512 __attribute__((target("avx2,avx512f")))
+#endif
+
+namespace imagefusion {
+namespace starfm_impl_detail {
+
+namespace {
+
+template<Type basetype>
+void weighRowScalar(RowKernelArgs<basetype> const& args, double* weights) {
+    for (int i = 0; i < args.n; ++i)
+        weights[i] = isCandidate(args, i) ? candidateWeight(args, i) : -1;
+}
+
+
+#ifdef IMAGEFUSION_X86_ROW_KERNELS
+
+/*
+ * Exact conversion of 4 (AVX2) or 8 (AVX-512) image values to double, specialized for each base
+ * type.
+ */
+template<Type basetype>
+struct Lanes;
+
+template<>
+struct Lanes<Type::uint8> {
+    IMAGEFUSION_TARGET_AVX2 static __m256d load4(uint8_t const* p) {
+        int32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v)));
+    }
+
+    IMAGEFUSION_TARGET_AVX512 static __m512d load8(uint8_t const* p) {
+        return _mm512_cvtepi32_pd(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<__m128i const*>(p))));
+    }
+};
+
+template<>
+struct Lanes<Type::int8> {
+    IMAGEFUSION_TARGET_AVX2 static __m256d load4(int8_t const* p) {
+        int32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return _mm256_cvtepi32_pd(_mm_cvtepi8_epi32(_mm_cvtsi32_si128(v)));
+    }
+
+    IMAGEFUSION_TARGET_AVX512 static __m512d load8(int8_t const* p) {
+        return _mm512_cvtepi32_pd(_mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<__m128i const*>(p))));
+    }
+};
+
+template<>
+struct Lanes<Type::uint16> {
+    IMAGEFUSION_TARGET_AVX2 static __m256d load4(uint16_t const* p) {
+        return _mm256_cvtepi32_pd(_mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<__m128i const*>(p))));
+    }
+
+    IMAGEFUSION_TARGET_AVX512 static __m512d load8(uint16_t const* p) {
+        return _mm512_cvtepi32_pd(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(p))));
+    }
+};
+
+template<>
+struct Lanes<Type::int16> {
+    IMAGEFUSION_TARGET_AVX2 static __m256d load4(int16_t const* p) {
+        return _mm256_cvtepi32_pd(_mm_cvtepi16_epi32(_mm_loadl_epi64(reinterpret_cast<__m128i const*>(p))));
+    }
+
+    IMAGEFUSION_TARGET_AVX512 static __m512d load8(int16_t const* p) {
+        return _mm512_cvtepi32_pd(_mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(p))));
+    }
+};
+
+template<>
+struct Lanes<Type::int32> {
+    IMAGEFUSION_TARGET_AVX2 static __m256d load4(int32_t const* p) {
+        return _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<__m128i const*>(p)));
+    }
+
+    IMAGEFUSION_TARGET_AVX512 static __m512d load8(int32_t const* p) {
+        return _mm512_cvtepi32_pd(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(p)));
+    }
+};
+
+template<>
+struct Lanes<Type::float32> {
+    IMAGEFUSION_TARGET_AVX2 static __m256d load4(float const* p) {
+        return _mm256_cvtps_pd(_mm_loadu_ps(p));
+    }
+
+    IMAGEFUSION_TARGET_AVX512 static __m512d load8(float const* p) {
+        return _mm512_cvtps_pd(_mm256_loadu_ps(p));
+    }
+};
+
+template<>
+struct Lanes<Type::float64> {
+    IMAGEFUSION_TARGET_AVX2 static __m256d load4(double const* p) {
+        return _mm256_loadu_pd(p);
+    }
+
+    IMAGEFUSION_TARGET_AVX512 static __m512d load8(double const* p) {
+        return _mm512_loadu_pd(p);
+    }
+};
+
+
+template<Type basetype>
+IMAGEFUSION_TARGET_AVX2 void weighRowAvx2(RowKernelArgs<basetype> const& args, double* weights) {
+    __m256d const one     = _mm256_set1_pd(1);
+    __m256d const none    = _mm256_set1_pd(-1);
+    __m256d const absMask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7FFFFFFFFFFFFFFFLL));
+    __m256d const hkc     = _mm256_set1_pd(args.hk_center);
+    __m256d const tol     = _mm256_set1_pd(args.tol);
+    __m256d const dtc     = _mm256_set1_pd(args.dt_center);
+    __m256d const dsc     = _mm256_set1_pd(args.ds_center);
+    __m256d const sigma   = _mm256_set1_pd(args.sigma_combined);
+    bool useLog = args.logScale > 0;
+
+    int i = 0;
+    for (; i + 4 <= args.n; i += 4) {
+        __m256d hk = Lanes<basetype>::load4(args.hk + i);
+        __m256d dt = Lanes<basetype>::load4(args.dt + i);
+        __m256d ds = Lanes<basetype>::load4(args.ds + i);
+
+        // the comparisons are ordered, so NaN values are not skipped, like in the scalar kernel
+        __m256d skip   = _mm256_cmp_pd(_mm256_and_pd(_mm256_sub_pd(hkc, hk), absMask), tol, _CMP_GE_OQ);
+        __m256d dtFail = _mm256_cmp_pd(dt, dtc, _CMP_GE_OQ);
+        __m256d dsFail = _mm256_cmp_pd(ds, dsc, _CMP_GE_OQ);
+        skip = _mm256_or_pd(skip, args.useStrict ? _mm256_or_pd(dtFail, dsFail) : _mm256_and_pd(dtFail, dsFail));
+        if (args.mask) {
+            int32_t m;
+            std::memcpy(&m, args.mask + i, sizeof(m));
+            __m256i m64 = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(m));
+            skip = _mm256_or_pd(skip, _mm256_castsi256_pd(_mm256_cmpeq_epi64(m64, _mm256_setzero_si256())));
+        }
+
+        int skipBits = _mm256_movemask_pd(skip);
+        if (skipBits == 0xF) {
+            _mm256_storeu_pd(weights + i, none);
+            continue;
+        }
+
+        __m256d dw = _mm256_loadu_pd(args.dw + i);
+        __m256d st = _mm256_loadu_pd(args.st + i);
+        __m256d w  = _mm256_div_pd(one, _mm256_mul_pd(dw, st));
+        if (!useLog)
+            w = _mm256_blendv_pd(one, w, _mm256_cmp_pd(st, sigma, _CMP_GE_OQ));
+        _mm256_storeu_pd(weights + i, _mm256_blendv_pd(w, none, skip));
+    }
+
+    for (; i < args.n; ++i)
+        weights[i] = isCandidate(args, i) ? candidateWeight(args, i) : -1;
+}
+
+
+template<Type basetype>
+IMAGEFUSION_TARGET_AVX512 void weighRowAvx512(RowKernelArgs<basetype> const& args, double* weights) {
+    __m512d const one     = _mm512_set1_pd(1);
+    __m512d const none    = _mm512_set1_pd(-1);
+    __m512i const absMask = _mm512_set1_epi64(0x7FFFFFFFFFFFFFFFLL);
+    __m512d const hkc     = _mm512_set1_pd(args.hk_center);
+    __m512d const tol     = _mm512_set1_pd(args.tol);
+    __m512d const dtc     = _mm512_set1_pd(args.dt_center);
+    __m512d const dsc     = _mm512_set1_pd(args.ds_center);
+    __m512d const sigma   = _mm512_set1_pd(args.sigma_combined);
+    bool useLog = args.logScale > 0;
+
+    int i = 0;
+    for (; i + 8 <= args.n; i += 8) {
+        __m512d hk = Lanes<basetype>::load8(args.hk + i);
+        __m512d dt = Lanes<basetype>::load8(args.dt + i);
+        __m512d ds = Lanes<basetype>::load8(args.ds + i);
+
+        // the comparisons are ordered, so NaN values are not skipped, like in the scalar kernel
+        __m512d absDiff = _mm512_castsi512_pd(_mm512_and_si512(_mm512_castpd_si512(_mm512_sub_pd(hkc, hk)), absMask));
+        __mmask8 skip   = _mm512_cmp_pd_mask(absDiff, tol, _CMP_GE_OQ);
+        __mmask8 dtFail = _mm512_cmp_pd_mask(dt, dtc, _CMP_GE_OQ);
+        __mmask8 dsFail = _mm512_cmp_pd_mask(ds, dsc, _CMP_GE_OQ);
+        skip |= args.useStrict ? (dtFail | dsFail) : (dtFail & dsFail);
+        if (args.mask) {
+            __m512i m64 = _mm512_cvtepu8_epi64(_mm_loadl_epi64(reinterpret_cast<__m128i const*>(args.mask + i)));
+            skip |= _mm512_testn_epi64_mask(m64, m64);
+        }
+
+        if (skip == 0xFF) {
+            _mm512_storeu_pd(weights + i, none);
+            continue;
+        }
+
+        __m512d dw = _mm512_loadu_pd(args.dw + i);
+        __m512d st = _mm512_loadu_pd(args.st + i);
+        __m512d w  = _mm512_div_pd(one, _mm512_mul_pd(dw, st));
+        if (!useLog)
+            w = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(st, sigma, _CMP_GE_OQ), one, w);
+        _mm512_storeu_pd(weights + i, _mm512_mask_blend_pd(skip, w, none));
+    }
+
+    for (; i < args.n; ++i)
+        weights[i] = isCandidate(args, i) ? candidateWeight(args, i) : -1;
+}
+
+#endif /* IMAGEFUSION_X86_ROW_KERNELS */
+
+
+enum class InstructionSet {
+    scalar,
+    avx2,
+    avx512
+};
+
+
+InstructionSet detectInstructionSet() {
+    static InstructionSet const is = [] {
+#ifdef IMAGEFUSION_X86_ROW_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            return InstructionSet::avx512;
+        if (__builtin_cpu_supports("avx2"))
+            return InstructionSet::avx2;
+#endif /* IMAGEFUSION_X86_ROW_KERNELS */
+        return InstructionSet::scalar;
+    }();
+    return is;
+}
+
+} /* anonymous namespace */
+
+
+template<Type basetype>
+RowKernel<basetype> selectRowKernel() {
+    switch (detectInstructionSet()) {
+#ifdef IMAGEFUSION_X86_ROW_KERNELS
+    case InstructionSet::avx512:
+        return &weighRowAvx512<basetype>;
+    case InstructionSet::avx2:
+        return &weighRowAvx2<basetype>;
+#endif /* IMAGEFUSION_X86_ROW_KERNELS */
+    default:
+        return &weighRowScalar<basetype>;
+    }
+}
+
+template RowKernel<Type::int8>    selectRowKernel<Type::int8>();
+template RowKernel<Type::uint8>   selectRowKernel<Type::uint8>();
+template RowKernel<Type::int16>   selectRowKernel<Type::int16>();
+template RowKernel<Type::uint16>  selectRowKernel<Type::uint16>();
+template RowKernel<Type::int32>   selectRowKernel<Type::int32>();
+template RowKernel<Type::float32> selectRowKernel<Type::float32>();
+template RowKernel<Type::float64> selectRowKernel<Type::float64>();
+
+} /* namespace starfm_impl_detail */
+} /* namespace imagefusion */
@@ -0,0 +1,324 @@
+// Internal hooks for the testthat suite. They are exported to R through RcppExports but not listed in the
+// NAMESPACE, so they can only be reached with ImageFusion:::. None of them reads or writes files.
+#include <Rcpp.h>
+#include "bitmask.h"
+#include "estarfm.h"
+#include "fitfc.h"
+#include "image.h"
+#include "multiresimages.h"
+#include "spstfm.h"
+#include "starfm.h"
+#include "utils_common.h"
+
+#include <memory>
+
+using namespace Rcpp;
+
+
+// Compares the parallel Fit-FC stages with their serial result on random images. Used by the tests.
+// Returns the maximum absolute differences of the regression map, the residual and the cubic filter.
+// [[Rcpp::export]]
+NumericVector fitfc_parallel_parity_cpp(int n_threads)
+{
+  using namespace imagefusion;
+  cv::RNG rng{42};
+  Image h1{300, 600, Type::uint16x3};
+  Image l1{300, 600, Type::uint16x3};
+  Image l2{300, 600, Type::uint16x3};
+  rng.fill(h1.cvMat(), cv::RNG::UNIFORM, 0, 10000);
+  rng.fill(l1.cvMat(), cv::RNG::UNIFORM, 0, 10000);
+  rng.fill(l2.cvMat(), cv::RNG::UNIFORM, 0, 10000);
+  ConstImage mask;
+  
+  FitFCOptions o;
+  o.setWinSize(31);
+#ifdef _OPENMP
+  o.setNumberThreads(1);
+#endif /* _OPENMP */
+  auto serial = CallBaseTypeFunctor::run(fitfc_impl_detail::RegressionMapper{o, h1, l1, l2, mask}, h1.type());
+  Image filteredSerial = fitfc_impl_detail::cubic_filter(Image{serial.second.cvMat().clone()}, 10, 1);
+  
+#ifdef _OPENMP
+  o.setNumberThreads(std::max(n_threads, 1));
+#endif /* _OPENMP */
+  auto parallel = CallBaseTypeFunctor::run(fitfc_impl_detail::RegressionMapper{o, h1, l1, l2, mask}, h1.type());
+  Image filteredParallel = fitfc_impl_detail::cubic_filter(Image{serial.second.cvMat().clone()}, 10, std::max(n_threads, 1));
+  
+  return NumericVector::create(
+    _["regression"]   = cv::norm(serial.first.cvMat(),  parallel.first.cvMat(),  cv::NORM_INF),
+    _["residual"]     = cv::norm(serial.second.cvMat(), parallel.second.cvMat(), cv::NORM_INF),
+    _["cubic_filter"] = cv::norm(filteredSerial.cvMat(), filteredParallel.cvMat(), cv::NORM_INF));
+}
+
+
+// Checks the BitMask operations against the unpacked mask images for widths around the 64 bit word
+// boundaries. Returns a named vector with one entry per property, which is TRUE if it holds for all widths.
+// [[Rcpp::export]]
+LogicalVector bitmask_edge_cases_cpp()
+{
+  using namespace imagefusion;
+  cv::RNG rng{7};
+  bool roundTrip = true, count = true, notPadding = true, allSetPadding = true, findNext = true, crop = true;
+  for (int w : {1, 63, 64, 65, 127, 128, 129, 200}) {
+    int h = 3;
+    Image img{w, h, Type::uint8x2};
+    rng.fill(img.cvMat(), cv::RNG::UNIFORM, 0, 2);
+    img.cvMat() *= 255;
+    BitMask m{img};
+    
+    roundTrip = roundTrip && cv::norm(m.toImage().cvMat(), img.cvMat(), cv::NORM_INF) == 0;
+    
+    std::vector<cv::Mat> planes;
+    cv::split(img.cvMat(), planes);
+    std::size_t n = 0;
+    for (unsigned int c = 0; c < 2; ++c) {
+      std::size_t nc = cv::countNonZero(planes[c]);
+      count = count && m.count(c) == nc;
+      n += nc;
+    }
+    count = count && m.count() == n;
+    
+    // the padding bits behind the last pixel of a row must stay 0
+    auto paddingIsZero = [w] (BitMask const& b) {
+      if (w % BitMask::wordBits == 0)
+        return true;
+      for (unsigned int c = 0; c < b.channels(); ++c)
+        for (int y = 0; y < b.height(); ++y)
+          if (b.rowWords(y, c)[b.wordsPerRow() - 1] >> (w % BitMask::wordBits))
+            return false;
+      return true;
+    };
+    BitMask inv = m.bitwise_not();
+    notPadding = notPadding && paddingIsZero(inv) && inv.count() == static_cast<std::size_t>(2 * w * h) - n
+                 && cv::norm(inv.bitwise_not().toImage().cvMat(), img.cvMat(), cv::NORM_INF) == 0;
+    BitMask all{Size{w, h}, 2, true};
+    allSetPadding = allSetPadding && paddingIsZero(all) && all.count() == static_cast<std::size_t>(2 * w * h);
+    
+    // compare with a linear search from every start column
+    for (unsigned int c = 0; c < 2; ++c) {
+      for (int y = 0; y < h; ++y) {
+        for (int x = 0; x <= w; ++x) {
+          int nextSet = x, nextUnset = x;
+          while (nextSet < w && !m.boolAt(nextSet, y, c))
+            ++nextSet;
+          while (nextUnset < w && m.boolAt(nextUnset, y, c))
+            ++nextUnset;
+          findNext = findNext && m.findNextSet(x, y, c) == nextSet && m.findNextUnset(x, y, c) == nextUnset;
+        }
+      }
+    }
+    
+    for (int x0 : {0, 1, w / 2, w - 1}) {
+      if (x0 >= w)
+        continue;
+      Rectangle r{x0, 1, w - x0, h - 1};
+      BitMask cropped = m.crop(r);
+      crop = crop && cv::norm(cropped.toImage().cvMat(), img.sharedCopy(r).cvMat(), cv::NORM_INF) == 0;
+    }
+  }
+  
+  return LogicalVector::create(
+    _["round_trip"]      = roundTrip,
+    _["count"]           = count,
+    _["not_padding"]     = notPadding,
+    _["all_set_padding"] = allSetPadding,
+    _["find_next"]       = findNext,
+    _["crop"]            = crop);
+}
+
+
+// Predicts a random scene with STARFM and Fit-FC once with mask images and once with BitMasks, which
+// are used directly for the prediction mask. Returns the maximum absolute differences at the predicted locations.
+// [[Rcpp::export]]
+NumericVector bitmask_predict_parity_cpp()
+{
+  using namespace imagefusion;
+  cv::RNG rng{11};
+  auto mri = std::make_shared<MultiResImages>();
+  for (std::string tag : {"high", "low"}) {
+    for (int date : {1, 2}) {
+      Image img{130, 70, Type::uint16x2};
+      rng.fill(img.cvMat(), cv::RNG::UNIFORM, 0, 10000);
+      mri->set(tag, date, std::move(img));
+    }
+  }
+  Image validMask{130, 70, Type::uint8x1};
+  Image predMask{130, 70, Type::uint8x1};
+  rng.fill(validMask.cvMat(), cv::RNG::UNIFORM, 0, 10);
+  validMask = validMask.createSingleChannelMaskFromRange({Interval::closed(1, 9)});
+  rng.fill(predMask.cvMat(), cv::RNG::UNIFORM, 0, 2);
+  predMask.cvMat() *= 255;
+  
+  // the prediction area does not start at a word boundary, so the BitMask has to be cropped with a shift
+  Rectangle predArea{5, 7, 100, 50};
+  ConstImage compareMask = predMask.sharedCopy(predArea);
+  
+  StarfmOptions so;
+  so.setHighResTag("high");
+  so.setLowResTag("low");
+  so.setSinglePairDate(1);
+  so.setWinSize(11);
+  so.setPredictionArea(predArea);
+  StarfmFusor sf;
+  sf.srcImages(mri);
+  sf.processOptions(so);
+  sf.predict(2, validMask, predMask);
+  Image starfmImg{sf.outputImage().cvMat().clone()};
+  sf.predict(2, BitMask{validMask}, BitMask{predMask});
+  double starfmDiff = cv::norm(starfmImg.cvMat(), sf.outputImage().cvMat(), cv::NORM_INF, compareMask.cvMat());
+  
+  FitFCOptions fo;
+  fo.setHighResTag("high");
+  fo.setLowResTag("low");
+  fo.setPairDate(1);
+  fo.setWinSize(11);
+  fo.setResolutionFactor(10);
+  fo.setPredictionArea(predArea);
+  FitFCFusor ff;
+  ff.srcImages(mri);
+  ff.processOptions(fo);
+  ff.predict(2, validMask, predMask);
+  Image fitfcImg{ff.outputImage().cvMat().clone()};
+  ff.predict(2, BitMask{validMask}, BitMask{predMask});
+  double fitfcDiff = cv::norm(fitfcImg.cvMat(), ff.outputImage().cvMat(), cv::NORM_INF, compareMask.cvMat());
+  
+  return NumericVector::create(
+    _["starfm"] = starfmDiff,
+    _["fitfc"]  = fitfcDiff);
+}
+
+
+// Compares the batched and parallel parts of SPSTFM with their single-sample or serial counterparts on random
+// data. Returns the maximum absolute differences of the sparse coefficients (SparseCoder::solve with one vs. multiple
+// threads and vs. gpsr for each sample) and of the block mode K-SVD dictionaries (parallel ksvd vs. a serial loop
+// of ksvd_iteration).
+// [[Rcpp::export]]
+NumericVector spstfm_parallel_parity_cpp(int n_threads)
+{
+  using namespace imagefusion;
+  using namespace imagefusion::spstfm_impl_detail;
+#ifdef _OPENMP
+  helpers::OmpThreadsGuard threadsGuard{n_threads};
+#endif /* _OPENMP */
+  cv::RNG rng{3};
+  int dim = 50, atoms = 64, nSamples = 300;
+  cv::Mat dict(dim, atoms, CV_64FC1);
+  cv::Mat samples(dim, nSamples, CV_64FC1);
+  rng.fill(dict, cv::RNG::NORMAL, 0, 1);
+  rng.fill(samples, cv::RNG::NORMAL, 0, 1);
+  for (int k = 0; k < atoms; ++k) {
+    cv::Mat dk = dict.col(k);
+    dk /= cv::norm(dk);
+  }
+  
+  auto gpsrOpt = SpstfmOptions::GPSROptions::trainingDefaults();
+  SparseCoder coder{dict, gpsrOpt};
+  cv::Mat coeff = coder.solve(samples);
+  cv::Mat serialCoeff;
+  {
+#ifdef _OPENMP
+    helpers::OmpThreadsGuard serialGuard{1};
+#endif /* _OPENMP */
+    serialCoeff = coder.solve(samples);
+  }
+  double threadsDiff = cv::norm(coeff, serialCoeff, cv::NORM_INF);
+  
+  // A' * y is computed with one matrix product for all samples in solve(), so allow rounding differences
+  double coderDiff = 0;
+  for (int i = 0; i < nSamples; ++i) {
+    cv::Mat x = gpsr(samples.col(i).clone(), dict, gpsrOpt);
+    coderDiff = std::max(coderDiff, cv::norm(x, coeff.col(i), cv::NORM_INF));
+  }
+  
+  double ksvdDiff = 0;
+  for (auto norm : {SpstfmOptions::DictionaryNormalization::independent, SpstfmOptions::DictionaryNormalization::fixed}) {
+    cv::Mat parallelCoeff = coeff.clone();
+    cv::Mat parallelDict = ksvd(samples, dict, parallelCoeff, /*useOnlineMode*/ false, norm);
+    
+    cv::Mat loopCoeff = coeff.clone();
+    cv::Mat loopDict = dict.clone();
+    cv::Mat residual = samples - dict * loopCoeff;
+    for (int k = 0; k < atoms; ++k)
+      ksvd_iteration(k, residual, loopDict, loopCoeff, /*useOnlineMode*/ false, norm);
+    ksvdDiff = std::max(ksvdDiff, cv::norm(parallelDict, loopDict, cv::NORM_INF));
+  }
+  
+  return NumericVector::create(
+    _["sparse_coder_threads"] = threadsDiff,
+    _["sparse_coder_gpsr"]    = coderDiff,
+    _["ksvd_block"]           = ksvdDiff);
+}
+
+
+// Predicts two dates with STARFM and ESTARFM, which have different valid masks, but the same pair mask, like the
+// jobs do with use_nodata_value = TRUE. Returns for each fusor whether the pair context has been reused for the
+// second date and whether predictWithPairMask with the valid mask as pair mask gives the same result as predict.
+// [[Rcpp::export]]
+LogicalVector pair_context_reuse_cpp()
+{
+  using namespace imagefusion;
+  cv::RNG rng{13};
+  auto mri = std::make_shared<MultiResImages>();
+  auto randomImage = [&] () {
+    Image img{90, 60, Type::uint16x2};
+    rng.fill(img.cvMat(), cv::RNG::UNIFORM, 0, 10000);
+    return img;
+  };
+  for (int date : {1, 3})
+    mri->set("high", date, randomImage());
+  for (int date : {1, 2, 3, 4})
+    mri->set("low", date, randomImage());
+  
+  // the pair mask has some invalid locations and each date adds some more
+  auto randomMask = [&] () {
+    Image m{90, 60, Type::uint8x1};
+    rng.fill(m.cvMat(), cv::RNG::UNIFORM, 0, 20);
+    return m.createSingleChannelMaskFromRange({Interval::closed(1, 19)});
+  };
+  Image pairMask = randomMask();
+  Image validMask2{pairMask.cvMat() & randomMask().cvMat()};
+  Image validMask4{pairMask.cvMat() & randomMask().cvMat()};
+  
+  StarfmOptions so;
+  so.setHighResTag("high");
+  so.setLowResTag("low");
+  so.setSinglePairDate(1);
+  so.setWinSize(11);
+  StarfmFusor sf;
+  sf.srcImages(mri);
+  sf.processOptions(so);
+  sf.predictWithPairMask(2, pairMask, validMask2);
+  auto starfmCtx = sf.pairContext();
+  sf.predictWithPairMask(4, pairMask, validMask4);
+  bool starfmReused = sf.pairContext() == starfmCtx;
+  
+  sf.predict(4, validMask4);
+  Image starfmImg{sf.outputImage().cvMat().clone()};
+  sf.predictWithPairMask(4, validMask4, validMask4);
+  bool starfmSame = cv::norm(starfmImg.cvMat(), sf.outputImage().cvMat(), cv::NORM_INF, validMask4.cvMat()) == 0;
+  
+  EstarfmOptions eo;
+  eo.setHighResTag("high");
+  eo.setLowResTag("low");
+  eo.setDate1(1);
+  eo.setDate3(3);
+  eo.setWinSize(11);
+  EstarfmFusor ef;
+  ef.srcImages(mri);
+  ef.processOptions(eo);
+  ef.predictWithPairMask(2, pairMask, validMask2);
+  auto estarfmCtx = ef.pairContext();
+  ef.predictWithPairMask(4, pairMask, validMask4);
+  bool estarfmReused = ef.pairContext() == estarfmCtx;
+  
+  ef.predict(4, validMask4);
+  Image estarfmImg{ef.outputImage().cvMat().clone()};
+  ef.predictWithPairMask(4, validMask4, validMask4);
+  bool estarfmSame = cv::norm(estarfmImg.cvMat(), ef.outputImage().cvMat(), cv::NORM_INF, validMask4.cvMat()) == 0;
+  
+  return LogicalVector::create(
+    _["starfm_reused"]  = starfmReused,
+    _["starfm_same"]    = starfmSame,
+    _["estarfm_reused"] = estarfmReused,
+    _["estarfm_same"]   = estarfmSame);
+}
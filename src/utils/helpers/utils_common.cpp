@@ -185,14 +185,19 @@ std::map<std::vector<int>, std::vector<int>> getJobs(std::vector<int> const& pai
 
 
 imagefusion::Image processSetMask(imagefusion::ConstImage const& mask, imagefusion::ConstImage const& img, imagefusion::IntervalSet const& validSet, bool singleChannel) {
+    // evaluate the set and combine it with the mask in a single pass, if the result has the channels of the set mask
+    if (mask.empty() || mask.channels() == 1 || (!singleChannel && mask.channels() == img.channels()))
+        return singleChannel ? img.createSingleChannelMaskFromSet({validSet}, /*useAnd*/ true, mask)
+                             : img.createMultiChannelMaskFromSet({validSet}, mask);
+
+    // a multi-channel mask with a single-channel set mask gives a multi-channel result
     imagefusion::Image tempMask = singleChannel ? img.createSingleChannelMaskFromSet({validSet}) : img.createMultiChannelMaskFromSet({validSet});
-    if (mask.empty())
-        return tempMask;
     return mask.bitwise_and(std::move(tempMask));
 }
 
 
-std::string outputImageFile(imagefusion::ConstImage const& img, imagefusion::GeoInfo gi, std::string origFileName, std::string prefix, std::string postfix, imagefusion::FileFormat f, int date1, int date2, int date3) {
+std::string outputImageFilename(std::string const& origFileName, std::string const& prefix, std::string const& postfix, imagefusion::FileFormat f, int date1, int date2, int date3)
+{
     // std::filesystem::path p = origFileName;
     // 
     // std::string extension = p.extension().string();
@@ -216,29 +221,29 @@ std::string outputImageFile(imagefusion::ConstImage const& img, imagefusion::Geo
     if (date1 == date2 && date2 == date3)
         basename = imagefusion::filesystem::stem(origFileName);
     std::string p = prefix + basename + postfix + extension;
-    // auto outpath = p;
+    return p;
+}
+
 
-    std::string outfilename = p;
+std::string outputImageFile(imagefusion::ConstImage const& img, imagefusion::GeoInfo gi, std::string origFileName, std::string prefix, std::string postfix, imagefusion::FileFormat f, int date1, int date2, int date3,
+                            std::vector<std::pair<std::string,std::string>> const& writeOptions)
+{
+    std::string outfilename = outputImageFilename(origFileName, prefix, postfix, f, date1, date2, date3);
+    std::string extension = imagefusion::filesystem::extension(outfilename);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
     try {
-        img.write(outfilename, gi, f);
-
-        // test color table
-        imagefusion::GeoInfo test{outfilename};
-        bool ctOK = gi.compareColorTables(test);
-        if (!ctOK) {
-            gi.colorTable.clear();
-            gi.addTo(outfilename);
-        }
+        // the color table is checked and, if it has been changed by the driver, removed while the file is still open
+        img.write(outfilename, gi, f, writeOptions);
     }
     catch (imagefusion::runtime_error& e) {
         Rcpp::Rcout << e.what() << std::endl;
-        if (f != imagefusion::FileFormat("GTiff") && extension != ".tif" && extension != ".tiff") {
+        if (f != imagefusion::FileFormat("GTiff") && extension != "tif" && extension != "tiff") {
             Rcpp::Rcout << "Retrying with GTiff driver." << std::endl;
-            return outputImageFile(img, gi, origFileName, prefix, postfix, imagefusion::FileFormat("GTiff"), date1, date2, date3);
+            return outputImageFile(img, gi, origFileName, prefix, postfix, imagefusion::FileFormat("GTiff"), date1, date2, date3, writeOptions);
         }
         else if (prefix != "save_") {
             Rcpp::Rcout << "Retrying at working directory with prefix 'save_'." << std::endl;
-            return outputImageFile(img, gi, origFileName, "save_", postfix, imagefusion::FileFormat("GTiff"), date1, date2, date3);
+            return outputImageFile(img, gi, origFileName, "save_", postfix, imagefusion::FileFormat("GTiff"), date1, date2, date3, writeOptions);
         }
         else
             IF_THROW_EXCEPTION(imagefusion::runtime_error(e.what())) << boost::errinfo_file_name(outfilename);
@@ -248,6 +253,33 @@ std::string outputImageFile(imagefusion::ConstImage const& img, imagefusion::Geo
 }
 
 
+std::vector<std::pair<std::string,std::string>> parseWriteOptions(std::vector<std::string> const& args) {
+    std::vector<std::pair<std::string,std::string>> options;
+    for (std::string const& a : args) {
+        std::string::size_type eq = a.find('=');
+        if (eq == std::string::npos || eq == 0)
+            IF_THROW_EXCEPTION(imagefusion::invalid_argument_error(
+                    "The output option '" + a + "' is not of the form NAME=VALUE, like COMPRESS=DEFLATE."));
+        options.emplace_back(a.substr(0, eq), a.substr(eq + 1));
+    }
+    return options;
+}
+
+
+imagefusion::GeoInfo predictionGeoInfo(imagefusion::GeoInfo const& giTemplate, imagefusion::Rectangle const& predArea) {
+    if (!giTemplate.hasGeotransform())
+        return imagefusion::GeoInfo{};
+
+    imagefusion::GeoInfo gi{giTemplate};
+    gi.geotrans.translateImage(predArea.x, predArea.y);
+    if (predArea.width != 0)
+        gi.size.width = predArea.width;
+    if (predArea.height != 0)
+        gi.size.height = predArea.height;
+    return gi;
+}
+
+
 namespace {
 struct SimpleHistFunctor {
     imagefusion::ConstImage const& i;
@@ -4,7 +4,13 @@
 #include "exceptions.h"
 #include "optionparser.h"
 #include "geoinfo.h"
+#include "bandwriter.h"
+#ifdef _OPENMP
+#include "parallelizer.h"
+#include <omp.h>
+#endif /* _OPENMP */
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 #include <string>
@@ -334,9 +340,105 @@ getPrefixAndPostfix(std::vector<imagefusion::option::Option> const& prefixOpts,
 
 imagefusion::Image processSetMask(imagefusion::ConstImage const& mask, imagefusion::ConstImage const& img, imagefusion::IntervalSet const& validSet, bool singleChannel = false);
 
+std::string outputImageFilename(std::string const& origFileName, std::string const& prefix, std::string const& postfix,
+                                imagefusion::FileFormat f = imagefusion::FileFormat::unsupported,
+                                int date1 = 0, int date2 = 0, int date3 = 0);
+
 std::string outputImageFile(imagefusion::ConstImage const& img, imagefusion::GeoInfo gi, std::string origFileName,
                             std::string prefix, std::string postfix, imagefusion::FileFormat f = imagefusion::FileFormat::unsupported,
-                            int date1 = 0, int date2 = 0, int date3 = 0);
+                            int date1 = 0, int date2 = 0, int date3 = 0,
+                            std::vector<std::pair<std::string,std::string>> const& writeOptions = {});
+
+std::vector<std::pair<std::string,std::string>> parseWriteOptions(std::vector<std::string> const& args);
+
+// GeoInfo to write with a prediction: the template moved to the prediction area, or an empty GeoInfo
+// if the template has no geotransform (then nothing is added to the output file)
+imagefusion::GeoInfo predictionGeoInfo(imagefusion::GeoInfo const& giTemplate, imagefusion::Rectangle const& predArea);
+
+
+template<class Fusor>
+void predictAndWrite(Fusor& fusor, int date, imagefusion::ConstImage const& mask, std::string const& filename,
+                     imagefusion::GeoInfo const& gi, std::vector<std::pair<std::string,std::string>> const& writeOptions)
+{
+    fusor.predict(date, mask);
+    fusor.outputImage().write(filename, gi, imagefusion::FileFormat::unsupported, writeOptions);
+}
+
+// like above, but with a separate mask for the input pairs, so the pair context of STARFM and
+// ESTARFM is reused for all dates, even if the mask differs for each date
+template<class Fusor>
+void predictAndWrite(Fusor& fusor, int date, imagefusion::ConstImage const& mask, imagefusion::ConstImage const& pairMask, std::string const& filename,
+                     imagefusion::GeoInfo const& gi, std::vector<std::pair<std::string,std::string>> const& writeOptions)
+{
+    fusor.predictWithPairMask(date, pairMask, mask);
+    fusor.outputImage().write(filename, gi, imagefusion::FileFormat::unsupported, writeOptions);
+}
+
+#ifdef _OPENMP
+// predict band by band and write each band in the background, while the next band is predicted
+template<class Alg, class AlgOpt, class PrepareContext, class PredictTile>
+void predictAndWriteWith(imagefusion::Parallelizer<Alg,AlgOpt>& fusor, PrepareContext&& prepareContext, PredictTile&& predictTile, std::string const& filename,
+                         imagefusion::GeoInfo const& gi, std::vector<std::pair<std::string,std::string>> const& writeOptions)
+{
+    imagefusion::FileFormat format = imagefusion::FileFormat::fromFileExtension(imagefusion::filesystem::extension(filename));
+    if (!imagefusion::BandWriter::supportsFormat(format)) {
+        fusor.predictWith(prepareContext, predictTile);
+        fusor.outputImage().write(filename, gi, imagefusion::FileFormat::unsupported, writeOptions);
+        return;
+    }
+
+    imagefusion::Rectangle pa = fusor.getOptions().getPredictionArea();
+    if (pa.x == 0 && pa.y == 0 && pa.width == 0 && pa.height == 0) {
+        pa.width  = fusor.srcImages().getAny().width();
+        pa.height = fusor.srcImages().getAny().height();
+    }
+
+    imagefusion::BandWriter writer{filename, imagefusion::Size{pa.width, pa.height}, fusor.srcImages().getAny().type(), gi, format, writeOptions};
+    fusor.predictBandsWith([&] (imagefusion::ConstImage const& band, imagefusion::Rectangle const& area) {
+        writer.write(band, area.y - pa.y);
+    }, prepareContext, predictTile);
+    writer.close();
+}
+
+template<class Alg, class AlgOpt>
+void predictAndWrite(imagefusion::Parallelizer<Alg,AlgOpt>& fusor, int date, imagefusion::ConstImage const& mask, std::string const& filename,
+                     imagefusion::GeoInfo const& gi, std::vector<std::pair<std::string,std::string>> const& writeOptions)
+{
+    predictAndWriteWith(fusor,
+                        [&] (auto& f) { f.preparePairContext(mask); },
+                        [&] (Alg& f) { f.predict(date, mask); },
+                        filename, gi, writeOptions);
+}
+
+template<class Alg, class AlgOpt>
+void predictAndWrite(imagefusion::Parallelizer<Alg,AlgOpt>& fusor, int date, imagefusion::ConstImage const& mask, imagefusion::ConstImage const& pairMask, std::string const& filename,
+                     imagefusion::GeoInfo const& gi, std::vector<std::pair<std::string,std::string>> const& writeOptions)
+{
+    predictAndWriteWith(fusor,
+                        [&] (auto& f) { f.preparePairContext(pairMask); },
+                        [&] (Alg& f) { f.predictWithPairMask(date, pairMask, mask); },
+                        filename, gi, writeOptions);
+}
+
+// sets the number of OpenMP threads for the following parallel regions and restores the previous
+// number when it goes out of scope, also when an exception is thrown
+class OmpThreadsGuard {
+public:
+    explicit OmpThreadsGuard(int n) : prevThreads{omp_get_max_threads()} {
+        omp_set_num_threads(std::max(n, 1));
+    }
+
+    ~OmpThreadsGuard() {
+        omp_set_num_threads(prevThreads);
+    }
+
+    OmpThreadsGuard(OmpThreadsGuard const&) = delete;
+    OmpThreadsGuard& operator=(OmpThreadsGuard const&) = delete;
+
+private:
+    int prevThreads;
+};
+#endif /* _OPENMP */
 
 
 double findAppropriateNodataValue(imagefusion::ConstImage const& i, imagefusion::ConstImage const& mask);
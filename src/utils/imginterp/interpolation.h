@@ -1,6 +1,9 @@
 #pragma once
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
+#include <array>
+#include <vector>
 #include <string>
 #include <tuple>
 
@@ -10,6 +13,7 @@
 #include "type.h"
 #include "imagefusion.h"
 #include "image.h"
+#include "bitmask.h"
 #include "optionparser.h"
 #include "geoinfo.h"
 #include "multiresimages.h"
@@ -29,10 +33,18 @@ struct InterpStats {
     unsigned int nInterpAfter;
 };
 
+// an image of the interpolation window with its masks, resolved once per interpolation
+struct DateLayer {
+    int date;
+    cv::Mat const* img;
+    imagefusion::BitMask const* mask;  // nullptr if there is no mask for this date
+    imagefusion::BitMask const* cloud; // nullptr if there is no cloud mask for this date
+};
+
 struct Interpolator {
     imagefusion::MultiResImages& imgs;
-    imagefusion::MultiResImages& cloudmask;
-    imagefusion::MultiResImages& maskimgs;
+    imagefusion::MultiResCollection<imagefusion::BitMask>& cloudmask;
+    imagefusion::MultiResCollection<imagefusion::BitMask>& maskimgs;
     std::string tag;
     int interpDate;
     bool doPreferCloudsOverNodata;
@@ -57,84 +69,147 @@ std::tuple<imagefusion::Image, imagefusion::Image, InterpStats> Interpolator::op
     imagefusion::Image pixelState{interped.size(), imagefusion::getFullType(imagefusion::Type::uint8, interped.channels())};
     pixelState.set(0);
 
+    // resolve the images and masks of all dates once, so the pixel loop does not need any map lookups
+    auto resolve = [&] (int date) {
+        DateLayer l{date, &imgs.get(tag, date).cvMat(), nullptr, nullptr};
+        if (maskimgs.has(tag, date) && !maskimgs.get(tag, date).empty())
+            l.mask = &maskimgs.get(tag, date);
+        if (cloudmask.has(tag, date))
+            l.cloud = &cloudmask.get(tag, date);
+        return l;
+    };
+
     auto dates = imgs.getDates(tag);
     auto interpDateIt = std::find(std::begin(dates), std::end(dates), interpDate);
-    std::array<std::vector<int>, 2> leftRightDates;
-    leftRightDates[0] = std::vector<int>(std::vector<int>::reverse_iterator(interpDateIt), dates.rend()); // left (reversed)
-    leftRightDates[1] = std::vector<int>(interpDateIt + 1, std::end(dates)); // right
+    std::array<std::vector<DateLayer>, 2> leftRightLayers; // both ordered from the nearest to the farthest date
+    for (auto it = std::vector<int>::reverse_iterator(interpDateIt); it != dates.rend(); ++it)
+        leftRightLayers[0].push_back(resolve(*it));
+    for (auto it = interpDateIt + 1; it != std::end(dates); ++it)
+        leftRightLayers[1].push_back(resolve(*it));
 
-    imagefusion::ConstImage predMask;
+    imagefusion::BitMask const* predMask = nullptr;
     unsigned int maskChannels = 0;
     if (maskimgs.has(tag, interpDate) && !maskimgs.get(tag, interpDate).empty()) {
-        predMask = maskimgs.get(tag, interpDate).constSharedCopy();
-        maskChannels = (unsigned int)(predMask.channels());
+        predMask = &maskimgs.get(tag, interpDate);
+        maskChannels = predMask->channels();
     }
+    imagefusion::BitMask const& cloudNow = cloudmask.get(tag, interpDate);
 
     unsigned int nNoData = 0, nInterpBefore = 0, nInterpAfter = 0;
-    #pragma omp parallel for reduction(+:nNoData) reduction(+:nInterpBefore) reduction(+:nInterpAfter)
-    for (unsigned int y = 0; y < h; y++) {
-        for (unsigned int x = 0; x < w; x++) {
-            for (unsigned int c = 0; c < cn; c++) {
-                unsigned int maskChannel = maskChannels > c ? c : 0;
-                bool isInvalid = maskChannels > 0 && !predMask.boolAt(x, y, maskChannel);
-                bool isCloud   = cloudmask.get(tag, interpDate).boolAt(x, y, 0);
-                if (isInvalid && (!isCloud || !doPreferCloudsOverNodata)) {
-                    nNoData++;
-                    pixelState.at<uint8_t>(x, y, c) = static_cast<uint8_t>(PixelState::nodata);
-                    continue;
-                }
-                if (!isCloud) {
-                    pixelState.at<uint8_t>(x, y, c) = static_cast<uint8_t>(PixelState::clear);
-                    continue;
+    #pragma omp parallel
+    {
+        // image row pointers of the left and right dates and for every element of the row the index
+        // of the nearest valid date to the left and right (-1 if there is none)
+        std::array<std::vector<imgval_t const*>, 2> rows{std::vector<imgval_t const*>(leftRightLayers[0].size()),
+                                                         std::vector<imgval_t const*>(leftRightLayers[1].size())};
+        std::array<std::vector<int>, 2> nearest{std::vector<int>(w * cn), std::vector<int>(w * cn)};
+        std::vector<uint8_t> doInterp(w * cn);
+
+        #pragma omp for reduction(+:nNoData) reduction(+:nInterpBefore) reduction(+:nInterpAfter)
+        for (int y = 0; y < static_cast<int>(h); y++) {
+            for (int dir = 0; dir < 2; ++dir)
+                for (std::size_t i = 0; i < rows[dir].size(); ++i)
+                    rows[dir][i] = leftRightLayers[dir][i].img->ptr<imgval_t>(y);
+            uint8_t* stateRow = pixelState.cvMat().ptr<uint8_t>(y);
+            imgval_t* outRow = interped.cvMat().ptr<imgval_t>(y);
+
+            // first pass: classify the elements and find the nearest valid dates
+            for (unsigned int x = 0; x < w; ) {
+                // the run up to the next cloud is clear or nodata, without a mask it is clear in bulk
+                unsigned int cloudBegin = cloudNow.findNextSet(x, y);
+                if (!predMask) {
+                    std::fill(stateRow + x * cn, stateRow + cloudBegin * cn, static_cast<uint8_t>(PixelState::clear));
+                    std::fill(doInterp.begin() + x * cn, doInterp.begin() + cloudBegin * cn, false);
+                    x = cloudBegin;
                 }
-                // ok, this is a pixel to interpolate
-                pixelState.at<uint8_t>(x, y, c) = static_cast<uint8_t>(PixelState::interpolated);
-                nInterpBefore++;
-
-                std::array<int,2> leftRightDate = {interpDate, interpDate};
-                for (int dir = 0; dir < 2; ++dir) {
-                    for (unsigned int date : leftRightDates.at(dir)) {
-                        if (maskimgs.has(tag, date)) {
-                            auto const& mask = maskimgs.get(tag, date);
-                            unsigned int maskChannel = mask.channels() > c ? c : 0;
-                            if (!mask.empty() && !mask.boolAt(x, y, maskChannel))
-                                continue;
+                for (; x < cloudBegin; x++) {
+                    for (unsigned int c = 0; c < cn; c++) {
+                        unsigned int i = x * cn + c;
+                        doInterp[i] = false;
+                        unsigned int maskChannel = maskChannels > c ? c : 0;
+                        if (!predMask->boolAt(x, y, maskChannel)) {
+                            nNoData++;
+                            stateRow[i] = static_cast<uint8_t>(PixelState::nodata);
                         }
-
-                        if (cloudmask.has(tag, date) && cloudmask.get(tag, date).boolAt(x, y, 0))
+                        else
+                            stateRow[i] = static_cast<uint8_t>(PixelState::clear);
+                    }
+                }
+                if (x >= w)
+                    break;
+
+                // the run of clouds
+                unsigned int cloudEnd = cloudNow.findNextUnset(x, y);
+                for (; x < cloudEnd; x++) {
+                    for (unsigned int c = 0; c < cn; c++) {
+                        unsigned int i = x * cn + c;
+                        doInterp[i] = false;
+                        unsigned int maskChannel = maskChannels > c ? c : 0;
+                        bool isInvalid = predMask && !predMask->boolAt(x, y, maskChannel);
+                        if (isInvalid && !doPreferCloudsOverNodata) {
+                            nNoData++;
+                            stateRow[i] = static_cast<uint8_t>(PixelState::nodata);
                             continue;
-
-                        leftRightDate.at(dir) = date;
-                        break;
+                        }
+                        // ok, this is a pixel to interpolate
+                        stateRow[i] = static_cast<uint8_t>(PixelState::interpolated);
+                        doInterp[i] = true;
+                        nInterpBefore++;
+
+                        for (int dir = 0; dir < 2; ++dir) {
+                            std::vector<DateLayer> const& layers = leftRightLayers[dir];
+                            int found = -1;
+                            for (std::size_t l = 0; l < layers.size(); ++l) {
+                                DateLayer const& layer = layers[l];
+                                if (layer.mask) {
+                                    unsigned int mc = layer.mask->channels();
+                                    if (!layer.mask->boolAt(x, y, mc > c ? c : 0))
+                                        continue;
+                                }
+                                if (layer.cloud && layer.cloud->boolAt(x, y, 0))
+                                    continue;
+                                found = static_cast<int>(l);
+                                break;
+                            }
+                            nearest[dir][i] = found;
+                        }
                     }
                 }
+            }
+
+            // second pass: fill the elements from the nearest valid dates
+            for (unsigned int i = 0; i < w * cn; i++) {
+                if (!doInterp[i])
+                    continue;
 
-                int dateLeft  = leftRightDate.front();
-                int dateRight = leftRightDate.back();
-                if (dateRight == interpDate) {
+                int left  = nearest[0][i];
+                int right = nearest[1][i];
+                if (right < 0) {
                     // right invalid
-                    if (dateLeft == interpDate) {
+                    if (left < 0) {
                         // left invalid, too, leave value as it is for now, but mark location
-                        pixelState.at<uint8_t>(x, y, c) = static_cast<uint8_t>(PixelState::noninterpolated);
+                        stateRow[i] = static_cast<uint8_t>(PixelState::noninterpolated);
                         nInterpAfter++;
                     }
                     else
                         // only left valid
-                        interped.at<imgval_t>(x, y, c) = imgs.get(tag, dateLeft).at<imgval_t>(x, y, c);
+                        outRow[i] = rows[0][left][i];
                 }
-                else if (dateLeft == interpDate)
+                else if (left < 0)
                     // only right valid
-                    interped.at<imgval_t>(x, y, c) = imgs.get(tag, dateRight).at<imgval_t>(x, y, c);
+                    outRow[i] = rows[1][right][i];
                 else {
                     // both valid
-                    double yLeft  = imgs.get(tag, dateLeft).at<imgval_t>(x, y, c);
-                    double yRight = imgs.get(tag, dateRight).at<imgval_t>(x, y, c);
+                    int dateLeft  = leftRightLayers[0][left].date;
+                    int dateRight = leftRightLayers[1][right].date;
+                    double yLeft  = rows[0][left][i];
+                    double yRight = rows[1][right][i];
                     double yInt = (interpDate - dateLeft) * (yRight - yLeft) / (dateRight - dateLeft) + yLeft;
-                    interped.at<imgval_t>(x, y, c) = cv::saturate_cast<imgval_t>(yInt);
+                    outRow[i] = cv::saturate_cast<imgval_t>(yInt);
                 }
-            } /*c*/
-        } /*x*/
-    } /*y*/
+            }
+        } /*y*/
+    }
 
     InterpStats s{/*filename*/ "", /*date*/ interpDate, /*sz*/ imagefusion::Size(w, h), /*nChans*/ cn, /*nNoData*/ nNoData, /*nInterpBefore*/ nInterpBefore, /*nInterpAfter*/ nInterpAfter};
     return {std::move(interped), std::move(pixelState), s};